@@ -0,0 +1,342 @@
+//! Procedural macros which parse g-code at compile time.
+//!
+//! Both [`gcode!()`] and [`include_gcode!()`] run the `gcode` crate's own
+//! parser while your code is being compiled, expanding to a
+//! [`gcode::packed::Program`] whose commands and arguments live in `static`
+//! arrays. There is no parsing at runtime, and because the data is immutable
+//! it can be placed in flash instead of RAM.
+//!
+//! ```rust
+//! use gcode::packed::Program;
+//! use gcode_macros::gcode;
+//!
+//! static HOME: Program<'static> = gcode!("G28 X0 Y0 (home)\nG90");
+//!
+//! let home = HOME.get(0).unwrap();
+//! assert_eq!(home.major_number(), 28);
+//! assert_eq!(home.value_for('X'), Some(0.0));
+//! assert!(home.span().is_placeholder());
+//! ```
+//!
+//! Comments and line numbers are dropped. Passing the `spans` flag will also
+//! keep the [`Span`](gcode::Span) of each command:
+//!
+//! ```rust
+//! # use gcode::{packed::Program, Span};
+//! # use gcode_macros::gcode;
+//! static HOME: Program<'static> = gcode!("G90\nG28 X0", spans);
+//!
+//! assert_eq!(HOME.get(1).unwrap().span(), Span::new(4, 10, 1));
+//! ```
+//!
+//! Anything the parser would normally report via [`gcode::Callbacks`] (e.g.
+//! garbage text or a letter without a number) is a compile error.
+//!
+//! ```rust,compile_fail
+//! # use gcode::packed::Program;
+//! # use gcode_macros::gcode;
+//! static BROKEN: Program<'static> = gcode!("G90 ?!");
+//! ```
+
+#![deny(
+    bare_trait_objects,
+    elided_lifetimes_in_paths,
+    missing_debug_implementations,
+    rust_2018_idioms,
+    unreachable_pub,
+    unsafe_code,
+    unused_qualifications,
+    unused_results,
+    missing_docs
+)]
+
+use gcode::{Callbacks, GCode, Mnemonic, Span};
+use proc_macro::TokenStream;
+use proc_macro2::{Literal, TokenStream as TokenStream2};
+use quote::quote;
+use std::{
+    convert::TryFrom,
+    path::{Path, PathBuf},
+};
+use syn::{
+    parse::{Parse, ParseStream},
+    parse_macro_input, Ident, LitStr, Token,
+};
+
+/// Parse a string literal as g-code, expanding to a
+/// [`gcode::packed::Program`].
+///
+/// Use `gcode!("...", spans)` to also record where each command came from.
+#[proc_macro]
+pub fn gcode(input: TokenStream) -> TokenStream {
+    let Input { text, spans } = parse_macro_input!(input as Input);
+
+    compile(&text.value(), spans)
+        .map_err(|errors| errors.into_syn_error(text.span(), "gcode!()"))
+        .unwrap_or_else(|e| e.to_compile_error())
+        .into()
+}
+
+/// Read a file and parse it as g-code, expanding to a
+/// [`gcode::packed::Program`].
+///
+/// The path is relative to the crate's `Cargo.toml` (i.e.
+/// `CARGO_MANIFEST_DIR`). Use `include_gcode!("...", spans)` to also record
+/// where each command came from.
+#[proc_macro]
+pub fn include_gcode(input: TokenStream) -> TokenStream {
+    let Input { text: path, spans } = parse_macro_input!(input as Input);
+
+    expand_include(&path, spans)
+        .unwrap_or_else(|e| e.to_compile_error())
+        .into()
+}
+
+/// The arguments to both macros, a string literal followed by an optional
+/// `spans` flag.
+struct Input {
+    text: LitStr,
+    spans: bool,
+}
+
+impl Parse for Input {
+    fn parse(input: ParseStream<'_>) -> syn::Result<Self> {
+        let text = input.parse()?;
+        let mut spans = false;
+
+        if input.parse::<Option<Token![,]>>()?.is_some() && !input.is_empty() {
+            let flag: Ident = input.parse()?;
+            if flag != "spans" {
+                return Err(syn::Error::new(flag.span(), "expected `spans`"));
+            }
+            spans = true;
+            let _: Option<Token![,]> = input.parse()?;
+        }
+
+        Ok(Input { text, spans })
+    }
+}
+
+fn expand_include(path: &LitStr, spans: bool) -> syn::Result<TokenStream2> {
+    let full_path = resolve(&path.value());
+    let src = std::fs::read_to_string(&full_path).map_err(|e| {
+        syn::Error::new(
+            path.span(),
+            format!("Unable to read \"{}\": {}", full_path.display(), e),
+        )
+    })?;
+
+    let program = compile(&src, spans).map_err(|errors| {
+        errors.into_syn_error(path.span(), &full_path.display().to_string())
+    })?;
+    let full_path = full_path.display().to_string();
+
+    Ok(quote!({
+        // make sure we get recompiled when the file changes
+        const _: &[u8] = include_bytes!(#full_path);
+        #program
+    }))
+}
+
+fn resolve(path: &str) -> PathBuf {
+    let path = Path::new(path);
+
+    match std::env::var_os("CARGO_MANIFEST_DIR") {
+        Some(dir) if path.is_relative() => Path::new(&dir).join(path),
+        _ => path.to_path_buf(),
+    }
+}
+
+/// Parse some g-code and generate the [`gcode::packed::Program`] for it.
+fn compile(src: &str, spans: bool) -> Result<TokenStream2, Errors<'_>> {
+    let mut errors = Errors::new(src);
+    let gcodes: Vec<GCode> = gcode::full_parse_with_callbacks(src, &mut errors)
+        .flat_map(|line| line.gcodes().to_vec())
+        .collect();
+
+    let mut commands = Vec::new();
+    let mut arguments = Vec::new();
+    let mut command_spans = Vec::new();
+
+    for gcode in &gcodes {
+        match pack(src, gcode, arguments.len()) {
+            Ok(command) => commands.push(command),
+            Err(msg) => errors.push(gcode.span(), msg),
+        }
+
+        for arg in gcode.arguments() {
+            if !arg.value.is_finite() {
+                errors.push(arg.span, format!("{} is out of range", arg));
+                continue;
+            }
+            let letter = Literal::character(arg.letter);
+            let value = Literal::f32_suffixed(arg.value);
+            arguments.push(quote!(
+                ::gcode::packed::PackedWord::new(#letter, #value)
+            ));
+        }
+
+        command_spans.push(span(gcode.span()));
+    }
+
+    errors.check()?;
+
+    let command_count = commands.len();
+    let argument_count = arguments.len();
+    let (spans_static, spans_expr) = if spans {
+        (
+            quote!(
+                static SPANS: [::gcode::Span; #command_count] =
+                    [#(#command_spans),*];
+            ),
+            quote!(::core::option::Option::Some(&SPANS)),
+        )
+    } else {
+        (quote!(), quote!(::core::option::Option::None))
+    };
+
+    Ok(quote!({
+        static COMMANDS: [::gcode::packed::PackedCommand; #command_count] =
+            [#(#commands),*];
+        static ARGUMENTS: [::gcode::packed::PackedWord; #argument_count] =
+            [#(#arguments),*];
+        #spans_static
+
+        ::gcode::packed::Program::new(&COMMANDS, &ARGUMENTS, #spans_expr)
+    }))
+}
+
+/// Generate the [`gcode::packed::PackedCommand`] for a [`GCode`], given
+/// where its arguments will start.
+fn pack(
+    src: &str,
+    gcode: &GCode,
+    first_argument: usize,
+) -> Result<TokenStream2, String> {
+    let mnemonic = match gcode.mnemonic() {
+        Mnemonic::General => quote!(::gcode::Mnemonic::General),
+        Mnemonic::Miscellaneous => quote!(::gcode::Mnemonic::Miscellaneous),
+        Mnemonic::ProgramNumber => quote!(::gcode::Mnemonic::ProgramNumber),
+        Mnemonic::ToolChange => quote!(::gcode::Mnemonic::ToolChange),
+    };
+
+    // GCode::major_number() assumes the number is positive, so look at the
+    // original text to check
+    let number = &src[gcode.span().start + 1..];
+    if number.trim_start().starts_with('-') {
+        return Err(String::from("Command numbers can't be negative"));
+    }
+
+    let name = format!("{}{}", gcode.mnemonic(), gcode.major_number());
+    let major = u16::try_from(gcode.major_number())
+        .map_err(|_| format!("The command number in {} is too big", name))?;
+    let minor = u8::try_from(gcode.minor_number())
+        .map_err(|_| format!("The command number in {} is too big", name))?;
+    let first = u32::try_from(first_argument)
+        .map_err(|_| String::from("The program has too many arguments"))?;
+    let count = u8::try_from(gcode.arguments().len())
+        .map_err(|_| format!("{} has too many arguments", name))?;
+
+    Ok(quote!(
+        ::gcode::packed::PackedCommand::new(
+            #mnemonic, #major, #minor, #first, #count,
+        )
+    ))
+}
+
+fn span(span: Span) -> TokenStream2 {
+    let start = Literal::usize_unsuffixed(span.start);
+    let end = Literal::usize_unsuffixed(span.end);
+    let line = Literal::usize_unsuffixed(span.line);
+
+    quote!(::gcode::Span::new(#start, #end, #line))
+}
+
+/// [`Callbacks`] which turn every problem into an error message.
+#[derive(Debug)]
+struct Errors<'src> {
+    src: &'src str,
+    messages: Vec<String>,
+}
+
+impl<'src> Errors<'src> {
+    fn new(src: &'src str) -> Self {
+        Errors {
+            src,
+            messages: Vec::new(),
+        }
+    }
+
+    fn push(&mut self, span: Span, msg: String) {
+        let line_start = self.src[..span.start]
+            .rfind('\n')
+            .map(|ix| ix + 1)
+            .unwrap_or(0);
+        let column = self.src[line_start..span.start].chars().count();
+
+        self.messages.push(format!(
+            "{} (line {}, column {})",
+            msg,
+            span.line + 1,
+            column + 1
+        ));
+    }
+
+    fn check(&mut self) -> Result<(), Errors<'src>> {
+        if self.messages.is_empty() {
+            Ok(())
+        } else {
+            Err(Errors {
+                src: self.src,
+                messages: std::mem::take(&mut self.messages),
+            })
+        }
+    }
+
+    fn into_syn_error(
+        self,
+        span: proc_macro2::Span,
+        origin: &str,
+    ) -> syn::Error {
+        let mut messages = self.messages.into_iter();
+        let first = messages.next().unwrap_or_default();
+        let mut error = syn::Error::new(span, format!("{}: {}", origin, first));
+
+        for msg in messages {
+            error
+                .combine(syn::Error::new(span, format!("{}: {}", origin, msg)));
+        }
+
+        error
+    }
+}
+
+impl<'src> Callbacks for Errors<'src> {
+    fn unknown_content(&mut self, text: &str, span: Span) {
+        self.push(span, format!("Unknown content: {:?}", text));
+    }
+
+    fn unexpected_line_number(&mut self, line_number: f32, span: Span) {
+        self.push(span, format!("Unexpected line number: N{}", line_number));
+    }
+
+    fn argument_without_a_command(
+        &mut self,
+        letter: char,
+        value: f32,
+        span: Span,
+    ) {
+        self.push(
+            span,
+            format!("The argument {}{} has no command", letter, value),
+        );
+    }
+
+    fn number_without_a_letter(&mut self, value: &str, span: Span) {
+        self.push(span, format!("The number {:?} has no letter", value));
+    }
+
+    fn letter_without_a_number(&mut self, value: &str, span: Span) {
+        self.push(span, format!("The letter {:?} has no number", value));
+    }
+}
@@ -0,0 +1,12 @@
+; Prime the nozzle with a line along the front edge of the bed
+G28 ; home all axes
+G90
+M83 ; relative extrusion
+G92 E0
+G1 Z0.3 F3000
+G1 X5 Y20 F5000
+G1 X5 Y200 E15 F1500
+G1 X5.4 Y200 F5000
+G1 X5.4 Y20 E15 F1500
+G92 E0
+G1 Z2 F3000
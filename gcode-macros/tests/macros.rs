@@ -0,0 +1,51 @@
+use gcode::{packed::Program, GCode, Mnemonic};
+use gcode_macros::{gcode, include_gcode};
+
+static PURGE_LINE: Program<'static> =
+    include_gcode!("tests/data/purge_line.gcode");
+static PURGE_LINE_WITH_SPANS: Program<'static> =
+    include_gcode!("tests/data/purge_line.gcode", spans);
+
+#[test]
+fn compiled_programs_match_the_runtime_parser() {
+    let src = include_str!("data/purge_line.gcode");
+    let expected: Vec<GCode> = gcode::parse(src).collect();
+
+    let got: Vec<GCode> = PURGE_LINE_WITH_SPANS
+        .commands()
+        .map(|cmd| cmd.to_gcode().unwrap())
+        .collect();
+
+    assert_eq!(got, expected);
+    for (cmd, original) in PURGE_LINE_WITH_SPANS.commands().zip(&expected) {
+        assert_eq!(cmd.span(), original.span());
+        assert!(!cmd.span().is_placeholder());
+    }
+}
+
+#[test]
+fn spans_are_optional() {
+    assert!(!PURGE_LINE.has_spans());
+    assert!(PURGE_LINE_WITH_SPANS.has_spans());
+    assert_eq!(PURGE_LINE.len(), PURGE_LINE_WITH_SPANS.len());
+}
+
+#[test]
+fn inline_programs() {
+    let program =
+        gcode!("G90 ; absolute\nN10 G01 X5 Y-2.5\nM104 S210\nG38.2 Z-10");
+
+    let got: Vec<String> = program.commands().map(|c| c.to_string()).collect();
+
+    assert_eq!(got, &["G90", "G1 X5 Y-2.5", "M104 S210", "G38.2 Z-10"]);
+    assert_eq!(program.get(2).unwrap().mnemonic(), Mnemonic::Miscellaneous);
+    assert_eq!(program.arguments().len(), 4);
+}
+
+#[test]
+fn empty_programs() {
+    static EMPTY: Program<'static> = gcode!("(nothing to see here)", spans);
+
+    assert!(EMPTY.is_empty());
+    assert_eq!(EMPTY.commands().count(), 0);
+}
@@ -25,3 +25,199 @@ bench!(program_1);
 bench!(program_2);
 bench!(program_3);
 bench!(PI_octcat);
+
+/// Simulates the work done by a consumer (e.g. a motion planner) for each
+/// line, so we can see how much of it overlaps with tokenizing.
+fn process(line: &gcode::Line<'_>) -> f32 {
+    line.gcodes()
+        .iter()
+        .flat_map(|g| g.arguments())
+        .map(|arg| (arg.value * 1.5).sqrt())
+        .sum()
+}
+
+/// A couple of the files in `tests/data` glued together and repeated, like a
+/// long job arriving over `stdin`.
+fn stdin_style_input() -> String {
+    let program = [
+        include_str!("../tests/data/program_1.gcode"),
+        include_str!("../tests/data/program_2.gcode"),
+        include_str!("../tests/data/program_3.gcode"),
+        include_str!("../tests/data/Insulpro.Piping.-.115mm.OD.-.40mm.WT.txt"),
+    ]
+    .join("\n");
+
+    vec![program; 64].join("\n")
+}
+
+#[bench]
+fn stream_sequential(b: &mut Bencher) {
+    let src = stdin_style_input();
+    b.bytes = src.len() as u64;
+
+    b.iter(|| {
+        gcode::full_parse_with_callbacks(&src, gcode::Nop)
+            .map(|line| process(&line))
+            .sum::<f32>()
+    });
+}
+
+#[bench]
+fn stream_pipelined(b: &mut Bencher) {
+    let src = stdin_style_input();
+    b.bytes = src.len() as u64;
+
+    b.iter(|| {
+        let mut total = 0.0;
+        gcode::pipeline::parse_pipelined(&src, gcode::Nop, |line| {
+            total += process(&line)
+        });
+        total
+    });
+}
+
+#[bench]
+fn export_json_lines(b: &mut Bencher) {
+    use gcode::export::{Exporter, Format, Schema};
+
+    let src = stdin_style_input();
+    b.bytes = src.len() as u64;
+
+    b.iter(|| {
+        let mut exporter = Exporter::new(
+            std::io::sink(),
+            Format::JsonLines,
+            Schema::default(),
+        );
+        for line in gcode::full_parse_with_callbacks(&src, gcode::Nop) {
+            exporter.write_line(&line).unwrap();
+        }
+        exporter.finish().unwrap();
+    });
+}
+
+#[bench]
+fn export_message_pack(b: &mut Bencher) {
+    use gcode::export::{Exporter, Format, Schema};
+
+    let src = stdin_style_input();
+    b.bytes = src.len() as u64;
+
+    b.iter(|| {
+        let mut exporter = Exporter::new(
+            std::io::sink(),
+            Format::MessagePack,
+            Schema::default(),
+        );
+        for line in gcode::full_parse_with_callbacks(&src, gcode::Nop) {
+            exporter.write_line(&line).unwrap();
+        }
+        exporter.finish().unwrap();
+    });
+}
+
+macro_rules! bench_profile {
+    ($name:ident, $profile:ty) => {
+        #[bench]
+        fn $name(b: &mut Bencher) {
+            let src = stdin_style_input();
+            b.bytes = src.len() as u64;
+
+            b.iter(|| {
+                gcode::Parser::<
+                    gcode::Nop,
+                    gcode::buffers::DefaultBuffers,
+                    $profile,
+                >::new(&src, gcode::Nop)
+                .count()
+            });
+        }
+    };
+}
+
+bench_profile!(profile_full, gcode::profile::Full);
+bench_profile!(profile_commands_only, gcode::profile::CommandsOnly);
+bench_profile!(
+    profile_without_comments,
+    gcode::profile::Custom<false, true, true>
+);
+bench_profile!(profile_without_spans, gcode::profile::Custom<true, false, true>);
+
+#[bench]
+fn rewrite_without_source_map(b: &mut Bencher) {
+    use std::io::{BufWriter, Write};
+
+    let src = stdin_style_input();
+    b.bytes = src.len() as u64;
+
+    b.iter(|| {
+        let mut writer = BufWriter::with_capacity(64 * 1024, std::io::sink());
+        for gcode in gcode::parse(&src) {
+            writeln!(writer, "{}", gcode).unwrap();
+        }
+        writer.flush().unwrap();
+    });
+}
+
+#[bench]
+fn rewrite_with_source_map(b: &mut Bencher) {
+    use gcode::sourcemap::MappedWriter;
+
+    let src = stdin_style_input();
+    b.bytes = src.len() as u64;
+
+    b.iter(|| {
+        let mut writer = MappedWriter::new(std::io::sink());
+        for gcode in gcode::parse(&src) {
+            writer.write_gcode(&gcode).unwrap();
+            writer.newline().unwrap();
+        }
+        writer.finish().unwrap().1.encode()
+    });
+}
+
+#[bench]
+fn moves_one_at_a_time(b: &mut Bencher) {
+    use gcode::moves::Toolpath;
+
+    let src = stdin_style_input();
+    b.bytes = src.len() as u64;
+
+    b.iter(|| {
+        Toolpath::parse(&src)
+            .moves
+            .iter()
+            .map(|m| m.xy_length())
+            .sum::<f32>()
+    });
+}
+
+#[bench]
+fn moves_in_chunks(b: &mut Bencher) {
+    use gcode::moves::MoveChunks;
+
+    let src = stdin_style_input();
+    b.bytes = src.len() as u64;
+
+    b.iter(|| {
+        let mut chunks = MoveChunks::parse(&src);
+        let mut distance = 0.0;
+
+        while let Some(chunk) = chunks.next_chunk() {
+            let dx = chunk
+                .end_x()
+                .iter()
+                .zip(chunk.start_x())
+                .map(|(e, s)| e - s);
+            let dy = chunk
+                .end_y()
+                .iter()
+                .zip(chunk.start_y())
+                .map(|(e, s)| e - s);
+            distance +=
+                dx.zip(dy).map(|(x, y)| (x * x + y * y).sqrt()).sum::<f32>();
+        }
+
+        distance
+    });
+}
@@ -0,0 +1,218 @@
+//! Measures how long each call to `Parser::next()` takes, rather than overall
+//! throughput.
+//!
+//! A motion planner consumes one line at a time, so what matters for a
+//! real-time controller is the slowest line, not the average. Every input is
+//! parsed several times and each line keeps the fastest of its timings,
+//! which filters out preemption and cache warm-up noise while keeping lines
+//! which are *consistently* slow. The percentiles are taken across lines.
+//!
+//! This uses a plain `main()` (`harness = false`) so it runs on stable and
+//! doesn't need `libtest`, which makes it easy to run on a target under
+//! emulation:
+//!
+//! ```console
+//! $ cargo bench --bench line_latency
+//! $ cargo bench --bench line_latency --target armv7-unknown-linux-gnueabihf --no-run
+//! $ qemu-arm -L /usr/arm-linux-gnueabihf target/armv7-unknown-linux-gnueabihf/release/deps/line_latency-*
+//! ```
+//!
+//! The run fails if any input exceeds its bounds (the p99 bound is only
+//! checked for inputs with at least 100 lines). The defaults are generous
+//! enough for a desktop machine and can be overridden (in nanoseconds) with
+//! the `GCODE_LATENCY_P99_NS` and `GCODE_LATENCY_MAX_NS` environment
+//! variables. `GCODE_LATENCY_ROUNDS` sets how many times each input is
+//! parsed.
+
+use gcode::{
+    buffers::{Buffers, DefaultBuffers, SmallFixedBuffers},
+    Nop, Parser,
+};
+use std::{
+    env,
+    hint::black_box,
+    process,
+    time::{Duration, Instant},
+};
+
+const DEFAULT_ROUNDS: usize = 20;
+const DEFAULT_P99: Duration = Duration::from_micros(20);
+const DEFAULT_MAX: Duration = Duration::from_micros(200);
+
+/// The fastest time taken to parse each line of some input.
+fn line_timings<B>(src: &str, rounds: usize) -> Vec<Duration>
+where
+    B: for<'input> Buffers<'input>,
+{
+    let mut fastest: Vec<Duration> = Vec::new();
+
+    for _ in 0..rounds {
+        let mut parser: Parser<'_, Nop, B> = Parser::new(src, Nop);
+        let mut line = 0;
+
+        loop {
+            let start = Instant::now();
+            let next = black_box(parser.next());
+            let elapsed = start.elapsed();
+
+            if next.is_none() {
+                break;
+            }
+
+            match fastest.get_mut(line) {
+                Some(previous) => *previous = (*previous).min(elapsed),
+                None => fastest.push(elapsed),
+            }
+            line += 1;
+        }
+    }
+
+    fastest.sort_unstable();
+    fastest
+}
+
+/// The value below which `fraction` of the (sorted) `timings` fall.
+fn percentile(timings: &[Duration], fraction: f64) -> Duration {
+    if timings.is_empty() {
+        return Duration::default();
+    }
+
+    let index = ((timings.len() - 1) as f64 * fraction).round() as usize;
+    timings[index]
+}
+
+/// Synthetic inputs which exercise the worst cases for a single line.
+fn worst_cases() -> Vec<(&'static str, String)> {
+    let letters = "ABCDEFHIJKLPQRSUVWXYZ";
+
+    let many_arguments: String = std::iter::once("G01".to_string())
+        .chain(
+            letters
+                .chars()
+                .cycle()
+                .take(64)
+                .enumerate()
+                .map(|(i, letter)| format!("{}{}.{:03}", letter, i, i * 7)),
+        )
+        .collect::<Vec<_>>()
+        .join(" ");
+
+    let many_commands = (0..32)
+        .map(|i| format!("G{} X{}", i % 4, i))
+        .collect::<Vec<_>>()
+        .join(" ");
+
+    let long_line = (0..250)
+        .map(|i| format!("X{}.{:04}", i, i * 37 % 10_000))
+        .collect::<Vec<_>>()
+        .join(" ");
+
+    let long_comment = "x".repeat(4096);
+
+    vec![
+        ("many-arguments", many_arguments),
+        ("many-commands", many_commands),
+        ("max-length-line", format!("N10 G01 {}", long_line)),
+        ("long-semicolon-comment", format!("G90 ; {}", long_comment)),
+        (
+            "long-paren-comment",
+            format!("G90 ({}) G01 X1", long_comment),
+        ),
+        ("garbage", format!("G01 X1 {} Y2", "$%^&*#@!".repeat(512))),
+    ]
+}
+
+fn corpus() -> Vec<(&'static str, String)> {
+    let files = [
+        ("program_1", include_str!("../tests/data/program_1.gcode")),
+        ("program_2", include_str!("../tests/data/program_2.gcode")),
+        ("program_3", include_str!("../tests/data/program_3.gcode")),
+        ("PI_octcat", include_str!("../tests/data/PI_octcat.gcode")),
+        (
+            "Insulpro",
+            include_str!(
+                "../tests/data/Insulpro.Piping.-.115mm.OD.-.40mm.WT.txt"
+            ),
+        ),
+    ];
+
+    files
+        .iter()
+        .map(|&(name, src)| (name, src.to_string()))
+        .chain(worst_cases())
+        .collect()
+}
+
+fn env_duration(name: &str, default: Duration) -> Duration {
+    env::var(name)
+        .ok()
+        .and_then(|value| value.parse().ok())
+        .map(Duration::from_nanos)
+        .unwrap_or(default)
+}
+
+fn main() {
+    let rounds = env::var("GCODE_LATENCY_ROUNDS")
+        .ok()
+        .and_then(|value| value.parse().ok())
+        .unwrap_or(DEFAULT_ROUNDS);
+    let p99_bound = env_duration("GCODE_LATENCY_P99_NS", DEFAULT_P99);
+    let max_bound = env_duration("GCODE_LATENCY_MAX_NS", DEFAULT_MAX);
+
+    // "cargo bench" passes "--bench", anything else is a filter
+    let filter = env::args().skip(1).find(|arg| !arg.starts_with("--"));
+
+    println!(
+        "{:<24} {:<8} {:>7} {:>9} {:>9} {:>9} {:>9}",
+        "input", "buffers", "lines", "p50", "p99", "p99.9", "max"
+    );
+
+    let mut failures = Vec::new();
+
+    for (name, src) in corpus() {
+        if let Some(filter) = &filter {
+            if !name.contains(filter.as_str()) {
+                continue;
+            }
+        }
+
+        let runs = [
+            ("vec", line_timings::<DefaultBuffers>(&src, rounds)),
+            ("fixed", line_timings::<SmallFixedBuffers>(&src, rounds)),
+        ];
+
+        for (buffers, timings) in &runs {
+            let p99 = percentile(timings, 0.99);
+            let max = timings.last().copied().unwrap_or_default();
+
+            println!(
+                "{:<24} {:<8} {:>7} {:>9?} {:>9?} {:>9?} {:>9?}",
+                name,
+                buffers,
+                timings.len(),
+                percentile(timings, 0.5),
+                p99,
+                percentile(timings, 0.999),
+                max,
+            );
+
+            // the p99 of a handful of lines is really just the max
+            let enough_lines = timings.len() >= 100;
+
+            if (enough_lines && p99 > p99_bound) || max > max_bound {
+                failures.push(format!("{} ({})", name, buffers));
+            }
+        }
+    }
+
+    if !failures.is_empty() {
+        eprintln!();
+        eprintln!(
+            "Exceeded the latency bounds (p99 {:?}, max {:?}): {}",
+            p99_bound,
+            max_bound,
+            failures.join(", ")
+        );
+        process::exit(1);
+    }
+}
@@ -0,0 +1,565 @@
+//! Adjusting feed rates to keep the load on a milling cutter constant.
+//!
+//! A program usually cuts at one feed rate regardless of how much material
+//! the tool is actually in contact with, so it crawls through light cuts and
+//! can overload the tool in heavy ones. A [`FeedOptimizer`] simulates each
+//! move with the [material removal model](crate::removal), estimates the
+//! cross section of material being cut, and rewrites the `F` words on feed
+//! moves to hold a [`Target`] chip load or removal rate.
+//!
+//! Commands are processed in windows of a fixed size, so memory use doesn't
+//! grow with the length of the program.
+//!
+//! ```rust
+//! use gcode::{
+//!     adaptive::{FeedOptimizer, Target},
+//!     removal::{Stock, Tool},
+//!     GCode,
+//! };
+//!
+//! // a full-width slot, then a lighter pass which widens it
+//! let src = "G90 G21\nG0 X-5 Y5 Z1\nG1 Z-2 F300\nG1 X25 F500\nG0 Z1\n\
+//!            G0 X-5 Y6.5\nG1 Z-2 F300\nG1 X25 F500\n";
+//! let mut stock = Stock::new([0.0, 0.0, -10.0], [20.0, 20.0, 0.0], 0.1);
+//! let optimizer = FeedOptimizer::new(Tool::Flat { diameter: 4.0 }, Target::RemovalRate(4000.0))
+//!     .with_feed_limits(50.0, 2000.0)
+//!     .with_override_range(0.5, 3.0);
+//!
+//! let mut adjusted = optimizer.optimize(&mut stock, gcode::parse(src));
+//! let program: Vec<GCode> = adjusted.by_ref().collect();
+//!
+//! // 4000 mm³/min through a 4mm x 2mm slot is 500 mm/min...
+//! assert_eq!(program[4].value_for('F'), Some(500.0));
+//! // ...but the second pass only cuts 1.5mm of the tool's width
+//! assert_eq!(program[8].value_for('F'), Some(1333.0));
+//! assert!(adjusted.report().time_saved().as_secs_f32() > 0.0);
+//! ```
+
+use crate::{
+    moves::{Move, Resolver},
+    removal::{Simulator, Stock, Tool},
+    GCode, Mnemonic, Word,
+};
+use std::{collections::VecDeque, time::Duration};
+
+/// What a [`FeedOptimizer`] tries to hold constant.
+#[derive(Debug, Copy, Clone, PartialEq)]
+pub enum Target {
+    /// A material removal rate, in cubic program units per minute.
+    RemovalRate(f32),
+    /// The thickness of the chip each tooth cuts, allowing for radial chip
+    /// thinning when less than half the tool is engaged.
+    ChipLoad {
+        /// The chip thickness, in program units.
+        per_tooth: f32,
+        /// The number of teeth on the cutter.
+        flutes: u32,
+        /// The spindle speed, in RPM.
+        spindle_speed: f32,
+    },
+}
+
+/// Rewrites feed rates for a constant tool load.
+#[derive(Debug, Copy, Clone, PartialEq)]
+pub struct FeedOptimizer {
+    tool: Tool,
+    target: Target,
+    simulator: Simulator,
+    min_feed: f32,
+    max_feed: f32,
+    min_override: f32,
+    max_override: f32,
+    window: usize,
+}
+
+impl FeedOptimizer {
+    /// The default number of commands simulated at a time.
+    pub const DEFAULT_WINDOW: usize = 512;
+    /// Cross sections smaller than this (in square program units) are
+    /// treated as cutting air.
+    const MIN_AREA: f32 = 1e-3;
+
+    /// Create a [`FeedOptimizer`] for a tool.
+    ///
+    /// By default feeds are kept between 1 and 10,000 units per minute, and
+    /// between half and double what the program asked for.
+    pub fn new(tool: Tool, target: Target) -> Self {
+        FeedOptimizer {
+            tool,
+            target,
+            simulator: Simulator::new(tool),
+            min_feed: 1.0,
+            max_feed: 10_000.0,
+            min_override: 0.5,
+            max_override: 2.0,
+            window: FeedOptimizer::DEFAULT_WINDOW,
+        }
+    }
+
+    /// Set the slowest and fastest feed rates the machine allows.
+    pub fn with_feed_limits(self, min_feed: f32, max_feed: f32) -> Self {
+        FeedOptimizer {
+            min_feed,
+            max_feed: max_feed.max(min_feed),
+            ..self
+        }
+    }
+
+    /// Limit new feed rates to a range relative to the programmed one (e.g.
+    /// `0.5` to `2.0` for 50% to 200%).
+    pub fn with_override_range(self, min: f32, max: f32) -> Self {
+        FeedOptimizer {
+            min_override: min,
+            max_override: max.max(min),
+            ..self
+        }
+    }
+
+    /// Set how many commands are simulated at a time.
+    pub fn with_window(self, window: usize) -> Self {
+        FeedOptimizer {
+            window: window.max(1),
+            ..self
+        }
+    }
+
+    /// Set how many threads the material removal simulation uses.
+    pub fn with_threads(self, threads: usize) -> Self {
+        FeedOptimizer {
+            simulator: self.simulator.with_threads(threads),
+            ..self
+        }
+    }
+
+    /// Lazily rewrite a program, cutting it out of the `stock` as it goes.
+    ///
+    /// The `stock` stops keeping [history](Stock::with_history) because it
+    /// would need memory for every move in the program.
+    pub fn optimize<'s, I>(
+        &self,
+        stock: &'s mut Stock,
+        program: I,
+    ) -> AdaptiveFeed<'s, I::IntoIter>
+    where
+        I: IntoIterator<Item = GCode>,
+    {
+        stock.forget_history();
+
+        AdaptiveFeed {
+            optimizer: *self,
+            stock,
+            program: program.into_iter(),
+            resolver: Resolver::new(),
+            output: VecDeque::with_capacity(self.window),
+            emitted_feed: None,
+            report: Report::default(),
+        }
+    }
+
+    /// The ideal feed rate for cutting a cross section of material.
+    fn feed_for(&self, engagement: &Engagement) -> Option<f32> {
+        let area = engagement.area()?;
+
+        if area < FeedOptimizer::MIN_AREA {
+            // cutting air
+            return Some(f32::INFINITY);
+        }
+
+        match self.target {
+            Target::RemovalRate(rate) => Some(rate / area),
+            Target::ChipLoad {
+                per_tooth,
+                flutes,
+                spindle_speed,
+            } => {
+                let diameter = self.tool.radius() * 2.0;
+                let depth = engagement.depth.max(FeedOptimizer::MIN_AREA);
+                let width = (area / depth).min(diameter);
+                let ratio = width / diameter;
+                let thinning = if ratio < 0.5 {
+                    2.0 * libm::sqrtf(ratio - ratio * ratio)
+                } else {
+                    1.0
+                };
+
+                Some(
+                    per_tooth * flutes as f32 * spindle_speed
+                        / thinning.max(1e-3),
+                )
+            },
+        }
+    }
+
+    /// Clamp a feed to the machine's limits and the allowed override range.
+    fn limit(&self, ideal: f32, programmed: f32) -> f32 {
+        let feed = ideal
+            .max(programmed * self.min_override)
+            .min(programmed * self.max_override)
+            .max(self.min_feed)
+            .min(self.max_feed);
+
+        libm::roundf(feed)
+    }
+}
+
+/// How much material a command cuts.
+#[derive(Debug, Default, Copy, Clone, PartialEq)]
+struct Engagement {
+    /// The largest cross section cut by any part of the command.
+    peak_area: f32,
+    xy_length: f32,
+    depth: f32,
+    /// The feed rate the program used.
+    programmed: Option<f32>,
+    /// Did the command make a move in the X-Y plane from a known position?
+    moved: bool,
+}
+
+impl Engagement {
+    /// The cross section of material cut, if the command moved sideways.
+    fn area(&self) -> Option<f32> {
+        if self.moved {
+            Some(self.peak_area)
+        } else {
+            None
+        }
+    }
+}
+
+/// A program with its feed rates adjusted, created by
+/// [`FeedOptimizer::optimize()`].
+#[derive(Debug)]
+pub struct AdaptiveFeed<'s, I> {
+    optimizer: FeedOptimizer,
+    stock: &'s mut Stock,
+    program: I,
+    resolver: Resolver,
+    output: VecDeque<GCode>,
+    /// The feed rate in effect in the rewritten program.
+    emitted_feed: Option<f32>,
+    report: Report,
+}
+
+impl<'s, I: Iterator<Item = GCode>> AdaptiveFeed<'s, I> {
+    /// What has been done so far.
+    pub fn report(&self) -> &Report { &self.report }
+
+    /// Simulate the next window of commands and queue them for output.
+    fn fill(&mut self) {
+        let window: Vec<GCode> =
+            self.program.by_ref().take(self.optimizer.window).collect();
+        if window.is_empty() {
+            return;
+        }
+
+        let mut moves = Vec::new();
+        let mut owners = Vec::new();
+        let mut engagements = Vec::with_capacity(window.len());
+        // short enough that a move which is partly in the air doesn't look
+        // like a lighter cut than it really is
+        let max_length = self.optimizer.tool.radius().max(1e-3);
+
+        for (index, gcode) in window.iter().enumerate() {
+            let resolver = &mut self.resolver;
+            resolver.apply(gcode, |m: Move| {
+                for piece in split(m, max_length) {
+                    moves.push(piece);
+                    owners.push(index);
+                }
+            });
+            engagements.push(Engagement {
+                programmed: resolver.state().feed_rate,
+                ..Engagement::default()
+            });
+        }
+
+        let simulated = self.optimizer.simulator.run(self.stock, &moves);
+
+        for (k, m) in moves.iter().enumerate() {
+            let engagement = &mut engagements[owners[k]];
+            let length = m.xy_length();
+
+            if !m.rapid && length > 0.0 {
+                engagement.moved = true;
+                engagement.xy_length += length;
+                engagement.peak_area =
+                    engagement.peak_area.max(simulated.removed[k] / length);
+                engagement.depth = engagement.depth.max(simulated.deepest[k]);
+            }
+        }
+
+        for (gcode, engagement) in window.into_iter().zip(&engagements) {
+            let gcode = self.rewrite(gcode, engagement);
+            self.output.push_back(gcode);
+        }
+    }
+
+    fn rewrite(&mut self, gcode: GCode, engagement: &Engagement) -> GCode {
+        if !is_feed_move(&gcode) {
+            if let Some(feed) = gcode.value_for('F') {
+                self.emitted_feed = Some(feed);
+            }
+            return gcode;
+        }
+
+        let programmed = match engagement.programmed {
+            Some(programmed) => programmed,
+            // nothing to scale from, so leave it alone
+            None => return gcode,
+        };
+        let feed = match self.optimizer.feed_for(engagement) {
+            Some(ideal) => {
+                let feed = self.optimizer.limit(ideal, programmed);
+                self.report.record(engagement.xy_length, programmed, feed);
+                feed
+            },
+            // plunges keep their programmed feed
+            None => programmed,
+        };
+
+        let gcode = if self.emitted_feed == Some(feed) {
+            with_feed(gcode, None)
+        } else {
+            with_feed(gcode, Some(feed))
+        };
+        self.emitted_feed = Some(feed);
+
+        gcode
+    }
+}
+
+impl<'s, I: Iterator<Item = GCode>> Iterator for AdaptiveFeed<'s, I> {
+    type Item = GCode;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        if self.output.is_empty() {
+            self.fill();
+        }
+
+        self.output.pop_front()
+    }
+}
+
+/// Split a move into equal pieces no longer than `max_length`.
+fn split(m: Move, max_length: f32) -> impl Iterator<Item = Move> {
+    let pieces = libm::ceilf(m.length() / max_length).max(1.0) as usize;
+    let at = move |t: f32| {
+        let mut point = m.start;
+        for axis in 0..3 {
+            point[axis] += (m.end[axis] - m.start[axis]) * t;
+        }
+        point
+    };
+
+    (0..pieces).map(move |i| Move {
+        start: at(i as f32 / pieces as f32),
+        end: at((i + 1) as f32 / pieces as f32),
+        extrusion: m.extrusion / pieces as f32,
+        ..m
+    })
+}
+
+fn is_feed_move(gcode: &GCode) -> bool {
+    gcode.mnemonic() == Mnemonic::General
+        && (1..=3).contains(&gcode.major_number())
+        && gcode.minor_number() == 0
+}
+
+/// Replace a command's `F` word, or remove it if `feed` is `None`.
+fn with_feed(gcode: GCode, feed: Option<f32>) -> GCode {
+    let mut rewritten = GCode::new_with_argument_buffer(
+        gcode.mnemonic(),
+        gcode.number(),
+        gcode.span(),
+        Vec::with_capacity(gcode.arguments().len() + 1),
+    );
+    let mut span = None;
+
+    for &word in gcode.arguments() {
+        if word.letter.to_ascii_uppercase() == 'F' {
+            span = Some(word.span);
+        } else {
+            let _ = rewritten.push_argument_inner(word, false);
+        }
+    }
+
+    if let Some(feed) = feed {
+        let span = span.unwrap_or_else(|| gcode.span());
+        let _ =
+            rewritten.push_argument_inner(Word::new('F', feed, span), false);
+    }
+
+    rewritten
+}
+
+/// A summary of what an [`AdaptiveFeed`] did.
+#[derive(Debug, Default, Copy, Clone, PartialEq)]
+pub struct Report {
+    /// The number of feed moves which were considered.
+    pub moves: usize,
+    /// How many of them were sped up.
+    pub sped_up: usize,
+    /// How many of them were slowed down.
+    pub slowed_down: usize,
+    /// The estimated time spent on those moves at the programmed feeds.
+    pub time_before: Duration,
+    /// The estimated time spent on those moves at the new feeds.
+    pub time_after: Duration,
+}
+
+impl Report {
+    /// An estimate of how much time was saved. Slowing down heavy cuts can
+    /// outweigh speeding up light ones, so this may be zero.
+    pub fn time_saved(&self) -> Duration {
+        self.time_before
+            .checked_sub(self.time_after)
+            .unwrap_or_default()
+    }
+
+    fn record(&mut self, length: f32, before: f32, after: f32) {
+        let minutes = |feed: f32| {
+            Duration::from_secs_f32(60.0 * length / feed.max(f32::EPSILON))
+        };
+
+        self.moves += 1;
+        if after > before {
+            self.sped_up += 1;
+        } else if after < before {
+            self.slowed_down += 1;
+        }
+        self.time_before += minutes(before);
+        self.time_after += minutes(after);
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn stock() -> Stock {
+        Stock::new([0.0, 0.0, -10.0], [20.0, 20.0, 0.0], 0.1)
+    }
+
+    fn feeds(optimizer: FeedOptimizer, src: &str) -> (Vec<GCode>, Report) {
+        let mut stock = stock();
+        let mut adjusted = optimizer.optimize(&mut stock, crate::parse(src));
+        let program = adjusted.by_ref().collect();
+
+        (program, *adjusted.report())
+    }
+
+    #[test]
+    fn history_is_turned_off() {
+        let mut stock = stock();
+        assert!(stock.keeps_history());
+        let optimizer = FeedOptimizer::new(
+            Tool::Flat { diameter: 4.0 },
+            Target::RemovalRate(1000.0),
+        );
+
+        let src = "G0 X-5 Y10 Z1\nG1 Z-1 F400\nG1 X25\n".repeat(10);
+        let adjusted = optimizer.optimize(&mut stock, crate::parse(&src));
+        assert_eq!(adjusted.count(), 30);
+
+        assert!(!stock.keeps_history());
+        assert!(stock.volume() < 4000.0);
+    }
+
+    #[test]
+    fn air_cuts_run_at_the_maximum_override() {
+        let src = "G0 X-5 Y-10 Z1\nG1 Z-1 F400\nG1 X25\n";
+
+        let (program, report) = feeds(
+            FeedOptimizer::new(
+                Tool::Flat { diameter: 4.0 },
+                Target::RemovalRate(1000.0),
+            ),
+            src,
+        );
+
+        // the plunge keeps its feed, the move past the stock goes at 200%
+        assert_eq!(program[1].value_for('F'), Some(400.0));
+        assert_eq!(program[2].value_for('F'), Some(800.0));
+        assert_eq!(report.sped_up, 1);
+        assert_eq!(report.time_before, report.time_after * 2);
+    }
+
+    #[test]
+    fn heavy_cuts_are_slowed_down() {
+        // a 6mm wide, 3mm deep slot is 18mm² of material
+        let src = "G0 X-5 Y10 Z1\nG1 Z-3 F100\nG1 X25 F900\n";
+
+        let (program, report) = feeds(
+            FeedOptimizer::new(
+                Tool::Flat { diameter: 6.0 },
+                Target::RemovalRate(9000.0),
+            )
+            .with_override_range(0.1, 1.0),
+            src,
+        );
+
+        assert_eq!(program[2].value_for('F'), Some(500.0));
+        assert_eq!(report.slowed_down, 1);
+        assert_eq!(report.time_saved(), Duration::from_secs(0));
+    }
+
+    #[test]
+    fn chip_thinning_allows_faster_light_cuts() {
+        let tool = Tool::Flat { diameter: 10.0 };
+        let target = Target::ChipLoad {
+            per_tooth: 0.05,
+            flutes: 2,
+            spindle_speed: 10_000.0,
+        };
+        let optimizer =
+            FeedOptimizer::new(tool, target).with_override_range(0.0, 100.0);
+        let full_width = Engagement {
+            peak_area: 10.0,
+            xy_length: 10.0,
+            depth: 1.0,
+            programmed: Some(1000.0),
+            moved: true,
+        };
+        let light = Engagement {
+            peak_area: 1.0,
+            ..full_width
+        };
+
+        // 0.05mm x 2 flutes x 10,000 RPM
+        assert_eq!(optimizer.feed_for(&full_width), Some(1000.0));
+        // 10% engagement thins the chip to 60% of the feed per tooth
+        let got = optimizer.feed_for(&light).unwrap();
+        assert!((got - 1000.0 / 0.6).abs() < 1.0, "{}", got);
+    }
+
+    #[test]
+    fn unchanged_feeds_arent_repeated() {
+        let src = "G0 X-5 Y-10 Z1\nG1 Z-1 F400\nG1 X25\nG1 Y-5\nG1 X-5\n";
+
+        let (program, _) = feeds(
+            FeedOptimizer::new(
+                Tool::Flat { diameter: 4.0 },
+                Target::RemovalRate(1000.0),
+            ),
+            src,
+        );
+
+        let got: Vec<_> = program.iter().map(|g| g.value_for('F')).collect();
+        assert_eq!(got, &[None, Some(400.0), Some(800.0), None, None]);
+    }
+
+    #[test]
+    fn small_windows_give_the_same_result() {
+        let src = "G0 X-5 Y5 Z1\nG1 Z-2 F300\nG1 X25 F500\nG0 Z1\nG0 X-5 \
+                   Y7.5\nG1 Z-2 F300\nG1 X25 F500\nG2 X25 Y12.5 I0 J2.5\n";
+        let optimizer = FeedOptimizer::new(
+            Tool::Ball { diameter: 4.0 },
+            Target::RemovalRate(2000.0),
+        );
+
+        let (whole, _) = feeds(optimizer, src);
+        let (windowed, _) = feeds(optimizer.with_window(1), src);
+
+        assert_eq!(whole, windowed);
+    }
+}
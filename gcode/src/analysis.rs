@@ -0,0 +1,541 @@
+//! Running several analyses over a program with a single parse.
+//!
+//! Each [`Analysis`] subscribes to the lines, comments and resolved
+//! [`Move`]s it cares about. An [`Analyzer`] parses the text and follows
+//! its modal state once, then hands every event to each analysis, so adding
+//! another analysis doesn't mean another pass over the text.
+//!
+//! Events are delivered in batches. With more than one thread, the
+//! analyses are split into groups which process each batch in parallel
+//! while the next batch is being parsed. Every analysis still sees every
+//! event in program order.
+//!
+//! ```rust
+//! use gcode::{
+//!     analysis::{Analysis, Analyzer, LayerIndex, Statistics},
+//!     Comment,
+//! };
+//!
+//! /// Count the comments which mention a word.
+//! struct Mentions(&'static str, usize);
+//!
+//! impl Analysis for Mentions {
+//!     type Output = usize;
+//!
+//!     fn on_comment(&mut self, comment: &Comment<'_>) {
+//!         if comment.value.contains(self.0) {
+//!             self.1 += 1;
+//!         }
+//!     }
+//!
+//!     fn finish(self, _: &gcode::moves::Resolver) -> usize { self.1 }
+//! }
+//!
+//! let src = "G28\n;LAYER:0\nG1 Z0.2\nG1 X10 E1\n;LAYER:1\nG1 Z0.4\nG1 X0 E2\n";
+//!
+//! let mut analyzer = Analyzer::new();
+//! let statistics = analyzer.add(Statistics::default());
+//! let layers = analyzer.add(LayerIndex::default());
+//! let mentions = analyzer.add(Mentions("LAYER", 0));
+//! let mut results = analyzer.run(src);
+//!
+//! assert_eq!(results.take(statistics).unwrap().moves, 4);
+//! assert_eq!(results.take(layers).unwrap().len(), 2);
+//! assert_eq!(results.take(mentions), Some(2));
+//! ```
+
+use crate::{
+    moves::{Layer, Move, Resolver},
+    state::ModalState,
+    Callbacks, Comment, Line, Nop,
+};
+use std::{any::Any, fmt, marker::PhantomData, thread};
+
+/// Something which learns about a program from its lines, comments and
+/// moves.
+///
+/// For each line, [`Analysis::on_line()`] is called first, then
+/// [`Analysis::on_comment()`] for each of its comments and
+/// [`Analysis::on_move()`] for each move it made. All of them default to
+/// doing nothing.
+pub trait Analysis: Send {
+    /// The result of the analysis.
+    type Output: Send + 'static;
+
+    /// A line was parsed. The `state` is the modal state after the line.
+    fn on_line(&mut self, _line: &Line<'_>, _state: &ModalState) {}
+
+    /// A comment was found.
+    fn on_comment(&mut self, _comment: &Comment<'_>) {}
+
+    /// A [`Move`] was made. Its layer and feature can be looked up in the
+    /// [`Resolver`] passed to [`Analysis::finish()`].
+    fn on_move(&mut self, _movement: &Move) {}
+
+    /// The whole program has been seen.
+    fn finish(self, resolver: &Resolver) -> Self::Output;
+}
+
+/// An [`Analysis`] with its output type erased, so different analyses can
+/// be stored together.
+trait Subscriber: Send {
+    fn on_batch(&mut self, batch: &Batch<'_>);
+    fn finish(self: Box<Self>, resolver: &Resolver) -> Box<dyn Any + Send>;
+}
+
+impl<A: Analysis> Subscriber for A {
+    fn on_batch(&mut self, batch: &Batch<'_>) {
+        let mut moves = batch.moves.iter();
+
+        for ((line, state), &move_count) in batch
+            .lines
+            .iter()
+            .zip(&batch.states)
+            .zip(&batch.move_counts)
+        {
+            self.on_line(line, state);
+            for comment in line.comments() {
+                self.on_comment(comment);
+            }
+            for movement in moves.by_ref().take(move_count) {
+                self.on_move(movement);
+            }
+        }
+    }
+
+    fn finish(self: Box<Self>, resolver: &Resolver) -> Box<dyn Any + Send> {
+        Box::new(Analysis::finish(*self, resolver))
+    }
+}
+
+/// A run of lines, along with the state and moves that came from them.
+#[derive(Debug, Default)]
+struct Batch<'input> {
+    lines: Vec<Line<'input>>,
+    states: Vec<ModalState>,
+    /// The number of moves each line made.
+    move_counts: Vec<usize>,
+    moves: Vec<Move>,
+}
+
+impl<'input> Batch<'input> {
+    fn is_empty(&self) -> bool { self.lines.is_empty() }
+}
+
+/// Identifies an [`Analysis`] added to an [`Analyzer`], so its output can
+/// be retrieved from the [`Results`].
+pub struct Handle<T> {
+    index: usize,
+    _output: PhantomData<fn() -> T>,
+}
+
+impl<T> Clone for Handle<T> {
+    fn clone(&self) -> Self { *self }
+}
+
+impl<T> Copy for Handle<T> {}
+
+impl<T> fmt::Debug for Handle<T> {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        f.debug_tuple("Handle").field(&self.index).finish()
+    }
+}
+
+/// Runs any number of [`Analysis`]es over a single parse.
+pub struct Analyzer<'a> {
+    subscribers: Vec<Box<dyn Subscriber + 'a>>,
+    resolver: Resolver,
+    threads: usize,
+    batch_size: usize,
+}
+
+impl<'a> Analyzer<'a> {
+    /// The default number of lines delivered to the analyses at a time.
+    pub const DEFAULT_BATCH_SIZE: usize = 4096;
+
+    /// Create an [`Analyzer`] which runs everything on the current thread.
+    pub fn new() -> Self {
+        Analyzer {
+            subscribers: Vec::new(),
+            resolver: Resolver::new(),
+            threads: 1,
+            batch_size: Analyzer::DEFAULT_BATCH_SIZE,
+        }
+    }
+
+    /// Split the analyses across up to this many threads. Parsing happens
+    /// alongside them, on the current thread.
+    pub fn with_threads(self, threads: usize) -> Self {
+        Analyzer {
+            threads: threads.max(1),
+            ..self
+        }
+    }
+
+    /// Set the number of lines delivered at a time.
+    pub fn with_batch_size(self, batch_size: usize) -> Self {
+        Analyzer {
+            batch_size: batch_size.max(1),
+            ..self
+        }
+    }
+
+    /// Use a custom [`Resolver`] to turn commands into moves.
+    pub fn with_resolver(self, resolver: Resolver) -> Self {
+        Analyzer { resolver, ..self }
+    }
+
+    /// Subscribe an [`Analysis`] to the program.
+    pub fn add<A: Analysis + 'a>(&mut self, analysis: A) -> Handle<A::Output> {
+        self.subscribers.push(Box::new(analysis));
+
+        Handle {
+            index: self.subscribers.len() - 1,
+            _output: PhantomData,
+        }
+    }
+
+    /// Parse some text and run every analysis over it.
+    pub fn run(self, src: &str) -> Results { self.run_with_callbacks(src, Nop) }
+
+    /// Parse some text and run every analysis over it, using the provided
+    /// [`Callbacks`] when a parse error occurs that we can recover from.
+    pub fn run_with_callbacks<C: Callbacks>(
+        self,
+        src: &str,
+        callbacks: C,
+    ) -> Results {
+        self.run_lines(crate::full_parse_with_callbacks(src, callbacks))
+    }
+
+    /// Run every analysis over some already-parsed [`Line`]s.
+    pub fn run_lines<'input, I>(mut self, lines: I) -> Results
+    where
+        I: IntoIterator<Item = Line<'input>>,
+    {
+        let mut lines = lines.into_iter();
+        let mut current = self.next_batch(&mut lines);
+        let mut counts = (0, 0);
+
+        while !current.is_empty() {
+            counts.0 += current.lines.len();
+            counts.1 += current.moves.len();
+
+            let Analyzer {
+                ref mut subscribers,
+                ref mut resolver,
+                threads,
+                batch_size,
+            } = self;
+            let groups = threads.min(subscribers.len()).max(1);
+
+            current = if groups == 1 {
+                for subscriber in subscribers.iter_mut() {
+                    subscriber.on_batch(&current);
+                }
+                next_batch(resolver, batch_size, &mut lines)
+            } else {
+                let per_group = (subscribers.len() + groups - 1) / groups;
+                let batch = &current;
+
+                thread::scope(|scope| {
+                    for group in subscribers.chunks_mut(per_group) {
+                        let _ = scope.spawn(move || {
+                            for subscriber in group {
+                                subscriber.on_batch(batch);
+                            }
+                        });
+                    }
+
+                    next_batch(resolver, batch_size, &mut lines)
+                })
+            };
+        }
+
+        let resolver = self.resolver;
+        let outputs = self
+            .subscribers
+            .into_iter()
+            .map(|subscriber| Some(subscriber.finish(&resolver)))
+            .collect();
+
+        Results {
+            outputs,
+            lines: counts.0,
+            moves: counts.1,
+        }
+    }
+
+    fn next_batch<'input, I>(&mut self, lines: &mut I) -> Batch<'input>
+    where
+        I: Iterator<Item = Line<'input>>,
+    {
+        next_batch(&mut self.resolver, self.batch_size, lines)
+    }
+}
+
+fn next_batch<'input, I>(
+    resolver: &mut Resolver,
+    batch_size: usize,
+    lines: &mut I,
+) -> Batch<'input>
+where
+    I: Iterator<Item = Line<'input>>,
+{
+    let mut batch = Batch::default();
+
+    for line in lines.take(batch_size) {
+        let before = batch.moves.len();
+        let moves = &mut batch.moves;
+        resolver.line(&line, |m| moves.push(m));
+
+        batch.move_counts.push(batch.moves.len() - before);
+        batch.states.push(*resolver.state());
+        batch.lines.push(line);
+    }
+
+    batch
+}
+
+impl<'a> Default for Analyzer<'a> {
+    fn default() -> Analyzer<'a> { Analyzer::new() }
+}
+
+impl<'a> fmt::Debug for Analyzer<'a> {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        f.debug_struct("Analyzer")
+            .field("analyses", &self.subscribers.len())
+            .field("resolver", &self.resolver)
+            .field("threads", &self.threads)
+            .field("batch_size", &self.batch_size)
+            .finish()
+    }
+}
+
+/// The outputs of every [`Analysis`] run by an [`Analyzer`].
+pub struct Results {
+    outputs: Vec<Option<Box<dyn Any + Send>>>,
+    /// The number of lines parsed.
+    pub lines: usize,
+    /// The number of moves made.
+    pub moves: usize,
+}
+
+impl Results {
+    /// Take an analysis' output. This returns `None` if it has already been
+    /// taken.
+    pub fn take<T: 'static>(&mut self, handle: Handle<T>) -> Option<T> {
+        let output = self.outputs.get_mut(handle.index)?.take()?;
+        output.downcast().ok().map(|boxed| *boxed)
+    }
+
+    /// Look at an analysis' output without taking it.
+    pub fn get<T: 'static>(&self, handle: Handle<T>) -> Option<&T> {
+        self.outputs.get(handle.index)?.as_ref()?.downcast_ref()
+    }
+}
+
+impl fmt::Debug for Results {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        f.debug_struct("Results")
+            .field("outputs", &self.outputs.len())
+            .field("lines", &self.lines)
+            .field("moves", &self.moves)
+            .finish()
+    }
+}
+
+/// Simple counts and totals for a program.
+#[derive(Debug, Default, Copy, Clone, PartialEq)]
+pub struct Statistics {
+    /// The number of lines.
+    pub lines: usize,
+    /// The number of commands.
+    pub gcodes: usize,
+    /// The number of comments.
+    pub comments: usize,
+    /// The number of moves.
+    pub moves: usize,
+    /// The distance travelled by rapid moves.
+    pub rapid_distance: f32,
+    /// The distance travelled by feed moves.
+    pub feed_distance: f32,
+    /// The total amount of filament extruded, ignoring retractions.
+    pub extrusion: f32,
+    /// The smallest and largest coordinates reached on each axis, if any
+    /// moves were made.
+    pub bounds: Option<([f32; 3], [f32; 3])>,
+}
+
+impl Analysis for Statistics {
+    type Output = Statistics;
+
+    fn on_line(&mut self, line: &Line<'_>, _: &ModalState) {
+        self.lines += 1;
+        self.gcodes += line.gcodes().len();
+    }
+
+    fn on_comment(&mut self, _: &Comment<'_>) { self.comments += 1; }
+
+    fn on_move(&mut self, movement: &Move) {
+        self.moves += 1;
+
+        if movement.rapid {
+            self.rapid_distance += movement.length();
+        } else {
+            self.feed_distance += movement.length();
+        }
+        self.extrusion += movement.extrusion.max(0.0);
+
+        let (mut min, mut max) =
+            self.bounds.unwrap_or((movement.start, movement.start));
+        for axis in 0..3 {
+            min[axis] = min[axis].min(movement.end[axis]);
+            max[axis] = max[axis].max(movement.end[axis]);
+        }
+        self.bounds = Some((min, max));
+    }
+
+    fn finish(self, _: &Resolver) -> Statistics { self }
+}
+
+/// Where each layer of a 3D print starts.
+#[derive(Debug, Default, Clone, PartialEq)]
+pub struct LayerIndex {
+    starts: Vec<usize>,
+}
+
+/// The first line of a layer, found by [`LayerIndex`].
+#[derive(Debug, Copy, Clone, PartialEq)]
+pub struct LayerStart {
+    /// The layer.
+    pub layer: Layer,
+    /// The (zero-based) line its first extrusion is on.
+    pub line: usize,
+}
+
+impl Analysis for LayerIndex {
+    type Output = Vec<LayerStart>;
+
+    fn on_move(&mut self, movement: &Move) {
+        if movement.is_extrusion()
+            && movement.layer as usize >= self.starts.len()
+        {
+            self.starts.push(movement.span.line);
+        }
+    }
+
+    fn finish(self, resolver: &Resolver) -> Vec<LayerStart> {
+        self.starts
+            .into_iter()
+            .zip(resolver.layers())
+            .map(|(line, &layer)| LayerStart { layer, line })
+            .collect()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    /// Records every event, to check they arrive in order.
+    #[derive(Debug, Default)]
+    struct Recorder(Vec<String>);
+
+    impl Analysis for Recorder {
+        type Output = Vec<String>;
+
+        fn on_line(&mut self, line: &Line<'_>, state: &ModalState) {
+            self.0.push(format!(
+                "line {} {:?}",
+                line.span().line,
+                state.feed_rate
+            ));
+        }
+
+        fn on_comment(&mut self, comment: &Comment<'_>) {
+            self.0.push(format!("comment {}", comment.value));
+        }
+
+        fn on_move(&mut self, movement: &Move) {
+            self.0.push(format!("move {:?}", movement.end));
+        }
+
+        fn finish(self, _: &Resolver) -> Vec<String> { self.0 }
+    }
+
+    #[test]
+    fn events_arrive_in_order() {
+        let src = "G0 X0 Y0\nG1 X1 F100 ; cut\nG2 X3 Y0 I1 J0\n";
+
+        let mut analyzer = Analyzer::new().with_batch_size(1);
+        let recorder = analyzer.add(Recorder::default());
+        let mut results = analyzer.run(src);
+
+        let got = results.take(recorder).unwrap();
+        assert_eq!(got[0], "line 0 None");
+        assert_eq!(got[1], "line 1 Some(100.0)");
+        assert_eq!(got[2], "comment ; cut");
+        assert_eq!(got[3], "move [1.0, 0.0, 0.0]");
+        assert_eq!(got[4], "line 2 Some(100.0)");
+        assert!(got[5..].iter().all(|event| event.starts_with("move")));
+        assert_eq!(results.lines, 3);
+    }
+
+    #[test]
+    fn threads_dont_change_the_results() {
+        let src = include_str!("../tests/data/program_3.gcode");
+        let run = |threads: usize| {
+            let mut analyzer =
+                Analyzer::new().with_threads(threads).with_batch_size(100);
+            let handles = (
+                analyzer.add(Statistics::default()),
+                analyzer.add(Recorder::default()),
+                analyzer.add(LayerIndex::default()),
+                analyzer.add(Recorder::default()),
+            );
+            let mut results = analyzer.run(src);
+
+            (
+                results.take(handles.0).unwrap(),
+                results.take(handles.1).unwrap(),
+                results.take(handles.2).unwrap(),
+                results.take(handles.3).unwrap(),
+            )
+        };
+
+        let single = run(1);
+        let parallel = run(3);
+
+        assert_eq!(single, parallel);
+        assert_eq!(single.1, single.3);
+        assert!(single.0.moves > 0);
+    }
+
+    #[test]
+    fn layers_are_indexed() {
+        let src = "G28\nG1 Z0.2\nG1 X10 E1\nG1 Y10 E2\nG1 Z0.4\nG0 X0\nG1 \
+                   Y0 E3\n";
+
+        let mut analyzer = Analyzer::new();
+        let layers = analyzer.add(LayerIndex::default());
+        let got = analyzer.run(src).take(layers).unwrap();
+
+        let lines: Vec<_> = got.iter().map(|start| start.line).collect();
+        assert_eq!(lines, &[2, 6]);
+        assert_eq!(got[1].layer.z, 0.4);
+    }
+
+    #[test]
+    fn outputs_can_only_be_taken_once() {
+        let mut analyzer = Analyzer::new();
+        let statistics = analyzer.add(Statistics::default());
+        let mut results = analyzer.run("G0 X1 Y1\n; hi\nG1 X2 Y2\n");
+
+        let stats = results.get(statistics).copied().unwrap();
+        assert_eq!(stats.comments, 1);
+        assert_eq!(stats.bounds, Some(([1.0, 1.0, 0.0], [2.0, 2.0, 0.0])));
+        assert_eq!(results.take(statistics), Some(stats));
+        assert_eq!(results.take(statistics), None);
+    }
+}
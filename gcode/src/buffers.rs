@@ -64,6 +64,10 @@ pub trait Buffer<T> {
 
     /// The items currently stored in the [`Buffer`].
     fn as_slice(&self) -> &[T];
+
+    /// Would the next [`Buffer::try_push()`] fail? Buffers which grow as
+    /// needed are never full.
+    fn is_full(&self) -> bool { false }
 }
 
 impl<T, A: Array<Item = T>> Buffer<T> for ArrayVec<A> {
@@ -72,6 +76,8 @@ impl<T, A: Array<Item = T>> Buffer<T> for ArrayVec<A> {
     }
 
     fn as_slice(&self) -> &[T] { &self }
+
+    fn is_full(&self) -> bool { ArrayVec::is_full(self) }
 }
 
 /// The smallest usable set of [`Buffers`].
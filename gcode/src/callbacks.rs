@@ -4,6 +4,32 @@ use crate::{Comment, Mnemonic, Span, Word};
 use crate::{buffers::Buffers, GCode};
 
 /// Callbacks used during the parsing process to indicate possible errors.
+///
+/// The parser is generic over its [`Callbacks`], so each implementation gets
+/// its own copy of the parsing code. When code size matters more than the
+/// cost of an indirect call (e.g. a microcontroller with little flash), use
+/// `&mut dyn Callbacks` so every caller shares a single copy.
+///
+/// ```rust
+/// use gcode::{Callbacks, Nop, Parser, Span};
+///
+/// #[derive(Debug, Default)]
+/// struct CountErrors(usize);
+///
+/// impl Callbacks for CountErrors {
+///     fn unknown_content(&mut self, _text: &str, _span: Span) { self.0 += 1; }
+/// }
+///
+/// fn count_lines(src: &str, callbacks: &mut dyn Callbacks) -> usize {
+///     let parser: Parser<'_, &mut dyn Callbacks> = Parser::new(src, callbacks);
+///     parser.count()
+/// }
+///
+/// let mut errors = CountErrors::default();
+/// assert_eq!(count_lines("G90\n$$\nG01 X5", &mut errors), 2);
+/// assert_eq!(errors.0, 1);
+/// assert_eq!(count_lines("G90", &mut Nop), 1);
+/// ```
 pub trait Callbacks {
     /// The parser encountered some text it wasn't able to make sense of.
     fn unknown_content(&mut self, _text: &str, _span: Span) {}
@@ -0,0 +1,829 @@
+//! Finding repeated blocks of commands so they only need to be stored (and
+//! analysed) once.
+//!
+//! Programs often contain the same sequence of commands many times over,
+//! either because a plate holds several copies of a part or because CAM
+//! software repeats an operation at different offsets. Comparing the raw
+//! commands won't find these copies because moves use absolute coordinates,
+//! so each command is first *normalised* by rewriting the `X`, `Y` and `Z`
+//! words of `G00` to `G03` moves as offsets from the previous position, and
+//! their `E` words as offsets from the previous extruder position (unless
+//! extrusion is already relative, i.e. `M83`).
+//!
+//! [`Deduplicated::reconstruct()`] rebuilds the program from its blocks, so
+//! coordinates are only as accurate as
+//! [`Deduplicator::with_decimal_places()`]. Getting back exactly the program
+//! that went in means keeping the original words as well, which takes as much
+//! memory as the program itself, so it's opt-in through
+//! [`Deduplicator::with_exact_reconstruction()`].
+//!
+//! A rolling hash over windows of normalised commands finds candidate
+//! repeats in a single pass. Each match is then extended as far as it goes,
+//! and the program is described as a table of unique [`Block`]s plus a list
+//! of [`Placement`]s saying where each block is used.
+//!
+//! ```rust
+//! use gcode::{dedup::Deduplicator, GCode};
+//!
+//! let mut src = String::from("G21 G90\n");
+//! for copy in 0..20 {
+//!     let x = copy as f32 * 50.0;
+//!     src.push_str(&format!(
+//!         "G0 X{} Y0\nG1 Z-1 F100\nG1 X{} Y20\nG1 X{} Y20\nG1 X{} Y0\nG0 Z5\n",
+//!         x, x, x + 20.0, x + 20.0,
+//!     ));
+//! }
+//! let program: Vec<GCode> = gcode::parse(&src).collect();
+//!
+//! let deduplicated = Deduplicator::new().with_min_block_len(4).run(&program);
+//!
+//! // only the first couple of copies need to be stored
+//! let unique: usize = deduplicated.blocks().iter().map(|b| b.len()).sum();
+//! assert_eq!(program.len(), 122);
+//! assert!(unique <= 14);
+//! assert_eq!(deduplicated.reconstruct(), program);
+//! ```
+
+use crate::{
+    buffers::Buffer,
+    packed::PackedWord,
+    state::{DistanceMode, ModalState},
+    GCode, Mnemonic, Span, Word,
+};
+use std::{borrow::Borrow, collections::HashMap, ops::Range};
+
+/// Settings for finding repeated blocks.
+#[derive(Debug, Copy, Clone, PartialEq)]
+pub struct Deduplicator {
+    min_block_len: usize,
+    decimal_places: u8,
+    exact: bool,
+}
+
+impl Deduplicator {
+    /// The default number of decimal places used when comparing moves.
+    pub const DEFAULT_DECIMAL_PLACES: u8 = 3;
+    /// The default minimum number of commands in a repeated block.
+    pub const DEFAULT_MIN_BLOCK_LEN: usize = 8;
+
+    /// Create a [`Deduplicator`] with the default settings.
+    pub fn new() -> Self {
+        Deduplicator {
+            min_block_len: Deduplicator::DEFAULT_MIN_BLOCK_LEN,
+            decimal_places: Deduplicator::DEFAULT_DECIMAL_PLACES,
+            exact: false,
+        }
+    }
+
+    /// Only treat runs of at least `len` commands as repeats.
+    ///
+    /// Shorter blocks find more repeats, at the cost of more
+    /// [`Placement`]s.
+    pub fn with_min_block_len(self, len: usize) -> Self {
+        Deduplicator {
+            min_block_len: len.max(1),
+            ..self
+        }
+    }
+
+    /// Round coordinates to this many decimal places before comparing
+    /// moves.
+    ///
+    /// Coordinates from [`Block::commands()`] are always within half of the
+    /// last decimal place of the originals, and this error doesn't
+    /// accumulate from one move to the next.
+    pub fn with_decimal_places(self, decimal_places: u8) -> Self {
+        Deduplicator {
+            decimal_places: decimal_places.min(9),
+            ..self
+        }
+    }
+
+    /// Keep a copy of every original command, so
+    /// [`Deduplicated::reconstruct()`] gives back exactly the program that
+    /// went in instead of rounding its coordinates.
+    ///
+    /// The copy uses about as much memory as the program itself.
+    pub fn with_exact_reconstruction(self, exact: bool) -> Self {
+        Deduplicator { exact, ..self }
+    }
+
+    /// Find the repeated blocks in a program.
+    pub fn run<I, G, A>(&self, gcodes: I) -> Deduplicated
+    where
+        I: IntoIterator<Item = G>,
+        G: Borrow<GCode<A>>,
+        A: Buffer<Word>,
+    {
+        let mut normalized = Normalized::new(
+            10_f64.powi(i32::from(self.decimal_places)),
+            self.exact,
+        );
+        let mut state = ModalState::new();
+
+        for gcode in gcodes {
+            let gcode = gcode.borrow();
+            let index = normalized.push(gcode, &state);
+            // follow along with the reconstructed program so rounding errors
+            // can't accumulate
+            state.apply(&normalized.denormalize(index, &state));
+        }
+
+        let segments = self.find_repeats(&normalized);
+        normalized.into_blocks(&segments)
+    }
+
+    /// Split the program into runs of commands, where each repeated run
+    /// points back at an earlier run with the same commands.
+    fn find_repeats(&self, normalized: &Normalized) -> Vec<Segment> {
+        let window = self.min_block_len;
+        let hashes = window_hashes(&normalized.hashes, window);
+
+        let mut segments = Vec::new();
+        let mut seen: HashMap<u64, Vec<usize>> = HashMap::new();
+        let mut next_to_remember = 0;
+        let mut literal_start = 0;
+        let mut i = 0;
+
+        while i < hashes.len() {
+            // windows can only be matched against earlier windows which
+            // don't overlap the current one
+            while next_to_remember + window <= i {
+                seen.entry(hashes[next_to_remember])
+                    .or_default()
+                    .push(next_to_remember);
+                next_to_remember += 1;
+            }
+
+            // prefer the most recent match, so a run of copies is split into
+            // one block per copy instead of ever-longer repeats
+            let source =
+                seen.get(&hashes[i]).and_then(|candidates| {
+                    candidates.iter().rev().copied().find(|&j| {
+                        (0..window).all(|k| normalized.eq(j + k, i + k))
+                    })
+                });
+
+            match source {
+                Some(source) => {
+                    let mut len = window;
+                    while i + len < normalized.len()
+                        && source + len < i
+                        && normalized.eq(source + len, i + len)
+                    {
+                        len += 1;
+                    }
+
+                    if literal_start < i {
+                        segments.push(Segment::literal(literal_start..i));
+                    }
+                    segments.push(Segment {
+                        range: i..i + len,
+                        source: Some(source),
+                    });
+                    i += len;
+                    literal_start = i;
+                },
+                None => i += 1,
+            }
+        }
+
+        if literal_start < normalized.len() {
+            segments.push(Segment::literal(literal_start..normalized.len()));
+        }
+
+        split_at_sources(segments)
+    }
+}
+
+impl Default for Deduplicator {
+    fn default() -> Self { Deduplicator::new() }
+}
+
+/// A run of commands, and the earlier run it repeats (if any).
+#[derive(Debug, Clone, PartialEq)]
+struct Segment {
+    range: Range<usize>,
+    source: Option<usize>,
+}
+
+impl Segment {
+    fn literal(range: Range<usize>) -> Self {
+        Segment {
+            range,
+            source: None,
+        }
+    }
+}
+
+/// Split literal segments wherever a repeat's source starts or ends, so the
+/// first copy of a repeated block ends up in the same [`Block`] as the
+/// others.
+fn split_at_sources(segments: Vec<Segment>) -> Vec<Segment> {
+    let mut cuts: Vec<usize> = segments
+        .iter()
+        .filter_map(|segment| {
+            let source = segment.source?;
+            Some(vec![source, source + segment.range.len()])
+        })
+        .flatten()
+        .collect();
+    cuts.sort_unstable();
+    cuts.dedup();
+
+    let mut split = Vec::with_capacity(segments.len() + cuts.len());
+
+    for segment in segments {
+        if segment.source.is_some() {
+            split.push(segment);
+            continue;
+        }
+
+        let Range { mut start, end } = segment.range;
+        let first_cut = cuts.partition_point(|&cut| cut <= start);
+        for &cut in cuts[first_cut..].iter().take_while(|&&cut| cut < end) {
+            split.push(Segment::literal(start..cut));
+            start = cut;
+        }
+        split.push(Segment::literal(start..end));
+    }
+
+    split
+}
+
+/// The hash of every `window`-long run of `hashes`.
+fn window_hashes(hashes: &[u64], window: usize) -> Vec<u64> {
+    const BASE: u64 = 0x100_0000_01b3;
+
+    if hashes.len() < window {
+        return Vec::new();
+    }
+
+    // BASE^(window - 1), for removing the oldest hash from the window
+    let leading = (1..window).fold(1_u64, |acc, _| acc.wrapping_mul(BASE));
+    let mut current = hashes[..window]
+        .iter()
+        .fold(0_u64, |acc, &h| acc.wrapping_mul(BASE).wrapping_add(h));
+
+    let mut windows = Vec::with_capacity(hashes.len() - window + 1);
+    windows.push(current);
+
+    for i in window..hashes.len() {
+        current = current
+            .wrapping_sub(hashes[i - window].wrapping_mul(leading))
+            .wrapping_mul(BASE)
+            .wrapping_add(hashes[i]);
+        windows.push(current);
+    }
+
+    windows
+}
+
+/// A command in a normalised program.
+#[derive(Debug, Copy, Clone, PartialEq)]
+struct Entry {
+    mnemonic: Mnemonic,
+    number: f32,
+    major_number: u32,
+    minor_number: u32,
+    arguments: (u32, u32),
+    /// Are the axis words already relative (or not axis words at all)?
+    relative_axes: bool,
+    /// Is the `E` word already relative (or not an extruder position)?
+    relative_extrusion: bool,
+}
+
+/// Commands where the axis words of moves are relative to the previous
+/// position, stored in flat arrays.
+#[derive(Debug, Default, Clone, PartialEq)]
+struct Normalized {
+    entries: Vec<Entry>,
+    arguments: Vec<PackedWord>,
+    /// The words as they were written, in the same order as `arguments`
+    /// (only kept for exact reconstruction).
+    originals: Option<Vec<PackedWord>>,
+    hashes: Vec<u64>,
+    /// Coordinates are rounded to multiples of `1 / scale`.
+    scale: f64,
+}
+
+impl Normalized {
+    fn new(scale: f64, exact: bool) -> Self {
+        Normalized {
+            entries: Vec::new(),
+            arguments: Vec::new(),
+            originals: if exact { Some(Vec::new()) } else { None },
+            hashes: Vec::new(),
+            scale,
+        }
+    }
+
+    fn len(&self) -> usize { self.entries.len() }
+
+    fn push<A: Buffer<Word>>(
+        &mut self,
+        gcode: &GCode<A>,
+        state: &ModalState,
+    ) -> usize {
+        let is_move = gcode.mnemonic() == Mnemonic::General
+            && gcode.major_number() <= 3
+            && gcode.minor_number() == 0;
+        let relative_axes =
+            !is_move || state.distance_mode == Some(DistanceMode::Relative);
+        let relative_extrusion = relative_axes
+            || state.extrusion_mode == Some(DistanceMode::Relative);
+
+        let mut entry = Entry {
+            mnemonic: gcode.mnemonic(),
+            number: gcode.number(),
+            major_number: gcode.major_number(),
+            minor_number: gcode.minor_number(),
+            arguments: (0, 0),
+            relative_axes,
+            relative_extrusion,
+        };
+
+        let start = self.arguments.len();
+        for arg in gcode.arguments() {
+            let value = match origin(arg.letter, &entry, state) {
+                Some(current) => {
+                    round(f64::from(arg.value) - current, self.scale)
+                },
+                None => arg.value,
+            };
+            self.arguments.push(PackedWord::new(arg.letter, value));
+            if let Some(originals) = &mut self.originals {
+                originals.push(PackedWord::new(arg.letter, arg.value));
+            }
+        }
+        entry.arguments = (start as u32, self.arguments.len() as u32);
+
+        self.hashes
+            .push(hash_entry(&entry, self.arguments_for(&entry)));
+        self.entries.push(entry);
+
+        self.entries.len() - 1
+    }
+
+    fn arguments_for(&self, entry: &Entry) -> &[PackedWord] {
+        let (start, end) = entry.arguments;
+        &self.arguments[start as usize..end as usize]
+    }
+
+    /// Are the normalised commands at `a` and `b` the same?
+    fn eq(&self, a: usize, b: usize) -> bool {
+        if self.hashes[a] != self.hashes[b] {
+            return false;
+        }
+
+        let (left, right) = (&self.entries[a], &self.entries[b]);
+        left.mnemonic == right.mnemonic
+            && left.major_number == right.major_number
+            && left.minor_number == right.minor_number
+            && left.relative_axes == right.relative_axes
+            && left.relative_extrusion == right.relative_extrusion
+            && self.arguments_for(left) == self.arguments_for(right)
+    }
+
+    fn denormalize(&self, index: usize, state: &ModalState) -> GCode {
+        let entry = &self.entries[index];
+        denormalize(entry, self.arguments_for(entry), state, self.scale)
+    }
+
+    fn into_blocks(self, segments: &[Segment]) -> Deduplicated {
+        let mut blocks: Vec<Block> = Vec::new();
+        let mut placements = Vec::with_capacity(segments.len());
+        // block hash -> indices of blocks with that hash
+        let mut lookup: HashMap<u64, Vec<usize>> = HashMap::new();
+
+        for segment in segments {
+            let range = segment.range.clone();
+            let hash = self.hashes[range.clone()]
+                .iter()
+                .fold(range.len() as u64, |acc, &h| acc.rotate_left(5) ^ h);
+            let candidates = lookup.entry(hash).or_default();
+
+            let existing = candidates
+                .iter()
+                .copied()
+                .find(|&b| self.same_as_block(&blocks[b], range.clone()));
+
+            let block = match existing {
+                Some(block) => block,
+                None => {
+                    blocks.push(self.block(range.clone()));
+                    candidates.push(blocks.len() - 1);
+                    blocks.len() - 1
+                },
+            };
+
+            placements.push(Placement {
+                block,
+                start: range.start,
+            });
+        }
+
+        let len = self.entries.len();
+        let originals = match self.originals {
+            Some(arguments) => Some(Originals {
+                commands: self.entries,
+                arguments,
+            }),
+            None => None,
+        };
+
+        Deduplicated {
+            blocks,
+            placements,
+            len,
+            originals,
+        }
+    }
+
+    fn same_as_block(&self, block: &Block, range: Range<usize>) -> bool {
+        block.len() == range.len()
+            && range
+                .clone()
+                .all(|i| self.eq(i, block.first + (i - range.start)))
+    }
+
+    fn block(&self, range: Range<usize>) -> Block {
+        let mut entries = Vec::with_capacity(range.len());
+        let mut arguments = Vec::new();
+
+        for entry in &self.entries[range.clone()] {
+            let start = arguments.len() as u32;
+            arguments.extend_from_slice(self.arguments_for(entry));
+            entries.push(Entry {
+                arguments: (start, arguments.len() as u32),
+                ..*entry
+            });
+        }
+
+        Block {
+            entries,
+            arguments,
+            first: range.start,
+            scale: self.scale,
+        }
+    }
+}
+
+/// A cheap FNV-1a hash of a normalised command.
+fn hash_entry(entry: &Entry, arguments: &[PackedWord]) -> u64 {
+    const PRIME: u64 = 0x100_0000_01b3;
+    let mut hash: u64 = 0xcbf2_9ce4_8422_2325;
+    let mut add = |value: u64| {
+        hash ^= value;
+        hash = hash.wrapping_mul(PRIME);
+    };
+
+    add(entry.mnemonic as u64);
+    add(u64::from(entry.major_number));
+    add(u64::from(entry.minor_number));
+    add(u64::from(entry.relative_axes));
+    add(u64::from(entry.relative_extrusion));
+    for arg in arguments {
+        add(u64::from(arg.letter));
+        add(u64::from(arg.value.to_bits()));
+    }
+
+    hash
+}
+
+/// Round to the nearest multiple of `1 / scale`.
+///
+/// Dividing by the (exact) scale rather than multiplying by its reciprocal
+/// means the result is the closest `f32` to the decimal number, which is
+/// what the parser would have produced for the same text.
+fn round(value: f64, scale: f64) -> f32 {
+    ((value * scale).round() / scale) as f32
+}
+
+/// The value a word was normalised against, if it's stored as an offset.
+fn origin(letter: char, entry: &Entry, state: &ModalState) -> Option<f64> {
+    let current = match state.position.axis(letter) {
+        Some(current) if !entry.relative_axes => current,
+        None if letter.to_ascii_lowercase() == 'e'
+            && !entry.relative_extrusion =>
+        {
+            state.extruder
+        },
+        _ => return None,
+    };
+
+    Some(f64::from(current.unwrap_or(0.0)))
+}
+
+fn denormalize(
+    entry: &Entry,
+    arguments: &[PackedWord],
+    state: &ModalState,
+    scale: f64,
+) -> GCode {
+    to_gcode(
+        entry,
+        arguments.iter().map(|arg| {
+            let value = match origin(arg.letter, entry, state) {
+                Some(current) => round(current + f64::from(arg.value), scale),
+                None => arg.value,
+            };
+            PackedWord::new(arg.letter, value)
+        }),
+    )
+}
+
+fn to_gcode<I>(entry: &Entry, arguments: I) -> GCode
+where
+    I: IntoIterator<Item = PackedWord>,
+{
+    arguments.into_iter().fold(
+        GCode::new(entry.mnemonic, entry.number, Span::PLACEHOLDER),
+        |gcode, arg| gcode.with_argument(arg.to_word(Span::PLACEHOLDER)),
+    )
+}
+
+/// A sequence of commands which only needs to be stored once.
+///
+/// The `X`, `Y` and `Z` words of absolute moves are stored as offsets from
+/// the previous position, so the same [`Block`] can be used wherever a
+/// program repeats a sequence of moves.
+#[derive(Debug, Clone, PartialEq)]
+pub struct Block {
+    entries: Vec<Entry>,
+    arguments: Vec<PackedWord>,
+    /// Where this block was first seen in the original program.
+    first: usize,
+    scale: f64,
+}
+
+impl Block {
+    /// The number of commands in this [`Block`].
+    pub fn len(&self) -> usize { self.entries.len() }
+
+    /// Is this [`Block`] empty?
+    pub fn is_empty(&self) -> bool { self.entries.is_empty() }
+
+    /// Recreate this block's commands, as they would appear when starting
+    /// from a particular [`ModalState`].
+    ///
+    /// Absolute coordinates are only accurate to the
+    /// [`Deduplicator::with_decimal_places()`].
+    pub fn commands(&self, state: &ModalState) -> Vec<GCode> {
+        let mut state = *state;
+
+        self.entries
+            .iter()
+            .map(|entry| {
+                let (start, end) = entry.arguments;
+                let arguments = &self.arguments[start as usize..end as usize];
+                let gcode = denormalize(entry, arguments, &state, self.scale);
+                state.apply(&gcode);
+                gcode
+            })
+            .collect()
+    }
+}
+
+/// Where a [`Block`] is used in the original program.
+#[derive(Debug, Copy, Clone, PartialEq, Eq, Hash)]
+pub struct Placement {
+    /// The index of the [`Block`] in [`Deduplicated::blocks()`].
+    pub block: usize,
+    /// The index of the block's first command in the original program.
+    pub start: usize,
+}
+
+/// A program described as unique [`Block`]s and where they are used.
+#[derive(Debug, Clone, PartialEq)]
+pub struct Deduplicated {
+    blocks: Vec<Block>,
+    placements: Vec<Placement>,
+    /// The number of commands in the original program.
+    len: usize,
+    originals: Option<Originals>,
+}
+
+/// The original program, kept for exact reconstruction.
+#[derive(Debug, Clone, PartialEq)]
+struct Originals {
+    /// Every command in the original program.
+    commands: Vec<Entry>,
+    /// The original words for `commands`.
+    arguments: Vec<PackedWord>,
+}
+
+impl Deduplicated {
+    /// Every unique [`Block`].
+    pub fn blocks(&self) -> &[Block] { &self.blocks }
+
+    /// Where each [`Block`] is used, in program order.
+    ///
+    /// Every command in the original program is covered by exactly one
+    /// [`Placement`].
+    pub fn placements(&self) -> &[Placement] { &self.placements }
+
+    /// The number of commands in the original program.
+    pub fn len(&self) -> usize { self.len }
+
+    /// Was the original program empty?
+    pub fn is_empty(&self) -> bool { self.len == 0 }
+
+    /// Get back the original program.
+    ///
+    /// Spans aren't retained. Coordinates are only accurate to the
+    /// [`Deduplicator::with_decimal_places()`] unless
+    /// [`Deduplicator::with_exact_reconstruction()`] was used, in which case
+    /// everything else is exactly as it was.
+    pub fn reconstruct(&self) -> Vec<GCode> {
+        if let Some(originals) = &self.originals {
+            return originals
+                .commands
+                .iter()
+                .map(|entry| {
+                    let (start, end) = entry.arguments;
+                    let arguments =
+                        &originals.arguments[start as usize..end as usize];
+                    to_gcode(entry, arguments.iter().copied())
+                })
+                .collect();
+        }
+
+        let mut state = ModalState::new();
+        let mut program = Vec::with_capacity(self.len);
+
+        for placement in &self.placements {
+            for gcode in self.blocks[placement.block].commands(&state) {
+                state.apply(&gcode);
+                program.push(gcode);
+            }
+        }
+
+        program
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn copies(count: usize, spacing: f32) -> String {
+        let mut src = String::from("G21 G90\nM3 S1000\n");
+
+        for copy in 0..count {
+            let x = copy as f32 * spacing;
+            src.push_str(&format!(
+                "G0 X{} Y5\nG1 Z-1 F100\nG1 X{} Y25\nG2 X{} Y25 I5 J0\nG1 \
+                 X{} Y5\nG0 Z5\n",
+                x,
+                x,
+                x + 10.0,
+                x + 10.0,
+            ));
+        }
+
+        src.push_str("M5\nM30\n");
+        src
+    }
+
+    fn parse(src: &str) -> Vec<GCode> { crate::parse(src).collect() }
+
+    #[test]
+    fn rolling_hash_matches_a_direct_hash() {
+        let hashes: Vec<u64> = (0..50).map(|i| i * 7919 + 3).collect();
+
+        let windows = window_hashes(&hashes, 5);
+
+        assert_eq!(windows.len(), 46);
+        for (i, &got) in windows.iter().enumerate() {
+            let direct = window_hashes(&hashes[i..i + 5], 5);
+            assert_eq!(got, direct[0]);
+        }
+    }
+
+    #[test]
+    fn copies_at_different_offsets_share_a_block() {
+        let program = parse(&copies(20, 40.0));
+
+        let got = Deduplicator::new().with_min_block_len(6).run(&program);
+
+        // roughly the preamble, the first two copies and the postamble
+        let unique: usize = got.blocks().iter().map(Block::len).sum();
+        assert!(unique <= 2 + 6 + 6 + 2 + 1, "{} unique commands", unique);
+        assert_eq!(got.len(), program.len());
+        assert_eq!(got.reconstruct(), program);
+    }
+
+    #[test]
+    fn relative_programs_are_also_deduplicated() {
+        let mut src = String::from("G91\n");
+        for _ in 0..10 {
+            src.push_str("G1 X10\nG1 Y10\nG1 X-10\nG1 Y-10\nG0 X15\n");
+        }
+        let program = parse(&src);
+
+        let got = Deduplicator::new().with_min_block_len(5).run(&program);
+
+        assert_eq!(got.blocks().len(), 2);
+        assert_eq!(got.reconstruct(), program);
+    }
+
+    #[test]
+    fn unique_programs_are_a_single_block() {
+        let program = parse("G90\nG0 X1\nG1 X2 Y3\nG1 X5 Y8\nM30");
+
+        let got = Deduplicator::new().with_min_block_len(2).run(&program);
+
+        assert_eq!(got.blocks().len(), 1);
+        assert_eq!(got.placements(), &[Placement { block: 0, start: 0 }]);
+        assert_eq!(got.reconstruct(), program);
+    }
+
+    #[test]
+    fn rounding_errors_dont_accumulate() {
+        let mut src = String::from("G90\n");
+        for i in 0..1000 {
+            src.push_str(&format!("G1 X{:.4}\n", i as f32 * 0.1234));
+        }
+        let program = parse(&src);
+
+        let got = Deduplicator::new().with_decimal_places(2).run(&program);
+
+        for (original, reconstructed) in program.iter().zip(got.reconstruct()) {
+            let (a, b) = (
+                original.value_for('X').unwrap_or(0.0),
+                reconstructed.value_for('X').unwrap_or(0.0),
+            );
+            assert!((a - b).abs() <= 0.006, "{} vs {}", a, b);
+        }
+    }
+
+    #[test]
+    fn reconstructing_is_lossless() {
+        let mut src = String::from("G90\n");
+        for copy in 0..10 {
+            let x = copy as f32 * 10.0 + 0.0004 * copy as f32;
+            src.push_str(&format!(
+                "G0 X{} Y1.23456\nG1 X{} Y5.5 F1500\nG1 X{}\n",
+                x,
+                x + 2.5,
+                x + 0.00123,
+            ));
+        }
+        let program = parse(&src);
+
+        // the copies only match after rounding to the nearest unit
+        let deduplicator = Deduplicator::new()
+            .with_decimal_places(0)
+            .with_min_block_len(3);
+        assert_ne!(deduplicator.run(&program).reconstruct(), program);
+
+        let got = deduplicator.with_exact_reconstruction(true).run(&program);
+        assert!(got.blocks().len() < 5);
+
+        let reconstructed = got.reconstruct();
+        assert_eq!(reconstructed, program);
+        for (original, reconstructed) in program.iter().zip(&reconstructed) {
+            let values = |g: &GCode| -> Vec<(char, u32)> {
+                g.arguments()
+                    .iter()
+                    .map(|w| (w.letter, w.value.to_bits()))
+                    .collect()
+            };
+            assert_eq!(values(original), values(reconstructed));
+            assert_eq!(original.number(), reconstructed.number());
+        }
+    }
+
+    #[test]
+    fn absolute_extrusion_is_deduplicated() {
+        let mut src = String::from("G21 G90\nM82\nG92 E0\n");
+        let mut e = 0.0;
+        for copy in 0..10 {
+            let x = copy as f32 * 30.0;
+            src.push_str(&format!("G0 X{} Y0\n", x));
+            for (dx, dy) in &[(20.0, 0.0), (20.0, 20.0), (0.0, 20.0)] {
+                e += 0.8;
+                src.push_str(&format!("G1 X{} Y{} E{:.1}\n", x + dx, dy, e));
+            }
+            e -= 1.0;
+            src.push_str(&format!("G1 E{:.1}\n", e));
+        }
+        let program = parse(&src);
+
+        let got = Deduplicator::new().with_min_block_len(5).run(&program);
+
+        let unique: usize = got.blocks().iter().map(Block::len).sum();
+        // the preamble, the first travel move and the first two copies
+        assert!(unique <= 3 + 1 + 5 + 5, "{} unique commands", unique);
+        let reconstructed = got.reconstruct();
+        assert_eq!(reconstructed.len(), program.len());
+        for (original, rebuilt) in program.iter().zip(&reconstructed) {
+            let (a, b) = (
+                original.value_for('E').unwrap_or(0.0),
+                rebuilt.value_for('E').unwrap_or(0.0),
+            );
+            assert!((a - b).abs() <= 0.0005, "{} vs {}", a, b);
+        }
+    }
+}
@@ -0,0 +1,498 @@
+//! Parsing text which isn't UTF-8.
+//!
+//! Some CAM packages write g-code as UTF-16, or put Latin-1 characters (e.g.
+//! a `°` written as the single byte `0xB0`) in comments, which makes the
+//! file invalid UTF-8. An [`EncodedParser`] parses the raw bytes directly,
+//! so the file doesn't need to be transcoded into a `String` first.
+//!
+//! Every [`Span`] is a byte offset into the original input, and comments are
+//! only decoded when asked for (see [`Encoding::decode()`]).
+//!
+//! ```rust
+//! use gcode::encoding::{EncodedParser, Encoding};
+//!
+//! // "G01 X5 (30°)" as UTF-16LE, with a byte order mark
+//! let mut bytes = vec![0xFF, 0xFE];
+//! for unit in "G01 X5 (30°)\n".encode_utf16() {
+//!     bytes.extend_from_slice(&unit.to_le_bytes());
+//! }
+//!
+//! let encoding = Encoding::detect(&bytes).unwrap();
+//! assert_eq!(encoding, Encoding::Utf16Le);
+//!
+//! let lines: Vec<_> = EncodedParser::new(&bytes, encoding, gcode::Nop).collect();
+//!
+//! assert_eq!(lines[0].gcodes()[0].to_string(), "G1 X5");
+//! let comment = lines[0].comment_spans()[0];
+//! assert_eq!(encoding.decode(&bytes, comment), "(30°)");
+//! // spans are byte offsets into the UTF-16 text
+//! assert_eq!(comment.start, 2 + 7 * 2);
+//! ```
+//!
+//! # Implementation
+//!
+//! All g-code syntax is ASCII. Lines which are already valid UTF-8 are
+//! handed straight to the normal lexer. Anything else is first reduced to
+//! an ASCII "skeleton" with one byte per code unit, where every non-ASCII
+//! code unit becomes a placeholder, and the skeleton is lexed instead. The
+//! skeleton is kept in a scratch buffer which only ever holds a single line,
+//! and offsets in it map straight back to offsets in the input.
+
+use crate::{
+    buffers::VecBuffers,
+    lexer::Lexer,
+    owned::OwnedLine,
+    parser::Lines,
+    profile::Full,
+    scan,
+    words::{Word, WordsOrComments},
+    Callbacks, Comment, Line, Mnemonic, Span,
+};
+use std::{
+    borrow::Cow,
+    char::{decode_utf16, REPLACEMENT_CHARACTER},
+    mem, str,
+};
+
+/// A character encoding.
+#[derive(Debug, Copy, Clone, PartialEq, Eq)]
+pub enum Encoding {
+    /// UTF-8, with any invalid bytes (e.g. Latin-1 in a comment) lexed as
+    /// garbage and decoded lossily.
+    Utf8,
+    /// ISO-8859-1, or any other encoding with one byte per character where
+    /// the first 128 characters are ASCII.
+    Latin1,
+    /// UTF-16, little endian.
+    Utf16Le,
+    /// UTF-16, big endian.
+    Utf16Be,
+}
+
+impl Encoding {
+    /// Guess the [`Encoding`] from a byte order mark at the start of the
+    /// input.
+    pub fn detect(bytes: &[u8]) -> Option<Encoding> {
+        if bytes.starts_with(&[0xEF, 0xBB, 0xBF]) {
+            Some(Encoding::Utf8)
+        } else if bytes.starts_with(&[0xFF, 0xFE]) {
+            Some(Encoding::Utf16Le)
+        } else if bytes.starts_with(&[0xFE, 0xFF]) {
+            Some(Encoding::Utf16Be)
+        } else {
+            None
+        }
+    }
+
+    /// How many bytes are in each code unit.
+    pub fn unit_size(self) -> usize {
+        match self {
+            Encoding::Utf8 | Encoding::Latin1 => 1,
+            Encoding::Utf16Le | Encoding::Utf16Be => 2,
+        }
+    }
+
+    /// The length of this [`Encoding`]'s byte order mark, if `bytes` starts
+    /// with one.
+    fn bom_len(self, bytes: &[u8]) -> usize {
+        match Encoding::detect(bytes) {
+            Some(detected) if detected == self => match self {
+                Encoding::Utf8 => 3,
+                _ => 2,
+            },
+            _ => 0,
+        }
+    }
+
+    /// Decode the text in part of the input, e.g. a comment.
+    ///
+    /// Invalid sequences are replaced with [`REPLACEMENT_CHARACTER`]. UTF-8
+    /// text is only copied when it needed fixing up.
+    pub fn decode(self, bytes: &[u8], span: Span) -> Cow<'_, str> {
+        let bytes = bytes.get(span.start..span.end).unwrap_or_default();
+
+        match self {
+            Encoding::Utf8 => String::from_utf8_lossy(bytes),
+            Encoding::Latin1 => match str::from_utf8(bytes) {
+                Ok(ascii) if ascii.is_ascii() => Cow::Borrowed(ascii),
+                _ => Cow::Owned(bytes.iter().map(|&b| b as char).collect()),
+            },
+            Encoding::Utf16Le | Encoding::Utf16Be => {
+                let units = bytes
+                    .chunks_exact(2)
+                    .map(|pair| self.unit(pair[0], pair[1]));
+                Cow::Owned(
+                    decode_utf16(units)
+                        .map(|c| c.unwrap_or(REPLACEMENT_CHARACTER))
+                        .collect(),
+                )
+            },
+        }
+    }
+
+    fn unit(self, first: u8, second: u8) -> u16 {
+        match self {
+            Encoding::Utf16Be => u16::from_be_bytes([first, second]),
+            _ => u16::from_le_bytes([first, second]),
+        }
+    }
+}
+
+/// The byte non-ASCII code units are replaced with in a skeleton. It isn't
+/// whitespace or part of any token, so it is lexed the same way as a
+/// non-ASCII character would be.
+const PLACEHOLDER: u8 = 0x7F;
+
+/// A parser for text in some [`Encoding`], producing [`OwnedLine`]s whose
+/// [`Span`]s are byte offsets into the original input.
+#[derive(Debug)]
+pub struct EncodedParser<'input, C> {
+    bytes: &'input [u8],
+    encoding: Encoding,
+    callbacks: C,
+    /// The byte offset of the next unparsed line.
+    offset: usize,
+    line: usize,
+    last_gcode_type: Option<Word>,
+    /// The skeleton of the line being parsed, for lines which aren't valid
+    /// UTF-8.
+    scratch: String,
+}
+
+impl<'input, C: Callbacks> EncodedParser<'input, C> {
+    /// Create a new [`EncodedParser`], skipping the byte order mark if there
+    /// is one.
+    pub fn new(bytes: &'input [u8], encoding: Encoding, callbacks: C) -> Self {
+        EncodedParser {
+            bytes,
+            encoding,
+            callbacks,
+            offset: encoding.bom_len(bytes),
+            line: 0,
+            last_gcode_type: None,
+            scratch: String::new(),
+        }
+    }
+
+    /// The text being parsed.
+    pub fn bytes(&self) -> &'input [u8] { self.bytes }
+
+    /// The [`Encoding`] being used.
+    pub fn encoding(&self) -> Encoding { self.encoding }
+
+    /// Decode a [`Comment`] (or anything else) from the input.
+    pub fn decode(&self, span: Span) -> Cow<'input, str> {
+        self.encoding.decode(self.bytes, span)
+    }
+
+    /// Find the next line, returning its bytes (including the newline).
+    fn next_raw_line(&mut self) -> Option<&'input [u8]> {
+        let rest = self.bytes.get(self.offset..).filter(|r| !r.is_empty())?;
+        let unit = self.encoding.unit_size();
+
+        let len = if unit == 1 {
+            scan::find_newline(rest).map(|i| i + 1)
+        } else {
+            rest.chunks_exact(2)
+                .position(|pair| self.encoding.unit(pair[0], pair[1]) == 0x0A)
+                .map(|i| (i + 1) * 2)
+        };
+        let len = len.unwrap_or(rest.len());
+
+        Some(&rest[..len])
+    }
+
+    /// Parse one line of text which has been converted to UTF-8 (or a
+    /// skeleton of it), where offsets are measured in code units.
+    fn parse_line(
+        &mut self,
+        text: &str,
+        start_unit: usize,
+        scale: usize,
+    ) -> Option<OwnedLine> {
+        let tokens = Lexer::starting_at(text, start_unit, self.line);
+        let atoms = WordsOrComments::new(tokens);
+        let callbacks = Rescaled {
+            inner: &mut self.callbacks,
+            scale,
+        };
+        let mut lines =
+            Lines::<'_, _, _, VecBuffers, Full>::new(atoms, callbacks)
+                .with_last_gcode_type(self.last_gcode_type);
+
+        let line: Option<Line<'_>> = lines.next();
+        self.last_gcode_type = lines.last_gcode_type();
+
+        line.map(|line| {
+            let line = OwnedLine::from(line);
+
+            if scale == 1 {
+                line
+            } else {
+                line.map_spans(|span| rescale(span, scale))
+            }
+        })
+    }
+}
+
+impl<'input, C: Callbacks> Iterator for EncodedParser<'input, C> {
+    type Item = OwnedLine;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        while let Some(raw) = self.next_raw_line() {
+            let start = self.offset;
+            let unit = self.encoding.unit_size();
+            let mut scratch = mem::take(&mut self.scratch);
+
+            let line = match str::from_utf8(raw) {
+                Ok(text) if unit == 1 => self.parse_line(text, start, 1),
+                _ => {
+                    skeleton(raw, self.encoding, &mut scratch);
+                    self.parse_line(&scratch, start / unit, unit)
+                },
+            };
+
+            self.scratch = scratch;
+            self.offset += raw.len();
+            self.line += 1;
+
+            if line.is_some() {
+                return line;
+            }
+        }
+
+        None
+    }
+}
+
+/// Reduce a line to ASCII, with one byte per code unit.
+fn skeleton(raw: &[u8], encoding: Encoding, buffer: &mut String) {
+    let ascii = |unit: u16| {
+        if unit < 0x80 {
+            unit as u8 as char
+        } else {
+            PLACEHOLDER as char
+        }
+    };
+
+    buffer.clear();
+
+    match encoding {
+        Encoding::Utf8 | Encoding::Latin1 => {
+            buffer.extend(raw.iter().map(|&b| ascii(u16::from(b))))
+        },
+        Encoding::Utf16Le | Encoding::Utf16Be => buffer.extend(
+            raw.chunks_exact(2)
+                .map(|pair| ascii(encoding.unit(pair[0], pair[1]))),
+        ),
+    }
+}
+
+fn rescale(span: Span, scale: usize) -> Span {
+    if span.is_placeholder() {
+        span
+    } else {
+        Span::new(span.start * scale, span.end * scale, span.line)
+    }
+}
+
+fn rescale_word(word: Word, scale: usize) -> Word {
+    Word::new(word.letter, word.value, rescale(word.span, scale))
+}
+
+/// [`Callbacks`] which convert [`Span`]s from code units to bytes.
+#[derive(Debug)]
+struct Rescaled<C> {
+    inner: C,
+    scale: usize,
+}
+
+impl<C: Callbacks> Callbacks for Rescaled<C> {
+    fn unknown_content(&mut self, text: &str, span: Span) {
+        self.inner.unknown_content(text, rescale(span, self.scale));
+    }
+
+    fn gcode_buffer_overflowed(
+        &mut self,
+        mnemonic: Mnemonic,
+        major_number: u32,
+        minor_number: u32,
+        arguments: &[Word],
+        span: Span,
+    ) {
+        let arguments: Vec<_> = arguments
+            .iter()
+            .map(|&word| rescale_word(word, self.scale))
+            .collect();
+        self.inner.gcode_buffer_overflowed(
+            mnemonic,
+            major_number,
+            minor_number,
+            &arguments,
+            rescale(span, self.scale),
+        );
+    }
+
+    fn gcode_argument_buffer_overflowed(
+        &mut self,
+        mnemonic: Mnemonic,
+        major_number: u32,
+        minor_number: u32,
+        argument: Word,
+    ) {
+        self.inner.gcode_argument_buffer_overflowed(
+            mnemonic,
+            major_number,
+            minor_number,
+            rescale_word(argument, self.scale),
+        );
+    }
+
+    fn comment_buffer_overflow(&mut self, comment: Comment<'_>) {
+        self.inner.comment_buffer_overflow(Comment {
+            value: comment.value,
+            span: rescale(comment.span, self.scale),
+        });
+    }
+
+    fn unexpected_line_number(&mut self, line_number: f32, span: Span) {
+        self.inner
+            .unexpected_line_number(line_number, rescale(span, self.scale));
+    }
+
+    fn argument_without_a_command(
+        &mut self,
+        letter: char,
+        value: f32,
+        span: Span,
+    ) {
+        self.inner.argument_without_a_command(
+            letter,
+            value,
+            rescale(span, self.scale),
+        );
+    }
+
+    fn number_without_a_letter(&mut self, value: &str, span: Span) {
+        self.inner
+            .number_without_a_letter(value, rescale(span, self.scale));
+    }
+
+    fn letter_without_a_number(&mut self, value: &str, span: Span) {
+        self.inner
+            .letter_without_a_number(value, rescale(span, self.scale));
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::Nop;
+
+    const SRC: &str = "%\nO1000 (ÜBERSICHT)\nN10 G90 G21\nG01 X1.5 Y-2 \
+                       F100 ; 45° chamfer\nX3\n\nM30\n";
+
+    fn utf16(text: &str, encoding: Encoding, bom: bool) -> Vec<u8> {
+        let mut bytes = Vec::new();
+        let units = bom.then(|| 0xFEFF).into_iter().chain(text.encode_utf16());
+
+        for unit in units {
+            if encoding == Encoding::Utf16Be {
+                bytes.extend_from_slice(&unit.to_be_bytes());
+            } else {
+                bytes.extend_from_slice(&unit.to_le_bytes());
+            }
+        }
+
+        bytes
+    }
+
+    fn latin1(text: &str) -> Vec<u8> {
+        text.chars().map(|c| c as u32 as u8).collect()
+    }
+
+    /// Strip spans so lines from different encodings can be compared.
+    fn without_spans(lines: Vec<OwnedLine>) -> Vec<OwnedLine> {
+        lines
+            .into_iter()
+            .map(|line| line.map_spans(|_| Span::new(0, 0, 0)))
+            .collect()
+    }
+
+    fn parse(bytes: &[u8], encoding: Encoding) -> Vec<OwnedLine> {
+        EncodedParser::new(bytes, encoding, Nop).collect()
+    }
+
+    fn comments(bytes: &[u8], encoding: Encoding) -> Vec<String> {
+        parse(bytes, encoding)
+            .iter()
+            .flat_map(|line| line.comment_spans().to_vec())
+            .map(|span| encoding.decode(bytes, span).into_owned())
+            .collect()
+    }
+
+    #[test]
+    fn utf8_matches_the_normal_parser() {
+        let expected: Vec<_> = crate::Parser::<Nop>::new(SRC, Nop)
+            .map(OwnedLine::from)
+            .collect();
+
+        let got = parse(SRC.as_bytes(), Encoding::Utf8);
+
+        assert_eq!(got, expected);
+    }
+
+    #[test]
+    fn every_encoding_gives_the_same_commands() {
+        let expected = without_spans(parse(SRC.as_bytes(), Encoding::Utf8));
+        let inputs = vec![
+            (latin1(SRC), Encoding::Latin1),
+            (utf16(SRC, Encoding::Utf16Le, false), Encoding::Utf16Le),
+            (utf16(SRC, Encoding::Utf16Le, true), Encoding::Utf16Le),
+            (utf16(SRC, Encoding::Utf16Be, true), Encoding::Utf16Be),
+        ];
+
+        for (bytes, encoding) in inputs {
+            let got = without_spans(parse(&bytes, encoding));
+            assert_eq!(got, expected, "{:?}", encoding);
+
+            let comments = comments(&bytes, encoding);
+            assert_eq!(comments, &["(ÜBERSICHT)", "; 45° chamfer"]);
+        }
+    }
+
+    #[test]
+    fn spans_are_byte_offsets_into_the_input() {
+        let bytes = utf16(SRC, Encoding::Utf16Be, true);
+        let lines = parse(&bytes, Encoding::Utf16Be);
+
+        let x3 = lines[3].gcodes()[0].arguments()[0];
+
+        let expected_start =
+            2 + SRC.encode_utf16().count() * 2 - "X3\n\nM30\n".len() * 2;
+        assert_eq!(x3.span, Span::new(expected_start, expected_start + 4, 4));
+        assert_eq!(Encoding::Utf16Be.decode(&bytes, x3.span), "X3");
+    }
+
+    #[test]
+    fn a_stray_latin1_byte_in_utf8_isnt_fatal() {
+        let mut bytes = b"G01 X5 (30".to_vec();
+        bytes.push(0xB0);
+        bytes.extend_from_slice(b")\nG00 Z1\n");
+
+        let lines = parse(&bytes, Encoding::Utf8);
+
+        assert_eq!(lines.len(), 2);
+        assert_eq!(lines[1].gcodes()[0].to_string(), "G0 Z1");
+        assert_eq!(comments(&bytes, Encoding::Utf8), &["(30\u{FFFD})"]);
+        assert_eq!(comments(&bytes, Encoding::Latin1), &["(30°)"]);
+    }
+
+    #[test]
+    fn detect_byte_order_marks() {
+        assert_eq!(Encoding::detect(b"\xEF\xBB\xBFG90"), Some(Encoding::Utf8));
+        assert_eq!(Encoding::detect(b"\xFF\xFEG\0"), Some(Encoding::Utf16Le));
+        assert_eq!(Encoding::detect(b"\xFE\xFF\0G"), Some(Encoding::Utf16Be));
+        assert_eq!(Encoding::detect(b"G90"), None);
+    }
+}
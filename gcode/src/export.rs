@@ -0,0 +1,714 @@
+//! Streaming export to [JSON Lines] and [MessagePack].
+//!
+//! This is a lot faster than going through `serde` because records are
+//! written straight into a reusable buffer with a flat layout (spans become
+//! `[start, end]` pairs) and numbers are formatted with a specialised routine.
+//!
+//! ```rust
+//! use gcode::export::{Exporter, Format, Schema};
+//!
+//! let src = "G01 X5 Y-2.5 (move)\nM30";
+//! let mut exporter = Exporter::new(Vec::new(), Format::JsonLines, Schema::default());
+//!
+//! for line in gcode::full_parse_with_callbacks(src, gcode::Nop) {
+//!     exporter.write_line(&line).unwrap();
+//! }
+//!
+//! let json = String::from_utf8(exporter.finish().unwrap()).unwrap();
+//! let mut records = json.lines();
+//! assert_eq!(
+//!     records.next().unwrap(),
+//!     r#"{"line":0,"span":[0,19],"gcodes":[{"mnemonic":"G","number":1,"arguments":{"X":5,"Y":-2.5},"span":[0,12]}],"comments":["(move)"]}"#
+//! );
+//! ```
+//!
+//! A command's arguments are written as a map keyed by their letter, so a
+//! command which repeats a letter (e.g. `G01 X1 X2`) produces a duplicate
+//! key. The values are written in their original order, but most JSON and
+//! MessagePack readers will only keep one of them.
+//!
+//! [JSON Lines]: http://jsonlines.org/
+//! [MessagePack]: https://msgpack.org/
+
+use crate::{
+    buffers::{Buffer, Buffers},
+    Comment, GCode, Line, Mnemonic, Span, Word,
+};
+use std::io::{self, Write};
+
+/// The output format.
+#[derive(Debug, Copy, Clone, PartialEq, Eq)]
+pub enum Format {
+    /// One JSON object per line of output.
+    JsonLines,
+    /// A sequence of MessagePack maps, one after the other.
+    MessagePack,
+}
+
+/// What gets written for each record.
+#[derive(Debug, Copy, Clone, PartialEq, Eq)]
+pub struct Schema {
+    /// Write one record per [`Line`] or per [`GCode`].
+    pub granularity: Granularity,
+    /// Include [`Span`]s as `[start, end]` pairs.
+    pub spans: bool,
+    /// Include [`Comment`]s. When exporting per-command, each comment becomes
+    /// its own record.
+    pub comments: bool,
+    /// Include line numbers (`N10`). When exporting per-command, every
+    /// record from the line gets the line number.
+    pub line_numbers: bool,
+}
+
+impl Default for Schema {
+    fn default() -> Schema {
+        Schema {
+            granularity: Granularity::Line,
+            spans: true,
+            comments: true,
+            line_numbers: true,
+        }
+    }
+}
+
+/// How much goes into each record.
+#[derive(Debug, Copy, Clone, PartialEq, Eq)]
+pub enum Granularity {
+    /// One record per [`Line`].
+    Line,
+    /// One record per [`GCode`].
+    Command,
+}
+
+/// Writes parsed [`Line`]s to a [`Write`]r.
+///
+/// Records are accumulated in an internal buffer which is flushed whenever
+/// it gets too big, so there is no need to wrap the writer in a
+/// [`std::io::BufWriter`]. The buffer is also flushed when the [`Exporter`]
+/// is dropped, although any errors will be ignored. Use [`Exporter::finish()`]
+/// to find out about them.
+#[derive(Debug)]
+pub struct Exporter<W: Write> {
+    writer: Option<W>,
+    format: Format,
+    schema: Schema,
+    buffer: Vec<u8>,
+}
+
+impl<W: Write> Exporter<W> {
+    /// How much output to accumulate before writing it out.
+    pub const FLUSH_THRESHOLD: usize = 64 * 1024;
+
+    /// Create a new [`Exporter`].
+    pub fn new(writer: W, format: Format, schema: Schema) -> Self {
+        Exporter {
+            writer: Some(writer),
+            format,
+            schema,
+            buffer: Vec::with_capacity(Self::FLUSH_THRESHOLD + 1024),
+        }
+    }
+
+    /// Export a [`Line`], creating one or more records depending on the
+    /// [`Schema`].
+    pub fn write_line<'input, B: Buffers<'input>>(
+        &mut self,
+        line: &Line<'input, B>,
+    ) -> io::Result<()> {
+        match self.schema.granularity {
+            Granularity::Line => self.line_record(line),
+            Granularity::Command => {
+                let line_index = line.span().line;
+                let line_number =
+                    line.line_number().filter(|_| self.schema.line_numbers);
+
+                for gcode in line.gcodes() {
+                    self.command_record(line_index, line_number, gcode);
+                }
+                if self.schema.comments {
+                    for comment in line.comments() {
+                        self.comment_record(line_index, line_number, comment);
+                    }
+                }
+            },
+        }
+
+        if self.buffer.len() >= Self::FLUSH_THRESHOLD {
+            self.flush()?;
+        }
+
+        Ok(())
+    }
+
+    /// Write any buffered records to the underlying [`Write`]r.
+    pub fn flush(&mut self) -> io::Result<()> {
+        if let Some(writer) = self.writer.as_mut() {
+            writer.write_all(&self.buffer)?;
+            self.buffer.clear();
+            writer.flush()?;
+        }
+
+        Ok(())
+    }
+
+    /// Flush everything and get the underlying [`Write`]r back.
+    pub fn finish(mut self) -> io::Result<W> {
+        self.flush()?;
+        Ok(self.writer.take().expect("Only taken when finishing"))
+    }
+
+    fn line_record<'input, B: Buffers<'input>>(
+        &mut self,
+        line: &Line<'input, B>,
+    ) {
+        let Schema {
+            spans,
+            comments,
+            line_numbers,
+            ..
+        } = self.schema;
+        let line_number = line.line_number().filter(|_| line_numbers);
+
+        let fields = 2
+            + spans as usize
+            + line_number.is_some() as usize
+            + comments as usize;
+        let mut out = self.encoder();
+        out.begin_record(fields);
+
+        out.line(line.span().line, line_number);
+        if spans {
+            out.key("span");
+            out.span(line.span());
+        }
+
+        out.key("gcodes");
+        out.begin_array(line.gcodes().len());
+        for (i, gcode) in line.gcodes().iter().enumerate() {
+            out.separator(i);
+            out.gcode(gcode, spans);
+        }
+        out.end_array();
+
+        if comments {
+            out.key("comments");
+            out.begin_array(line.comments().len());
+            for (i, comment) in line.comments().iter().enumerate() {
+                out.separator(i);
+                out.string(comment.value);
+            }
+            out.end_array();
+        }
+
+        out.end_record();
+    }
+
+    fn command_record<A>(
+        &mut self,
+        line: usize,
+        line_number: Option<Word>,
+        gcode: &GCode<A>,
+    ) where
+        A: Buffer<Word>,
+    {
+        let spans = self.schema.spans;
+        let mut out = self.encoder();
+
+        out.begin_record(4 + spans as usize + line_number.is_some() as usize);
+        out.line(line, line_number);
+        out.gcode_fields(gcode, spans);
+        out.end_record();
+    }
+
+    fn comment_record(
+        &mut self,
+        line: usize,
+        line_number: Option<Word>,
+        comment: &Comment<'_>,
+    ) {
+        let spans = self.schema.spans;
+        let mut out = self.encoder();
+
+        out.begin_record(2 + spans as usize + line_number.is_some() as usize);
+        out.line(line, line_number);
+        out.key("comment");
+        out.string(comment.value);
+        if spans {
+            out.key("span");
+            out.span(comment.span);
+        }
+        out.end_record();
+    }
+
+    fn encoder(&mut self) -> Encoder<'_> {
+        Encoder {
+            buffer: &mut self.buffer,
+            format: self.format,
+            first_field: true,
+        }
+    }
+}
+
+impl<W: Write> Drop for Exporter<W> {
+    fn drop(&mut self) { let _ = self.flush(); }
+}
+
+/// Appends JSON or MessagePack to a buffer.
+///
+/// The MessagePack encoding needs to know how many items are in a map or
+/// array up front, while JSON needs to know when to insert commas, so every
+/// method receives enough information for both.
+struct Encoder<'a> {
+    buffer: &'a mut Vec<u8>,
+    format: Format,
+    first_field: bool,
+}
+
+impl<'a> Encoder<'a> {
+    fn begin_record(&mut self, fields: usize) {
+        match self.format {
+            Format::JsonLines => self.buffer.push(b'{'),
+            Format::MessagePack => self.map_header(fields),
+        }
+        self.first_field = true;
+    }
+
+    fn end_record(&mut self) {
+        if self.format == Format::JsonLines {
+            self.buffer.extend_from_slice(b"}\n");
+        }
+    }
+
+    fn key(&mut self, key: &str) {
+        match self.format {
+            Format::JsonLines => {
+                if !self.first_field {
+                    self.buffer.push(b',');
+                }
+                self.buffer.push(b'"');
+                self.buffer.extend_from_slice(key.as_bytes());
+                self.buffer.extend_from_slice(b"\":");
+            },
+            Format::MessagePack => self.string(key),
+        }
+        self.first_field = false;
+    }
+
+    fn begin_array(&mut self, len: usize) {
+        match self.format {
+            Format::JsonLines => self.buffer.push(b'['),
+            Format::MessagePack => {
+                if len < 16 {
+                    self.buffer.push(0x90 | len as u8);
+                } else if len <= u16::max_value() as usize {
+                    self.buffer.push(0xdc);
+                    self.buffer.extend_from_slice(&(len as u16).to_be_bytes());
+                } else {
+                    self.buffer.push(0xdd);
+                    self.buffer.extend_from_slice(&(len as u32).to_be_bytes());
+                }
+            },
+        }
+    }
+
+    fn end_array(&mut self) {
+        if self.format == Format::JsonLines {
+            self.buffer.push(b']');
+        }
+    }
+
+    /// Insert a comma between JSON array elements.
+    fn separator(&mut self, index: usize) {
+        if self.format == Format::JsonLines && index > 0 {
+            self.buffer.push(b',');
+        }
+    }
+
+    fn map_header(&mut self, len: usize) {
+        if len < 16 {
+            self.buffer.push(0x80 | len as u8);
+        } else if len <= u16::max_value() as usize {
+            self.buffer.push(0xde);
+            self.buffer.extend_from_slice(&(len as u16).to_be_bytes());
+        } else {
+            self.buffer.push(0xdf);
+            self.buffer.extend_from_slice(&(len as u32).to_be_bytes());
+        }
+    }
+
+    /// The `"line"` field, followed by the line number if there is one.
+    fn line(&mut self, line: usize, line_number: Option<Word>) {
+        self.key("line");
+        self.uint(line as u64);
+        if let Some(n) = line_number {
+            self.key("n");
+            self.float(n.value);
+        }
+    }
+
+    fn gcode<A>(&mut self, gcode: &GCode<A>, spans: bool)
+    where
+        A: Buffer<Word>,
+    {
+        let mut nested = Encoder {
+            buffer: &mut *self.buffer,
+            format: self.format,
+            first_field: true,
+        };
+        nested.begin_record(3 + spans as usize);
+        nested.gcode_fields(gcode, spans);
+
+        if self.format == Format::JsonLines {
+            self.buffer.push(b'}');
+        }
+    }
+
+    fn gcode_fields<A>(&mut self, gcode: &GCode<A>, spans: bool)
+    where
+        A: Buffer<Word>,
+    {
+        self.key("mnemonic");
+        self.string(mnemonic_letter(gcode.mnemonic()));
+        self.key("number");
+        self.float(gcode.number());
+
+        self.key("arguments");
+        let arguments = gcode.arguments();
+        let mut nested = Encoder {
+            buffer: &mut *self.buffer,
+            format: self.format,
+            first_field: true,
+        };
+        nested.begin_record(arguments.len());
+        for arg in arguments {
+            let mut letter = [0; 4];
+            nested.key(arg.letter.encode_utf8(&mut letter));
+            nested.float(arg.value);
+        }
+        if self.format == Format::JsonLines {
+            self.buffer.push(b'}');
+        }
+
+        if spans {
+            self.key("span");
+            self.span(gcode.span());
+        }
+    }
+
+    fn span(&mut self, span: Span) {
+        self.begin_array(2);
+        self.uint(span.start as u64);
+        self.separator(1);
+        self.uint(span.end as u64);
+        self.end_array();
+    }
+
+    fn uint(&mut self, value: u64) {
+        match self.format {
+            Format::JsonLines => write_u64(self.buffer, value),
+            Format::MessagePack => {
+                if value < 128 {
+                    self.buffer.push(value as u8);
+                } else if value <= u8::max_value() as u64 {
+                    self.buffer.extend_from_slice(&[0xcc, value as u8]);
+                } else if value <= u16::max_value() as u64 {
+                    self.buffer.push(0xcd);
+                    self.buffer
+                        .extend_from_slice(&(value as u16).to_be_bytes());
+                } else if value <= u32::max_value() as u64 {
+                    self.buffer.push(0xce);
+                    self.buffer
+                        .extend_from_slice(&(value as u32).to_be_bytes());
+                } else {
+                    self.buffer.push(0xcf);
+                    self.buffer.extend_from_slice(&value.to_be_bytes());
+                }
+            },
+        }
+    }
+
+    fn float(&mut self, value: f32) {
+        match self.format {
+            Format::JsonLines if value.is_finite() => {
+                write_f32(self.buffer, value)
+            },
+            // JSON has no way to represent NaN or infinity
+            Format::JsonLines => self.buffer.extend_from_slice(b"null"),
+            Format::MessagePack => {
+                self.buffer.push(0xca);
+                self.buffer
+                    .extend_from_slice(&value.to_bits().to_be_bytes());
+            },
+        }
+    }
+
+    fn string(&mut self, value: &str) {
+        match self.format {
+            Format::JsonLines => write_json_string(self.buffer, value),
+            Format::MessagePack => {
+                let len = value.len();
+                if len < 32 {
+                    self.buffer.push(0xa0 | len as u8);
+                } else if len <= u8::max_value() as usize {
+                    self.buffer.extend_from_slice(&[0xd9, len as u8]);
+                } else if len <= u16::max_value() as usize {
+                    self.buffer.push(0xda);
+                    self.buffer.extend_from_slice(&(len as u16).to_be_bytes());
+                } else {
+                    self.buffer.push(0xdb);
+                    self.buffer.extend_from_slice(&(len as u32).to_be_bytes());
+                }
+                self.buffer.extend_from_slice(value.as_bytes());
+            },
+        }
+    }
+}
+
+fn mnemonic_letter(mnemonic: Mnemonic) -> &'static str {
+    match mnemonic {
+        Mnemonic::General => "G",
+        Mnemonic::Miscellaneous => "M",
+        Mnemonic::ProgramNumber => "O",
+        Mnemonic::ToolChange => "T",
+    }
+}
+
+fn write_u64(buffer: &mut Vec<u8>, mut value: u64) {
+    let mut digits = [0_u8; 20];
+    let mut i = digits.len();
+
+    loop {
+        i -= 1;
+        digits[i] = b'0' + (value % 10) as u8;
+        value /= 10;
+        if value == 0 {
+            break;
+        }
+    }
+
+    buffer.extend_from_slice(&digits[i..]);
+}
+
+/// Write the shortest decimal representation which parses back to the same
+/// [`f32`].
+///
+/// Coordinates in g-code almost always have a handful of decimal places, so
+/// we try each number of decimal places in turn, falling back to the
+/// standard library's (much slower) formatting for anything unusual.
+fn write_f32(buffer: &mut Vec<u8>, value: f32) {
+    const POWERS_OF_TEN: [f64; 7] = [1.0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6];
+    const MAX_EXACT: f64 = (1_u64 << 53) as f64;
+
+    let magnitude = (value as f64).abs();
+
+    if magnitude < 1e9 && (magnitude == 0.0 || magnitude >= 1e-4) {
+        for (decimals, &scale) in POWERS_OF_TEN.iter().enumerate() {
+            let scaled = (magnitude * scale).round();
+
+            if scaled < MAX_EXACT && (scaled / scale) as f32 == value.abs() {
+                if value.is_sign_negative() && scaled != 0.0 {
+                    buffer.push(b'-');
+                }
+                write_fixed(buffer, scaled as u64, decimals);
+                return;
+            }
+        }
+    }
+
+    write!(buffer, "{}", value).expect("Writing to a Vec never fails");
+}
+
+/// Write `value / 10^decimals`.
+fn write_fixed(buffer: &mut Vec<u8>, value: u64, decimals: usize) {
+    if decimals == 0 {
+        return write_u64(buffer, value);
+    }
+
+    let start = buffer.len();
+    write_u64(buffer, value);
+    let digits = buffer.len() - start;
+
+    if digits <= decimals {
+        // pad with leading zeroes so there's at least one before the point
+        let padding = decimals + 1 - digits;
+        let _ =
+            buffer.splice(start..start, std::iter::repeat(b'0').take(padding));
+    }
+
+    let point = buffer.len() - decimals;
+    buffer.insert(point, b'.');
+}
+
+fn write_json_string(buffer: &mut Vec<u8>, value: &str) {
+    buffer.push(b'"');
+
+    let bytes = value.as_bytes();
+    let mut last = 0;
+
+    for (i, &b) in bytes.iter().enumerate() {
+        let escape: &[u8] = match b {
+            b'"' => b"\\\"",
+            b'\\' => b"\\\\",
+            b'\n' => b"\\n",
+            b'\r' => b"\\r",
+            b'\t' => b"\\t",
+            0..=0x1f => b"",
+            _ => continue,
+        };
+
+        buffer.extend_from_slice(&bytes[last..i]);
+        if escape.is_empty() {
+            write!(buffer, "\\u{:04x}", b)
+                .expect("Writing to a Vec never fails");
+        } else {
+            buffer.extend_from_slice(escape);
+        }
+        last = i + 1;
+    }
+
+    buffer.extend_from_slice(&bytes[last..]);
+    buffer.push(b'"');
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::Nop;
+    use std::prelude::v1::*;
+
+    fn export(src: &str, format: Format, schema: Schema) -> Vec<u8> {
+        let mut exporter = Exporter::new(Vec::new(), format, schema);
+
+        for line in crate::full_parse_with_callbacks(src, Nop) {
+            exporter.write_line(&line).unwrap();
+        }
+
+        exporter.finish().unwrap()
+    }
+
+    fn float(value: f32) -> String {
+        let mut buffer = Vec::new();
+        write_f32(&mut buffer, value);
+        String::from_utf8(buffer).unwrap()
+    }
+
+    #[test]
+    fn format_floats() {
+        let inputs = vec![
+            (0.0, "0"),
+            (-0.0, "0"),
+            (1.0, "1"),
+            (-2.5, "-2.5"),
+            (0.05, "0.05"),
+            (-0.001, "-0.001"),
+            (123.4567, "123.4567"),
+            (0.1 + 0.2, "0.3"),
+            (1e12, "1000000000000"),
+            (1.5e-7, "0.00000015"),
+        ];
+
+        for (value, expected) in inputs {
+            assert_eq!(float(value), expected);
+        }
+    }
+
+    #[test]
+    fn formatted_floats_round_trip() {
+        for i in 0..10_000 {
+            let value = (i as f32 - 5000.0) * 0.0137;
+
+            assert_eq!(float(value).parse::<f32>().unwrap(), value);
+        }
+    }
+
+    #[test]
+    fn escape_json_strings() {
+        let mut buffer = Vec::new();
+
+        write_json_string(&mut buffer, "; \"quoted\" \\ \t\u{1}°");
+
+        assert_eq!(
+            String::from_utf8(buffer).unwrap(),
+            r#""; \"quoted\" \\ \t\u0001°""#
+        );
+    }
+
+    #[test]
+    fn per_command_json_without_spans() {
+        let schema = Schema {
+            granularity: Granularity::Command,
+            spans: false,
+            ..Schema::default()
+        };
+
+        let got = export("G90 G01 X1.25\n; done", Format::JsonLines, schema);
+
+        assert_eq!(
+            String::from_utf8(got).unwrap(),
+            concat!(
+                r#"{"line":0,"mnemonic":"G","number":90,"arguments":{}}"#,
+                "\n",
+                r#"{"line":0,"mnemonic":"G","number":1,"arguments":{"X":1.25}}"#,
+                "\n",
+                r#"{"line":1,"comment":"; done"}"#,
+                "\n",
+            )
+        );
+    }
+
+    #[test]
+    fn line_numbers_are_included() {
+        let got = export("N10 M30", Format::JsonLines, Schema::default());
+
+        assert!(String::from_utf8(got).unwrap().contains(r#""n":10"#));
+    }
+
+    #[test]
+    fn per_command_records_get_the_line_number() {
+        let schema = Schema {
+            granularity: Granularity::Command,
+            spans: false,
+            ..Schema::default()
+        };
+
+        let got = export("N10 G38.2 Z-5 ; probe", Format::JsonLines, schema);
+
+        assert_eq!(
+            String::from_utf8(got).unwrap(),
+            concat!(
+                r#"{"line":0,"n":10,"mnemonic":"G","number":38.2,"arguments":{"Z":-5}}"#,
+                "\n",
+                r#"{"line":0,"n":10,"comment":"; probe"}"#,
+                "\n",
+            )
+        );
+
+        let without = Schema {
+            line_numbers: false,
+            ..schema
+        };
+        let got = export("N10 G38.2 Z-5 ; probe", Format::JsonLines, without);
+        assert!(!String::from_utf8(got).unwrap().contains(r#""n""#));
+    }
+
+    #[test]
+    fn message_pack_encoding() {
+        let schema = Schema {
+            granularity: Granularity::Command,
+            spans: false,
+            comments: false,
+            line_numbers: false,
+        };
+
+        let got = export("G01 X1", Format::MessagePack, schema);
+
+        let mut expected = vec![0x84];
+        expected.extend_from_slice(b"\xa4line\x00");
+        expected.extend_from_slice(b"\xa8mnemonic\xa1G");
+        expected.extend_from_slice(b"\xa6number\xca");
+        expected.extend_from_slice(&1.0_f32.to_bits().to_be_bytes());
+        expected.extend_from_slice(b"\xa9arguments\x81\xa1X\xca");
+        expected.extend_from_slice(&1.0_f32.to_bits().to_be_bytes());
+        assert_eq!(got, expected);
+    }
+}
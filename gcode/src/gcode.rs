@@ -100,6 +100,10 @@ impl<A: Buffer<Word>> GCode<A> {
     /// The overall category this [`GCode`] belongs to.
     pub fn mnemonic(&self) -> Mnemonic { self.mnemonic }
 
+    /// The command number as it was written (i.e. `12.3` in `G12.3`).
+    #[cfg_attr(not(feature = "std"), allow(dead_code))]
+    pub(crate) fn number(&self) -> f32 { self.number }
+
     /// The integral part of a command number (i.e. the `12` in `G12.3`).
     pub fn major_number(&self) -> u32 {
         debug_assert!(self.number >= 0.0);
@@ -125,7 +129,18 @@ impl<A: Buffer<Word>> GCode<A> {
         &mut self,
         arg: Word,
     ) -> Result<(), CapacityError<Word>> {
-        self.span = self.span.merge(arg.span);
+        self.push_argument_inner(arg, true)
+    }
+
+    /// [`GCode::push_argument()`], optionally skipping span tracking.
+    pub(crate) fn push_argument_inner(
+        &mut self,
+        arg: Word,
+        track_span: bool,
+    ) -> Result<(), CapacityError<Word>> {
+        if track_span {
+            self.span = self.span.merge(arg.span);
+        }
         self.arguments.try_push(arg)
     }
 
@@ -0,0 +1,425 @@
+//! Whole programs with their comments interned.
+//!
+//! Slicers repeat the same handful of comments (`;TYPE:FILL`,
+//! `;WIPE_START`, `;MESH:...`) tens of thousands of times. An
+//! [`InternedProgram`] stores each distinct comment once, in a
+//! [`CommentTable`], and lines refer to their comments by [`CommentId`].
+//! Unlike an [`OwnedLine`], nothing needs to keep the source text alive, and
+//! finding the lines with a particular comment is just comparing integers.
+//!
+//! ```rust
+//! use gcode::interned::InternedProgram;
+//!
+//! let src = ";TYPE:WALL\nG1 X1\nG1 X2\n;TYPE:FILL\nG1 Y1\n;TYPE:WALL\nG1 X3\n";
+//! let program = InternedProgram::parse(src);
+//!
+//! // 7 lines, but only 2 distinct comments
+//! assert_eq!(program.len(), 7);
+//! assert_eq!(program.table().len(), 2);
+//!
+//! let wall = program.table().lookup(";TYPE:WALL").unwrap();
+//! let walls: Vec<_> = program.lines_with(wall).collect();
+//! assert_eq!(walls, &[0, 5]);
+//!
+//! // split the program wherever the feature changes
+//! let features = program.table().ids_where(|c| c.starts_with(";TYPE:"));
+//! assert_eq!(program.segments(&features), &[0..3, 3..5, 5..7]);
+//! ```
+//!
+//! [`OwnedLine`]: crate::owned::OwnedLine
+
+use crate::{Callbacks, Comment, GCode, Line, Nop, Span, Word};
+use std::ops::Range;
+
+/// A reference to a comment in a [`CommentTable`].
+#[derive(Debug, Copy, Clone, PartialEq, Eq, PartialOrd, Ord, Hash)]
+pub struct CommentId(u32);
+
+impl CommentId {
+    /// The order this comment was first seen in, starting from `0`.
+    pub fn index(self) -> usize { self.0 as usize }
+}
+
+/// A deduplicated set of comments.
+///
+/// The text of every comment is kept in a single buffer and looked up with
+/// an open-addressing hash table, so interning a comment which has been
+/// seen before doesn't allocate.
+#[derive(Debug, Clone, PartialEq)]
+pub struct CommentTable {
+    text: String,
+    /// Where each comment ends in `text` (it starts where the last one
+    /// ended).
+    ends: Vec<u32>,
+    hashes: Vec<u64>,
+    /// Indices into `ends`, or [`CommentTable::EMPTY`]. The length is
+    /// always a power of two.
+    slots: Vec<u32>,
+}
+
+impl CommentTable {
+    const EMPTY: u32 = u32::max_value();
+    const INITIAL_SLOTS: usize = 64;
+
+    /// Create an empty [`CommentTable`].
+    pub fn new() -> Self {
+        CommentTable {
+            text: String::new(),
+            ends: Vec::new(),
+            hashes: Vec::new(),
+            slots: vec![CommentTable::EMPTY; CommentTable::INITIAL_SLOTS],
+        }
+    }
+
+    /// The number of distinct comments.
+    pub fn len(&self) -> usize { self.ends.len() }
+
+    /// Is the table empty?
+    pub fn is_empty(&self) -> bool { self.ends.is_empty() }
+
+    /// Get the [`CommentId`] for a comment, adding it to the table if it
+    /// hasn't been seen before.
+    pub fn intern(&mut self, comment: &str) -> CommentId {
+        let hash = hash(comment);
+
+        match self.find(comment, hash) {
+            Ok(id) => id,
+            Err(slot) => {
+                let id = CommentId(self.ends.len() as u32);
+                self.text.push_str(comment);
+                self.ends.push(self.text.len() as u32);
+                self.hashes.push(hash);
+                self.slots[slot] = id.0;
+
+                // keep at least half of the slots empty so probes are short
+                if self.ends.len() * 2 > self.slots.len() {
+                    self.grow();
+                }
+
+                id
+            },
+        }
+    }
+
+    /// Find a comment's [`CommentId`] without adding it.
+    pub fn lookup(&self, comment: &str) -> Option<CommentId> {
+        self.find(comment, hash(comment)).ok()
+    }
+
+    /// Get a comment's text.
+    pub fn get(&self, id: CommentId) -> Option<&str> {
+        let end = *self.ends.get(id.index())? as usize;
+        let start = match id.index() {
+            0 => 0,
+            index => self.ends[index - 1] as usize,
+        };
+
+        Some(&self.text[start..end])
+    }
+
+    /// Iterate over every comment, in the order they were first seen.
+    pub fn iter(&self) -> impl Iterator<Item = (CommentId, &str)> + '_ {
+        (0..self.len() as u32).map(move |index| {
+            let id = CommentId(index);
+            (id, self.get(id).unwrap_or_default())
+        })
+    }
+
+    /// The [`CommentId`] of every comment matching a predicate, so lines
+    /// can be checked without looking at their text again.
+    pub fn ids_where<F>(&self, mut predicate: F) -> Vec<CommentId>
+    where
+        F: FnMut(&str) -> bool,
+    {
+        self.iter()
+            .filter(|(_, text)| predicate(text))
+            .map(|(id, _)| id)
+            .collect()
+    }
+
+    /// Look for a comment, returning its [`CommentId`] or the empty slot it
+    /// would go into.
+    fn find(&self, comment: &str, hash: u64) -> Result<CommentId, usize> {
+        let mask = self.slots.len() - 1;
+        let mut slot = hash as usize & mask;
+
+        loop {
+            match self.slots[slot] {
+                CommentTable::EMPTY => return Err(slot),
+                index => {
+                    let id = CommentId(index);
+
+                    if self.hashes[id.index()] == hash
+                        && self.get(id) == Some(comment)
+                    {
+                        return Ok(id);
+                    }
+                },
+            }
+
+            slot = (slot + 1) & mask;
+        }
+    }
+
+    fn grow(&mut self) {
+        let mut slots = vec![CommentTable::EMPTY; self.slots.len() * 2];
+        let mask = slots.len() - 1;
+
+        for (index, &hash) in self.hashes.iter().enumerate() {
+            let mut slot = hash as usize & mask;
+
+            while slots[slot] != CommentTable::EMPTY {
+                slot = (slot + 1) & mask;
+            }
+            slots[slot] = index as u32;
+        }
+
+        self.slots = slots;
+    }
+}
+
+impl Default for CommentTable {
+    fn default() -> CommentTable { CommentTable::new() }
+}
+
+/// FNV-1a, which is quick for short keys like comments.
+fn hash(text: &str) -> u64 {
+    const PRIME: u64 = 0x100_0000_01b3;
+
+    text.bytes().fold(0xcbf2_9ce4_8422_2325, |hash, byte| {
+        (hash ^ u64::from(byte)).wrapping_mul(PRIME)
+    })
+}
+
+/// A [`Line`] whose comments are stored in an [`InternedProgram`].
+#[derive(Debug, Default, Clone, PartialEq)]
+pub struct InternedLine {
+    gcodes: Vec<GCode>,
+    /// A range of the [`InternedProgram`]'s comment IDs.
+    comments: (u32, u32),
+    line_number: Option<Word>,
+    span: Span,
+}
+
+impl InternedLine {
+    /// All [`GCode`]s in this line.
+    pub fn gcodes(&self) -> &[GCode] { &self.gcodes }
+
+    /// The line number, if there was one.
+    pub fn line_number(&self) -> Option<Word> { self.line_number }
+
+    /// Get the [`InternedLine`]'s position in its source text.
+    pub fn span(&self) -> Span { self.span }
+}
+
+/// A whole program, with every comment interned.
+#[derive(Debug, Default, Clone, PartialEq)]
+pub struct InternedProgram {
+    lines: Vec<InternedLine>,
+    comments: Vec<CommentId>,
+    table: CommentTable,
+}
+
+impl InternedProgram {
+    /// Create an empty [`InternedProgram`].
+    pub fn new() -> Self { InternedProgram::default() }
+
+    /// Parse a whole program.
+    pub fn parse(src: &str) -> Self {
+        InternedProgram::parse_with_callbacks(src, Nop)
+    }
+
+    /// Parse a whole program, using the provided [`Callbacks`] when a
+    /// parse error occurs that we can recover from.
+    pub fn parse_with_callbacks<C: Callbacks>(src: &str, callbacks: C) -> Self {
+        let mut program = InternedProgram::new();
+
+        for line in crate::full_parse_with_callbacks(src, callbacks) {
+            program.push(line);
+        }
+
+        program
+    }
+
+    /// Add a [`Line`] to the end of the program.
+    pub fn push(&mut self, line: Line<'_>) {
+        let start = self.comments.len() as u32;
+        for comment in line.comments() {
+            self.comments.push(self.table.intern(comment.value));
+        }
+
+        let comments = (start, self.comments.len() as u32);
+        let line_number = line.line_number();
+        let span = line.span();
+
+        self.lines.push(InternedLine {
+            gcodes: line.into_gcodes(),
+            comments,
+            line_number,
+            span,
+        });
+    }
+
+    /// The number of lines.
+    pub fn len(&self) -> usize { self.lines.len() }
+
+    /// Does the program contain any lines?
+    pub fn is_empty(&self) -> bool { self.lines.is_empty() }
+
+    /// Every line in the program.
+    pub fn lines(&self) -> &[InternedLine] { &self.lines }
+
+    /// The comments used by this program.
+    pub fn table(&self) -> &CommentTable { &self.table }
+
+    /// The comments on a particular line.
+    pub fn comments_on(&self, index: usize) -> &[CommentId] {
+        match self.lines.get(index) {
+            Some(line) => {
+                let (start, end) = line.comments;
+                &self.comments[start as usize..end as usize]
+            },
+            None => &[],
+        }
+    }
+
+    /// The index of every line containing a particular comment.
+    pub fn lines_with(
+        &self,
+        id: CommentId,
+    ) -> impl Iterator<Item = usize> + '_ {
+        (0..self.len()).filter(move |&ix| self.comments_on(ix).contains(&id))
+    }
+
+    /// Split the program into consecutive ranges of lines, starting a new
+    /// one at every line containing one of the `markers`.
+    pub fn segments(&self, markers: &[CommentId]) -> Vec<Range<usize>> {
+        let mut segments = Vec::new();
+        let mut start = 0;
+
+        for index in 1..self.len() {
+            let is_marker = self
+                .comments_on(index)
+                .iter()
+                .any(|id| markers.contains(id));
+
+            if is_marker {
+                segments.push(start..index);
+                start = index;
+            }
+        }
+
+        if start < self.len() {
+            segments.push(start..self.len());
+        }
+
+        segments
+    }
+
+    /// Turn a line back into a normal [`Line`], borrowing its comments from
+    /// the [`CommentTable`].
+    ///
+    /// Comments only store their text, so they are given
+    /// [`Span::PLACEHOLDER`].
+    pub fn to_line(&self, index: usize) -> Option<Line<'_>> {
+        let interned = self.lines.get(index)?;
+        let mut line = Line::default();
+
+        for &id in self.comments_on(index) {
+            let value = self.table.get(id).unwrap_or_default();
+            let _ = line.push_comment(Comment {
+                value,
+                span: Span::PLACEHOLDER,
+            });
+        }
+        for gcode in &interned.gcodes {
+            let _ = line.push_gcode(gcode.clone());
+        }
+        line.set_line_number(interned.line_number);
+
+        Some(line)
+    }
+}
+
+impl<'input> Extend<Line<'input>> for InternedProgram {
+    fn extend<I: IntoIterator<Item = Line<'input>>>(&mut self, lines: I) {
+        for line in lines {
+            self.push(line);
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn repeated_comments_are_stored_once() {
+        let mut table = CommentTable::new();
+
+        let first = table.intern(";WIPE_START");
+        let second = table.intern(";WIPE_END");
+        let again = table.intern(";WIPE_START");
+
+        assert_eq!(first, again);
+        assert_ne!(first, second);
+        assert_eq!(table.len(), 2);
+        assert_eq!(table.get(second), Some(";WIPE_END"));
+        assert_eq!(table.lookup(";LAYER:1"), None);
+    }
+
+    #[test]
+    fn table_grows() {
+        let mut table = CommentTable::new();
+
+        let ids: Vec<_> = (0..1000)
+            .map(|i| table.intern(&format!(";MESH:part_{}.stl", i)))
+            .collect();
+
+        assert_eq!(table.len(), 1000);
+        for (i, &id) in ids.iter().enumerate() {
+            let text = format!(";MESH:part_{}.stl", i);
+            assert_eq!(table.lookup(&text), Some(id));
+            assert_eq!(table.get(id), Some(text.as_str()));
+        }
+        // empty comments are fine too
+        let empty = table.intern("");
+        assert_eq!(table.get(empty), Some(""));
+    }
+
+    #[test]
+    fn lines_round_trip() {
+        let src = "N10 G1 X5 ; move\n(first) G0 Y2 (second)\n; move\n";
+        let original: Vec<_> = crate::full_parse_with_callbacks(src, Nop)
+            .map(|line| {
+                (
+                    line.gcodes().to_vec(),
+                    line.comments().iter().map(|c| c.value).collect::<Vec<_>>(),
+                    line.line_number(),
+                )
+            })
+            .collect();
+
+        let program = InternedProgram::parse(src);
+
+        assert_eq!(program.table().len(), 3);
+        for (index, (gcodes, comments, line_number)) in
+            original.into_iter().enumerate()
+        {
+            let line = program.to_line(index).unwrap();
+            assert_eq!(line.gcodes(), gcodes.as_slice());
+            let got: Vec<_> = line.comments().iter().map(|c| c.value).collect();
+            assert_eq!(got, comments);
+            assert_eq!(line.line_number(), line_number);
+            assert_eq!(program.lines()[index].span().line, index);
+        }
+    }
+
+    #[test]
+    fn segments_without_markers() {
+        let program = InternedProgram::parse("G1 X1\nG1 X2\n;LAYER:0\nG1 X3\n");
+
+        assert_eq!(program.segments(&[]), &[0..4]);
+        assert!(InternedProgram::new().segments(&[]).is_empty());
+    }
+}
@@ -1,4 +1,4 @@
-use crate::Span;
+use crate::{scan, Span};
 
 #[derive(Debug, Copy, Clone, PartialEq)]
 pub(crate) enum TokenType {
@@ -33,18 +33,37 @@ pub(crate) struct Token<'input> {
 pub(crate) struct Lexer<'input> {
     current_position: usize,
     current_line: usize,
+    /// Where `src` starts in the overall stream, used when the text is parsed
+    /// piece by piece.
+    offset: usize,
     src: &'input str,
 }
 
 impl<'input> Lexer<'input> {
     pub(crate) fn new(src: &'input str) -> Self {
+        Lexer::starting_at(src, 0, 0)
+    }
+
+    /// Create a [`Lexer`] for some text which starts `offset` bytes and
+    /// `line` lines into a larger stream.
+    pub(crate) fn starting_at(
+        src: &'input str,
+        offset: usize,
+        line: usize,
+    ) -> Self {
         Lexer {
             current_position: 0,
-            current_line: 0,
+            current_line: line,
+            offset,
             src,
         }
     }
 
+    /// Create a [`Span`] for a range of `src`.
+    fn span(&self, start: usize, end: usize, line: usize) -> Span {
+        Span::new(self.offset + start, self.offset + end, line)
+    }
+
     /// Keep advancing the [`Lexer`] as long as a `predicate` returns `true`,
     /// returning the chomped string, if any.
     fn chomp<F>(&mut self, mut predicate: F) -> Option<&'input str>
@@ -82,7 +101,37 @@ impl<'input> Lexer<'input> {
         }
     }
 
-    fn skip_whitespace(&mut self) { let _ = self.chomp(char::is_whitespace); }
+    fn skip_whitespace(&mut self) {
+        loop {
+            let (skipped, newlines) =
+                scan::skip_ascii_whitespace(self.rest().as_bytes());
+            self.current_position += skipped;
+            self.current_line += newlines;
+
+            // fall back to the slow path for unicode whitespace
+            match self.rest().chars().next() {
+                Some(c) if !c.is_ascii() && c.is_whitespace() => {
+                    self.current_position += c.len_utf8();
+                },
+                _ => return,
+            }
+        }
+    }
+
+    /// Advance to the end of the current comment body, assuming `find_end`
+    /// locates the first character *not* in the comment.
+    fn skip_comment_body<F>(&mut self, find_end: F) -> &'input str
+    where
+        F: FnOnce(&[u8]) -> Option<usize>,
+    {
+        let start = self.current_position;
+        let rest = self.rest();
+        // comment bodies never contain a newline, so the line stays the same
+        let end = start + find_end(rest.as_bytes()).unwrap_or(rest.len());
+        self.current_position = end;
+
+        &self.src[start..end]
+    }
 
     fn tokenize_comment(&mut self) -> Option<Token<'input>> {
         let start = self.current_position;
@@ -90,17 +139,17 @@ impl<'input> Lexer<'input> {
 
         if self.rest().starts_with(';') {
             // the comment is every character from ';' to '\n' or EOF
-            let comment = self.chomp(|c| c != '\n').unwrap_or("");
+            let comment = self.skip_comment_body(scan::find_newline);
             let end = self.current_position;
 
             Some(Token {
                 kind: TokenType::Comment,
                 value: comment,
-                span: Span { start, end, line },
+                span: self.span(start, end, line),
             })
         } else if self.rest().starts_with('(') {
             // skip past the comment body
-            let _ = self.chomp(|c| c != '\n' && c != ')');
+            let _ = self.skip_comment_body(scan::find_paren_comment_end);
 
             // at this point, it's guaranteed that the next character is '\n',
             // ')' or EOF
@@ -117,7 +166,7 @@ impl<'input> Lexer<'input> {
             Some(Token {
                 kind,
                 value,
-                span: Span { start, end, line },
+                span: self.span(start, end, line),
             })
         } else {
             None
@@ -133,11 +182,7 @@ impl<'input> Lexer<'input> {
             Some(Token {
                 kind: TokenType::Letter,
                 value: &self.src[start..=start],
-                span: Span {
-                    start,
-                    end: start + 1,
-                    line: self.current_line,
-                },
+                span: self.span(start, start + 1, self.current_line),
             })
         } else {
             None
@@ -149,13 +194,17 @@ impl<'input> Lexer<'input> {
         let line = self.current_line;
 
         let mut decimal_seen = false;
+        let mut digit_seen = false;
         let mut letters_seen = 0;
 
         let value = self.chomp(|c| {
             letters_seen += 1;
             let is_sign = c == '-' || c == '+';
 
-            if (is_sign && letters_seen == 1) || c.is_ascii_digit() {
+            if c.is_ascii_digit() {
+                digit_seen = true;
+                true
+            } else if is_sign && letters_seen == 1 {
                 true
             } else if c == '.' && !decimal_seen {
                 decimal_seen = true;
@@ -165,21 +214,30 @@ impl<'input> Lexer<'input> {
             }
         })?;
 
+        // a lone "-" or "." isn't a number
+        let kind = if digit_seen {
+            TokenType::Number
+        } else {
+            TokenType::Unknown
+        };
+
         Some(Token {
-            kind: TokenType::Number,
+            kind,
             value,
-            span: Span {
-                start,
-                line,
-                end: self.current_position,
-            },
+            span: self.span(start, self.current_position, line),
         })
     }
 
     fn finished(&self) -> bool { self.current_position >= self.src.len() }
 
     fn peek(&self) -> Option<TokenType> {
-        self.rest().chars().next().map(TokenType::from)
+        // Note: non-ASCII bytes are always Unknown, so we'll step over a
+        // multi-byte character one byte at a time without ever stopping in
+        // the middle of it
+        self.src
+            .as_bytes()
+            .get(self.current_position)
+            .map(|&b| scan::classify(b))
     }
 }
 
@@ -205,7 +263,7 @@ impl<'input> Iterator for Lexer<'input> {
                 return Some(Token {
                     kind: TokenType::Unknown,
                     value: &self.src[start..end],
-                    span: Span::new(start, end, line),
+                    span: self.span(start, end, line),
                 });
             }
 
@@ -219,6 +277,13 @@ impl<'input> Iterator for Lexer<'input> {
                 TokenType::Number => {
                     return Some(self.tokenize_number().expect(MSG))
                 },
+                // garbage stops at the end of a line so the line number
+                // stays correct
+                TokenType::Unknown
+                    if self.src.as_bytes()[self.current_position] == b'\n' =>
+                {
+                    break
+                },
                 TokenType::Unknown => self.current_position += 1,
             }
         }
@@ -227,8 +292,8 @@ impl<'input> Iterator for Lexer<'input> {
             // make sure we deal with trailing garbage
             Some(Token {
                 kind: TokenType::Unknown,
-                value: &self.src[start..],
-                span: Span::new(start, self.current_position, line),
+                value: &self.src[start..self.current_position],
+                span: self.span(start, self.current_position, line),
             })
         } else {
             None
@@ -239,6 +304,7 @@ impl<'input> Iterator for Lexer<'input> {
 #[cfg(test)]
 mod tests {
     use super::*;
+    use std::prelude::v1::*;
 
     #[test]
     fn take_while_works_as_expected() {
@@ -330,6 +396,17 @@ mod tests {
         assert_eq!(next.value, "x");
     }
 
+    #[test]
+    fn garbage_stops_at_the_end_of_the_line() {
+        let mut lexer = Lexer::new("$$ $\nG");
+
+        let garbage = lexer.next().unwrap();
+        let letter = lexer.next().unwrap();
+
+        assert_eq!(garbage.value, "$$ $");
+        assert_eq!(letter.span, Span::new(5, 6, 1));
+    }
+
     #[test]
     fn tokenize_a_letter() {
         let mut lexer = Lexer::new("asd\nf");
@@ -354,6 +431,23 @@ mod tests {
         assert_eq!(lexer.current_position, 4);
     }
 
+    #[test]
+    fn a_sign_without_digits_isnt_a_number() {
+        let got: Vec<_> = Lexer::new("X- Y.").collect();
+
+        let kinds: Vec<_> = got.iter().map(|tok| tok.kind).collect();
+        assert_eq!(
+            kinds,
+            &[
+                TokenType::Letter,
+                TokenType::Unknown,
+                TokenType::Letter,
+                TokenType::Unknown
+            ]
+        );
+        assert_eq!(got[1].value, "-");
+    }
+
     #[test]
     fn negative_number() {
         let mut lexer = Lexer::new("-3.14\nf");
@@ -363,6 +457,31 @@ mod tests {
         assert_eq!(got.value, "-3.14");
     }
 
+    #[test]
+    fn non_ascii_garbage_and_whitespace() {
+        let mut lexer = Lexer::new("\u{3000}G°\u{a0}X1 (10°)");
+
+        let tokens: Vec<_> = lexer.by_ref().map(|t| t.value).collect();
+
+        assert_eq!(tokens, vec!["G", "°\u{a0}", "X", "1", "(10°)"]);
+    }
+
+    #[test]
+    fn spans_are_relative_to_the_start_of_the_stream() {
+        let mut lexer = Lexer::starting_at("G90\n(comment)", 100, 7);
+
+        let spans: Vec<_> = lexer.by_ref().map(|t| t.span).collect();
+
+        assert_eq!(
+            spans,
+            vec![
+                Span::new(100, 101, 7),
+                Span::new(101, 103, 7),
+                Span::new(104, 113, 8),
+            ]
+        );
+    }
+
     #[test]
     fn positive_number() {
         let mut lexer = Lexer::new("+3.14\nf");
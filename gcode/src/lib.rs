@@ -103,7 +103,9 @@
 //!
 //! You shouldn't normally need to do this unless you are on an embedded device
 //! and know your expected input will be bigger than
-//! [`buffers::SmallFixedBuffers`] will allow.
+//! [`buffers::SmallFixedBuffers`] will allow. If only the odd line has more
+//! commands than will fit, parsing with [`profile::SplitLines`] emits the
+//! extras as continuation lines instead.
 //!
 //! ```rust
 //! use gcode::{Word, Comment, GCode, Nop, Parser, buffers::Buffers};
@@ -145,14 +147,43 @@
 //! for a `span()` method (e.g. [`GCode::span()`]) or a `span` field (e.g.
 //! [`Comment::span`]).
 //!
+//! Applications which don't need spans, comments or line numbers can stop
+//! the [`Parser`] from recording them by giving it a different
+//! [`Profile`](profile::Profile).
+//!
+//! Programs which are known at compile time can be parsed ahead of time with
+//! the `gcode-macros` crate, producing a [`packed::Program`] which lives in
+//! read-only memory.
+//!
+//! The [`state`] module follows the modal state of a machine (units, distance
+//! mode, position, tool, etc.) as a program is executed.
+//!
 //! # Cargo Features
 //!
 //! Additional functionality can be enabled by adding feature flags to your
 //! `Cargo.toml` file:
 //!
 //! - **std:** adds `std::error::Error` impls to any errors and switches to
-//!   `Vec` for the default backing buffers
+//!   `Vec` for the default backing buffers. It also enables:
+//!   - [`pipeline`]: parsing on multiple threads
+//!   - [`streaming`]: parsing text which arrives in chunks
+//!   - [`encoding`]: parsing text which isn't UTF-8
+//!   - [`owned`]: lines which don't borrow from their source text
+//!   - [`interned`]: whole programs, with each distinct comment kept once
+//!   - [`export`]: writing JSON Lines or MessagePack
+//!   - [`sourcemap`]: tracing generated output back to its input
+//!   - [`split`]: dividing long programs into self-contained parts
+//!   - [`subprogram`]: expanding subprogram calls
+//!   - [`dedup`]: finding repeated blocks
+//!   - [`travel`]: reordering contours to cut down on rapid moves
+//!   - [`moves`]: resolving a 3D printer program into individual moves
+//!   - [`mesh`]: turning those moves into triangle meshes for previews
+//!   - [`removal`]: simulating a milling cutter removing material from stock
+//!   - [`adaptive`]: adjusting feed rates to keep the cutter's load constant
+//!   - [`analysis`]: running several analyses over a single parse
 //! - **serde-1:** allows serializing and deserializing most types with `serde`
+//! - **compact-float:** parse numbers with a much smaller (but very slightly
+//!   less accurate) routine than the one in `core`, for when flash is tight
 #![deny(
     bare_trait_objects,
     elided_lifetimes_in_paths,
@@ -187,16 +218,40 @@ mod comment;
 mod gcode;
 mod lexer;
 mod line;
+mod number;
+pub mod packed;
 mod parser;
+pub mod profile;
+mod scan;
 mod span;
+pub mod state;
 mod words;
 
+with_std! {
+    pub mod adaptive;
+    pub mod analysis;
+    pub mod dedup;
+    pub mod encoding;
+    pub mod export;
+    pub mod interned;
+    pub mod mesh;
+    pub mod moves;
+    pub mod owned;
+    pub mod pipeline;
+    pub mod removal;
+    pub mod sourcemap;
+    pub mod split;
+    pub mod streaming;
+    pub mod subprogram;
+    pub mod travel;
+}
+
 pub use crate::{
     callbacks::{Callbacks, Nop},
     comment::Comment,
     gcode::{GCode, Mnemonic},
     line::Line,
-    parser::{full_parse_with_callbacks, parse, Parser},
+    parser::{full_parse_with_callbacks, parse, Continuations, Parser},
     span::Span,
     words::Word,
 };
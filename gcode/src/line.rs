@@ -67,10 +67,23 @@ impl<'input, B: Buffers<'input>> Line<'input, B> {
         &mut self,
         gcode: GCode<B::Arguments>,
     ) -> Result<(), CapacityError<GCode<B::Arguments>>> {
-        // Note: We need to make sure a failed push doesn't change our span
-        let span = self.span.merge(gcode.span());
-        self.gcodes.try_push(gcode)?;
-        self.span = span;
+        self.push_gcode_inner(gcode, true)
+    }
+
+    /// [`Line::push_gcode()`], optionally skipping span tracking.
+    pub(crate) fn push_gcode_inner(
+        &mut self,
+        gcode: GCode<B::Arguments>,
+        track_span: bool,
+    ) -> Result<(), CapacityError<GCode<B::Arguments>>> {
+        if track_span {
+            // Note: We need to make sure a failed push doesn't change our span
+            let span = self.span.merge(gcode.span());
+            self.gcodes.try_push(gcode)?;
+            self.span = span;
+        } else {
+            self.gcodes.try_push(gcode)?;
+        }
 
         Ok(())
     }
@@ -80,9 +93,22 @@ impl<'input, B: Buffers<'input>> Line<'input, B> {
         &mut self,
         comment: Comment<'input>,
     ) -> Result<(), CapacityError<Comment<'input>>> {
-        let span = self.span.merge(comment.span);
-        self.comments.try_push(comment)?;
-        self.span = span;
+        self.push_comment_inner(comment, true)
+    }
+
+    /// [`Line::push_comment()`], optionally skipping span tracking.
+    pub(crate) fn push_comment_inner(
+        &mut self,
+        comment: Comment<'input>,
+        track_span: bool,
+    ) -> Result<(), CapacityError<Comment<'input>>> {
+        if track_span {
+            let span = self.span.merge(comment.span);
+            self.comments.try_push(comment)?;
+            self.span = span;
+        } else {
+            self.comments.try_push(comment)?;
+        }
         Ok(())
     }
 
@@ -99,16 +125,28 @@ impl<'input, B: Buffers<'input>> Line<'input, B> {
     /// Set the [`Line::line_number()`].
     pub fn set_line_number<W: Into<Option<Word>>>(&mut self, line_number: W) {
         match line_number.into() {
-            Some(n) => {
-                self.span = self.span.merge(n.span);
-                self.line_number = Some(n);
-            },
+            Some(n) => self.set_line_number_inner(n, true),
             None => self.line_number = None,
         }
     }
 
+    /// [`Line::set_line_number()`], optionally skipping span tracking.
+    pub(crate) fn set_line_number_inner(
+        &mut self,
+        line_number: Word,
+        track_span: bool,
+    ) {
+        if track_span {
+            self.span = self.span.merge(line_number.span);
+        }
+        self.line_number = Some(line_number);
+    }
+
     /// Get the [`Line`]'s position in its source text.
     pub fn span(&self) -> Span { self.span }
 
+    /// Is there no room for another [`GCode`]?
+    pub(crate) fn gcodes_are_full(&self) -> bool { self.gcodes.is_full() }
+
     pub(crate) fn into_gcodes(self) -> B::Commands { self.gcodes }
 }
@@ -0,0 +1,864 @@
+//! Triangle meshes of a 3D print's extruded plastic, for previews.
+//!
+//! A [`MeshBuilder`] turns the extrusion moves in a [`Toolpath`] into tubes
+//! with a diamond-shaped cross section. The width of each tube comes from
+//! how much filament the move used and the height of its layer. Connected
+//! moves share the vertices at their joints, layers are built in parallel,
+//! and the result is an indexed [`Mesh`] made of flat buffers which can be
+//! uploaded to a GPU as-is or saved as binary STL, OBJ or GLB.
+//!
+//! ```rust
+//! use gcode::{mesh::MeshBuilder, moves::Toolpath};
+//!
+//! let src = "G28\nG1 Z0.2\n;TYPE:WALL-OUTER\nG1 X10 E0.5\nG1 Y10 E1.0\n";
+//! let toolpath = Toolpath::parse(src);
+//!
+//! let mesh = MeshBuilder::new().build(&toolpath);
+//!
+//! // one ring of 4 vertices at each end and another at the corner
+//! assert_eq!(mesh.vertex_count(), 12);
+//! // 8 triangles for each move plus 2 for each end cap
+//! assert_eq!(mesh.triangle_count(), 20);
+//! assert!(mesh.features.iter().all(|&f| toolpath.features[f as usize] == "WALL-OUTER"));
+//!
+//! let mut stl = Vec::new();
+//! mesh.write_stl(&mut stl).unwrap();
+//! assert_eq!(stl.len(), 84 + 20 * 50);
+//! ```
+//!
+//! # Level of Detail
+//!
+//! Detailed prints contain millions of tiny moves. Setting a tolerance with
+//! [`MeshBuilder::with_tolerance()`] simplifies each path so no point moves
+//! by more than the tolerance, and drops any path shorter than it.
+
+use crate::moves::{Layer, Move, Toolpath};
+use core::f32::consts::PI;
+use std::{
+    io::{self, Write},
+    thread,
+};
+
+/// Generates a [`Mesh`] from a [`Toolpath`].
+#[derive(Debug, Copy, Clone, PartialEq)]
+pub struct MeshBuilder {
+    filament_diameter: f32,
+    tolerance: f32,
+}
+
+impl MeshBuilder {
+    /// The most common filament diameter, in millimetres.
+    pub const DEFAULT_FILAMENT_DIAMETER: f32 = 1.75;
+    /// The longest a mitred joint may be, relative to the tube's width.
+    const MAX_MITER: f32 = 2.0;
+    /// A joint sharper than this (the cosine of the angle between the two
+    /// moves) isn't mitred, because the miter would stick out a long way.
+    const SHARP_TURN: f32 = -0.7;
+
+    /// Create a [`MeshBuilder`] with the default settings.
+    pub fn new() -> Self {
+        MeshBuilder {
+            filament_diameter: MeshBuilder::DEFAULT_FILAMENT_DIAMETER,
+            tolerance: 0.0,
+        }
+    }
+
+    /// Set the diameter of the filament, used to work out how wide each
+    /// extrusion is.
+    pub fn with_filament_diameter(self, filament_diameter: f32) -> Self {
+        MeshBuilder {
+            filament_diameter,
+            ..self
+        }
+    }
+
+    /// Simplify paths so no point moves by more than `tolerance`. A
+    /// tolerance of `0.0` keeps every move.
+    pub fn with_tolerance(self, tolerance: f32) -> Self {
+        MeshBuilder {
+            tolerance: tolerance.max(0.0),
+            ..self
+        }
+    }
+
+    /// Build a [`Mesh`] for every extrusion in a [`Toolpath`].
+    pub fn build(&self, toolpath: &Toolpath) -> Mesh {
+        let layers = self.paths(toolpath);
+        let threads = thread::available_parallelism()
+            .map(|n| n.get())
+            .unwrap_or(1);
+        let chunks = balanced_chunks(&layers, threads);
+
+        let meshes: Vec<Mesh> = thread::scope(|scope| {
+            let workers: Vec<_> = chunks
+                .into_iter()
+                .map(|chunk| {
+                    scope.spawn(move || {
+                        let mut mesh = Mesh::default();
+                        for path in chunk.iter().flatten() {
+                            tube(path, &mut mesh);
+                        }
+                        mesh
+                    })
+                })
+                .collect();
+
+            workers
+                .into_iter()
+                .map(|worker| worker.join().expect("The worker panicked"))
+                .collect()
+        });
+
+        let mut mesh = Mesh::default();
+        for part in meshes {
+            mesh.append(part);
+        }
+
+        mesh
+    }
+
+    /// Group the extrusion moves into connected paths, one list per layer.
+    fn paths(&self, toolpath: &Toolpath) -> Vec<Vec<Path>> {
+        let mut layers: Vec<Vec<Path>> =
+            vec![Vec::new(); toolpath.layers.len()];
+        let filament_area =
+            PI * self.filament_diameter * self.filament_diameter / 4.0;
+
+        for m in toolpath.moves.iter().filter(|m| m.is_extrusion()) {
+            let layer = match toolpath.layers.get(m.layer as usize) {
+                Some(layer) => *layer,
+                None => continue,
+            };
+            let width = extrusion_width(m, &layer, filament_area);
+            let paths = &mut layers[m.layer as usize];
+
+            match paths.last_mut() {
+                Some(path) if path.continues_with(m) => {
+                    path.points.push(m.end);
+                    path.widths.push(width);
+                },
+                _ => paths.push(Path {
+                    points: vec![m.start, m.end],
+                    widths: vec![width],
+                    height: layer.height,
+                    feature: m.feature,
+                    layer: m.layer,
+                }),
+            }
+        }
+
+        if self.tolerance > 0.0 {
+            for paths in &mut layers {
+                paths.retain(|path| path.length() >= self.tolerance);
+                for path in paths.iter_mut() {
+                    path.simplify(self.tolerance);
+                }
+            }
+        }
+
+        layers
+    }
+}
+
+impl Default for MeshBuilder {
+    fn default() -> MeshBuilder { MeshBuilder::new() }
+}
+
+/// The width of the plastic laid down by a move, treating its cross section
+/// as a rectangle with semicircular ends.
+fn extrusion_width(m: &Move, layer: &Layer, filament_area: f32) -> f32 {
+    let h = layer.height;
+    let area = m.extrusion * filament_area / m.xy_length();
+    let width = area / h + h * (1.0 - PI / 4.0);
+
+    if width.is_finite() {
+        width.max(h * 0.25)
+    } else {
+        h
+    }
+}
+
+/// Split the layers into `count` contiguous chunks with roughly the same
+/// number of points in each.
+fn balanced_chunks(layers: &[Vec<Path>], count: usize) -> Vec<&[Vec<Path>]> {
+    let points = |layer: &Vec<Path>| -> usize {
+        layer.iter().map(|p| p.points.len()).sum()
+    };
+    let total: usize = layers.iter().map(points).sum();
+    let per_chunk = total / count.max(1) + 1;
+
+    let mut chunks = Vec::new();
+    let mut start = 0;
+    let mut in_chunk = 0;
+
+    for (i, layer) in layers.iter().enumerate() {
+        in_chunk += points(layer);
+
+        if in_chunk >= per_chunk {
+            chunks.push(&layers[start..=i]);
+            start = i + 1;
+            in_chunk = 0;
+        }
+    }
+    if start < layers.len() {
+        chunks.push(&layers[start..]);
+    }
+
+    chunks
+}
+
+/// Connected extrusion moves.
+#[derive(Debug, Clone, PartialEq)]
+struct Path {
+    points: Vec<[f32; 3]>,
+    /// The width of each segment.
+    widths: Vec<f32>,
+    height: f32,
+    feature: u16,
+    layer: u32,
+}
+
+impl Path {
+    fn continues_with(&self, m: &Move) -> bool {
+        let last = self.points[self.points.len() - 1];
+
+        self.layer == m.layer
+            && self.feature == m.feature
+            && distance(last, m.start) < 1e-4
+    }
+
+    fn length(&self) -> f32 {
+        self.points.windows(2).map(|w| distance(w[0], w[1])).sum()
+    }
+
+    /// Ramer-Douglas-Peucker simplification, giving each remaining segment
+    /// the length-weighted average width of the segments it replaced.
+    fn simplify(&mut self, tolerance: f32) {
+        let mut keep = vec![false; self.points.len()];
+        keep[0] = true;
+        keep[self.points.len() - 1] = true;
+
+        let mut stack = vec![(0, self.points.len() - 1)];
+
+        while let Some((first, last)) = stack.pop() {
+            let (a, b) = (self.points[first], self.points[last]);
+            let furthest = (first + 1..last)
+                .map(|i| (i, distance_to_segment(self.points[i], a, b)))
+                .fold(
+                    None,
+                    |best: Option<(usize, f32)>, candidate| match best {
+                        Some(best) if best.1 >= candidate.1 => Some(best),
+                        _ => Some(candidate),
+                    },
+                );
+
+            if let Some((i, d)) = furthest {
+                if d > tolerance {
+                    keep[i] = true;
+                    stack.push((first, i));
+                    stack.push((i, last));
+                }
+            }
+        }
+
+        let mut points = vec![self.points[0]];
+        let mut widths = Vec::new();
+        let mut weighted = 0.0;
+        let mut length = 0.0;
+
+        for i in 1..self.points.len() {
+            let segment = distance(self.points[i - 1], self.points[i]);
+            weighted += self.widths[i - 1] * segment;
+            length += segment;
+
+            if keep[i] {
+                points.push(self.points[i]);
+                widths.push(if length > 0.0 {
+                    weighted / length
+                } else {
+                    self.widths[i - 1]
+                });
+                weighted = 0.0;
+                length = 0.0;
+            }
+        }
+
+        self.points = points;
+        self.widths = widths;
+    }
+}
+
+/// Add a tube for a [`Path`] to the mesh.
+fn tube(path: &Path, mesh: &mut Mesh) {
+    let points = &path.points;
+    let last = points.len() - 1;
+    let side = |i: usize| side_of(points[i], points[i + 1]);
+
+    let mut previous = mesh.ring(path, points[0], side(0), path.widths[0], 1.0);
+    mesh.cap(previous, true);
+
+    for i in 1..last {
+        let (before, after) = (side(i - 1), side(i));
+        let turn = before[0] * after[0] + before[1] * after[1];
+        let width = (path.widths[i - 1] + path.widths[i]) / 2.0;
+
+        if turn < MeshBuilder::SHARP_TURN {
+            // end this tube and start another, instead of a huge miter
+            let end =
+                mesh.ring(path, points[i], before, path.widths[i - 1], 1.0);
+            mesh.join(previous, end);
+            mesh.cap(end, false);
+
+            previous = mesh.ring(path, points[i], after, path.widths[i], 1.0);
+            mesh.cap(previous, true);
+        } else {
+            let bisector =
+                normalize([before[0] + after[0], before[1] + after[1]]);
+            let cos = bisector[0] * before[0] + bisector[1] * before[1];
+            let miter = (1.0 / cos).min(MeshBuilder::MAX_MITER);
+
+            let ring = mesh.ring(path, points[i], bisector, width, miter);
+            mesh.join(previous, ring);
+            previous = ring;
+        }
+    }
+
+    let end = mesh.ring(
+        path,
+        points[last],
+        side(last - 1),
+        path.widths[last - 1],
+        1.0,
+    );
+    mesh.join(previous, end);
+    mesh.cap(end, false);
+}
+
+/// The unit vector pointing to the right of a move, in the X-Y plane.
+fn side_of(from: [f32; 3], to: [f32; 3]) -> [f32; 2] {
+    let direction = normalize([to[0] - from[0], to[1] - from[1]]);
+    [direction[1], -direction[0]]
+}
+
+fn normalize([x, y]: [f32; 2]) -> [f32; 2] {
+    let length = libm::hypotf(x, y);
+
+    if length > 0.0 {
+        [x / length, y / length]
+    } else {
+        [1.0, 0.0]
+    }
+}
+
+fn distance(a: [f32; 3], b: [f32; 3]) -> f32 {
+    let (dx, dy, dz) = (b[0] - a[0], b[1] - a[1], b[2] - a[2]);
+    libm::sqrtf(dx * dx + dy * dy + dz * dz)
+}
+
+fn distance_to_segment(p: [f32; 3], a: [f32; 3], b: [f32; 3]) -> f32 {
+    let ab = [b[0] - a[0], b[1] - a[1], b[2] - a[2]];
+    let ap = [p[0] - a[0], p[1] - a[1], p[2] - a[2]];
+    let length_squared = ab[0] * ab[0] + ab[1] * ab[1] + ab[2] * ab[2];
+
+    let t = if length_squared > 0.0 {
+        ((ap[0] * ab[0] + ap[1] * ab[1] + ap[2] * ab[2]) / length_squared)
+            .max(0.0)
+            .min(1.0)
+    } else {
+        0.0
+    };
+
+    distance(p, [a[0] + ab[0] * t, a[1] + ab[1] * t, a[2] + ab[2] * t])
+}
+
+/// An indexed triangle mesh, stored as flat buffers.
+///
+/// Vertex `i` is at `positions[3*i..3*i+3]`, with its normal at
+/// `normals[3*i..3*i+3]`, and was made by a move with the feature
+/// `features[i]` on layer `layers[i]`. Each triangle is three consecutive
+/// `indices`, wound counter-clockwise when viewed from outside.
+#[derive(Debug, Default, Clone, PartialEq)]
+pub struct Mesh {
+    /// The `[x, y, z]` coordinates of each vertex.
+    pub positions: Vec<f32>,
+    /// The unit normal of each vertex.
+    pub normals: Vec<f32>,
+    /// An index into [`Toolpath::features`] for each vertex.
+    pub features: Vec<u16>,
+    /// An index into [`Toolpath::layers`] for each vertex.
+    pub layers: Vec<u32>,
+    /// Indices into the vertex buffers, three per triangle.
+    pub indices: Vec<u32>,
+}
+
+impl Mesh {
+    /// The number of vertices.
+    pub fn vertex_count(&self) -> usize { self.positions.len() / 3 }
+
+    /// The number of triangles.
+    pub fn triangle_count(&self) -> usize { self.indices.len() / 3 }
+
+    /// Add a ring of 4 vertices (right, top, left, bottom) around a point on
+    /// the top of an extrusion, returning the index of the first one.
+    fn ring(
+        &mut self,
+        path: &Path,
+        point: [f32; 3],
+        side: [f32; 2],
+        width: f32,
+        miter: f32,
+    ) -> u32 {
+        let first = self.vertex_count() as u32;
+        let half_width = width / 2.0 * miter;
+        let half_height = path.height / 2.0;
+        let [x, y, z] = point;
+        let z = z - half_height;
+
+        let vertices = [
+            (
+                [x + side[0] * half_width, y + side[1] * half_width, z],
+                [side[0], side[1], 0.0],
+            ),
+            ([x, y, z + half_height], [0.0, 0.0, 1.0]),
+            (
+                [x - side[0] * half_width, y - side[1] * half_width, z],
+                [-side[0], -side[1], 0.0],
+            ),
+            ([x, y, z - half_height], [0.0, 0.0, -1.0]),
+        ];
+
+        for (position, normal) in &vertices {
+            self.positions.extend_from_slice(position);
+            self.normals.extend_from_slice(normal);
+            self.features.push(path.feature);
+            self.layers.push(path.layer);
+        }
+
+        first
+    }
+
+    /// Connect two rings with 4 quads.
+    fn join(&mut self, a: u32, b: u32) {
+        for k in 0..4 {
+            let next = (k + 1) % 4;
+            self.indices.extend_from_slice(&[a + k, b + next, a + next]);
+            self.indices.extend_from_slice(&[a + k, b + k, b + next]);
+        }
+    }
+
+    /// Close off the end of a tube.
+    fn cap(&mut self, ring: u32, start: bool) {
+        if start {
+            self.indices.extend_from_slice(&[ring, ring + 1, ring + 2]);
+            self.indices.extend_from_slice(&[ring, ring + 2, ring + 3]);
+        } else {
+            self.indices.extend_from_slice(&[ring, ring + 2, ring + 1]);
+            self.indices.extend_from_slice(&[ring, ring + 3, ring + 2]);
+        }
+    }
+
+    /// Add another [`Mesh`]'s vertices and triangles to this one.
+    pub fn append(&mut self, other: Mesh) {
+        let offset = self.vertex_count() as u32;
+
+        self.positions.extend(other.positions);
+        self.normals.extend(other.normals);
+        self.features.extend(other.features);
+        self.layers.extend(other.layers);
+        self.indices
+            .extend(other.indices.into_iter().map(|i| i + offset));
+    }
+
+    fn position(&self, index: u32) -> [f32; 3] {
+        let i = index as usize * 3;
+        [
+            self.positions[i],
+            self.positions[i + 1],
+            self.positions[i + 2],
+        ]
+    }
+
+    /// Write the mesh as a binary STL file.
+    pub fn write_stl<W: Write>(&self, mut writer: W) -> io::Result<()> {
+        let mut buffer = Vec::with_capacity(CHUNK_SIZE);
+        buffer.extend_from_slice(&[0; 80]);
+        buffer.extend_from_slice(&(self.triangle_count() as u32).to_le_bytes());
+
+        for triangle in self.indices.chunks_exact(3) {
+            let [a, b, c] = [
+                self.position(triangle[0]),
+                self.position(triangle[1]),
+                self.position(triangle[2]),
+            ];
+
+            for value in
+                face_normal(a, b, c).iter().chain(&a).chain(&b).chain(&c)
+            {
+                buffer.extend_from_slice(&value.to_le_bytes());
+            }
+            buffer.extend_from_slice(&[0, 0]);
+
+            if buffer.len() >= CHUNK_SIZE {
+                writer.write_all(&buffer)?;
+                buffer.clear();
+            }
+        }
+
+        writer.write_all(&buffer)?;
+        writer.flush()
+    }
+
+    /// Write the mesh as a Wavefront OBJ file.
+    pub fn write_obj<W: Write>(&self, writer: W) -> io::Result<()> {
+        let mut writer = io::BufWriter::with_capacity(CHUNK_SIZE, writer);
+
+        writeln!(writer, "o toolpath")?;
+        for v in self.positions.chunks_exact(3) {
+            writeln!(writer, "v {} {} {}", v[0], v[1], v[2])?;
+        }
+        for n in self.normals.chunks_exact(3) {
+            writeln!(writer, "vn {} {} {}", n[0], n[1], n[2])?;
+        }
+        for t in self.indices.chunks_exact(3) {
+            // OBJ indices start at 1
+            let (a, b, c) = (t[0] + 1, t[1] + 1, t[2] + 1);
+            writeln!(writer, "f {}//{} {}//{} {}//{}", a, a, b, b, c, c)?;
+        }
+
+        writer.flush()
+    }
+
+    /// Write the mesh as a binary glTF (GLB) file.
+    ///
+    /// The feature and layer of each vertex are stored as the custom
+    /// `_FEATURE` and `_LAYER` attributes, as floats because glTF doesn't
+    /// allow integer vertex attributes wider than 16 bits.
+    pub fn write_glb<W: Write>(&self, mut writer: W) -> io::Result<()> {
+        let mut binary = Vec::new();
+        let mut views = Vec::new();
+        let mut view = |binary: &mut Vec<u8>,
+                        values: &mut dyn Iterator<Item = [u8; 4]>,
+                        target: u32| {
+            let offset = binary.len();
+            for value in values {
+                binary.extend_from_slice(&value);
+            }
+            views.push(format!(
+                r#"{{"buffer":0,"byteOffset":{},"byteLength":{},"target":{}}}"#,
+                offset,
+                binary.len() - offset,
+                target
+            ));
+        };
+
+        const ARRAY_BUFFER: u32 = 34962;
+        const ELEMENT_ARRAY_BUFFER: u32 = 34963;
+
+        view(
+            &mut binary,
+            &mut self.positions.iter().map(|v| v.to_le_bytes()),
+            ARRAY_BUFFER,
+        );
+        view(
+            &mut binary,
+            &mut self.normals.iter().map(|v| v.to_le_bytes()),
+            ARRAY_BUFFER,
+        );
+        view(
+            &mut binary,
+            &mut self.features.iter().map(|&v| f32::from(v).to_le_bytes()),
+            ARRAY_BUFFER,
+        );
+        view(
+            &mut binary,
+            &mut self.layers.iter().map(|&v| (v as f32).to_le_bytes()),
+            ARRAY_BUFFER,
+        );
+        view(
+            &mut binary,
+            &mut self.indices.iter().map(|v| v.to_le_bytes()),
+            ELEMENT_ARRAY_BUFFER,
+        );
+
+        let json = if self.indices.is_empty() {
+            // accessors can't be empty, so there's nothing to describe
+            r#"{"asset":{"version":"2.0","generator":"gcode-rs"},"scene":0,"scenes":[{}]}"#.to_string()
+        } else {
+            let (min, max) = self.bounds();
+            let count = self.vertex_count();
+            let accessor = |view: usize,
+                            component: u32,
+                            count: usize,
+                            kind: &str| {
+                format!(
+                    r#"{{"bufferView":{},"componentType":{},"count":{},"type":"{}""#,
+                    view, component, count, kind
+                )
+            };
+            let accessors = [
+                format!(
+                    "{},\"min\":[{},{},{}],\"max\":[{},{},{}]}}",
+                    accessor(0, 5126, count, "VEC3"),
+                    min[0],
+                    min[1],
+                    min[2],
+                    max[0],
+                    max[1],
+                    max[2]
+                ),
+                format!("{}}}", accessor(1, 5126, count, "VEC3")),
+                format!("{}}}", accessor(2, 5126, count, "SCALAR")),
+                format!("{}}}", accessor(3, 5126, count, "SCALAR")),
+                format!(
+                    "{}}}",
+                    accessor(4, 5125, self.indices.len(), "SCALAR")
+                ),
+            ];
+
+            format!(
+                concat!(
+                    r#"{{"asset":{{"version":"2.0","generator":"gcode-rs"}},"#,
+                    r#""scene":0,"scenes":[{{"nodes":[0]}}],"nodes":[{{"mesh":0}}],"#,
+                    r#""meshes":[{{"primitives":[{{"attributes":{{"POSITION":0,"NORMAL":1,"_FEATURE":2,"_LAYER":3}},"indices":4,"mode":4}}]}}],"#,
+                    r#""buffers":[{{"byteLength":{}}}],"bufferViews":[{}],"accessors":[{}]}}"#,
+                ),
+                binary.len(),
+                views.join(","),
+                accessors.join(","),
+            )
+        };
+
+        let mut json = json.into_bytes();
+        while json.len() % 4 != 0 {
+            json.push(b' ');
+        }
+        while binary.len() % 4 != 0 {
+            binary.push(0);
+        }
+
+        let has_binary = !self.indices.is_empty();
+        let total =
+            12 + 8 + json.len() + if has_binary { 8 + binary.len() } else { 0 };
+
+        writer.write_all(b"glTF")?;
+        writer.write_all(&2_u32.to_le_bytes())?;
+        writer.write_all(&(total as u32).to_le_bytes())?;
+        writer.write_all(&(json.len() as u32).to_le_bytes())?;
+        writer.write_all(b"JSON")?;
+        writer.write_all(&json)?;
+        if has_binary {
+            writer.write_all(&(binary.len() as u32).to_le_bytes())?;
+            writer.write_all(b"BIN\0")?;
+            writer.write_all(&binary)?;
+        }
+
+        writer.flush()
+    }
+
+    /// The smallest and largest coordinates on each axis.
+    fn bounds(&self) -> ([f32; 3], [f32; 3]) {
+        let mut min = [f32::INFINITY; 3];
+        let mut max = [f32::NEG_INFINITY; 3];
+
+        for v in self.positions.chunks_exact(3) {
+            for axis in 0..3 {
+                min[axis] = min[axis].min(v[axis]);
+                max[axis] = max[axis].max(v[axis]);
+            }
+        }
+
+        (min, max)
+    }
+}
+
+/// How much output to accumulate before writing it out.
+const CHUNK_SIZE: usize = 64 * 1024;
+
+fn face_normal(a: [f32; 3], b: [f32; 3], c: [f32; 3]) -> [f32; 3] {
+    let u = [b[0] - a[0], b[1] - a[1], b[2] - a[2]];
+    let v = [c[0] - a[0], c[1] - a[1], c[2] - a[2]];
+    let n = [
+        u[1] * v[2] - u[2] * v[1],
+        u[2] * v[0] - u[0] * v[2],
+        u[0] * v[1] - u[1] * v[0],
+    ];
+    let length = libm::sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+
+    if length > 0.0 {
+        [n[0] / length, n[1] / length, n[2] / length]
+    } else {
+        [0.0, 0.0, 0.0]
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    /// A square perimeter on each of `layers` layers.
+    fn squares(layers: usize) -> String {
+        let mut src = String::from("G28\nG92 E0\nM82\n;TYPE:WALL-OUTER\n");
+        let mut e = 0.0;
+
+        for layer in 1..=layers {
+            src.push_str(&format!("G0 X0 Y0 Z{:.1}\n", layer as f32 * 0.2));
+            for &(x, y) in &[(10, 0), (10, 10), (0, 10), (0, 0)] {
+                e += 0.4;
+                src.push_str(&format!("G1 X{} Y{} E{:.2}\n", x, y, e));
+            }
+        }
+
+        src
+    }
+
+    /// The volume enclosed by a mesh, which is only meaningful if every
+    /// triangle faces outwards.
+    fn volume(mesh: &Mesh) -> f32 {
+        mesh.indices
+            .chunks_exact(3)
+            .map(|t| {
+                let [a, b, c] = [
+                    mesh.position(t[0]),
+                    mesh.position(t[1]),
+                    mesh.position(t[2]),
+                ];
+                (a[0] * (b[1] * c[2] - b[2] * c[1])
+                    - a[1] * (b[0] * c[2] - b[2] * c[0])
+                    + a[2] * (b[0] * c[1] - b[1] * c[0]))
+                    / 6.0
+            })
+            .sum()
+    }
+
+    #[test]
+    fn connected_moves_share_vertices() {
+        let toolpath = Toolpath::parse(&squares(1));
+
+        let mesh = MeshBuilder::new().build(&toolpath);
+
+        // 5 points around the square, one ring each
+        assert_eq!(mesh.vertex_count(), 5 * 4);
+        assert_eq!(mesh.triangle_count(), 4 * 8 + 2 * 2);
+        assert!(mesh
+            .indices
+            .iter()
+            .all(|&i| (i as usize) < mesh.vertex_count()));
+    }
+
+    #[test]
+    fn triangles_face_outwards() {
+        let toolpath = Toolpath::parse("G28\nG1 Z0.2\nG1 X10 E1\n");
+
+        let mesh = MeshBuilder::new().build(&toolpath);
+
+        // a diamond with diagonals `width` and 0.2, extruded 10mm
+        let width = extrusion_width(
+            &toolpath.moves[1],
+            &toolpath.layers[0],
+            PI * 1.75 * 1.75 / 4.0,
+        );
+        let expected = width * 0.2 / 2.0 * 10.0;
+        let got = volume(&mesh);
+        assert!(
+            (got - expected).abs() < 1e-3 * expected,
+            "{} != {}",
+            got,
+            expected
+        );
+    }
+
+    #[test]
+    fn width_matches_the_volume_of_filament() {
+        let toolpath = Toolpath::parse("G28\nG1 Z0.2\nG1 X100 E4.5\n");
+        let m = &toolpath.moves[1];
+
+        let width =
+            extrusion_width(m, &toolpath.layers[0], PI * 1.75 * 1.75 / 4.0);
+
+        // ~0.45mm is typical for a 0.4mm nozzle
+        assert!((width - 0.5).abs() < 0.1, "{}", width);
+    }
+
+    #[test]
+    fn layers_and_features_are_recorded_per_vertex() {
+        let toolpath = Toolpath::parse(&squares(3));
+
+        let mesh = MeshBuilder::new().build(&toolpath);
+
+        let mut layers = mesh.layers.clone();
+        layers.dedup();
+        assert_eq!(layers, &[0, 1, 2]);
+        assert!(mesh.features.iter().all(|&f| f == 1));
+    }
+
+    #[test]
+    fn a_tolerance_reduces_detail() {
+        let mut src = String::from("G28\nG1 Z0.2\n");
+        for i in 1..=1000 {
+            let x = i as f32 * 0.01;
+            src.push_str(&format!(
+                "G1 X{:.3} Y{:.4} E{:.4}\n",
+                x,
+                (x * 3.0).sin() * 0.001,
+                x * 0.05
+            ));
+        }
+        let toolpath = Toolpath::parse(&src);
+
+        let full = MeshBuilder::new().build(&toolpath);
+        let simplified =
+            MeshBuilder::new().with_tolerance(0.01).build(&toolpath);
+
+        assert_eq!(full.vertex_count(), 1001 * 4);
+        assert_eq!(simplified.vertex_count(), 2 * 4);
+    }
+
+    #[test]
+    fn sharp_turns_arent_mitred() {
+        let toolpath =
+            Toolpath::parse("G28\nG1 Z0.2\nG1 X10 E1\nG1 X0 Y0.5 E2\n");
+
+        let mesh = MeshBuilder::new().build(&toolpath);
+
+        // the tube is split at the hairpin, so it doesn't stick out
+        assert_eq!(mesh.vertex_count(), 4 * 4);
+        let (min, max) = mesh.bounds();
+        assert!(min[0] > -1.0 && max[0] < 11.0, "{:?} {:?}", min, max);
+    }
+
+    #[test]
+    fn export_formats() {
+        let mesh = MeshBuilder::new().build(&Toolpath::parse(&squares(2)));
+
+        let mut stl = Vec::new();
+        mesh.write_stl(&mut stl).unwrap();
+        assert_eq!(stl.len(), 84 + mesh.triangle_count() * 50);
+
+        let mut obj = Vec::new();
+        mesh.write_obj(&mut obj).unwrap();
+        let obj = String::from_utf8(obj).unwrap();
+        assert_eq!(
+            obj.lines().filter(|l| l.starts_with("v ")).count(),
+            mesh.vertex_count()
+        );
+        assert_eq!(
+            obj.lines().filter(|l| l.starts_with("f ")).count(),
+            mesh.triangle_count()
+        );
+
+        let mut glb = Vec::new();
+        mesh.write_glb(&mut glb).unwrap();
+        assert_eq!(&glb[..4], b"glTF");
+        let total = u32::from_le_bytes([glb[8], glb[9], glb[10], glb[11]]);
+        assert_eq!(total as usize, glb.len());
+        let json_len =
+            u32::from_le_bytes([glb[12], glb[13], glb[14], glb[15]]) as usize;
+        let json = std::str::from_utf8(&glb[20..20 + json_len]).unwrap();
+        assert!(json.contains(r#""_LAYER":3"#));
+        assert_eq!(glb.len() % 4, 0);
+
+        let mut empty = Vec::new();
+        Mesh::default().write_glb(&mut empty).unwrap();
+        assert_eq!(empty.len() % 4, 0);
+    }
+}
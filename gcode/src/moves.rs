@@ -0,0 +1,785 @@
+//! Turning a program into the straight-line moves a machine will make.
+//!
+//! A [`Resolver`] follows a program's [`ModalState`] and the extruder axis
+//! of a 3D printer (`E`, with `M82`/`M83` and `G92 E`), producing a
+//! [`Move`] for every motion command. Arcs are split into short straight
+//! segments, and moves are tagged with the layer they print and the feature
+//! (perimeter, infill, etc.) slicers announce with comments like
+//! `;TYPE:WALL-OUTER`.
+//!
+//! ```rust
+//! use gcode::moves::Toolpath;
+//!
+//! let src = "G28\nG90 M82\nG92 E0\nG1 Z0.2\nG1 X10 Y0 E1.5 F1200\nG0 X0 Y0\n";
+//! let toolpath = Toolpath::parse(src);
+//!
+//! assert_eq!(toolpath.moves.len(), 3);
+//! let extrusion = &toolpath.moves[1];
+//! assert!(extrusion.is_extrusion());
+//! assert_eq!(extrusion.end, [10.0, 0.0, 0.2]);
+//! assert_eq!(extrusion.extrusion, 1.5);
+//! assert_eq!(toolpath.layers[0].height, 0.2);
+//! ```
+
+use crate::{
+    buffers::{Buffer, Buffers},
+    state::{DistanceMode, ModalState, Motion, Position},
+    GCode, Line, Mnemonic, Span, Word,
+};
+use core::f32::consts::PI;
+use std::collections::VecDeque;
+
+/// A single straight-line move.
+#[derive(Debug, Copy, Clone, PartialEq)]
+pub struct Move {
+    /// Where the move started.
+    pub start: [f32; 3],
+    /// Where the move finished.
+    pub end: [f32; 3],
+    /// How much filament was pushed through the extruder, negative for a
+    /// retraction.
+    pub extrusion: f32,
+    /// The feed rate, if one has been set.
+    pub feed_rate: Option<f32>,
+    /// Was this a rapid (`G0`) move?
+    pub rapid: bool,
+    /// An index into [`Toolpath::layers`].
+    pub layer: u32,
+    /// An index into [`Toolpath::features`].
+    pub feature: u16,
+    /// The command this move came from.
+    pub span: Span,
+}
+
+impl Move {
+    /// The distance travelled.
+    pub fn length(&self) -> f32 {
+        let [dx, dy, dz] = self.delta();
+        libm::sqrtf(dx * dx + dy * dy + dz * dz)
+    }
+
+    /// The distance travelled in the X-Y plane.
+    pub fn xy_length(&self) -> f32 {
+        let [dx, dy, _] = self.delta();
+        libm::sqrtf(dx * dx + dy * dy)
+    }
+
+    /// Does this move deposit material?
+    pub fn is_extrusion(&self) -> bool {
+        self.extrusion > 0.0 && self.xy_length() > 0.0
+    }
+
+    fn delta(&self) -> [f32; 3] {
+        [
+            self.end[0] - self.start[0],
+            self.end[1] - self.start[1],
+            self.end[2] - self.start[2],
+        ]
+    }
+}
+
+/// A layer of a 3D print.
+#[derive(Debug, Copy, Clone, PartialEq)]
+pub struct Layer {
+    /// The height of the nozzle while printing this layer.
+    pub z: f32,
+    /// The distance from the previous layer.
+    pub height: f32,
+}
+
+/// Follows a program, turning motion commands into [`Move`]s.
+#[derive(Debug, Clone)]
+pub struct Resolver {
+    state: ModalState,
+    /// The extruder position, as an absolute value.
+    extruder: f32,
+    /// Set by `M83`, cleared by `M82`.
+    relative_extrusion: bool,
+    features: Vec<String>,
+    feature: u16,
+    layers: Vec<Layer>,
+    arc_segment_length: f32,
+}
+
+impl Resolver {
+    /// The default length of the straight segments arcs are split into.
+    pub const DEFAULT_ARC_SEGMENT_LENGTH: f32 = 0.5;
+    /// The layer height assumed when a print starts at `Z0`.
+    pub const DEFAULT_LAYER_HEIGHT: f32 = 0.2;
+    /// The most segments a single arc will be split into.
+    pub const MAX_ARC_SEGMENTS: usize = 256;
+
+    /// Create a new [`Resolver`] where nothing is known.
+    pub fn new() -> Self {
+        Resolver {
+            state: ModalState::new(),
+            extruder: 0.0,
+            relative_extrusion: false,
+            features: vec![String::new()],
+            feature: 0,
+            layers: Vec::new(),
+            arc_segment_length: Resolver::DEFAULT_ARC_SEGMENT_LENGTH,
+        }
+    }
+
+    /// Set the length of the straight segments arcs are split into.
+    pub fn with_arc_segment_length(self, arc_segment_length: f32) -> Self {
+        Resolver {
+            arc_segment_length: arc_segment_length.max(1e-3),
+            ..self
+        }
+    }
+
+    /// The current [`ModalState`].
+    pub fn state(&self) -> &ModalState { &self.state }
+
+    /// The names of every feature seen so far. The first is always the empty
+    /// string, used before a slicer has announced any feature.
+    pub fn features(&self) -> &[String] { &self.features }
+
+    /// Every layer seen so far.
+    pub fn layers(&self) -> &[Layer] { &self.layers }
+
+    /// Look for a slicer comment announcing the next feature, such as
+    /// `;TYPE:WALL-OUTER` (Cura and PrusaSlicer) or `; FEATURE: Infill`.
+    pub fn comment(&mut self, text: &str) {
+        let body = text
+            .trim_start_matches(|c| c == ';' || c == '(')
+            .trim_end_matches(')')
+            .trim();
+        let name = ["TYPE:", "FEATURE:"]
+            .iter()
+            .find_map(|prefix| strip_prefix_ignore_case(body, prefix));
+
+        if let Some(name) = name {
+            self.feature = self.intern_feature(name.trim());
+        }
+    }
+
+    fn intern_feature(&mut self, name: &str) -> u16 {
+        if let Some(index) = self.features.iter().position(|f| f == name) {
+            return index as u16;
+        }
+
+        if self.features.len() > usize::from(u16::max_value()) {
+            return 0;
+        }
+        self.features.push(name.to_string());
+        (self.features.len() - 1) as u16
+    }
+
+    /// Process every comment and [`GCode`] in a [`Line`].
+    pub fn line<'input, B, F>(&mut self, line: &Line<'input, B>, mut on_move: F)
+    where
+        B: Buffers<'input>,
+        F: FnMut(Move),
+    {
+        for comment in line.comments() {
+            self.comment(comment.value);
+        }
+        for gcode in line.gcodes() {
+            self.apply(gcode, &mut on_move);
+        }
+    }
+
+    /// Update the state for a [`GCode`], emitting any [`Move`]s it makes.
+    pub fn apply<A, F>(&mut self, gcode: &GCode<A>, mut on_move: F)
+    where
+        A: Buffer<Word>,
+        F: FnMut(Move),
+    {
+        match (gcode.mnemonic(), gcode.major_number(), gcode.minor_number()) {
+            (Mnemonic::Miscellaneous, 82, 0) => self.relative_extrusion = false,
+            (Mnemonic::Miscellaneous, 83, 0) => self.relative_extrusion = true,
+            (Mnemonic::General, 92, 0) => {
+                if let Some(e) = gcode.value_for('E') {
+                    self.extruder = e;
+                }
+                self.state.apply(gcode);
+            },
+            (Mnemonic::General, n @ 0..=3, 0) => {
+                self.motion(gcode, n, &mut on_move)
+            },
+            _ => self.state.apply(gcode),
+        }
+    }
+
+    fn motion<A, F>(&mut self, gcode: &GCode<A>, number: u32, on_move: &mut F)
+    where
+        A: Buffer<Word>,
+        F: FnMut(Move),
+    {
+        let start = self.state.position;
+        let relative = self.state.distance_mode == Some(DistanceMode::Relative);
+        self.state.apply(gcode);
+        let end = self.state.position;
+
+        let extrusion = match gcode.value_for('E') {
+            Some(e) if relative || self.relative_extrusion => e,
+            Some(e) => e - self.extruder,
+            None => 0.0,
+        };
+        self.extruder += extrusion;
+
+        // we can't draw a move until we know where it started
+        let (start, end) = match (known(start), known(end)) {
+            (Some(start), Some(end)) => (start, end),
+            _ => return,
+        };
+
+        if extrusion > 0.0 && start[..2] != end[..2] {
+            self.enter_layer(end[2]);
+        }
+
+        let template = Move {
+            start,
+            end,
+            extrusion,
+            feed_rate: self.state.feed_rate,
+            rapid: number == 0,
+            layer: self.layers.len().saturating_sub(1) as u32,
+            feature: self.feature,
+            span: gcode.span(),
+        };
+
+        match Motion::from_major_number(number) {
+            Some(Motion::ClockwiseArc) | Some(Motion::CounterClockwiseArc) => {
+                let clockwise = number == 2;
+                self.arc(template, gcode, clockwise, on_move);
+            },
+            _ => on_move(template),
+        }
+    }
+
+    /// Start a new layer if material is being deposited above the current
+    /// one.
+    fn enter_layer(&mut self, z: f32) {
+        const EPSILON: f32 = 1e-4;
+
+        let previous = self.layers.last().map(|layer| layer.z);
+
+        match previous {
+            Some(previous) if z <= previous + EPSILON => {},
+            Some(previous) => self.layers.push(Layer {
+                z,
+                height: z - previous,
+            }),
+            None => self.layers.push(Layer {
+                z,
+                height: if z > EPSILON {
+                    z
+                } else {
+                    Resolver::DEFAULT_LAYER_HEIGHT
+                },
+            }),
+        }
+    }
+
+    /// Split an arc in the X-Y plane into straight segments.
+    fn arc<A, F>(
+        &self,
+        whole: Move,
+        gcode: &GCode<A>,
+        clockwise: bool,
+        on_move: &mut F,
+    ) where
+        A: Buffer<Word>,
+        F: FnMut(Move),
+    {
+        let [x0, y0, z0] = whole.start;
+        let [x1, y1, z1] = whole.end;
+        let cx = x0 + gcode.value_for('I').unwrap_or(0.0);
+        let cy = y0 + gcode.value_for('J').unwrap_or(0.0);
+        let radius = libm::hypotf(x0 - cx, y0 - cy);
+
+        let start_angle = libm::atan2f(y0 - cy, x0 - cx);
+        let end_angle = libm::atan2f(y1 - cy, x1 - cx);
+        let mut sweep = end_angle - start_angle;
+
+        if clockwise && sweep >= 0.0 {
+            sweep -= 2.0 * PI;
+        } else if !clockwise && sweep <= 0.0 {
+            sweep += 2.0 * PI;
+        }
+
+        let arc_length = libm::fabsf(sweep) * radius;
+        let segments = libm::ceilf(arc_length / self.arc_segment_length);
+        let segments =
+            (segments as usize).max(1).min(Resolver::MAX_ARC_SEGMENTS);
+
+        let mut previous = whole.start;
+
+        for i in 1..=segments {
+            let t = i as f32 / segments as f32;
+            let end = if i == segments {
+                whole.end
+            } else {
+                let angle = start_angle + sweep * t;
+                [
+                    cx + radius * libm::cosf(angle),
+                    cy + radius * libm::sinf(angle),
+                    z0 + (z1 - z0) * t,
+                ]
+            };
+
+            on_move(Move {
+                start: previous,
+                end,
+                extrusion: whole.extrusion / segments as f32,
+                ..whole
+            });
+            previous = end;
+        }
+    }
+}
+
+impl Default for Resolver {
+    fn default() -> Resolver { Resolver::new() }
+}
+
+fn known(position: Position) -> Option<[f32; 3]> {
+    Some([position.x?, position.y?, position.z.unwrap_or(0.0)])
+}
+
+fn strip_prefix_ignore_case<'a>(
+    text: &'a str,
+    prefix: &str,
+) -> Option<&'a str> {
+    let head = text.get(..prefix.len())?;
+
+    if head.eq_ignore_ascii_case(prefix) {
+        Some(&text[prefix.len()..])
+    } else {
+        None
+    }
+}
+
+/// Every [`Move`] in a program, along with the layers and features they
+/// refer to.
+#[derive(Debug, Default, Clone, PartialEq)]
+pub struct Toolpath {
+    /// The moves, in the order they are made.
+    pub moves: Vec<Move>,
+    /// The layers the moves were grouped into.
+    pub layers: Vec<Layer>,
+    /// The feature names, indexed by [`Move::feature`].
+    pub features: Vec<String>,
+}
+
+impl Toolpath {
+    /// Parse a program and resolve all of its moves.
+    pub fn parse(src: &str) -> Toolpath {
+        Toolpath::from_lines(
+            Resolver::new(),
+            crate::full_parse_with_callbacks(src, crate::Nop),
+        )
+    }
+
+    /// Resolve the moves in some already-parsed [`Line`]s.
+    pub fn from_lines<'input, I, B>(
+        mut resolver: Resolver,
+        lines: I,
+    ) -> Toolpath
+    where
+        I: IntoIterator<Item = Line<'input, B>>,
+        B: Buffers<'input>,
+    {
+        let mut moves = Vec::new();
+
+        for line in lines {
+            resolver.line(&line, |m| moves.push(m));
+        }
+
+        Toolpath {
+            moves,
+            layers: resolver.layers,
+            features: resolver.features,
+        }
+    }
+}
+
+/// What kind of motion a move was.
+#[derive(Debug, Copy, Clone, PartialEq, Eq, Hash)]
+#[repr(u8)]
+pub enum MoveKind {
+    /// A rapid (`G0`) move.
+    Rapid = 0,
+    /// A cutting or travel move at the feed rate.
+    Feed = 1,
+    /// A feed move which pushes filament through the extruder.
+    Extrude = 2,
+    /// A feed move which pulls filament back.
+    Retract = 3,
+}
+
+impl MoveKind {
+    /// Classify a [`Move`].
+    pub fn of(m: &Move) -> MoveKind {
+        if m.rapid {
+            MoveKind::Rapid
+        } else if m.extrusion > 0.0 {
+            MoveKind::Extrude
+        } else if m.extrusion < 0.0 {
+            MoveKind::Retract
+        } else {
+            MoveKind::Feed
+        }
+    }
+}
+
+/// A batch of [`Move`]s stored as a structure of arrays.
+///
+/// Every column has the same length, so the `i`'th move is made up of the
+/// `i`'th element of each one. Feed rates which haven't been set are
+/// `NaN`. Consecutive moves from the same command (e.g. the segments of an
+/// arc) share an entry in [`MoveChunk::spans()`].
+#[derive(Debug, Default, Clone, PartialEq)]
+pub struct MoveChunk {
+    start: [Vec<f32>; 3],
+    end: [Vec<f32>; 3],
+    extrusion: Vec<f32>,
+    feed_rate: Vec<f32>,
+    kind: Vec<MoveKind>,
+    span_index: Vec<u32>,
+    spans: Vec<Span>,
+}
+
+impl MoveChunk {
+    /// Create an empty [`MoveChunk`] with room for `capacity` moves.
+    pub fn with_capacity(capacity: usize) -> Self {
+        let column = || Vec::with_capacity(capacity);
+
+        MoveChunk {
+            start: [column(), column(), column()],
+            end: [column(), column(), column()],
+            extrusion: column(),
+            feed_rate: column(),
+            kind: Vec::with_capacity(capacity),
+            span_index: Vec::with_capacity(capacity),
+            spans: Vec::new(),
+        }
+    }
+
+    /// The number of moves.
+    pub fn len(&self) -> usize { self.kind.len() }
+
+    /// Is the chunk empty?
+    pub fn is_empty(&self) -> bool { self.kind.is_empty() }
+
+    /// The X coordinate each move started at.
+    pub fn start_x(&self) -> &[f32] { &self.start[0] }
+
+    /// The Y coordinate each move started at.
+    pub fn start_y(&self) -> &[f32] { &self.start[1] }
+
+    /// The Z coordinate each move started at.
+    pub fn start_z(&self) -> &[f32] { &self.start[2] }
+
+    /// The X coordinate each move finished at.
+    pub fn end_x(&self) -> &[f32] { &self.end[0] }
+
+    /// The Y coordinate each move finished at.
+    pub fn end_y(&self) -> &[f32] { &self.end[1] }
+
+    /// The Z coordinate each move finished at.
+    pub fn end_z(&self) -> &[f32] { &self.end[2] }
+
+    /// How much filament each move extruded (see [`Move::extrusion`]).
+    pub fn extrusion(&self) -> &[f32] { &self.extrusion }
+
+    /// Each move's feed rate, or `NaN` if none had been set.
+    pub fn feed_rate(&self) -> &[f32] { &self.feed_rate }
+
+    /// The kind of each move.
+    pub fn kind(&self) -> &[MoveKind] { &self.kind }
+
+    /// An index into [`MoveChunk::spans()`] for each move.
+    pub fn span_index(&self) -> &[u32] { &self.span_index }
+
+    /// The commands the moves in this chunk came from.
+    pub fn spans(&self) -> &[Span] { &self.spans }
+
+    /// Where the `index`'th move came from.
+    pub fn span(&self, index: usize) -> Option<Span> {
+        let span_index = *self.span_index.get(index)?;
+        self.spans.get(span_index as usize).copied()
+    }
+
+    /// Add a move to the end of the chunk.
+    pub fn push(&mut self, m: &Move) {
+        for axis in 0..3 {
+            self.start[axis].push(m.start[axis]);
+            self.end[axis].push(m.end[axis]);
+        }
+        self.extrusion.push(m.extrusion);
+        self.feed_rate.push(m.feed_rate.unwrap_or(f32::NAN));
+        self.kind.push(MoveKind::of(m));
+
+        if self.spans.last() != Some(&m.span) {
+            self.spans.push(m.span);
+        }
+        self.span_index.push((self.spans.len() - 1) as u32);
+    }
+
+    /// Remove every move, keeping the allocated memory.
+    pub fn clear(&mut self) {
+        for column in self.start.iter_mut().chain(self.end.iter_mut()) {
+            column.clear();
+        }
+        self.extrusion.clear();
+        self.feed_rate.clear();
+        self.kind.clear();
+        self.span_index.clear();
+        self.spans.clear();
+    }
+}
+
+/// Resolves a program's moves in fixed-size [`MoveChunk`]s.
+///
+/// The same chunk is refilled by each call to [`MoveChunks::next_chunk()`],
+/// so no memory is allocated once the program is underway.
+///
+/// ```rust
+/// use gcode::moves::{MoveChunks, MoveKind};
+///
+/// let src = "G28\nG1 X10 F600\nG2 X20 I5\nG0 X0 Y0\n";
+/// let mut chunks = MoveChunks::parse(src).with_chunk_size(4);
+///
+/// let mut distance = 0.0;
+/// let mut rapids = 0;
+///
+/// while let Some(chunk) = chunks.next_chunk() {
+///     assert!(chunk.len() <= 4);
+///     // columns can be processed in bulk
+///     for i in 0..chunk.len() {
+///         let dx = chunk.end_x()[i] - chunk.start_x()[i];
+///         let dy = chunk.end_y()[i] - chunk.start_y()[i];
+///         distance += (dx * dx + dy * dy).sqrt();
+///     }
+///     rapids += chunk.kind().iter().filter(|&&k| k == MoveKind::Rapid).count();
+/// }
+///
+/// assert_eq!(rapids, 1);
+/// // 10mm, a semicircle with radius 5, then 20mm back
+/// assert!((distance - (30.0 + 5.0 * std::f32::consts::PI)).abs() < 0.1);
+/// ```
+#[derive(Debug)]
+pub struct MoveChunks<I> {
+    lines: I,
+    resolver: Resolver,
+    chunk: MoveChunk,
+    chunk_size: usize,
+    /// Moves which didn't fit into the last chunk.
+    overflow: VecDeque<Move>,
+}
+
+impl<'input> MoveChunks<Box<dyn Iterator<Item = Line<'input>> + 'input>> {
+    /// Parse a program and resolve its moves in chunks.
+    pub fn parse(src: &'input str) -> Self {
+        MoveChunks::new(
+            Resolver::new(),
+            Box::new(crate::full_parse_with_callbacks(src, crate::Nop)),
+        )
+    }
+}
+
+impl<'input, I, B> MoveChunks<I>
+where
+    I: Iterator<Item = Line<'input, B>>,
+    B: Buffers<'input>,
+{
+    /// The default number of moves in each chunk.
+    pub const DEFAULT_CHUNK_SIZE: usize = 1024;
+
+    /// Resolve the moves in some [`Line`]s.
+    pub fn new(resolver: Resolver, lines: I) -> Self {
+        MoveChunks {
+            lines,
+            resolver,
+            chunk: MoveChunk::with_capacity(Self::DEFAULT_CHUNK_SIZE),
+            chunk_size: Self::DEFAULT_CHUNK_SIZE,
+            overflow: VecDeque::new(),
+        }
+    }
+
+    /// Set the number of moves in each chunk.
+    pub fn with_chunk_size(self, chunk_size: usize) -> Self {
+        let chunk_size = chunk_size.max(1);
+
+        MoveChunks {
+            chunk: MoveChunk::with_capacity(chunk_size),
+            chunk_size,
+            ..self
+        }
+    }
+
+    /// The [`Resolver`], for looking up layers and features.
+    pub fn resolver(&self) -> &Resolver { &self.resolver }
+
+    /// Resolve the next chunk of moves. Every chunk except the last is
+    /// full.
+    pub fn next_chunk(&mut self) -> Option<&MoveChunk> {
+        let MoveChunks {
+            ref mut lines,
+            ref mut resolver,
+            ref mut chunk,
+            ref mut overflow,
+            chunk_size,
+        } = *self;
+
+        chunk.clear();
+
+        while chunk.len() < chunk_size {
+            if let Some(m) = overflow.pop_front() {
+                chunk.push(&m);
+                continue;
+            }
+
+            let line = match lines.next() {
+                Some(line) => line,
+                None => break,
+            };
+
+            resolver.line(&line, |m| {
+                if chunk.len() < chunk_size {
+                    chunk.push(&m);
+                } else {
+                    overflow.push_back(m);
+                }
+            });
+        }
+
+        if chunk.is_empty() {
+            None
+        } else {
+            Some(chunk)
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn relative_and_absolute_extrusion() {
+        let src = "G90\nG0 X0 Y0 Z0.3\nM82\nG1 X1 E2\nG1 X2 E3\nG92 E0\nG1 X3 \
+                   E0.5\nM83\nG1 X4 E0.25\nG1 X5 E0.25\nG1 E-1\n";
+
+        let got: Vec<_> = Toolpath::parse(src)
+            .moves
+            .iter()
+            .map(|m| m.extrusion)
+            .collect();
+
+        assert_eq!(got, &[2.0, 1.0, 0.5, 0.25, 0.25, -1.0]);
+    }
+
+    #[test]
+    fn layers_start_when_extruding_higher_up() {
+        let src = "G0 X0 Y0 Z0.2\nG1 X10 E1\nG0 Z1.0\nG0 X0 Z0.4\nG1 X10 \
+                   E2\nG0 Z0.6\nG1 X0 E3\n";
+
+        let toolpath = Toolpath::parse(src);
+
+        let heights: Vec<_> = toolpath.layers.iter().map(|l| l.z).collect();
+        assert_eq!(heights, &[0.2, 0.4, 0.6]);
+        assert!((toolpath.layers[1].height - 0.2).abs() < 1e-6);
+        let layers: Vec<_> = toolpath.moves.iter().map(|m| m.layer).collect();
+        // the z-hop between layers doesn't start a new one
+        assert_eq!(layers, &[0, 0, 0, 1, 1, 2]);
+    }
+
+    #[test]
+    fn features_come_from_slicer_comments() {
+        let src = "G0 X0 Y0 Z0.2\n;TYPE:WALL-OUTER\nG1 X10 E1\n; FEATURE: \
+                   Infill\nG1 X0 E2\n;TYPE:WALL-OUTER\nG1 X10 E3\n";
+
+        let toolpath = Toolpath::parse(src);
+
+        assert_eq!(toolpath.features, &["", "WALL-OUTER", "Infill"]);
+        let features: Vec<_> =
+            toolpath.moves.iter().map(|m| m.feature).collect();
+        assert_eq!(features, &[1, 2, 1]);
+    }
+
+    #[test]
+    fn arcs_are_split_into_segments() {
+        let src = "G0 X10 Y0 Z0\nG3 X-10 Y0 I-10 J0 E10\n";
+
+        let toolpath = Toolpath::parse(src);
+
+        let arc = &toolpath.moves[..];
+        // half of a circle with radius 10, in 0.5mm pieces
+        assert_eq!(arc.len(), 63);
+        for segment in arc {
+            let [x, y, _] = segment.end;
+            assert!((libm::hypotf(x, y) - 10.0).abs() < 1e-3);
+            // counter-clockwise from (10, 0) to (-10, 0) goes through +Y
+            assert!(y >= -1e-3);
+        }
+        let total: f32 = arc.iter().map(|m| m.extrusion).sum();
+        assert!((total - 10.0).abs() < 1e-3);
+        assert_eq!(arc.last().unwrap().end, [-10.0, 0.0, 0.0]);
+    }
+
+    #[test]
+    fn moves_from_an_unknown_position_are_skipped() {
+        let toolpath = Toolpath::parse("G1 X5 Y0 E1\nG1 Y5 E2\n");
+
+        assert_eq!(toolpath.moves.len(), 1);
+        assert_eq!(toolpath.moves[0].start, [5.0, 0.0, 0.0]);
+        assert_eq!(toolpath.moves[0].end, [5.0, 5.0, 0.0]);
+    }
+
+    #[test]
+    fn chunks_match_the_toolpath() {
+        let src = include_str!("../tests/data/program_3.gcode");
+        let toolpath = Toolpath::parse(src);
+        let mut chunks = MoveChunks::parse(src).with_chunk_size(100);
+        let mut got = Vec::new();
+
+        while let Some(chunk) = chunks.next_chunk() {
+            for i in 0..chunk.len() {
+                got.push((
+                    [
+                        chunk.start_x()[i],
+                        chunk.start_y()[i],
+                        chunk.start_z()[i],
+                    ],
+                    [chunk.end_x()[i], chunk.end_y()[i], chunk.end_z()[i]],
+                    chunk.extrusion()[i],
+                    chunk.kind()[i],
+                    chunk.span(i).unwrap(),
+                ));
+            }
+        }
+
+        let expected: Vec<_> = toolpath
+            .moves
+            .iter()
+            .map(|m| (m.start, m.end, m.extrusion, MoveKind::of(m), m.span))
+            .collect();
+        assert!(!expected.is_empty());
+        assert_eq!(got, expected);
+    }
+
+    #[test]
+    fn arcs_can_overflow_a_chunk() {
+        let src = "G0 X10 Y0 Z0\nG1 X20\nG3 X-10 Y0 I-15 J0\nG1 X-20\n";
+        let total = Toolpath::parse(src).moves.len();
+        let mut chunks = MoveChunks::parse(src).with_chunk_size(8);
+        let mut sizes = Vec::new();
+        let mut spans = 0;
+
+        while let Some(chunk) = chunks.next_chunk() {
+            sizes.push(chunk.len());
+            spans += chunk.spans().len();
+        }
+
+        assert_eq!(sizes.iter().sum::<usize>(), total);
+        assert!(sizes[..sizes.len() - 1].iter().all(|&size| size == 8));
+        // the arc's segments share a span within each chunk
+        assert!(spans < total);
+    }
+}
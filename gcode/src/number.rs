@@ -0,0 +1,171 @@
+//! Converting the text of a [`TokenType::Number`] into a value.
+//!
+//! By default this defers to `core`'s float parsing, which is correctly
+//! rounded but pulls a fair amount of code into the final binary. Enabling
+//! the `compact-float` feature swaps it for a much smaller parser which
+//! accumulates the digits in an integer and scales by an exact power of ten.
+//! For the sort of numbers found in g-code (at most 15 significant digits)
+//! the result is within 1 ULP of the correctly rounded value, and usually
+//! identical.
+//!
+//! [`TokenType::Number`]: crate::lexer::TokenType::Number
+
+/// Parse an optional sign followed by digits containing at most one decimal
+/// point, returning `None` if there are no digits.
+pub(crate) fn parse(text: &str) -> Option<f32> { imp::parse(text) }
+
+#[cfg(not(feature = "compact-float"))]
+mod imp {
+    pub(super) fn parse(text: &str) -> Option<f32> { text.parse().ok() }
+}
+
+#[cfg(feature = "compact-float")]
+use self::compact as imp;
+
+#[cfg_attr(not(feature = "compact-float"), allow(dead_code))]
+mod compact {
+    /// Every power of ten which can be exactly represented by a `f64`.
+    const POWERS_OF_TEN: [f64; 23] = [
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12,
+        1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+    ];
+
+    /// Any more digits than this and the mantissa may not be exactly
+    /// representable as a `f64`.
+    const MAX_MANTISSA: u64 = 1 << 53;
+
+    pub(super) fn parse(text: &str) -> Option<f32> {
+        let bytes = text.as_bytes();
+        let (negative, digits) = match bytes.first() {
+            Some(b'-') => (true, &bytes[1..]),
+            Some(b'+') => (false, &bytes[1..]),
+            _ => (false, bytes),
+        };
+
+        let mut mantissa: u64 = 0;
+        // the value is mantissa * 10^exponent
+        let mut exponent: i32 = 0;
+        let mut seen_digit = false;
+        let mut seen_decimal = false;
+
+        for &b in digits {
+            match b {
+                b'0'..=b'9' => {
+                    seen_digit = true;
+                    let digit = u64::from(b - b'0');
+
+                    if mantissa < MAX_MANTISSA / 10 {
+                        mantissa = mantissa * 10 + digit;
+                        if seen_decimal {
+                            exponent -= 1;
+                        }
+                    } else if !seen_decimal {
+                        // drop insignificant digits, remembering the
+                        // magnitude they contributed
+                        exponent += 1;
+                    }
+                },
+                b'.' if !seen_decimal => seen_decimal = true,
+                _ => return None,
+            }
+        }
+
+        if !seen_digit {
+            return None;
+        }
+
+        let mut value = mantissa as f64;
+        while exponent > 22 {
+            value *= 1e22;
+            exponent -= 22;
+        }
+        while exponent < -22 {
+            value /= 1e22;
+            exponent += 22;
+        }
+        if exponent >= 0 {
+            value *= POWERS_OF_TEN[exponent as usize];
+        } else {
+            value /= POWERS_OF_TEN[(-exponent) as usize];
+        }
+
+        let value = value as f32;
+        Some(if negative { -value } else { value })
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::prelude::v1::*;
+
+    /// How many representable `f32`s lie between two numbers.
+    fn ulps(a: f32, b: f32) -> u32 {
+        (a.to_bits() as i64 - b.to_bits() as i64).abs() as u32
+    }
+
+    #[test]
+    fn typical_numbers() {
+        let inputs = [
+            "0",
+            "1",
+            "-1",
+            "+1",
+            "90",
+            "01",
+            "50.0",
+            "-10",
+            "1.5",
+            ".5",
+            "5.",
+            "-.25",
+            "-0.5",
+            "-0.001",
+            "-0.999",
+            "0.001",
+            "3.14159",
+            "123.456",
+            "-2.3456789",
+            "10000000",
+            "0.1",
+            "0.2",
+            "0.3",
+            "99999.9999",
+            "1234567890123456789012",
+        ];
+
+        for &input in &inputs {
+            let expected: f32 = input.parse().unwrap();
+
+            let got = parse(input).unwrap();
+            let compact = compact::parse(input).unwrap();
+
+            assert!(ulps(got, expected) <= 1, "{}", input);
+            assert!(ulps(compact, expected) <= 1, "{}", input);
+        }
+    }
+
+    #[test]
+    fn compact_parser_matches_core_for_gcode_style_numbers() {
+        for i in -20_000_i32..20_000 {
+            // format from the sign and magnitude, so -0.5 isn't "0.500"
+            let sign = if i < 0 { "-" } else { "" };
+            let text =
+                format!("{}{}.{:03}", sign, i.abs() / 1000, i.abs() % 1000);
+
+            let expected: f32 = text.parse().unwrap();
+            let got = compact::parse(&text).unwrap();
+
+            assert_eq!(got, expected, "{}", text);
+            assert_eq!(got.is_sign_negative(), i < 0, "{}", text);
+        }
+    }
+
+    #[test]
+    fn numbers_need_digits() {
+        for &input in &["", "-", "+", ".", "-.", "1.2.3", "1-"] {
+            assert_eq!(parse(input), None, "{:?}", input);
+            assert_eq!(compact::parse(input), None, "{:?}", input);
+        }
+    }
+}
@@ -0,0 +1,457 @@
+//! Lines which own their data, so they can outlive the text they were
+//! parsed from.
+//!
+//! A [`Line`] borrows its comments from the source text, which makes it
+//! awkward to send lines to another thread, keep them in an async task, or
+//! hand them to a language without a borrow checker. An [`OwnedParser`]
+//! instead takes shared ownership of the text (e.g. an `Arc<str>`) and
+//! produces [`Batch`]es of [`OwnedLine`]s, where comments are stored as
+//! [`Span`]s into that text.
+//!
+//! Each [`Batch`] holds a single reference to the text, no matter how many
+//! lines it contains, so the reference count is only touched once per batch.
+//!
+//! ```rust
+//! use gcode::owned::{Batch, OwnedParser};
+//! use std::{sync::Arc, thread};
+//!
+//! let src: Arc<str> = Arc::from("G90 (absolute)\nG01 X5\nG01 Y10 ; done\n");
+//! let parser = OwnedParser::new(src, gcode::Nop).with_batch_size(2);
+//!
+//! let workers: Vec<_> = parser
+//!     .map(|batch: Batch| {
+//!         thread::spawn(move || {
+//!             batch
+//!                 .lines()
+//!                 .iter()
+//!                 .flat_map(|line| line.comments(batch.source()))
+//!                 .map(|comment| comment.value.to_string())
+//!                 .collect::<Vec<_>>()
+//!         })
+//!     })
+//!     .collect();
+//!
+//! let comments: Vec<_> = workers
+//!     .into_iter()
+//!     .flat_map(|worker| worker.join().unwrap())
+//!     .collect();
+//! assert_eq!(comments, &["(absolute)", "; done"]);
+//! ```
+
+use crate::{
+    buffers::VecBuffers, scan, streaming::StreamState, Callbacks, Comment,
+    GCode, Line, Span, Word,
+};
+use std::{rc::Rc, sync::Arc};
+
+/// Text which can be cheaply shared between several owners.
+///
+/// This is implemented for `Arc<str>` (for use across threads) and `Rc<str>`
+/// (when everything stays on one thread, e.g. WebAssembly), as well as
+/// their `String` equivalents so an existing `String` doesn't need to be
+/// copied.
+pub trait SharedText: Clone {
+    /// The text itself.
+    fn text(&self) -> &str;
+}
+
+impl SharedText for Arc<str> {
+    fn text(&self) -> &str { self }
+}
+
+impl SharedText for Arc<String> {
+    fn text(&self) -> &str { self }
+}
+
+impl SharedText for Rc<str> {
+    fn text(&self) -> &str { self }
+}
+
+impl SharedText for Rc<String> {
+    fn text(&self) -> &str { self }
+}
+
+/// A [`Line`] which doesn't borrow from the text it was parsed from.
+///
+/// Comments are stored as [`Span`]s, so the original text needs to be
+/// passed in to read them (see [`OwnedLine::comments()`]).
+#[derive(Debug, Default, Clone, PartialEq)]
+#[cfg_attr(
+    feature = "serde-1",
+    derive(serde_derive::Serialize, serde_derive::Deserialize)
+)]
+pub struct OwnedLine {
+    gcodes: Vec<GCode>,
+    comments: Vec<Span>,
+    line_number: Option<Word>,
+    span: Span,
+}
+
+impl OwnedLine {
+    /// All [`GCode`]s in this line.
+    pub fn gcodes(&self) -> &[GCode] { &self.gcodes }
+
+    /// Where each comment is located in the source text.
+    pub fn comment_spans(&self) -> &[Span] { &self.comments }
+
+    /// All [`Comment`]s in this line, looked up in the `source` text the
+    /// line was parsed from.
+    pub fn comments<'input>(
+        &'input self,
+        source: &'input str,
+    ) -> impl Iterator<Item = Comment<'input>> + 'input {
+        self.comments.iter().map(move |&span| Comment {
+            value: span.get_text(source).unwrap_or_default(),
+            span,
+        })
+    }
+
+    /// The line number, if there was one.
+    pub fn line_number(&self) -> Option<Word> { self.line_number }
+
+    /// Get the [`OwnedLine`]'s position in its source text.
+    pub fn span(&self) -> Span { self.span }
+
+    /// Borrow the source text again, turning this back into a normal
+    /// [`Line`].
+    pub fn to_line<'input>(&self, source: &'input str) -> Line<'input> {
+        let mut line = Line::default();
+
+        for &span in &self.comments {
+            let value = span.get_text(source).unwrap_or_default();
+            let _ = line.push_comment(Comment { value, span });
+        }
+        for gcode in &self.gcodes {
+            let _ = line.push_gcode(gcode.clone());
+        }
+        line.set_line_number(self.line_number);
+
+        line
+    }
+}
+
+impl OwnedLine {
+    /// Apply a function to every [`Span`] in the line.
+    pub(crate) fn map_spans<F>(self, map: F) -> OwnedLine
+    where
+        F: Fn(Span) -> Span,
+    {
+        let gcodes = self
+            .gcodes
+            .into_iter()
+            .map(|gcode| {
+                let mut mapped = GCode::new_with_argument_buffer(
+                    gcode.mnemonic(),
+                    gcode.number(),
+                    map(gcode.span()),
+                    Vec::with_capacity(gcode.arguments().len()),
+                );
+                for &word in gcode.arguments() {
+                    let word =
+                        Word::new(word.letter, word.value, map(word.span));
+                    let _ = mapped.push_argument_inner(word, false);
+                }
+                mapped
+            })
+            .collect();
+
+        OwnedLine {
+            gcodes,
+            comments: self.comments.into_iter().map(&map).collect(),
+            line_number: self
+                .line_number
+                .map(|word| Word::new(word.letter, word.value, map(word.span))),
+            span: map(self.span),
+        }
+    }
+}
+
+impl<'input> From<Line<'input>> for OwnedLine {
+    fn from(line: Line<'input>) -> OwnedLine {
+        let comments = line.comments().iter().map(|c| c.span).collect();
+        let line_number = line.line_number();
+        let span = line.span();
+
+        OwnedLine {
+            gcodes: line.into_gcodes(),
+            comments,
+            line_number,
+            span,
+        }
+    }
+}
+
+/// Consecutive [`OwnedLine`]s which share a single reference to their
+/// source text.
+///
+/// A `Batch<Arc<str>>` is `Send + Sync`, so it can be handed to another
+/// thread as-is.
+#[derive(Debug, Clone, PartialEq)]
+pub struct Batch<S = Arc<str>> {
+    source: S,
+    lines: Vec<OwnedLine>,
+}
+
+impl<S: SharedText> Batch<S> {
+    /// Parse an entire program as a single [`Batch`].
+    pub fn parse<C: Callbacks>(source: S, callbacks: C) -> Self {
+        let lines = OwnedParser::new(source.clone(), callbacks)
+            .with_batch_size(usize::max_value())
+            .flat_map(Batch::into_lines)
+            .collect();
+
+        Batch { source, lines }
+    }
+
+    /// The text these lines were parsed from.
+    pub fn source(&self) -> &str { self.source.text() }
+
+    /// A handle to the shared source text.
+    pub fn shared_source(&self) -> &S { &self.source }
+
+    /// The lines in this [`Batch`].
+    pub fn lines(&self) -> &[OwnedLine] { &self.lines }
+
+    /// How many lines are in this [`Batch`]?
+    pub fn len(&self) -> usize { self.lines.len() }
+
+    /// Is this [`Batch`] empty?
+    pub fn is_empty(&self) -> bool { self.lines.is_empty() }
+
+    /// Iterate over the lines as normal [`Line`]s borrowing the source text.
+    pub fn iter(&self) -> impl Iterator<Item = Line<'_>> + '_ {
+        let source = self.source();
+        self.lines.iter().map(move |line| line.to_line(source))
+    }
+
+    /// Split the [`Batch`] into individual lines, each with its own
+    /// reference to the source text.
+    pub fn into_shared_lines(self) -> impl Iterator<Item = SharedLine<S>> {
+        let Batch { source, lines } = self;
+
+        lines.into_iter().map(move |line| SharedLine {
+            source: source.clone(),
+            line,
+        })
+    }
+
+    /// Take the lines, dropping this [`Batch`]'s reference to the source
+    /// text.
+    pub fn into_lines(self) -> Vec<OwnedLine> { self.lines }
+}
+
+/// A single [`OwnedLine`] bundled with a reference to its source text.
+#[derive(Debug, Clone, PartialEq)]
+pub struct SharedLine<S = Arc<str>> {
+    source: S,
+    line: OwnedLine,
+}
+
+impl<S: SharedText> SharedLine<S> {
+    /// The text this line was parsed from.
+    pub fn source(&self) -> &str { self.source.text() }
+
+    /// The line itself.
+    pub fn line(&self) -> &OwnedLine { &self.line }
+
+    /// All [`GCode`]s in this line.
+    pub fn gcodes(&self) -> &[GCode] { self.line.gcodes() }
+
+    /// All [`Comment`]s in this line.
+    pub fn comments(&self) -> impl Iterator<Item = Comment<'_>> + '_ {
+        self.line.comments(self.source.text())
+    }
+
+    /// Get the line's position in its source text.
+    pub fn span(&self) -> Span { self.line.span() }
+}
+
+/// A parser which holds shared ownership of its input and produces
+/// [`Batch`]es of [`OwnedLine`]s.
+///
+/// Unlike [`crate::Parser`], this has no lifetime, so it can be stored
+/// anywhere.
+#[derive(Debug)]
+pub struct OwnedParser<S = Arc<str>, C = crate::Nop> {
+    source: S,
+    callbacks: C,
+    state: StreamState,
+    /// The byte offset of the first unparsed byte.
+    offset: usize,
+    batch_size: usize,
+}
+
+impl<S: SharedText, C> OwnedParser<S, C> {
+    /// The default number of source lines in each [`Batch`].
+    pub const DEFAULT_BATCH_SIZE: usize = 256;
+
+    /// Create a new [`OwnedParser`].
+    pub fn new(source: S, callbacks: C) -> Self {
+        OwnedParser {
+            source,
+            callbacks,
+            state: StreamState::new(),
+            offset: 0,
+            batch_size: OwnedParser::<S, C>::DEFAULT_BATCH_SIZE,
+        }
+    }
+
+    /// Set how many lines of source text are parsed into each [`Batch`].
+    pub fn with_batch_size(self, batch_size: usize) -> Self {
+        OwnedParser {
+            batch_size: batch_size.max(1),
+            ..self
+        }
+    }
+
+    /// The text being parsed.
+    pub fn source(&self) -> &str { self.source.text() }
+
+    /// How many bytes have been parsed so far.
+    pub fn bytes_parsed(&self) -> usize { self.offset }
+}
+
+impl<S: SharedText, C: Callbacks> OwnedParser<S, C> {
+    /// Parse the next [`Batch`], skipping any source lines which were empty.
+    pub fn next_batch(&mut self) -> Option<Batch<S>> {
+        let mut lines = Vec::new();
+        let text = self.source.text();
+
+        while lines.is_empty() && self.offset < text.len() {
+            let rest = &text.as_bytes()[self.offset..];
+            let on_line = |line: Line<'_>| lines.push(OwnedLine::from(line));
+
+            match end_of_lines(rest, self.batch_size) {
+                Some(end) => {
+                    self.offset += self.state.resume::<_, VecBuffers, _>(
+                        &rest[..end],
+                        &mut self.callbacks,
+                        on_line,
+                    );
+                },
+                None => {
+                    self.state.finish::<_, VecBuffers, _>(
+                        rest,
+                        &mut self.callbacks,
+                        on_line,
+                    );
+                    self.offset = text.len();
+                },
+            }
+        }
+
+        if lines.is_empty() {
+            None
+        } else {
+            Some(Batch {
+                source: self.source.clone(),
+                lines,
+            })
+        }
+    }
+}
+
+impl<S: SharedText, C: Callbacks> Iterator for OwnedParser<S, C> {
+    type Item = Batch<S>;
+
+    fn next(&mut self) -> Option<Self::Item> { self.next_batch() }
+}
+
+/// The index just past the `count`'th newline, if there are that many.
+fn end_of_lines(bytes: &[u8], count: usize) -> Option<usize> {
+    let mut end = 0;
+
+    for _ in 0..count {
+        end += scan::find_newline(&bytes[end..])? + 1;
+    }
+
+    Some(end)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::Nop;
+
+    const SRC: &str =
+        "O1000\nG90 (absolute)\n\nN10 G01 X5 ; first\nY10\n\nG00 \
+                       Z5 (up) (again)";
+
+    fn assert_send_sync<T: Send + Sync>() {}
+
+    #[test]
+    fn shared_lines_are_send_and_sync() {
+        assert_send_sync::<OwnedLine>();
+        assert_send_sync::<Batch<Arc<str>>>();
+        assert_send_sync::<SharedLine<Arc<str>>>();
+        assert_send_sync::<OwnedParser<Arc<str>, Nop>>();
+    }
+
+    #[test]
+    fn batches_match_the_normal_parser() {
+        let expected: Vec<_> = crate::Parser::<Nop>::new(SRC, Nop)
+            .map(OwnedLine::from)
+            .collect();
+
+        for &batch_size in &[1, 2, 3, 100] {
+            let parser: OwnedParser<Rc<str>> =
+                OwnedParser::new(Rc::from(SRC), Nop)
+                    .with_batch_size(batch_size);
+            let batches: Vec<_> = parser.collect();
+            let got: Vec<_> =
+                batches.into_iter().flat_map(Batch::into_lines).collect();
+
+            assert_eq!(got, expected, "batch size {}", batch_size);
+        }
+    }
+
+    #[test]
+    fn owned_lines_can_be_turned_back_into_lines() {
+        let batch = Batch::parse(Arc::<str>::from(SRC), Nop);
+        let expected: Vec<_> =
+            crate::Parser::<Nop>::new(batch.source(), Nop).collect();
+
+        let got: Vec<_> = batch.iter().collect();
+
+        assert_eq!(got, expected);
+    }
+
+    #[test]
+    fn one_reference_per_batch() {
+        let src: Arc<str> = Arc::from(SRC);
+        let parser = OwnedParser::new(Arc::clone(&src), Nop);
+
+        let batches: Vec<_> = parser.collect();
+
+        assert_eq!(batches.len(), 1);
+        assert_eq!(batches[0].len(), 5);
+        // one for us and one for the batch
+        assert_eq!(Arc::strong_count(&src), 2);
+    }
+
+    #[test]
+    fn comments_are_looked_up_in_the_source() {
+        let batch = Batch::parse(Arc::<str>::from(SRC), Nop);
+
+        let comments: Vec<_> = batch
+            .into_shared_lines()
+            .flat_map(|line| {
+                line.comments()
+                    .map(|c| c.value.to_string())
+                    .collect::<Vec<_>>()
+            })
+            .collect();
+
+        assert_eq!(comments, &["(absolute)", "; first", "(up)", "(again)"]);
+    }
+
+    #[test]
+    fn strings_are_shared_without_copying() {
+        let src = Rc::new(String::from(SRC));
+        let address = src.as_ptr();
+
+        let batch = Batch::parse(Rc::clone(&src), Nop);
+
+        assert_eq!(batch.source().as_ptr(), address);
+    }
+}
@@ -0,0 +1,326 @@
+//! A compact, pre-parsed representation of a program.
+//!
+//! Programs which are known ahead of time (homing routines, purge lines,
+//! calibration patterns, etc.) don't need to be parsed at runtime. The
+//! `gcode!()` and `include_gcode!()` macros from the `gcode-macros` crate run
+//! the parser at compile time and emit a [`Program`] whose commands and
+//! arguments are stored in `static` arrays, meaning they'll end up in
+//! read-only memory (e.g. flash) instead of RAM.
+//!
+//! ```rust
+//! use gcode::{
+//!     packed::{PackedCommand, PackedWord, Program},
+//!     Mnemonic,
+//! };
+//!
+//! // roughly what `gcode!("G90\nG01 X5 Y-2")` expands to
+//! static ARGUMENTS: [PackedWord; 2] =
+//!     [PackedWord::new('X', 5.0), PackedWord::new('Y', -2.0)];
+//! static COMMANDS: [PackedCommand; 2] = [
+//!     PackedCommand::new(Mnemonic::General, 90, 0, 0, 0),
+//!     PackedCommand::new(Mnemonic::General, 1, 0, 0, 2),
+//! ];
+//! static PROGRAM: Program<'static> = Program::new(&COMMANDS, &ARGUMENTS, None);
+//!
+//! let rapid_move = PROGRAM.commands().nth(1).unwrap();
+//! assert_eq!(rapid_move.major_number(), 1);
+//! assert_eq!(rapid_move.value_for('y'), Some(-2.0));
+//! ```
+
+use crate::{
+    buffers::{Buffer, CapacityError},
+    GCode, Mnemonic, Span, Word,
+};
+use core::{
+    fmt::{self, Display, Formatter},
+    iter::FusedIterator,
+};
+
+/// A [`Word`] without its [`Span`].
+#[derive(Debug, Copy, Clone, PartialEq)]
+#[repr(C)]
+pub struct PackedWord {
+    /// The letter part of this [`PackedWord`].
+    pub letter: char,
+    /// The value part.
+    pub value: f32,
+}
+
+impl PackedWord {
+    /// Create a new [`PackedWord`].
+    pub const fn new(letter: char, value: f32) -> Self {
+        PackedWord { letter, value }
+    }
+
+    /// Convert back to a normal [`Word`].
+    pub fn to_word(self, span: Span) -> Word {
+        Word::new(self.letter, self.value, span)
+    }
+}
+
+impl Display for PackedWord {
+    fn fmt(&self, f: &mut Formatter<'_>) -> fmt::Result {
+        write!(f, "{}{}", self.letter, self.value)
+    }
+}
+
+/// A single command, referring to its arguments by index.
+#[derive(Debug, Copy, Clone, PartialEq)]
+#[repr(C)]
+pub struct PackedCommand {
+    /// The overall category this command belongs to.
+    pub mnemonic: Mnemonic,
+    /// The integral part of a command number (i.e. the `12` in `G12.3`).
+    pub major_number: u16,
+    /// The fractional part of a command number (i.e. the `3` in `G12.3`).
+    pub minor_number: u8,
+    /// How many arguments this command has.
+    pub argument_count: u8,
+    /// The index of this command's first argument in
+    /// [`Program::arguments()`].
+    pub first_argument: u32,
+}
+
+impl PackedCommand {
+    /// Create a new [`PackedCommand`].
+    pub const fn new(
+        mnemonic: Mnemonic,
+        major_number: u16,
+        minor_number: u8,
+        first_argument: u32,
+        argument_count: u8,
+    ) -> Self {
+        PackedCommand {
+            mnemonic,
+            major_number,
+            minor_number,
+            argument_count,
+            first_argument,
+        }
+    }
+}
+
+/// A pre-parsed program.
+#[derive(Debug, Copy, Clone, PartialEq)]
+pub struct Program<'a> {
+    commands: &'a [PackedCommand],
+    arguments: &'a [PackedWord],
+    spans: Option<&'a [Span]>,
+}
+
+impl<'a> Program<'a> {
+    /// Create a new [`Program`].
+    ///
+    /// Each command's arguments must lie within `arguments` and, if provided,
+    /// there must be one [`Span`] per command.
+    pub const fn new(
+        commands: &'a [PackedCommand],
+        arguments: &'a [PackedWord],
+        spans: Option<&'a [Span]>,
+    ) -> Self {
+        Program {
+            commands,
+            arguments,
+            spans,
+        }
+    }
+
+    /// The number of commands in this [`Program`].
+    pub fn len(&self) -> usize { self.commands.len() }
+
+    /// Does this [`Program`] contain any commands?
+    pub fn is_empty(&self) -> bool { self.commands.is_empty() }
+
+    /// The arguments for every command, one after the other.
+    pub fn arguments(&self) -> &'a [PackedWord] { self.arguments }
+
+    /// Does this [`Program`] know where its commands came from?
+    pub fn has_spans(&self) -> bool { self.spans.is_some() }
+
+    /// Get the command at a particular index.
+    pub fn get(&self, index: usize) -> Option<Command<'a>> {
+        let packed = self.commands.get(index)?;
+        let start = packed.first_argument as usize;
+        let end = start + usize::from(packed.argument_count);
+
+        Some(Command {
+            packed,
+            arguments: &self.arguments[start..end],
+            span: self
+                .spans
+                .map(|spans| spans[index])
+                .unwrap_or(Span::PLACEHOLDER),
+        })
+    }
+
+    /// Iterate over the commands in this [`Program`].
+    pub fn commands(&self) -> Commands<'a> {
+        Commands {
+            program: *self,
+            next: 0,
+        }
+    }
+}
+
+impl<'a> IntoIterator for Program<'a> {
+    type IntoIter = Commands<'a>;
+    type Item = Command<'a>;
+
+    fn into_iter(self) -> Self::IntoIter { self.commands() }
+}
+
+/// A borrowed view of a single command in a [`Program`].
+#[derive(Debug, Copy, Clone, PartialEq)]
+pub struct Command<'a> {
+    packed: &'a PackedCommand,
+    arguments: &'a [PackedWord],
+    span: Span,
+}
+
+impl<'a> Command<'a> {
+    /// The overall category this [`Command`] belongs to.
+    pub fn mnemonic(&self) -> Mnemonic { self.packed.mnemonic }
+
+    /// The integral part of a command number (i.e. the `12` in `G12.3`).
+    pub fn major_number(&self) -> u32 { u32::from(self.packed.major_number) }
+
+    /// The fractional part of a command number (i.e. the `3` in `G12.3`).
+    pub fn minor_number(&self) -> u32 { u32::from(self.packed.minor_number) }
+
+    /// The arguments attached to this [`Command`].
+    pub fn arguments(&self) -> &'a [PackedWord] { self.arguments }
+
+    /// Where the [`Command`] was found in its source text, or
+    /// [`Span::PLACEHOLDER`] if the [`Program`] was compiled without spans.
+    pub fn span(&self) -> Span { self.span }
+
+    /// Get the value for a particular argument.
+    pub fn value_for(&self, letter: char) -> Option<f32> {
+        let letter = letter.to_ascii_lowercase();
+
+        self.arguments
+            .iter()
+            .find(|word| letter == word.letter.to_ascii_lowercase())
+            .map(|word| word.value)
+    }
+
+    /// Unpack this [`Command`] into a normal [`GCode`].
+    ///
+    /// The arguments are given [`Span::PLACEHOLDER`] because only the
+    /// command's [`Span`] is kept.
+    pub fn to_gcode<A>(&self) -> Result<GCode<A>, CapacityError<Word>>
+    where
+        A: Buffer<Word> + Default,
+    {
+        let number = self.packed.major_number as f32
+            + self.packed.minor_number as f32 / 10.0;
+        let mut gcode = GCode::new_with_argument_buffer(
+            self.mnemonic(),
+            number,
+            self.span,
+            A::default(),
+        );
+
+        for arg in self.arguments {
+            gcode.push_argument(arg.to_word(Span::PLACEHOLDER))?;
+        }
+
+        Ok(gcode)
+    }
+}
+
+impl<'a> Display for Command<'a> {
+    fn fmt(&self, f: &mut Formatter<'_>) -> fmt::Result {
+        write!(f, "{}{}", self.mnemonic(), self.major_number())?;
+
+        if self.minor_number() != 0 {
+            write!(f, ".{}", self.minor_number())?;
+        }
+
+        for arg in self.arguments() {
+            write!(f, " {}", arg)?;
+        }
+
+        Ok(())
+    }
+}
+
+/// An iterator over the [`Command`]s in a [`Program`].
+#[derive(Debug, Clone)]
+pub struct Commands<'a> {
+    program: Program<'a>,
+    next: usize,
+}
+
+impl<'a> Iterator for Commands<'a> {
+    type Item = Command<'a>;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        let command = self.program.get(self.next)?;
+        self.next += 1;
+        Some(command)
+    }
+
+    fn size_hint(&self) -> (usize, Option<usize>) {
+        let remaining = self.program.len() - self.next;
+        (remaining, Some(remaining))
+    }
+}
+
+impl<'a> ExactSizeIterator for Commands<'a> {}
+
+impl<'a> FusedIterator for Commands<'a> {}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::prelude::v1::*;
+
+    static ARGUMENTS: [PackedWord; 3] = [
+        PackedWord::new('X', 5.0),
+        PackedWord::new('Y', -2.0),
+        PackedWord::new('F', 1000.0),
+    ];
+    static COMMANDS: [PackedCommand; 3] = [
+        PackedCommand::new(Mnemonic::General, 90, 0, 0, 0),
+        PackedCommand::new(Mnemonic::General, 1, 0, 0, 2),
+        PackedCommand::new(Mnemonic::General, 38, 2, 2, 1),
+    ];
+    static SPANS: [Span; 3] = [
+        Span::new(0, 3, 0),
+        Span::new(4, 14, 1),
+        Span::new(15, 26, 2),
+    ];
+
+    #[test]
+    fn commands_can_be_unpacked() {
+        let program = Program::new(&COMMANDS, &ARGUMENTS, Some(&SPANS));
+
+        let got: Vec<GCode> =
+            program.commands().map(|c| c.to_gcode().unwrap()).collect();
+
+        let expected: Vec<GCode> =
+            crate::parse("G90\nG01 X5 Y-2\nG38.2 F1000").collect();
+        assert_eq!(got, expected);
+        assert_eq!(got[1].span(), Span::new(4, 14, 1));
+        assert_eq!(got[2].minor_number(), 2);
+    }
+
+    #[test]
+    fn commands_without_spans_use_the_placeholder() {
+        let program = Program::new(&COMMANDS, &ARGUMENTS, None);
+
+        assert!(program.commands().all(|c| c.span().is_placeholder()));
+        assert_eq!(program.commands().len(), 3);
+    }
+
+    #[test]
+    fn display_matches_gcode() {
+        let program = Program::new(&COMMANDS, &ARGUMENTS, None);
+
+        let got: Vec<String> =
+            program.commands().map(|c| c.to_string()).collect();
+
+        assert_eq!(got, &["G90", "G1 X5 Y-2", "G38.2 F1000"]);
+    }
+}
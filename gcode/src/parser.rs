@@ -1,8 +1,9 @@
 use crate::{
     buffers::{Buffers, DefaultBuffers},
     lexer::{Lexer, Token, TokenType},
+    profile::{Full, Profile, SplitLines},
     words::{Atom, Word, WordsOrComments},
-    Callbacks, Comment, GCode, Line, Mnemonic, Nop,
+    Callbacks, Comment, GCode, Line, Mnemonic, Nop, Span,
 };
 use core::{iter::Peekable, marker::PhantomData};
 
@@ -28,18 +29,21 @@ pub fn full_parse_with_callbacks<'input, C: Callbacks + 'input>(
 ) -> impl Iterator<Item = Line<'input>> + 'input {
     let tokens = Lexer::new(src);
     let atoms = WordsOrComments::new(tokens);
-    Lines::new(atoms, callbacks)
+    Lines::<'input, _, _, _, Full>::new(atoms, callbacks)
 }
 
 /// A parser for parsing g-code programs.
+///
+/// The [`Profile`] parameter can be used to turn off parts of the parse
+/// which aren't needed (see the [`crate::profile`] module).
 #[derive(Debug)]
-pub struct Parser<'input, C, B = DefaultBuffers> {
+pub struct Parser<'input, C, B = DefaultBuffers, P = Full> {
     // Explicitly instantiate Lines so Parser's type parameters don't expose
     // internal details
-    lines: Lines<'input, WordsOrComments<'input, Lexer<'input>>, C, B>,
+    lines: Lines<'input, WordsOrComments<'input, Lexer<'input>>, C, B, P>,
 }
 
-impl<'input, C, B> Parser<'input, C, B> {
+impl<'input, C, B, P> Parser<'input, C, B, P> {
     /// Create a new [`Parser`] from some source text and a set of
     /// [`Callbacks`].
     pub fn new(src: &'input str, callbacks: C) -> Self {
@@ -50,49 +54,120 @@ impl<'input, C, B> Parser<'input, C, B> {
     }
 }
 
-impl<'input, B> From<&'input str> for Parser<'input, Nop, B> {
+impl<'input, C, B, P> Parser<'input, C, B, SplitLines<P>> {
+    /// Also say whether each [`Line`] carries on from the previous one.
+    ///
+    /// A source line with more commands than the [`Buffers::Commands`]
+    /// buffer can hold is emitted as several [`Line`]s. Every fragment after
+    /// the first is a continuation, sharing the same source line but not
+    /// repeating its line number.
+    pub fn with_continuations(self) -> Continuations<'input, C, B, P> {
+        Continuations { parser: self }
+    }
+}
+
+impl<'input, B, P> From<&'input str> for Parser<'input, Nop, B, P> {
     fn from(src: &'input str) -> Self { Parser::new(src, Nop) }
 }
 
-impl<'input, C: Callbacks, B: Buffers<'input>> Iterator
-    for Parser<'input, C, B>
+impl<'input, C, B, P> Iterator for Parser<'input, C, B, P>
+where
+    C: Callbacks,
+    B: Buffers<'input>,
+    P: Profile,
 {
     type Item = Line<'input, B>;
 
     fn next(&mut self) -> Option<Self::Item> { self.lines.next() }
 }
 
+/// An iterator over [`Line`]s and whether each one is a continuation,
+/// created by [`Parser::with_continuations()`].
+#[derive(Debug)]
+pub struct Continuations<'input, C, B = DefaultBuffers, P = Full> {
+    parser: Parser<'input, C, B, SplitLines<P>>,
+}
+
+impl<'input, C, B, P> Iterator for Continuations<'input, C, B, P>
+where
+    C: Callbacks,
+    B: Buffers<'input>,
+    P: Profile,
+{
+    type Item = (Line<'input, B>, bool);
+
+    fn next(&mut self) -> Option<Self::Item> {
+        let line = self.parser.next()?;
+        Some((line, self.parser.lines.in_continuation))
+    }
+}
+
 #[derive(Debug)]
-struct Lines<'input, I, C, B>
+pub(crate) struct Lines<'input, I, C, B, P = Full>
 where
     I: Iterator<Item = Atom<'input>>,
 {
     atoms: Peekable<I>,
     callbacks: C,
     last_gcode_type: Option<Word>,
+    /// The previous line was split and the next one carries on from it.
+    split_pending: bool,
+    /// The line being read carries on from the previous one.
+    in_continuation: bool,
     _buffers: PhantomData<B>,
+    _profile: PhantomData<P>,
 }
 
-impl<'input, I, C, B> Lines<'input, I, C, B>
+impl<'input, I, C, B, P> Lines<'input, I, C, B, P>
 where
     I: Iterator<Item = Atom<'input>>,
 {
-    fn new(atoms: I, callbacks: C) -> Self {
+    pub(crate) fn new(atoms: I, callbacks: C) -> Self {
         Lines {
             atoms: atoms.peekable(),
             callbacks,
             last_gcode_type: None,
+            split_pending: false,
+            in_continuation: false,
             _buffers: PhantomData,
+            _profile: PhantomData,
         }
     }
+
+    /// Carry on from where another [`Lines`] left off, so arguments without
+    /// a command are attached to the right command type.
+    #[cfg_attr(not(feature = "std"), allow(dead_code))]
+    pub(crate) fn with_last_gcode_type(self, last: Option<Word>) -> Self {
+        Lines {
+            last_gcode_type: last,
+            ..self
+        }
+    }
+
+    /// The command type used by the most recent [`GCode`].
+    #[cfg_attr(not(feature = "std"), allow(dead_code))]
+    pub(crate) fn last_gcode_type(&self) -> Option<Word> {
+        self.last_gcode_type
+    }
 }
 
-impl<'input, I, C, B> Lines<'input, I, C, B>
+impl<'input, I, C, B, P> Lines<'input, I, C, B, P>
 where
     I: Iterator<Item = Atom<'input>>,
     C: Callbacks,
     B: Buffers<'input>,
+    P: Profile,
 {
+    /// The span to use for a new [`GCode`], taking the [`Profile`] into
+    /// account.
+    fn gcode_span(word: &Word) -> Span {
+        if P::SPANS {
+            word.span
+        } else {
+            Span::PLACEHOLDER
+        }
+    }
+
     fn handle_line_number(
         &mut self,
         word: Word,
@@ -102,8 +177,9 @@ where
         if line.gcodes().is_empty()
             && line.line_number().is_none()
             && !has_temp_gcode
+            && !self.in_continuation
         {
-            line.set_line_number(word);
+            line.set_line_number_inner(word, P::SPANS);
         } else {
             self.callbacks.unexpected_line_number(word.value, word.span);
         }
@@ -120,14 +196,14 @@ where
             // onto the line so we can start working on the next one
             self.last_gcode_type = Some(word);
             if let Some(completed) = temp_gcode.take() {
-                if let Err(e) = line.push_gcode(completed) {
+                if let Err(e) = line.push_gcode_inner(completed, P::SPANS) {
                     self.on_gcode_push_error(e.0);
                 }
             }
             *temp_gcode = Some(GCode::new_with_argument_buffer(
                 mnemonic,
                 word.value,
-                word.span,
+                Self::gcode_span(&word),
                 B::Arguments::default(),
             ));
             return;
@@ -135,7 +211,7 @@ where
 
         // we've got an argument, try adding it to the gcode we're building
         if let Some(temp) = temp_gcode {
-            if let Err(e) = temp.push_argument(word) {
+            if let Err(e) = temp.push_argument_inner(word, P::SPANS) {
                 self.on_arg_push_error(&temp, e.0);
             }
             return;
@@ -148,10 +224,10 @@ where
                 let mut new_gcode = GCode::new_with_argument_buffer(
                     Mnemonic::for_letter(ty.letter).unwrap(),
                     ty.value,
-                    ty.span,
+                    Self::gcode_span(&ty),
                     B::Arguments::default(),
                 );
-                if let Err(e) = new_gcode.push_argument(word) {
+                if let Err(e) = new_gcode.push_argument_inner(word, P::SPANS) {
                     self.on_arg_push_error(&new_gcode, e.0);
                 }
                 *temp_gcode = Some(new_gcode);
@@ -203,25 +279,93 @@ where
     fn next_line_number(&mut self) -> Option<usize> {
         self.atoms.peek().map(|a| a.span().line)
     }
+
+    /// When splitting overfull lines, check whether the next atom starts a
+    /// command which won't fit on the current line. The command we were
+    /// building is finished off first, so the split always happens between
+    /// commands.
+    fn must_split(
+        &mut self,
+        line: &mut Line<'input, B>,
+        temp_gcode: &mut Option<GCode<B::Arguments>>,
+    ) -> bool {
+        let starts_command = match self.atoms.peek() {
+            Some(Atom::Word(word)) => {
+                Mnemonic::for_letter(word.letter).is_some()
+            },
+            _ => false,
+        };
+        if !starts_command {
+            return false;
+        }
+
+        if let Some(completed) = temp_gcode.take() {
+            if let Err(e) = line.push_gcode_inner(completed, P::SPANS) {
+                self.on_gcode_push_error(e.0);
+            }
+        }
+
+        line.gcodes_are_full()
+    }
 }
 
-impl<'input, I, C, B> Iterator for Lines<'input, I, C, B>
+impl<'input, I, C, B, P> Iterator for Lines<'input, I, C, B, P>
 where
     I: Iterator<Item = Atom<'input>> + 'input,
     C: Callbacks,
     B: Buffers<'input>,
+    P: Profile,
 {
     type Item = Line<'input, B>;
 
     fn next(&mut self) -> Option<Self::Item> {
+        // keep going until we find a line with something in it (e.g. a line
+        // with just garbage on it is reported via callbacks, then skipped)
+        while self.atoms.peek().is_some() {
+            let line = self.read_line();
+
+            if !line.is_empty() {
+                return Some(line);
+            }
+        }
+
+        None
+    }
+}
+
+impl<'input, I, C, B, P> Lines<'input, I, C, B, P>
+where
+    I: Iterator<Item = Atom<'input>> + 'input,
+    C: Callbacks,
+    B: Buffers<'input>,
+    P: Profile,
+{
+    /// Consume all the atoms on the next line.
+    fn read_line(&mut self) -> Line<'input, B> {
         let mut line = Line::default();
+        if P::SPLIT_OVERFULL_LINES {
+            self.in_continuation = self.split_pending;
+            self.split_pending = false;
+        }
         // we need a scratch space for the gcode we're in the middle of
         // constructing
         let mut temp_gcode = None;
+        // the line number of the first thing we saw
+        let mut current_line = None;
 
         while let Some(next_line) = self.next_line_number() {
-            if !line.is_empty() && next_line != line.span().line {
+            match current_line {
                 // we've started the next line
+                Some(current) if current != next_line => break,
+                Some(_) => {},
+                None => current_line = Some(next_line),
+            }
+
+            if P::SPLIT_OVERFULL_LINES
+                && self.must_split(&mut line, &mut temp_gcode)
+            {
+                // the rest of this line goes in a continuation
+                self.split_pending = true;
                 break;
             }
 
@@ -230,17 +374,23 @@ where
                     self.callbacks.unknown_content(token.value, token.span)
                 },
                 Atom::Comment(comment) => {
-                    if let Err(e) = line.push_comment(comment) {
-                        self.on_comment_push_error(e.0);
+                    if P::COMMENTS {
+                        if let Err(e) =
+                            line.push_comment_inner(comment, P::SPANS)
+                        {
+                            self.on_comment_push_error(e.0);
+                        }
                     }
                 },
                 // line numbers are annoying, so handle them separately
                 Atom::Word(word) if word.letter.to_ascii_lowercase() == 'n' => {
-                    self.handle_line_number(
-                        word,
-                        &mut line,
-                        temp_gcode.is_some(),
-                    );
+                    if P::LINE_NUMBERS {
+                        self.handle_line_number(
+                            word,
+                            &mut line,
+                            temp_gcode.is_some(),
+                        );
+                    }
                 },
                 Atom::Word(word) => {
                     self.handle_arg(word, &mut line, &mut temp_gcode)
@@ -250,16 +400,12 @@ where
         }
 
         if let Some(gcode) = temp_gcode.take() {
-            if let Err(e) = line.push_gcode(gcode) {
+            if let Err(e) = line.push_gcode_inner(gcode, P::SPANS) {
                 self.on_gcode_push_error(e.0);
             }
         }
 
-        if line.is_empty() {
-            None
-        } else {
-            Some(line)
-        }
+        line
     }
 }
 
@@ -353,6 +499,15 @@ mod tests {
         assert_eq!(unexpected_line_number[0].0, 42.0);
     }
 
+    #[test]
+    fn lines_with_only_garbage_are_skipped() {
+        let src = "G90\n$$$\nG01";
+        let got: Vec<_> = parse(src).collect();
+
+        assert_eq!(got.len(), 2);
+        assert_eq!(got[1].span().line, 2);
+    }
+
     #[test]
     fn parse_g90() {
         let src = "G90";
@@ -422,7 +577,6 @@ mod tests {
     /// For some reason we were parsing the G90, then an empty G01 and the
     /// actual G01.
     #[test]
-    #[ignore]
     fn funny_bug_in_crate_example() {
         let src = "G90 \n G01 X50.0 Y-10";
         let expected = vec![
@@ -436,4 +590,111 @@ mod tests {
 
         assert_eq!(got, expected);
     }
+
+    #[test]
+    fn commands_only_profile_drops_everything_else() {
+        use crate::profile::CommandsOnly;
+
+        let src = "N10 G90 (absolute)\nN20 G01 X5 ; move\nY6";
+        let full: Vec<Line<'_>> = Parser::<Nop>::new(src, Nop).collect();
+
+        let got: Vec<Line<'_>> =
+            Parser::<Nop, DefaultBuffers, CommandsOnly>::new(src, Nop)
+                .collect();
+
+        assert_eq!(got.len(), full.len());
+        for (line, original) in got.iter().zip(&full) {
+            assert!(line.comments().is_empty());
+            assert!(line.line_number().is_none());
+            // Span's PartialEq treats the placeholder as equal to anything,
+            // so check for it explicitly
+            assert!(line.span().is_placeholder());
+            assert_eq!(line.gcodes(), original.gcodes());
+
+            for (gcode, original) in line.gcodes().iter().zip(original.gcodes())
+            {
+                assert!(gcode.span().is_placeholder());
+                assert!(!original.span().is_placeholder());
+
+                // words still know where they came from
+                for (word, original) in
+                    gcode.arguments().iter().zip(original.arguments())
+                {
+                    assert!(!word.span.is_placeholder());
+                    assert_eq!(
+                        (word.span.start, word.span.end, word.span.line),
+                        (
+                            original.span.start,
+                            original.span.end,
+                            original.span.line
+                        ),
+                    );
+                }
+            }
+        }
+    }
+
+    #[test]
+    fn overfull_lines_are_split_into_continuations() {
+        use crate::{buffers::SmallFixedBuffers, profile::SplitLines};
+
+        let src = "N10 G00 G90 X5 G21 (metric)\nG01 X5";
+
+        let (got, continuations): (Vec<Line<'_, SmallFixedBuffers>>, Vec<_>) =
+            Parser::<Nop, SmallFixedBuffers, SplitLines>::new(src, Nop)
+                .with_continuations()
+                .unzip();
+
+        assert_eq!(got.len(), 4);
+        let numbers: Vec<_> =
+            got.iter().map(|l| l.gcodes()[0].major_number()).collect();
+        assert_eq!(numbers, &[0, 90, 21, 1]);
+        assert_eq!(continuations, &[false, true, true, false]);
+        // the arguments stay with their command
+        assert_eq!(got[1].gcodes()[0].value_for('X'), Some(5.0));
+        // fragments share a source line, but only the first has its number
+        assert!(got[..3].iter().all(|l| l.span().line == 0));
+        assert_eq!(got[0].line_number().unwrap().value, 10.0);
+        assert!(got[1].line_number().is_none());
+        assert_eq!(got[2].comments().len(), 1);
+        assert_eq!(got[2].span(), Span::new(15, 27, 0));
+    }
+
+    #[test]
+    fn without_splitting_extra_commands_overflow() {
+        use crate::buffers::SmallFixedBuffers;
+
+        let src = "G00 G90 G17 G21";
+
+        let got: Vec<Line<'_, SmallFixedBuffers>> =
+            Parser::<Nop, SmallFixedBuffers>::new(src, Nop).collect();
+
+        assert_eq!(got.len(), 1);
+        assert_eq!(got[0].gcodes().len(), 1);
+    }
+
+    #[test]
+    fn custom_profiles_only_skip_what_they_are_told_to() {
+        use crate::profile::Custom;
+
+        let src = "N10 G90 (absolute)";
+
+        let no_comments: Vec<Line<'_>> =
+            Parser::<Nop, DefaultBuffers, Custom<false, true, true>>::new(
+                src, Nop,
+            )
+            .collect();
+        assert!(no_comments[0].comments().is_empty());
+        assert_eq!(no_comments[0].line_number().unwrap().value, 10.0);
+        assert_eq!(no_comments[0].span(), Span::new(0, 7, 0));
+
+        let no_line_numbers: Vec<Line<'_>> =
+            Parser::<Nop, DefaultBuffers, Custom<true, true, false>>::new(
+                src, Nop,
+            )
+            .collect();
+        assert!(no_line_numbers[0].line_number().is_none());
+        assert_eq!(no_line_numbers[0].comments().len(), 1);
+        assert_eq!(no_line_numbers[0].span(), Span::new(4, 18, 0));
+    }
 }
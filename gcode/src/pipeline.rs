@@ -0,0 +1,218 @@
+//! Pipeline-parallel parsing.
+//!
+//! When a program arrives as one big stream there's no way to split it into
+//! independent chunks, but the different stages of the parser can still run
+//! at the same time. A [`Pipeline`] runs the tokenizer on a background thread
+//! and hands batches of words and comments to the calling thread, which
+//! assembles them into [`Line`]s and passes each [`Line`] to the caller.
+//!
+//! ```rust
+//! use gcode::{pipeline::Pipeline, Nop};
+//!
+//! let src = "G90\nG01 X5 Y-2.5\nG01 X10 (move right)\n";
+//! let mut lines = 0;
+//!
+//! Pipeline::new().parse(src, Nop, |_: gcode::Line<'_>| lines += 1);
+//!
+//! assert_eq!(lines, 3);
+//! ```
+
+use crate::{
+    buffers::{Buffers, DefaultBuffers},
+    lexer::Lexer,
+    parser::Lines,
+    profile::Full,
+    words::{Atom, WordsOrComments},
+    Callbacks, Line,
+};
+use std::{
+    mem,
+    sync::mpsc::{self, Receiver, Sender, SyncSender},
+    thread,
+};
+
+/// Parse some text using the default [`Pipeline`] configuration, calling
+/// `on_line` for every [`Line`] that is found.
+pub fn parse_pipelined<'input, C, F>(src: &'input str, callbacks: C, on_line: F)
+where
+    C: Callbacks,
+    F: FnMut(Line<'input, DefaultBuffers>),
+{
+    Pipeline::default().parse(src, callbacks, on_line);
+}
+
+/// A two-stage parser which tokenizes on one thread and assembles [`Line`]s on
+/// another.
+///
+/// The stages are connected by a bounded queue of batches. Batches are sent
+/// back to the tokenizer once they've been consumed, so after warming up the
+/// pipeline doesn't need to allocate.
+#[derive(Debug, Copy, Clone, PartialEq)]
+pub struct Pipeline {
+    batch_size: usize,
+    queue_depth: usize,
+}
+
+impl Pipeline {
+    /// The default number of words/comments sent between threads at a time.
+    pub const DEFAULT_BATCH_SIZE: usize = 1024;
+    /// The default number of batches which may be waiting to be consumed.
+    pub const DEFAULT_QUEUE_DEPTH: usize = 4;
+
+    /// Create a new [`Pipeline`] using the default settings.
+    pub fn new() -> Self {
+        Pipeline {
+            batch_size: Pipeline::DEFAULT_BATCH_SIZE,
+            queue_depth: Pipeline::DEFAULT_QUEUE_DEPTH,
+        }
+    }
+
+    /// Set how many words/comments are sent to the consumer at a time.
+    ///
+    /// Larger batches mean less synchronisation, smaller batches mean the
+    /// consumer can start working sooner.
+    pub fn with_batch_size(self, batch_size: usize) -> Self {
+        Pipeline {
+            batch_size: batch_size.max(1),
+            ..self
+        }
+    }
+
+    /// Set how many batches the tokenizer may get ahead of the consumer.
+    pub fn with_queue_depth(self, queue_depth: usize) -> Self {
+        Pipeline {
+            queue_depth: queue_depth.max(1),
+            ..self
+        }
+    }
+
+    /// Parse some text, calling `on_line` for each [`Line`] from the current
+    /// thread.
+    ///
+    /// Any [`Callbacks`] are also invoked on the current thread, so they don't
+    /// need to be [`Send`].
+    pub fn parse<'input, C, B, F>(
+        &self,
+        src: &'input str,
+        callbacks: C,
+        mut on_line: F,
+    ) where
+        C: Callbacks,
+        B: Buffers<'input>,
+        F: FnMut(Line<'input, B>),
+    {
+        let Pipeline {
+            batch_size,
+            queue_depth,
+        } = *self;
+
+        thread::scope(|scope| {
+            let (filled_tx, filled_rx) = mpsc::sync_channel(queue_depth);
+            let (empty_tx, empty_rx) = mpsc::channel();
+
+            let _tokenizer = scope.spawn(move || {
+                tokenize(src, batch_size, &filled_tx, &empty_rx)
+            });
+
+            let batches = Batches {
+                filled: filled_rx,
+                empty: empty_tx,
+                current: Vec::new(),
+                index: 0,
+            };
+
+            Lines::<'input, _, C, B, Full>::new(batches, callbacks)
+                .for_each(|line| on_line(line));
+        });
+    }
+}
+
+impl Default for Pipeline {
+    fn default() -> Pipeline { Pipeline::new() }
+}
+
+/// The producer half of the pipeline.
+fn tokenize<'input>(
+    src: &'input str,
+    batch_size: usize,
+    filled: &SyncSender<Vec<Atom<'input>>>,
+    empty: &Receiver<Vec<Atom<'input>>>,
+) {
+    let mut atoms = WordsOrComments::new(Lexer::new(src));
+
+    loop {
+        let mut batch = empty
+            .try_recv()
+            .unwrap_or_else(|_| Vec::with_capacity(batch_size));
+        batch.extend(atoms.by_ref().take(batch_size));
+
+        if batch.is_empty() || filled.send(batch).is_err() {
+            // either we've reached the end of the input or the consumer hung up
+            return;
+        }
+    }
+}
+
+/// The consumer half of the pipeline, an iterator over the [`Atom`]s in each
+/// batch.
+#[derive(Debug)]
+struct Batches<'input> {
+    filled: Receiver<Vec<Atom<'input>>>,
+    empty: Sender<Vec<Atom<'input>>>,
+    current: Vec<Atom<'input>>,
+    index: usize,
+}
+
+impl<'input> Iterator for Batches<'input> {
+    type Item = Atom<'input>;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        while self.index >= self.current.len() {
+            let next = self.filled.recv().ok()?;
+            let mut used = mem::replace(&mut self.current, next);
+            self.index = 0;
+
+            used.clear();
+            // the tokenizer may have already finished, in which case there's
+            // nobody to recycle the buffer
+            let _ = self.empty.send(used);
+        }
+
+        let atom = self.current[self.index];
+        self.index += 1;
+        Some(atom)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::Nop;
+    use std::prelude::v1::*;
+
+    #[test]
+    fn pipelined_output_matches_the_normal_parser() {
+        let src = "G90 (absolute)\nN10 G01 X5 Y-2\n\n; a comment\nX7 Y8\nM30";
+        let expected: Vec<Line<'_>> =
+            crate::full_parse_with_callbacks(src, Nop).collect();
+
+        for &batch_size in &[1, 2, 3, 1024] {
+            let mut got = Vec::new();
+            Pipeline::new()
+                .with_batch_size(batch_size)
+                .with_queue_depth(1)
+                .parse(src, Nop, |line: Line<'_>| got.push(line));
+
+            assert_eq!(got, expected, "batch size: {}", batch_size);
+        }
+    }
+
+    #[test]
+    fn empty_input() {
+        let mut lines = 0;
+
+        parse_pipelined("", Nop, |_| lines += 1);
+
+        assert_eq!(lines, 0);
+    }
+}
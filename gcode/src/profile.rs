@@ -0,0 +1,121 @@
+//! Compile-time parse profiles.
+//!
+//! Plenty of applications never look at [`Comment`]s, [`Span`]s or line
+//! numbers. A [`Profile`] is a type-level switch telling the [`Parser`] which
+//! of these to keep track of. Because the switches are constants, the code
+//! which records a disabled feature is compiled out of the parser. The text
+//! is still lexed the same way, so this mostly saves memory and bookkeeping
+//! rather than parse time.
+//!
+//! ```rust
+//! use gcode::{profile::CommandsOnly, buffers::DefaultBuffers, Nop, Parser};
+//!
+//! let src = "N10 G90 (absolute)\nG01 X5";
+//! let parser: Parser<Nop, DefaultBuffers, CommandsOnly> = Parser::new(src, Nop);
+//!
+//! for line in parser {
+//!     assert!(line.comments().is_empty());
+//!     assert!(line.line_number().is_none());
+//!     assert!(line.span().is_placeholder());
+//! }
+//! ```
+
+#[allow(unused_imports)] // for rustdoc links
+use crate::{buffers::Buffers, Comment, GCode, Line, Parser, Span, Word};
+use core::marker::PhantomData;
+
+/// A set of switches controlling what the [`Parser`] records.
+pub trait Profile {
+    /// Store [`Comment`]s in each [`Line`]. When disabled, comments are
+    /// skipped without being reported.
+    const COMMENTS: bool;
+    /// Keep the [`Span`] of each [`Line`] and [`GCode`] up to date. When
+    /// disabled, they're left as [`Span::PLACEHOLDER`] (a [`Word`]'s span is
+    /// still filled in).
+    const SPANS: bool;
+    /// Record line numbers (`N10`). When disabled, line numbers are skipped
+    /// without being reported.
+    const LINE_NUMBERS: bool;
+    /// When a line has more [`GCode`]s than its buffer can hold, emit the
+    /// rest as continuation [`Line`]s instead of reporting them as
+    /// overflowed (see [`SplitLines`]).
+    const SPLIT_OVERFULL_LINES: bool = false;
+}
+
+/// Record everything. This is the default.
+#[derive(Debug, Copy, Clone, PartialEq)]
+pub enum Full {}
+
+impl Profile for Full {
+    const COMMENTS: bool = true;
+    const LINE_NUMBERS: bool = true;
+    const SPANS: bool = true;
+}
+
+/// Only record the [`GCode`]s and their arguments.
+#[derive(Debug, Copy, Clone, PartialEq)]
+pub enum CommandsOnly {}
+
+impl Profile for CommandsOnly {
+    const COMMENTS: bool = false;
+    const LINE_NUMBERS: bool = false;
+    const SPANS: bool = false;
+}
+
+/// A [`Profile`] for picking and choosing individual features.
+///
+/// ```rust
+/// use gcode::profile::{Custom, Profile};
+///
+/// /// Everything except comments
+/// type NoComments = Custom<false, true, true>;
+///
+/// assert!(!NoComments::COMMENTS);
+/// assert!(NoComments::SPANS);
+/// ```
+#[derive(Debug, Copy, Clone, PartialEq)]
+pub enum Custom<
+    const COMMENTS: bool,
+    const SPANS: bool,
+    const LINE_NUMBERS: bool,
+> {}
+
+impl<const COMMENTS: bool, const SPANS: bool, const LINE_NUMBERS: bool> Profile
+    for Custom<COMMENTS, SPANS, LINE_NUMBERS>
+{
+    const COMMENTS: bool = COMMENTS;
+    const LINE_NUMBERS: bool = LINE_NUMBERS;
+    const SPANS: bool = SPANS;
+}
+
+/// Wrap another [`Profile`] so lines with more [`GCode`]s than the
+/// [`Buffers::Commands`] buffer can hold are split into several [`Line`]s
+/// rather than losing commands.
+///
+/// Use [`crate::Parser::with_continuations()`] to find out which fragments
+/// carry on from the line before. This lets small fixed-size buffers handle
+/// the occasional long line without making every [`Line`] bigger.
+///
+/// ```rust
+/// use gcode::{buffers::SmallFixedBuffers, profile::SplitLines, Nop, Parser};
+///
+/// let src = "G00 G90 G17 G21\nG01 X5";
+/// let parser: Parser<Nop, SmallFixedBuffers, SplitLines> =
+///     Parser::new(src, Nop);
+/// let (lines, continuations): (Vec<_>, Vec<_>) =
+///     parser.with_continuations().unzip();
+///
+/// assert_eq!(lines.len(), 5);
+/// assert_eq!(continuations, &[false, true, true, true, false]);
+/// assert!(lines[1..4].iter().all(|line| line.span().line == 0));
+/// assert_eq!(lines[3].gcodes()[0].major_number(), 21);
+/// ```
+#[derive(Debug, Copy, Clone, PartialEq)]
+pub struct SplitLines<P = Full>(PhantomData<P>);
+
+impl<P: Profile> Profile for SplitLines<P> {
+    const COMMENTS: bool = P::COMMENTS;
+    const LINE_NUMBERS: bool = P::LINE_NUMBERS;
+    const SPANS: bool = P::SPANS;
+    const SPLIT_OVERFULL_LINES: bool = true;
+}
@@ -0,0 +1,915 @@
+//! Simulating how a milling cutter removes material from a block of stock.
+//!
+//! The [`Stock`] is a 2.5D heightfield: a grid of cells, each storing the
+//! height of the material's top surface. A [`Simulator`] sweeps a [`Tool`]
+//! along each [`Move`] (arcs having already been split into straight
+//! segments by the [`Resolver`]), lowering every cell the tool passes over.
+//!
+//! Because a cell's final height only depends on the moves which pass over
+//! it, the grid is split into bands of rows which are simulated on separate
+//! threads, each replaying the moves in order. Rows are updated a vector's
+//! width at a time.
+//!
+//! ```rust
+//! use gcode::{moves::Toolpath, removal::{Simulator, Stock, Tool}};
+//!
+//! let src = "G0 X-5 Y5 Z5\nG1 Z-1 F100\nG1 X25\nG0 Z5\nG0 X5 Y15\nG0 Z-1\n";
+//! let toolpath = Toolpath::parse(src);
+//! let mut stock = Stock::new([0.0, 0.0, -10.0], [20.0, 20.0, 0.0], 0.1);
+//!
+//! let report = Simulator::new(Tool::Flat { diameter: 4.0 })
+//!     .run(&mut stock, &toolpath.moves);
+//!
+//! // the second move cut a 4mm wide, 1mm deep slot along the 20mm block
+//! assert!((report.removed[1] - 4.0 * 20.0 * 1.0).abs() < 1.0);
+//! assert_eq!(stock.height_at(10.0, 5.0), Some(-1.0));
+//! assert_eq!(stock.height_at(10.0, 10.0), Some(0.0));
+//!
+//! // plunging into the stock with a rapid move is a crash
+//! assert_eq!(report.collisions.len(), 1);
+//! assert_eq!(report.collisions[0].span.line, 5);
+//! ```
+//!
+//! [`Resolver`]: crate::moves::Resolver
+
+use crate::{moves::Move, Span};
+use std::thread;
+
+/// The shape of a cutter.
+#[derive(Debug, Copy, Clone, PartialEq)]
+pub enum Tool {
+    /// A flat end mill.
+    Flat {
+        /// The cutter's diameter.
+        diameter: f32,
+    },
+    /// A ball end mill.
+    Ball {
+        /// The cutter's diameter.
+        diameter: f32,
+    },
+    /// An end mill with rounded corners.
+    BullNose {
+        /// The cutter's diameter.
+        diameter: f32,
+        /// The radius of the rounded corners.
+        corner_radius: f32,
+    },
+}
+
+impl Tool {
+    /// Half the tool's diameter.
+    pub fn radius(&self) -> f32 {
+        match *self {
+            Tool::Flat { diameter }
+            | Tool::Ball { diameter }
+            | Tool::BullNose { diameter, .. } => diameter / 2.0,
+        }
+    }
+
+    /// How far above the tip the tool's surface is, at some squared
+    /// distance from its axis, or infinity outside the tool.
+    fn profile(&self, distance_squared: f32) -> f32 {
+        let radius = self.radius();
+
+        if distance_squared > radius * radius {
+            return f32::INFINITY;
+        }
+
+        match *self {
+            Tool::Flat { .. } => 0.0,
+            Tool::Ball { .. } => {
+                radius - libm::sqrtf(radius * radius - distance_squared)
+            },
+            Tool::BullNose { corner_radius, .. } => {
+                let corner_radius = corner_radius.max(0.0).min(radius);
+                let flat = radius - corner_radius;
+                let into_corner = libm::sqrtf(distance_squared) - flat;
+
+                if into_corner <= 0.0 {
+                    0.0
+                } else {
+                    corner_radius
+                        - libm::sqrtf(
+                            (corner_radius * corner_radius
+                                - into_corner * into_corner)
+                                .max(0.0),
+                        )
+                }
+            },
+        }
+    }
+}
+
+/// A block of material, stored as the height of its top surface on a
+/// regular grid.
+#[derive(Debug, Clone, PartialEq)]
+pub struct Stock {
+    origin: [f32; 2],
+    bottom: f32,
+    cell_size: f32,
+    columns: usize,
+    rows: usize,
+    heights: Vec<f32>,
+    /// For each cell, an index into `spans` for the last move to cut it.
+    /// Empty if history isn't being kept.
+    last_cut: Vec<u32>,
+    spans: Vec<Span>,
+}
+
+const NEVER_CUT: u32 = u32::max_value();
+
+impl Stock {
+    /// Create a rectangular block of stock between two opposite corners,
+    /// divided into square cells `cell_size` wide.
+    pub fn new(min: [f32; 3], max: [f32; 3], cell_size: f32) -> Self {
+        let columns = cells_between(min[0], max[0], cell_size);
+        let rows = cells_between(min[1], max[1], cell_size);
+
+        Stock {
+            origin: [min[0], min[1]],
+            bottom: min[2],
+            cell_size,
+            columns,
+            rows,
+            heights: vec![max[2]; columns * rows],
+            last_cut: vec![NEVER_CUT; columns * rows],
+            spans: Vec::new(),
+        }
+    }
+
+    /// Choose whether to remember which move last cut each cell, for
+    /// [`Stock::remaining_above()`]. This is on by default, but needs memory
+    /// for every move simulated, so it should be turned off when streaming
+    /// long programs through the same [`Stock`].
+    pub fn with_history(self, keep_history: bool) -> Self {
+        let cells = self.heights.len();
+
+        Stock {
+            last_cut: if keep_history {
+                vec![NEVER_CUT; cells]
+            } else {
+                Vec::new()
+            },
+            spans: Vec::new(),
+            ..self
+        }
+    }
+
+    /// Stop remembering which move last cut each cell, in place.
+    pub(crate) fn forget_history(&mut self) {
+        self.last_cut = Vec::new();
+        self.spans = Vec::new();
+    }
+
+    /// Is [`Stock`] remembering which move last cut each cell?
+    pub fn keeps_history(&self) -> bool {
+        self.last_cut.len() == self.heights.len()
+    }
+
+    /// The number of cells along the X axis.
+    pub fn columns(&self) -> usize { self.columns }
+
+    /// The number of cells along the Y axis.
+    pub fn rows(&self) -> usize { self.rows }
+
+    /// The width of each (square) cell.
+    pub fn cell_size(&self) -> f32 { self.cell_size }
+
+    /// The height of every cell, row by row starting from the minimum Y.
+    pub fn heights(&self) -> &[f32] { &self.heights }
+
+    /// The height of the material at a point, if it's within the stock.
+    pub fn height_at(&self, x: f32, y: f32) -> Option<f32> {
+        self.cell_at(x, y).map(|ix| self.heights[ix])
+    }
+
+    fn cell_at(&self, x: f32, y: f32) -> Option<usize> {
+        let column = (x - self.origin[0]) / self.cell_size;
+        let row = (y - self.origin[1]) / self.cell_size;
+
+        if column < 0.0
+            || row < 0.0
+            || column >= self.columns as f32
+            || row >= self.rows as f32
+        {
+            return None;
+        }
+
+        Some(row as usize * self.columns + column as usize)
+    }
+
+    fn cell_area(&self) -> f32 { self.cell_size * self.cell_size }
+
+    /// The volume of material left.
+    pub fn volume(&self) -> f32 {
+        self.heights.iter().map(|h| h - self.bottom).sum::<f32>()
+            * self.cell_area()
+    }
+
+    /// Find the material left above a `target` height (e.g. the floor of a
+    /// pocket), along with the moves which last cut near it.
+    ///
+    /// Without [history](Stock::with_history) all of the remaining material
+    /// is counted as uncut.
+    pub fn remaining_above(&self, target: f32) -> Remaining {
+        let mut remaining = Remaining {
+            cells: 0,
+            volume: 0.0,
+            max_excess: 0.0,
+            uncut_volume: 0.0,
+            by_span: Vec::new(),
+        };
+        let mut by_move = vec![0.0_f32; self.spans.len()];
+
+        let last_cuts = self
+            .last_cut
+            .iter()
+            .copied()
+            .chain(core::iter::repeat(NEVER_CUT));
+
+        for (&height, last_cut) in self.heights.iter().zip(last_cuts) {
+            let excess = height - target;
+
+            if excess <= Simulator::EPSILON {
+                continue;
+            }
+
+            let volume = excess * self.cell_area();
+            remaining.cells += 1;
+            remaining.volume += volume;
+            remaining.max_excess = remaining.max_excess.max(excess);
+
+            match by_move.get_mut(last_cut as usize) {
+                Some(total) => *total += volume,
+                None => remaining.uncut_volume += volume,
+            }
+        }
+
+        remaining.by_span = self
+            .spans
+            .iter()
+            .zip(by_move)
+            .filter(|(_, volume)| *volume > 0.0)
+            .map(|(&span, volume)| (span, volume))
+            .collect();
+        remaining.by_span.sort_by(|a, b| {
+            b.1.partial_cmp(&a.1).unwrap_or(core::cmp::Ordering::Equal)
+        });
+
+        remaining
+    }
+}
+
+fn cells_between(min: f32, max: f32, cell_size: f32) -> usize {
+    libm::ceilf(((max - min) / cell_size).max(0.0)) as usize
+}
+
+/// Material left above some target height, from [`Stock::remaining_above()`].
+#[derive(Debug, Clone, PartialEq)]
+pub struct Remaining {
+    /// The number of cells above the target.
+    pub cells: usize,
+    /// The total volume above the target.
+    pub volume: f32,
+    /// The furthest any cell is above the target.
+    pub max_excess: f32,
+    /// The volume which was never touched by the tool.
+    pub uncut_volume: f32,
+    /// The remaining volume in cells each line was the last to cut, largest
+    /// first.
+    pub by_span: Vec<(Span, f32)>,
+}
+
+/// A rapid move which ran into the stock.
+#[derive(Debug, Copy, Clone, PartialEq)]
+pub struct Collision {
+    /// The offending move.
+    pub span: Span,
+    /// How deep into the material the tool went.
+    pub depth: f32,
+    /// How much material it hit.
+    pub volume: f32,
+}
+
+/// The outcome of [`Simulator::run()`].
+#[derive(Debug, Clone, PartialEq)]
+pub struct Report {
+    /// The total volume of material removed.
+    pub removed_volume: f32,
+    /// The volume removed by each move.
+    pub removed: Vec<f32>,
+    /// The deepest each move cut into the material.
+    pub deepest: Vec<f32>,
+    /// Rapid moves which hit the stock, in program order.
+    pub collisions: Vec<Collision>,
+}
+
+/// Sweeps a [`Tool`] through [`Stock`].
+#[derive(Debug, Copy, Clone, PartialEq)]
+pub struct Simulator {
+    tool: Tool,
+    threads: usize,
+}
+
+impl Simulator {
+    /// Cuts shallower than this are treated as numerical noise.
+    const EPSILON: f32 = 1e-4;
+
+    /// Create a [`Simulator`] using one thread per CPU.
+    pub fn new(tool: Tool) -> Self {
+        let threads = thread::available_parallelism()
+            .map(|n| n.get())
+            .unwrap_or(1);
+
+        Simulator { tool, threads }
+    }
+
+    /// Set how many threads to simulate with.
+    pub fn with_threads(self, threads: usize) -> Self {
+        Simulator {
+            threads: threads.max(1),
+            ..self
+        }
+    }
+
+    /// Remove the material each move cuts, in order.
+    pub fn run(&self, stock: &mut Stock, moves: &[Move]) -> Report {
+        let first_move = stock.spans.len() as u32;
+        if stock.keeps_history() {
+            stock.spans.extend(moves.iter().map(|m| m.span));
+        }
+
+        let pieces = self.pieces(stock, moves, first_move);
+        let columns = stock.columns.max(1);
+        let rows_per_band =
+            (stock.rows + self.threads - 1) / self.threads.max(1);
+        let band_size = rows_per_band.max(1) * columns;
+        let geometry = Geometry::of(stock, self.tool);
+
+        let bands: Vec<Vec<Cut>> = thread::scope(|scope| {
+            let mut last_cuts = stock.last_cut.chunks_mut(band_size);
+            let workers: Vec<_> = stock
+                .heights
+                .chunks_mut(band_size)
+                .enumerate()
+                .map(|(band, heights)| {
+                    let pieces = &pieces;
+                    let first_row = band * rows_per_band;
+                    let last_cut = last_cuts.next();
+
+                    scope.spawn(move || {
+                        let mut band = Band {
+                            geometry,
+                            first_row,
+                            heights,
+                            last_cut,
+                            cuts: vec![Cut::default(); moves.len()],
+                            candidates: Vec::new(),
+                        };
+                        for piece in pieces {
+                            band.sweep(piece, first_move);
+                        }
+                        band.cuts
+                    })
+                })
+                .collect();
+
+            workers
+                .into_iter()
+                .map(|worker| worker.join().expect("The worker panicked"))
+                .collect()
+        });
+
+        let mut cuts = vec![Cut::default(); moves.len()];
+        for band in bands {
+            for (total, cut) in cuts.iter_mut().zip(band) {
+                total.volume += cut.volume;
+                total.depth = total.depth.max(cut.depth);
+            }
+        }
+
+        let cell_area = stock.cell_area();
+        let collisions = moves
+            .iter()
+            .zip(&cuts)
+            .filter(|(m, cut)| m.rapid && cut.depth > Simulator::EPSILON)
+            .map(|(m, cut)| Collision {
+                span: m.span,
+                depth: cut.depth,
+                volume: cut.volume * cell_area,
+            })
+            .collect();
+        let removed: Vec<f32> =
+            cuts.iter().map(|cut| cut.volume * cell_area).collect();
+
+        Report {
+            removed_volume: removed.iter().sum(),
+            removed,
+            deepest: cuts.iter().map(|cut| cut.depth).collect(),
+            collisions,
+        }
+    }
+
+    /// Break moves into pieces which change height by less than a cell, so
+    /// a curved tool sweeping down a ramp is approximated well.
+    fn pieces(
+        &self,
+        stock: &Stock,
+        moves: &[Move],
+        first_move: u32,
+    ) -> Vec<Piece> {
+        let mut pieces = Vec::with_capacity(moves.len());
+
+        for (i, m) in moves.iter().enumerate() {
+            let dz = (m.end[2] - m.start[2]).abs();
+            let steps = if dz > 0.0 && !matches!(self.tool, Tool::Flat { .. }) {
+                libm::ceilf(dz / stock.cell_size).max(1.0) as usize
+            } else {
+                1
+            };
+
+            for step in 0..steps {
+                let lerp = |t: f32| {
+                    [
+                        m.start[0] + (m.end[0] - m.start[0]) * t,
+                        m.start[1] + (m.end[1] - m.start[1]) * t,
+                        m.start[2] + (m.end[2] - m.start[2]) * t,
+                    ]
+                };
+                pieces.push(Piece::new(
+                    lerp(step as f32 / steps as f32),
+                    lerp((step + 1) as f32 / steps as f32),
+                    first_move + i as u32,
+                ));
+            }
+        }
+
+        pieces
+    }
+}
+
+/// The volume (in cells) and depth cut by a move.
+#[derive(Debug, Default, Copy, Clone, PartialEq)]
+struct Cut {
+    volume: f32,
+    depth: f32,
+}
+
+/// A straight section of a move.
+#[derive(Debug, Copy, Clone, PartialEq)]
+struct Piece {
+    start: [f32; 3],
+    delta: [f32; 3],
+    inverse_length_squared: f32,
+    move_index: u32,
+}
+
+impl Piece {
+    fn new(start: [f32; 3], end: [f32; 3], move_index: u32) -> Self {
+        let delta = [end[0] - start[0], end[1] - start[1], end[2] - start[2]];
+        let length_squared = delta[0] * delta[0] + delta[1] * delta[1];
+
+        Piece {
+            start,
+            delta,
+            inverse_length_squared: if length_squared > 0.0 {
+                1.0 / length_squared
+            } else {
+                0.0
+            },
+            move_index,
+        }
+    }
+
+    /// The range of values along one axis the tool covers.
+    fn extent(&self, axis: usize, radius: f32) -> (f32, f32) {
+        let a = self.start[axis];
+        let b = a + self.delta[axis];
+        (a.min(b) - radius, a.max(b) + radius)
+    }
+
+    /// The lowest point of the tool above a point, or infinity if the tool
+    /// doesn't pass over it.
+    ///
+    /// This is exact for a flat tool. Other shapes use the distance from
+    /// the closest point on the piece, which is why ramps are split up.
+    fn lowest(&self, tool: Tool, x: f32, y: f32) -> f32 {
+        let [sx, sy, sz] = self.start;
+        let [dx, dy, dz] = self.delta;
+        let (px, py) = (x - sx, y - sy);
+
+        let along = (px * dx + py * dy) * self.inverse_length_squared;
+        let t = along.max(0.0).min(1.0);
+        let (ex, ey) = (px - dx * t, py - dy * t);
+        let profile = tool.profile(ex * ex + ey * ey);
+
+        if profile.is_infinite() {
+            return profile;
+        }
+
+        // the part of the piece where the tool's axis is close enough to
+        // cover this point (all of it when plunging straight down)
+        let (low, high) = if self.inverse_length_squared > 0.0 {
+            let radius = tool.radius();
+            let perpendicular = (px * px + py * py)
+                - along * along / self.inverse_length_squared;
+            let reach = libm::sqrtf(
+                (radius * radius - perpendicular).max(0.0)
+                    * self.inverse_length_squared,
+            );
+            ((along - reach).max(0.0), (along + reach).min(1.0))
+        } else {
+            (0.0, 1.0)
+        };
+
+        sz + dz * if dz < 0.0 { high } else { low } + profile
+    }
+}
+
+/// Everything a [`Band`] needs to know about the stock and tool.
+#[derive(Debug, Copy, Clone, PartialEq)]
+struct Geometry {
+    tool: Tool,
+    origin: [f32; 2],
+    cell_size: f32,
+    columns: usize,
+    bottom: f32,
+}
+
+impl Geometry {
+    fn of(stock: &Stock, tool: Tool) -> Self {
+        Geometry {
+            tool,
+            origin: stock.origin,
+            cell_size: stock.cell_size,
+            columns: stock.columns,
+            bottom: stock.bottom,
+        }
+    }
+
+    /// The cells whose centres lie between two coordinates on an axis.
+    fn cells(
+        &self,
+        axis: usize,
+        (low, high): (f32, f32),
+        count: usize,
+    ) -> (usize, usize) {
+        let first =
+            libm::ceilf((low - self.origin[axis]) / self.cell_size - 0.5);
+        let last =
+            libm::floorf((high - self.origin[axis]) / self.cell_size - 0.5);
+
+        let first = first.max(0.0) as usize;
+        let end = ((last + 1.0).max(0.0) as usize).min(count);
+        (first.min(end), end)
+    }
+
+    fn centre(&self, axis: usize, cell: usize) -> f32 {
+        self.origin[axis] + (cell as f32 + 0.5) * self.cell_size
+    }
+}
+
+/// A horizontal strip of the stock, simulated by one thread.
+#[derive(Debug)]
+struct Band<'a> {
+    geometry: Geometry,
+    first_row: usize,
+    heights: &'a mut [f32],
+    last_cut: Option<&'a mut [u32]>,
+    cuts: Vec<Cut>,
+    /// Scratch space for the tool's height over each cell in a row.
+    candidates: Vec<f32>,
+}
+
+impl<'a> Band<'a> {
+    fn sweep(&mut self, piece: &Piece, first_move: u32) {
+        let g = self.geometry;
+        let radius = g.tool.radius();
+        let rows = self.heights.len() / g.columns.max(1);
+
+        let (first_row, end_row) =
+            g.cells(1, piece.extent(1, radius), self.first_row + rows);
+        let (first_column, end_column) =
+            g.cells(0, piece.extent(0, radius), g.columns);
+        if end_column <= first_column {
+            return;
+        }
+
+        let candidates = &mut self.candidates;
+        candidates.clear();
+        candidates.resize(end_column - first_column, 0.0);
+        let cut = &mut self.cuts[(piece.move_index - first_move) as usize];
+
+        for row in first_row.max(self.first_row)..end_row {
+            let y = g.centre(1, row);
+
+            for (column, candidate) in
+                (first_column..).zip(candidates.iter_mut())
+            {
+                *candidate =
+                    piece.lowest(g.tool, g.centre(0, column), y).max(g.bottom);
+            }
+
+            let start = (row - self.first_row) * g.columns;
+            let cells = start + first_column..start + end_column;
+            let (volume, depth) =
+                lower(&mut self.heights[cells.clone()], candidates);
+
+            if volume > 0.0 {
+                cut.volume += volume;
+                cut.depth = cut.depth.max(depth);
+
+                if let Some(last_cuts) = self.last_cut.as_mut() {
+                    for ((height, last_cut), candidate) in self.heights
+                        [cells.clone()]
+                    .iter()
+                    .zip(&mut last_cuts[cells])
+                    .zip(candidates.iter())
+                    {
+                        if height == candidate {
+                            *last_cut = piece.move_index;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+/// Lower each height to its candidate if that's lower, returning the total
+/// and largest amounts removed.
+fn lower(heights: &mut [f32], candidates: &[f32]) -> (f32, f32) {
+    imp::lower(heights, candidates)
+}
+
+mod scalar {
+    /// Enough lanes for the compiler to use the widest vectors it has.
+    const LANES: usize = 8;
+
+    pub(super) fn lower(heights: &mut [f32], candidates: &[f32]) -> (f32, f32) {
+        let mut removed = [0.0_f32; LANES];
+        let mut deepest = [0.0_f32; LANES];
+        let mut heights = heights.chunks_exact_mut(LANES);
+        let mut candidates = candidates.chunks_exact(LANES);
+
+        for (h, c) in (&mut heights).zip(&mut candidates) {
+            for lane in 0..LANES {
+                let lowered = h[lane].min(c[lane]);
+                let cut = h[lane] - lowered;
+                removed[lane] += cut;
+                deepest[lane] = deepest[lane].max(cut);
+                h[lane] = lowered;
+            }
+        }
+
+        let (tail_removed, tail_deepest) =
+            lower_each(heights.into_remainder(), candidates.remainder());
+
+        (
+            removed.iter().sum::<f32>() + tail_removed,
+            deepest.iter().fold(tail_deepest, |a, &b| a.max(b)),
+        )
+    }
+
+    pub(super) fn lower_each(
+        heights: &mut [f32],
+        candidates: &[f32],
+    ) -> (f32, f32) {
+        let mut removed = 0.0;
+        let mut deepest = 0.0_f32;
+
+        for (h, &c) in heights.iter_mut().zip(candidates) {
+            let lowered = h.min(c);
+            removed += *h - lowered;
+            deepest = deepest.max(*h - lowered);
+            *h = lowered;
+        }
+
+        (removed, deepest)
+    }
+}
+
+#[cfg(not(all(target_arch = "wasm32", target_feature = "simd128")))]
+use self::scalar as imp;
+
+#[cfg(all(target_arch = "wasm32", target_feature = "simd128"))]
+use self::simd128 as imp;
+
+/// Row updates using WebAssembly's fixed-width SIMD instructions.
+#[cfg(all(target_arch = "wasm32", target_feature = "simd128"))]
+mod simd128 {
+    use core::arch::wasm32::{
+        f32x4, f32x4_add, f32x4_extract_lane, f32x4_max, f32x4_min,
+        f32x4_splat, f32x4_sub, v128,
+    };
+
+    const LANES: usize = 4;
+
+    fn load(chunk: &[f32]) -> v128 {
+        f32x4(chunk[0], chunk[1], chunk[2], chunk[3])
+    }
+
+    fn store(v: v128, chunk: &mut [f32]) {
+        chunk[0] = f32x4_extract_lane::<0>(v);
+        chunk[1] = f32x4_extract_lane::<1>(v);
+        chunk[2] = f32x4_extract_lane::<2>(v);
+        chunk[3] = f32x4_extract_lane::<3>(v);
+    }
+
+    pub(super) fn lower(heights: &mut [f32], candidates: &[f32]) -> (f32, f32) {
+        let mut removed = f32x4_splat(0.0);
+        let mut deepest = f32x4_splat(0.0);
+        let mut heights = heights.chunks_exact_mut(LANES);
+        let mut candidates = candidates.chunks_exact(LANES);
+
+        for (h, c) in (&mut heights).zip(&mut candidates) {
+            let height = load(h);
+            let lowered = f32x4_min(height, load(c));
+            let cut = f32x4_sub(height, lowered);
+            removed = f32x4_add(removed, cut);
+            deepest = f32x4_max(deepest, cut);
+            store(lowered, h);
+        }
+
+        let (tail_removed, tail_deepest) = super::scalar::lower_each(
+            heights.into_remainder(),
+            candidates.remainder(),
+        );
+        let mut lanes = [0.0; LANES];
+        let mut depths = [0.0; LANES];
+        store(removed, &mut lanes);
+        store(deepest, &mut depths);
+
+        (
+            lanes.iter().sum::<f32>() + tail_removed,
+            depths.iter().fold(tail_deepest, |a, &b| a.max(b)),
+        )
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::moves::Toolpath;
+
+    fn simulate(tool: Tool, src: &str) -> (Stock, Report) {
+        let toolpath = Toolpath::parse(src);
+        let mut stock = Stock::new([0.0, 0.0, -10.0], [20.0, 20.0, 0.0], 0.1);
+        let report = Simulator::new(tool).run(&mut stock, &toolpath.moves);
+
+        (stock, report)
+    }
+
+    #[test]
+    fn flat_slot() {
+        let (stock, report) = simulate(
+            Tool::Flat { diameter: 6.0 },
+            "G0 X-5 Y10 Z1\nG1 Z-2\nG1 X25\n",
+        );
+
+        assert_eq!(stock.height_at(10.0, 10.0), Some(-2.0));
+        assert_eq!(stock.height_at(10.0, 12.9), Some(-2.0));
+        assert_eq!(stock.height_at(10.0, 13.1), Some(0.0));
+        let expected = 6.0 * 20.0 * 2.0;
+        assert!((report.removed_volume - expected).abs() < 0.02 * expected);
+        assert!(
+            (stock.volume() - (20.0 * 20.0 * 10.0 - expected)).abs()
+                < 0.02 * expected
+        );
+        // only the second cut touches the stock
+        assert_eq!(report.removed[0], 0.0);
+        assert!(report.collisions.is_empty());
+    }
+
+    #[test]
+    fn ball_end_mill_leaves_a_rounded_groove() {
+        let (stock, _) = simulate(
+            Tool::Ball { diameter: 10.0 },
+            "G0 X-10 Y10.05 Z1\nG1 Z-5\nG1 X30\n",
+        );
+
+        for &offset in &[0.0, 1.0, 2.0, 3.0, 4.0] {
+            let expected = -libm::sqrtf(25.0 - offset * offset);
+            let got = stock.height_at(10.0, 10.05 + offset).unwrap();
+            assert!(
+                (got - expected).abs() < 0.05,
+                "{}: {} != {}",
+                offset,
+                got,
+                expected
+            );
+        }
+    }
+
+    #[test]
+    fn bull_nose_has_a_flat_bottom_and_rounded_corners() {
+        let tool = Tool::BullNose {
+            diameter: 10.0,
+            corner_radius: 2.0,
+        };
+
+        assert_eq!(tool.profile(0.0), 0.0);
+        assert_eq!(tool.profile(3.0 * 3.0), 0.0);
+        assert!((tool.profile(5.0 * 5.0) - 2.0).abs() < 1e-5);
+        assert_eq!(tool.profile(5.1 * 5.1), f32::INFINITY);
+    }
+
+    #[test]
+    fn rapid_moves_into_the_stock_are_collisions() {
+        let src = "G0 X5 Y5 Z5\nG0 Z1\nG0 X15\nG0 Z-0.5\nG1 Z-3\n";
+
+        let (_, report) = simulate(Tool::Flat { diameter: 3.0 }, src);
+
+        assert_eq!(report.collisions.len(), 1);
+        let collision = report.collisions[0];
+        assert_eq!(collision.span.line, 3);
+        assert!((collision.depth - 0.5).abs() < 1e-4);
+        // the feed move afterwards isn't a collision
+        assert!(report.removed[3] > 0.0);
+    }
+
+    #[test]
+    fn arcs_are_cut() {
+        // a full circle of radius 5 around (10, 10)
+        let src = "G0 X15 Y10 Z1\nG1 Z-1\nG2 X15 Y10 I-5 J0\n";
+
+        let (stock, _) = simulate(Tool::Flat { diameter: 2.0 }, src);
+
+        assert_eq!(stock.height_at(10.0, 15.0), Some(-1.0));
+        assert_eq!(stock.height_at(5.0, 10.0), Some(-1.0));
+        assert_eq!(stock.height_at(10.0, 10.0), Some(0.0));
+    }
+
+    #[test]
+    fn threads_dont_change_the_result() {
+        let src = "G0 X0 Y0 Z1\nG1 Z-1\nG1 X20 Y20\nG1 Y0 Z-2\nG0 Z1\nG0 X10 \
+                   Y10\nG1 Z-4\nG2 X10 Y10 I3 J0\n";
+        let toolpath = Toolpath::parse(src);
+        let tool = Tool::Ball { diameter: 4.0 };
+
+        let mut single = Stock::new([0.0, 0.0, -10.0], [20.0, 20.0, 0.0], 0.1);
+        let one = Simulator::new(tool)
+            .with_threads(1)
+            .run(&mut single, &toolpath.moves);
+        let mut many = Stock::new([0.0, 0.0, -10.0], [20.0, 20.0, 0.0], 0.1);
+        let seven = Simulator::new(tool)
+            .with_threads(7)
+            .run(&mut many, &toolpath.moves);
+
+        assert_eq!(single, many);
+        for (a, b) in one.removed.iter().zip(&seven.removed) {
+            assert!((a - b).abs() <= 1e-3 * a.max(1.0));
+        }
+    }
+
+    #[test]
+    fn remaining_material_points_at_the_last_cut() {
+        // the second pass doesn't go deep enough
+        let src =
+            "G0 X-5 Y5 Z1\nG1 Z-2\nG1 X25\nG0 Z1\nG0 Y15\nG1 Z-1.5\nG1 X-5\n";
+
+        let (stock, _) = simulate(Tool::Flat { diameter: 4.0 }, src);
+        let remaining = stock.remaining_above(-2.0);
+
+        let (span, volume) = remaining.by_span[0];
+        assert_eq!(span.line, 6);
+        assert!((volume - 4.0 * 20.0 * 0.5).abs() < 2.0);
+        assert!((remaining.max_excess - 2.0).abs() < 1e-4);
+        assert!(remaining.uncut_volume > 0.0);
+    }
+
+    #[test]
+    fn history_can_be_turned_off() {
+        let src = "G0 X-5 Y5 Z1\nG1 Z-2\nG1 X25\n";
+        let toolpath = Toolpath::parse(src);
+        let mut with = Stock::new([0.0, 0.0, -10.0], [20.0, 20.0, 0.0], 0.1);
+        let mut without = with.clone().with_history(false);
+        let simulator = Simulator::new(Tool::Flat { diameter: 4.0 });
+
+        let a = simulator.run(&mut with, &toolpath.moves);
+        let b = simulator.run(&mut without, &toolpath.moves);
+
+        assert_eq!(a, b);
+        assert_eq!(with.heights(), without.heights());
+        assert!(!without.keeps_history());
+        let remaining = without.remaining_above(-2.0);
+        assert!(remaining.by_span.is_empty());
+        assert_eq!(remaining.uncut_volume, remaining.volume);
+    }
+
+    #[test]
+    fn lowering_matches_a_simple_loop() {
+        let heights: Vec<f32> = (0..37).map(|i| (i % 5) as f32).collect();
+        let candidates: Vec<f32> =
+            (0..37).map(|i| (i % 3) as f32 + 0.5).collect();
+
+        let mut fast = heights.clone();
+        let got = lower(&mut fast, &candidates);
+        let mut slow = heights.clone();
+        let expected = scalar::lower_each(&mut slow, &candidates);
+
+        assert_eq!(fast, slow);
+        assert_eq!(got, expected);
+    }
+}
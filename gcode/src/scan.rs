@@ -0,0 +1,191 @@
+//! Byte-level scanning routines used by the [`Lexer`].
+//!
+//! Everything the lexer skips over in bulk (whitespace, comment bodies) is
+//! found by looking for ASCII bytes, so it can be done 16 bytes at a time
+//! when the target supports it. The scalar versions are always available and
+//! are what the SIMD versions fall back to for the tail of the input.
+//!
+//! [`Lexer`]: crate::lexer::Lexer
+
+use crate::lexer::TokenType;
+
+/// Classify a single byte. Non-ASCII bytes (including the continuation bytes
+/// of a multi-byte character) are always [`TokenType::Unknown`].
+pub(crate) fn classify(byte: u8) -> TokenType { CLASSES[byte as usize] }
+
+const CLASSES: [TokenType; 256] = {
+    let mut classes = [TokenType::Unknown; 256];
+    let mut i = 0;
+
+    while i < 128 {
+        let b = i as u8;
+        classes[i] = if b.is_ascii_alphabetic() {
+            TokenType::Letter
+        } else if b.is_ascii_digit() || b == b'.' || b == b'-' || b == b'+' {
+            TokenType::Number
+        } else if b == b'(' || b == b';' || b == b')' {
+            TokenType::Comment
+        } else {
+            TokenType::Unknown
+        };
+        i += 1;
+    }
+
+    classes
+};
+
+/// The ASCII characters [`char::is_whitespace()`] accepts.
+fn is_ascii_whitespace(b: u8) -> bool {
+    b == b' ' || (b'\t'..=b'\r').contains(&b)
+}
+
+/// Skip leading ASCII whitespace, returning the number of bytes skipped and
+/// how many of them were newlines.
+pub(crate) fn skip_ascii_whitespace(bytes: &[u8]) -> (usize, usize) {
+    imp::skip_ascii_whitespace(bytes)
+}
+
+/// Find the first `'\n'`.
+pub(crate) fn find_newline(bytes: &[u8]) -> Option<usize> {
+    imp::find_either(bytes, b'\n', b'\n')
+}
+
+/// Find the first `'\n'` or `')'`, whichever marks the end of a parenthesized
+/// comment.
+pub(crate) fn find_paren_comment_end(bytes: &[u8]) -> Option<usize> {
+    imp::find_either(bytes, b'\n', b')')
+}
+
+mod scalar {
+    pub(super) fn skip_ascii_whitespace(bytes: &[u8]) -> (usize, usize) {
+        let mut newlines = 0;
+
+        for (i, &b) in bytes.iter().enumerate() {
+            if !super::is_ascii_whitespace(b) {
+                return (i, newlines);
+            }
+            if b == b'\n' {
+                newlines += 1;
+            }
+        }
+
+        (bytes.len(), newlines)
+    }
+
+    pub(super) fn find_either(bytes: &[u8], a: u8, b: u8) -> Option<usize> {
+        bytes.iter().position(|&c| c == a || c == b)
+    }
+}
+
+#[cfg(not(all(target_arch = "wasm32", target_feature = "simd128")))]
+use self::scalar as imp;
+
+#[cfg(all(target_arch = "wasm32", target_feature = "simd128"))]
+use self::simd128 as imp;
+
+/// Implementations using WebAssembly's fixed-width SIMD instructions.
+///
+/// These are selected at compile time, so the crate needs to be built with
+/// `-C target-feature=+simd128` for them to be used.
+#[cfg(all(target_arch = "wasm32", target_feature = "simd128"))]
+mod simd128 {
+    use core::arch::wasm32::{
+        u8x16, u8x16_bitmask, u8x16_eq, u8x16_ge, u8x16_le, u8x16_splat, v128,
+        v128_and, v128_or,
+    };
+
+    const LANES: usize = 16;
+
+    fn load(chunk: &[u8]) -> v128 {
+        u8x16(
+            chunk[0], chunk[1], chunk[2], chunk[3], chunk[4], chunk[5],
+            chunk[6], chunk[7], chunk[8], chunk[9], chunk[10], chunk[11],
+            chunk[12], chunk[13], chunk[14], chunk[15],
+        )
+    }
+
+    pub(super) fn skip_ascii_whitespace(bytes: &[u8]) -> (usize, usize) {
+        let mut newlines = 0;
+        let mut offset = 0;
+
+        for chunk in bytes.chunks_exact(LANES) {
+            let v = load(chunk);
+            let space = u8x16_eq(v, u8x16_splat(b' '));
+            let control = v128_and(
+                u8x16_ge(v, u8x16_splat(b'\t')),
+                u8x16_le(v, u8x16_splat(b'\r')),
+            );
+            let whitespace = u8x16_bitmask(v128_or(space, control)) as u32;
+            let newline = u8x16_bitmask(u8x16_eq(v, u8x16_splat(b'\n'))) as u32;
+
+            // at most 16, because only the low 16 bits of the mask are used
+            let run = (!whitespace).trailing_zeros() as usize;
+            let prefix = (1_u32 << run) - 1;
+            newlines += (newline & prefix).count_ones() as usize;
+
+            if run < LANES {
+                return (offset + run, newlines);
+            }
+            offset += LANES;
+        }
+
+        let (skipped, tail_newlines) =
+            super::scalar::skip_ascii_whitespace(&bytes[offset..]);
+        (offset + skipped, newlines + tail_newlines)
+    }
+
+    pub(super) fn find_either(bytes: &[u8], a: u8, b: u8) -> Option<usize> {
+        let mut offset = 0;
+
+        for chunk in bytes.chunks_exact(LANES) {
+            let v = load(chunk);
+            let mask = u8x16_bitmask(v128_or(
+                u8x16_eq(v, u8x16_splat(a)),
+                u8x16_eq(v, u8x16_splat(b)),
+            ));
+
+            if mask != 0 {
+                return Some(offset + mask.trailing_zeros() as usize);
+            }
+            offset += LANES;
+        }
+
+        super::scalar::find_either(&bytes[offset..], a, b).map(|ix| offset + ix)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn classification_matches_the_char_version() {
+        for b in 0..=255_u8 {
+            let expected = if b.is_ascii() {
+                TokenType::from(b as char)
+            } else {
+                TokenType::Unknown
+            };
+
+            assert_eq!(classify(b), expected, "{:#x}", b);
+        }
+    }
+
+    #[test]
+    fn skip_whitespace_across_chunk_boundaries() {
+        let src = " \t\r\n        \n      \n\x0b\x0c  \n X";
+
+        let got = skip_ascii_whitespace(src.as_bytes());
+
+        assert_eq!(got, (src.len() - 1, 4));
+    }
+
+    #[test]
+    fn find_the_end_of_comments() {
+        let src = "(a comment which is longer than sixteen bytes) G90\n";
+
+        assert_eq!(find_paren_comment_end(src.as_bytes()), src.find(')'));
+        assert_eq!(find_newline(src.as_bytes()), Some(src.len() - 1));
+        assert_eq!(find_newline(b"no newline here, even after 16 bytes"), None);
+    }
+}
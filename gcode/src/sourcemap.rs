@@ -0,0 +1,757 @@
+//! Mapping generated g-code back to the program it came from.
+//!
+//! Once a program has been transformed (e.g. reordered by [`crate::travel`]
+//! or with redundant words removed) its line numbers no longer match the
+//! original file, so an error like *"alarm on line 5531"* can't be traced
+//! back by hand. A [`MappedWriter`] records which [`Span`] of the input
+//! each piece of output came from as it is written, producing a
+//! [`SourceMap`] which can be queried in either direction.
+//!
+//! ```rust
+//! use gcode::sourcemap::MappedWriter;
+//!
+//! let src = "G90\n(setup)\nG01 X10.000 Y20.000\nG01 X15.000\n";
+//! let mut writer = MappedWriter::new(Vec::new());
+//!
+//! for gcode in gcode::parse(src) {
+//!     writer.write_gcode(&gcode).unwrap();
+//!     writer.newline().unwrap();
+//! }
+//! let (output, map) = writer.finish().unwrap();
+//!
+//! assert_eq!(String::from_utf8(output).unwrap(), "G90\nG1 X10 Y20\nG1 X15\n");
+//! // the machine complained about the third line of the output...
+//! assert_eq!(map.input_line(2), Some(3));
+//! // ...and the output for the input's third line is on its second line
+//! assert_eq!(map.output_lines(2).collect::<Vec<_>>(), &[1]);
+//!
+//! // the map can be stored alongside the output and loaded again later
+//! let encoded = map.encode();
+//! assert_eq!(gcode::sourcemap::SourceMap::decode(&encoded).unwrap(), map);
+//! ```
+//!
+//! # Encoding
+//!
+//! [`SourceMap::encode()`] stores each [`Segment`] as the difference from
+//! the previous one, written as variable-length integers (7 bits per byte,
+//! with signed values zig-zag encoded). Output is generated in order and
+//! usually follows the input closely, so most segments fit in 6 bytes.
+
+use crate::{buffers::Buffer, GCode, Span, Word};
+use std::{
+    convert::TryFrom,
+    error::Error,
+    fmt::{self, Display, Formatter},
+    io::{self, Write},
+};
+
+/// A piece of output and the input it was generated from.
+#[derive(Debug, Copy, Clone, PartialEq)]
+#[cfg_attr(
+    feature = "serde-1",
+    derive(serde_derive::Serialize, serde_derive::Deserialize)
+)]
+pub struct Segment {
+    /// Where the text is in the output.
+    pub output: Span,
+    /// Where it came from in the input.
+    pub input: Span,
+}
+
+/// Collects [`Segment`]s as output is generated.
+#[derive(Debug, Default, Clone, PartialEq)]
+pub struct SourceMapBuilder {
+    /// Sorted by output position.
+    segments: Vec<Segment>,
+}
+
+impl SourceMapBuilder {
+    /// Create an empty [`SourceMapBuilder`].
+    pub fn new() -> Self {
+        SourceMapBuilder {
+            segments: Vec::new(),
+        }
+    }
+
+    /// Record that the `output` text was generated from some `input`.
+    ///
+    /// Segments may be added in any order, but the output's line numbers
+    /// must increase along with its byte offsets. Placeholder spans (e.g.
+    /// from a [`crate::profile::Profile`] which skips spans) are ignored.
+    pub fn add(
+        &mut self,
+        output: Span,
+        input: Span,
+    ) -> Result<(), InvalidSegment> {
+        if output.is_placeholder() || input.is_placeholder() {
+            return Ok(());
+        }
+        if output.end < output.start || input.end < input.start {
+            return Err(InvalidSegment::Inverted);
+        }
+
+        // output is normally generated in order, making this an append
+        let index = self
+            .segments
+            .partition_point(|s| s.output.start <= output.start);
+        let after_previous = index
+            .checked_sub(1)
+            .map_or(true, |i| self.segments[i].output.line <= output.line);
+        let before_next = self
+            .segments
+            .get(index)
+            .map_or(true, |next| output.line <= next.output.line);
+
+        if !(after_previous && before_next) {
+            return Err(InvalidSegment::LinesOutOfOrder);
+        }
+
+        self.segments.insert(index, Segment { output, input });
+        Ok(())
+    }
+
+    /// Finish building the [`SourceMap`].
+    pub fn build(self) -> SourceMap { SourceMap::new(self.segments) }
+}
+
+/// The error returned when [`SourceMapBuilder::add()`] is given a
+/// [`Segment`] which doesn't make sense.
+#[derive(Debug, Copy, Clone, PartialEq)]
+pub enum InvalidSegment {
+    /// A span ends before it starts.
+    Inverted,
+    /// The output is on an earlier line than output before it, or a later
+    /// line than output after it.
+    LinesOutOfOrder,
+}
+
+impl Display for InvalidSegment {
+    fn fmt(&self, f: &mut Formatter<'_>) -> fmt::Result {
+        match self {
+            InvalidSegment::Inverted => {
+                write!(f, "The span ends before it starts")
+            },
+            InvalidSegment::LinesOutOfOrder => {
+                write!(f, "The output's line numbers are out of order")
+            },
+        }
+    }
+}
+
+impl Error for InvalidSegment {}
+
+/// A lookup table between output and input positions.
+#[derive(Debug, Default, Clone)]
+pub struct SourceMap {
+    /// Sorted by output position.
+    segments: Vec<Segment>,
+    /// Indices into `segments`, sorted by input position.
+    by_input: Vec<u32>,
+    /// The length of the longest input span, which bounds how far back a
+    /// search through `by_input` needs to go.
+    longest_input: usize,
+}
+
+impl SourceMap {
+    fn new(segments: Vec<Segment>) -> Self {
+        let mut by_input: Vec<u32> = (0..segments.len() as u32).collect();
+        by_input.sort_by_key(|&i| {
+            let s = &segments[i as usize];
+            (s.input.start, s.output.start)
+        });
+        let longest_input = segments
+            .iter()
+            .map(|s| s.input.end.saturating_sub(s.input.start))
+            .max()
+            .unwrap_or(0);
+
+        SourceMap {
+            segments,
+            by_input,
+            longest_input,
+        }
+    }
+
+    /// Every [`Segment`], in the order it appears in the output.
+    pub fn segments(&self) -> &[Segment] { &self.segments }
+
+    /// How many [`Segment`]s are there?
+    pub fn len(&self) -> usize { self.segments.len() }
+
+    /// Is the [`SourceMap`] empty?
+    pub fn is_empty(&self) -> bool { self.segments.is_empty() }
+
+    /// Find the input which generated the output at a particular byte
+    /// offset.
+    pub fn input_at(&self, output_offset: usize) -> Option<Span> {
+        let index = self
+            .segments
+            .partition_point(|s| s.output.start <= output_offset)
+            .checked_sub(1)?;
+        let segment = &self.segments[index];
+
+        if output_offset < segment.output.end {
+            Some(segment.input)
+        } else {
+            None
+        }
+    }
+
+    /// Every input [`Span`] which contributed to a (zero-based) line of
+    /// output.
+    pub fn inputs_for_line(
+        &self,
+        output_line: usize,
+    ) -> impl Iterator<Item = Span> + '_ {
+        let start = self
+            .segments
+            .partition_point(|s| s.output.line < output_line);
+
+        self.segments[start..]
+            .iter()
+            .take_while(move |s| s.output.line == output_line)
+            .map(|s| s.input)
+    }
+
+    /// The (zero-based) input line for a (zero-based) line of output, using
+    /// the first thing written to that line.
+    pub fn input_line(&self, output_line: usize) -> Option<usize> {
+        self.inputs_for_line(output_line)
+            .next()
+            .map(|span| span.line)
+    }
+
+    /// Every piece of output generated from input containing a particular
+    /// byte offset, in the order they were written.
+    pub fn outputs_at(&self, input_offset: usize) -> Vec<Span> {
+        let end = self.by_input.partition_point(|&i| {
+            self.segments[i as usize].input.start <= input_offset
+        });
+        let mut outputs: Vec<Span> = self.by_input[..end]
+            .iter()
+            .rev()
+            .map(|&i| &self.segments[i as usize])
+            .take_while(|s| s.input.start + self.longest_input > input_offset)
+            .filter(|s| input_offset < s.input.end)
+            .map(|s| s.output)
+            .collect();
+
+        outputs.sort_by_key(|s| s.start);
+        outputs
+    }
+
+    /// The (zero-based) output lines generated from a (zero-based) line of
+    /// input, in ascending order.
+    pub fn output_lines(
+        &self,
+        input_line: usize,
+    ) -> impl Iterator<Item = usize> + '_ {
+        let start = self.by_input.partition_point(|&i| {
+            self.segments[i as usize].input.line < input_line
+        });
+        let mut lines: Vec<usize> = self.by_input[start..]
+            .iter()
+            .map(|&i| &self.segments[i as usize])
+            .take_while(|s| s.input.line == input_line)
+            .map(|s| s.output.line)
+            .collect();
+
+        lines.sort_unstable();
+        lines.dedup();
+        lines.into_iter()
+    }
+
+    /// Encode the [`SourceMap`] in a compact binary format.
+    pub fn encode(&self) -> Vec<u8> {
+        let mut buffer = Vec::with_capacity(self.segments.len() * 6 + 8);
+        write_unsigned(&mut buffer, self.segments.len() as u64);
+
+        let mut previous = Segment {
+            output: Span::new(0, 0, 0),
+            input: Span::new(0, 0, 0),
+        };
+
+        for segment in &self.segments {
+            let Segment { output, input } = *segment;
+
+            write_signed(&mut buffer, delta(output.start, previous.output.end));
+            write_unsigned(&mut buffer, (output.end - output.start) as u64);
+            write_unsigned(
+                &mut buffer,
+                (output.line - previous.output.line) as u64,
+            );
+            write_signed(&mut buffer, delta(input.start, previous.input.end));
+            write_unsigned(&mut buffer, (input.end - input.start) as u64);
+            write_signed(&mut buffer, delta(input.line, previous.input.line));
+
+            previous = *segment;
+        }
+
+        buffer
+    }
+
+    /// Load a [`SourceMap`] created by [`SourceMap::encode()`].
+    pub fn decode(mut bytes: &[u8]) -> Result<SourceMap, DecodeError> {
+        let count = usize::try_from(read_unsigned(&mut bytes)?)
+            .map_err(|_| DecodeError::Corrupted)?;
+        // every segment takes at least 6 bytes, so don't let a corrupted
+        // count allocate a huge amount of memory
+        let mut segments = Vec::with_capacity(count.min(bytes.len() / 6));
+
+        let mut previous = Segment {
+            output: Span::new(0, 0, 0),
+            input: Span::new(0, 0, 0),
+        };
+
+        for _ in 0..count {
+            let output_start =
+                undelta(previous.output.end, read_signed(&mut bytes)?)?;
+            let output_end = end(output_start, read_unsigned(&mut bytes)?)?;
+            let output_line = usize::try_from(read_unsigned(&mut bytes)?)
+                .ok()
+                .and_then(|delta| previous.output.line.checked_add(delta))
+                .ok_or(DecodeError::Corrupted)?;
+            let input_start =
+                undelta(previous.input.end, read_signed(&mut bytes)?)?;
+            let input_end = end(input_start, read_unsigned(&mut bytes)?)?;
+            let input_line =
+                undelta(previous.input.line, read_signed(&mut bytes)?)?;
+
+            if output_start < previous.output.start {
+                return Err(DecodeError::Corrupted);
+            }
+
+            let segment = Segment {
+                output: Span::new(output_start, output_end, output_line),
+                input: Span::new(input_start, input_end, input_line),
+            };
+            segments.push(segment);
+            previous = segment;
+        }
+
+        if bytes.is_empty() {
+            Ok(SourceMap::new(segments))
+        } else {
+            Err(DecodeError::Corrupted)
+        }
+    }
+}
+
+impl PartialEq for SourceMap {
+    fn eq(&self, other: &SourceMap) -> bool {
+        // everything else is derived from the segments
+        self.segments == other.segments
+    }
+}
+
+/// The error returned when [`SourceMap::decode()`] is given invalid data.
+#[derive(Debug, Copy, Clone, PartialEq)]
+pub enum DecodeError {
+    /// The data ended part-way through a segment.
+    UnexpectedEnd,
+    /// The data isn't a valid [`SourceMap`].
+    Corrupted,
+}
+
+impl Display for DecodeError {
+    fn fmt(&self, f: &mut Formatter<'_>) -> fmt::Result {
+        match self {
+            DecodeError::UnexpectedEnd => {
+                write!(f, "The source map ended unexpectedly")
+            },
+            DecodeError::Corrupted => write!(f, "The source map is corrupted"),
+        }
+    }
+}
+
+impl Error for DecodeError {}
+
+fn delta(value: usize, previous: usize) -> i64 {
+    value as i64 - previous as i64
+}
+
+/// Undo [`delta()`], making sure the value can be encoded again.
+fn undelta(previous: usize, delta: i64) -> Result<usize, DecodeError> {
+    i64::try_from(previous)
+        .ok()
+        .and_then(|previous| previous.checked_add(delta))
+        .and_then(|value| usize::try_from(value).ok())
+        .ok_or(DecodeError::Corrupted)
+}
+
+/// The end of a span, making sure it can be encoded again.
+fn end(start: usize, len: u64) -> Result<usize, DecodeError> {
+    usize::try_from(len)
+        .ok()
+        .and_then(|len| start.checked_add(len))
+        .filter(|&end| i64::try_from(end).is_ok())
+        .ok_or(DecodeError::Corrupted)
+}
+
+fn write_unsigned(buffer: &mut Vec<u8>, mut value: u64) {
+    while value >= 0x80 {
+        buffer.push((value as u8 & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    buffer.push(value as u8);
+}
+
+fn write_signed(buffer: &mut Vec<u8>, value: i64) {
+    write_unsigned(buffer, ((value << 1) ^ (value >> 63)) as u64);
+}
+
+fn read_unsigned(bytes: &mut &[u8]) -> Result<u64, DecodeError> {
+    let mut value = 0_u64;
+
+    for shift in (0..64).step_by(7) {
+        let (&byte, rest) =
+            bytes.split_first().ok_or(DecodeError::UnexpectedEnd)?;
+        *bytes = rest;
+        value |= u64::from(byte & 0x7f) << shift;
+
+        if byte & 0x80 == 0 {
+            return Ok(value);
+        }
+    }
+
+    Err(DecodeError::Corrupted)
+}
+
+fn read_signed(bytes: &mut &[u8]) -> Result<i64, DecodeError> {
+    let value = read_unsigned(bytes)?;
+    Ok((value >> 1) as i64 ^ -((value & 1) as i64))
+}
+
+/// A [`Write`]r which builds a [`SourceMap`] while g-code is written to it.
+///
+/// Like [`crate::export::Exporter`], output is accumulated in an internal
+/// buffer and written in large chunks.
+#[derive(Debug)]
+pub struct MappedWriter<W: Write> {
+    writer: W,
+    buffer: Vec<u8>,
+    /// How many bytes have already been written to `writer`.
+    flushed: usize,
+    line: usize,
+    builder: SourceMapBuilder,
+}
+
+impl<W: Write> MappedWriter<W> {
+    /// How much output to accumulate before writing it out.
+    pub const FLUSH_THRESHOLD: usize = 64 * 1024;
+
+    /// Create a new [`MappedWriter`].
+    pub fn new(writer: W) -> Self {
+        MappedWriter {
+            writer,
+            buffer: Vec::with_capacity(Self::FLUSH_THRESHOLD + 1024),
+            flushed: 0,
+            line: 0,
+            builder: SourceMapBuilder::new(),
+        }
+    }
+
+    /// The number of bytes written so far.
+    pub fn offset(&self) -> usize { self.flushed + self.buffer.len() }
+
+    /// The (zero-based) line currently being written.
+    pub fn line(&self) -> usize { self.line }
+
+    /// Write a [`GCode`], mapping it back to [`GCode::span()`].
+    ///
+    /// A command which was implied by an earlier line (e.g. the `X3` in
+    /// `G01 X1\nX3`) is mapped back to just its arguments, so it points at
+    /// its own line.
+    pub fn write_gcode<A: Buffer<Word>>(
+        &mut self,
+        gcode: &GCode<A>,
+    ) -> io::Result<()> {
+        let start = self.offset();
+        write!(self.buffer, "{}", gcode)?;
+        self.mapped(start, source_span(gcode))?;
+
+        self.flush_if_full()
+    }
+
+    /// Write some text which was generated from the `input`, or isn't
+    /// associated with any input at all (e.g. a new header).
+    pub fn write_str<S>(&mut self, text: &str, input: S) -> io::Result<()>
+    where
+        S: Into<Option<Span>>,
+    {
+        let start = self.offset();
+        self.buffer.extend_from_slice(text.as_bytes());
+
+        if let Some(input) = input.into() {
+            self.mapped(start, input)?;
+        }
+        self.line += text.bytes().filter(|&b| b == b'\n').count();
+
+        self.flush_if_full()
+    }
+
+    /// Start a new line.
+    pub fn newline(&mut self) -> io::Result<()> {
+        self.buffer.push(b'\n');
+        self.line += 1;
+
+        self.flush_if_full()
+    }
+
+    /// Write any buffered output to the underlying [`Write`]r.
+    pub fn flush(&mut self) -> io::Result<()> {
+        self.writer.write_all(&self.buffer)?;
+        self.flushed += self.buffer.len();
+        self.buffer.clear();
+        self.writer.flush()
+    }
+
+    /// Flush everything, returning the underlying [`Write`]r and the
+    /// finished [`SourceMap`].
+    pub fn finish(mut self) -> io::Result<(W, SourceMap)> {
+        self.flush()?;
+        Ok((self.writer, self.builder.build()))
+    }
+
+    fn mapped(&mut self, start: usize, input: Span) -> io::Result<()> {
+        let output = Span::new(start, self.offset(), self.line);
+        self.builder
+            .add(output, input)
+            .map_err(|e| io::Error::new(io::ErrorKind::InvalidInput, e))
+    }
+
+    fn flush_if_full(&mut self) -> io::Result<()> {
+        if self.buffer.len() >= Self::FLUSH_THRESHOLD {
+            self.flush()?;
+        }
+
+        Ok(())
+    }
+}
+
+/// The part of the input a [`GCode`] came from.
+fn source_span<A: Buffer<Word>>(gcode: &GCode<A>) -> Span {
+    let arguments = gcode
+        .arguments()
+        .iter()
+        .fold(Span::PLACEHOLDER, |span, word| span.merge(word.span));
+
+    if !arguments.is_placeholder() && arguments.line != gcode.span().line {
+        arguments
+    } else {
+        gcode.span()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn minify(src: &str) -> (String, SourceMap) {
+        let mut writer = MappedWriter::new(Vec::new());
+
+        for line in crate::full_parse_with_callbacks(src, crate::Nop) {
+            if line.gcodes().is_empty() {
+                continue;
+            }
+
+            for (i, gcode) in line.gcodes().iter().enumerate() {
+                if i > 0 {
+                    writer.write_str(" ", None).unwrap();
+                }
+                writer.write_gcode(gcode).unwrap();
+            }
+            writer.newline().unwrap();
+        }
+
+        let (output, map) = writer.finish().unwrap();
+        (String::from_utf8(output).unwrap(), map)
+    }
+
+    const SRC: &str = "%\n(header)\nG90 G21\n\nN10 G01 X1.000 Y2.000 \
+                       ; move\nX3.000\n\n\nG00 Z5.000\n";
+
+    #[test]
+    fn every_output_line_maps_back_to_its_input_line() {
+        let (output, map) = minify(SRC);
+
+        assert_eq!(output, "G90 G21\nG1 X1 Y2\nG1 X3\nG0 Z5\n");
+        let lines: Vec<_> = (0..4).map(|i| map.input_line(i)).collect();
+        assert_eq!(lines, &[Some(2), Some(4), Some(5), Some(8)]);
+        assert_eq!(map.input_line(4), None);
+    }
+
+    #[test]
+    fn output_offsets_map_to_input_spans() {
+        let (output, map) = minify(SRC);
+        let x3 = output.find("G1 X3").unwrap();
+
+        let input = map.input_at(x3 + 3).unwrap();
+
+        assert_eq!(input.get_text(SRC), Some("X3.000"));
+        // the space between two commands isn't mapped
+        assert_eq!(map.input_at(3), None);
+    }
+
+    #[test]
+    fn input_positions_map_to_output() {
+        let (output, map) = minify(SRC);
+        let g21 = SRC.find("G21").unwrap();
+
+        let outputs = map.outputs_at(g21 + 1);
+
+        assert_eq!(outputs.len(), 1);
+        assert_eq!(outputs[0].get_text(&output), Some("G21"));
+        assert_eq!(map.output_lines(4).collect::<Vec<_>>(), &[1]);
+        assert_eq!(map.output_lines(3).count(), 0);
+    }
+
+    #[test]
+    fn repeated_input_maps_to_every_copy() {
+        let src = "G01 X1\n";
+        let gcode = crate::parse(src).next().unwrap();
+        let mut writer = MappedWriter::new(Vec::new());
+        for _ in 0..3 {
+            writer.write_gcode(&gcode).unwrap();
+            writer.newline().unwrap();
+        }
+        let (_, map) = writer.finish().unwrap();
+
+        let lines: Vec<_> = map.output_lines(0).collect();
+
+        assert_eq!(lines, &[0, 1, 2]);
+        assert_eq!(map.outputs_at(0).len(), 3);
+    }
+
+    #[test]
+    fn round_trip_through_the_encoding() {
+        let src = include_str!("../tests/data/program_3.gcode");
+        let (_, map) = minify(src);
+
+        let encoded = map.encode();
+        let decoded = SourceMap::decode(&encoded).unwrap();
+
+        assert_eq!(decoded, map);
+        assert!(
+            encoded.len() <= map.len() * 8,
+            "{} bytes for {} segments",
+            encoded.len(),
+            map.len()
+        );
+    }
+
+    #[test]
+    fn out_of_order_segments_are_sorted() {
+        let mut builder = SourceMapBuilder::new();
+        builder
+            .add(Span::new(10, 12, 1), Span::new(0, 2, 0))
+            .unwrap();
+        builder
+            .add(Span::new(0, 5, 0), Span::new(20, 25, 3))
+            .unwrap();
+
+        let map = builder.build();
+
+        assert_eq!(map.input_line(0), Some(3));
+        assert_eq!(map.input_line(1), Some(0));
+        assert_eq!(SourceMap::decode(&map.encode()).unwrap(), map);
+    }
+
+    #[test]
+    fn truncated_maps_are_rejected() {
+        let (_, map) = minify(SRC);
+        let encoded = map.encode();
+
+        let got = SourceMap::decode(&encoded[..encoded.len() - 1]);
+
+        assert_eq!(got, Err(DecodeError::UnexpectedEnd));
+        assert!(SourceMap::decode(&[]).is_err());
+    }
+
+    #[test]
+    fn invalid_segments_are_rejected() {
+        let mut builder = SourceMapBuilder::new();
+        builder
+            .add(Span::new(10, 12, 1), Span::new(0, 2, 0))
+            .unwrap();
+
+        assert_eq!(
+            builder.add(Span::new(5, 3, 0), Span::new(0, 2, 0)),
+            Err(InvalidSegment::Inverted)
+        );
+        assert_eq!(
+            builder.add(Span::new(0, 2, 0), Span::new(4, 1, 0)),
+            Err(InvalidSegment::Inverted)
+        );
+        // after the first segment, but on an earlier line
+        assert_eq!(
+            builder.add(Span::new(20, 22, 0), Span::new(0, 2, 0)),
+            Err(InvalidSegment::LinesOutOfOrder)
+        );
+        // before the first segment, but on a later line
+        assert_eq!(
+            builder.add(Span::new(0, 2, 2), Span::new(0, 2, 0)),
+            Err(InvalidSegment::LinesOutOfOrder)
+        );
+
+        let map = builder.build();
+        assert_eq!(map.len(), 1);
+        assert_eq!(SourceMap::decode(&map.encode()).unwrap(), map);
+    }
+
+    #[test]
+    fn overflowing_values_are_corrupted() {
+        let mut encoded = Vec::new();
+        write_unsigned(&mut encoded, 2);
+        for _ in 0..2 {
+            write_signed(&mut encoded, i64::MAX);
+            write_unsigned(&mut encoded, u64::MAX);
+            write_unsigned(&mut encoded, u64::MAX);
+            write_signed(&mut encoded, i64::MAX);
+            write_unsigned(&mut encoded, u64::MAX);
+            write_signed(&mut encoded, i64::MIN);
+        }
+
+        assert_eq!(SourceMap::decode(&encoded), Err(DecodeError::Corrupted));
+    }
+
+    #[test]
+    fn decoding_garbage_never_panics() {
+        let (_, map) = minify(SRC);
+        let valid = map.encode();
+        // a deterministic stream of pseudo-random bytes
+        let mut seed = 0x2545_f491_u32;
+        let mut random = move || {
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            seed
+        };
+
+        for round in 0..20_000 {
+            let bytes: Vec<u8> = if round % 2 == 0 {
+                // completely random
+                let len = random() as usize % 64;
+                (0..len).map(|_| random() as u8).collect()
+            } else {
+                // a valid map with a few bytes changed
+                let mut bytes = valid.clone();
+                for _ in 0..1 + random() % 4 {
+                    let index = random() as usize % bytes.len();
+                    bytes[index] = match random() % 3 {
+                        0 => 0xff,
+                        1 => 0x7f,
+                        _ => random() as u8,
+                    };
+                }
+                bytes
+            };
+
+            if let Ok(decoded) = SourceMap::decode(&bytes) {
+                // anything we accept must survive a round trip
+                let encoded = decoded.encode();
+                assert_eq!(SourceMap::decode(&encoded), Ok(decoded));
+            }
+        }
+    }
+}
@@ -0,0 +1,758 @@
+//! Splitting a long program into several self-contained programs.
+//!
+//! Very long jobs are often spread across several machines or run as
+//! separate shifts. Just cutting the text into pieces doesn't work because
+//! most commands are modal, so each piece would start with the wrong units,
+//! distance mode, tool, etc. Instead, every part produced by a [`Splitter`]
+//! starts with a preamble (see [`ModalState::write_preamble()`]) which puts
+//! the machine back into the state it would have been in.
+//!
+//! Splitting happens in two steps:
+//!
+//! 1. [`Splitter::plan()`] reads the program once from start to finish, looking
+//!    at each place it could be split (see [`Boundary`]) along with the
+//!    [`ModalState`] and how long the job would have been running. Only a fixed
+//!    number of these candidates are kept (spread evenly over the job), so
+//!    memory usage doesn't depend on the size of the program
+//! 2. [`Plan::write()`] copies each [`Part`] to its own output in parallel,
+//!    seeking straight to where that part starts
+//!
+//! ```rust
+//! use gcode::split::{Boundary, Splitter, Target};
+//! use std::{io::Cursor, sync::Mutex};
+//!
+//! let src = "G21 G90\nT1 M6\nG0 Z5\nG0 X10 Y10\nG1 Z-1 F300\nT2 M6\nG1 X20\n";
+//! let splitter = Splitter::new(Boundary::ToolChange, Target::Parts(2));
+//!
+//! let plan = splitter.plan(Cursor::new(src))?;
+//! let outputs = Mutex::new(vec![Vec::new(); plan.parts().len()]);
+//!
+//! plan.write(
+//!     || Ok(Cursor::new(src)),
+//!     |part, text: &[u8]| {
+//!         outputs.lock().unwrap()[part].extend_from_slice(text);
+//!         Ok(())
+//!     },
+//! )?;
+//!
+//! let outputs = outputs.into_inner().unwrap();
+//! let second = String::from_utf8(outputs[1].clone()).unwrap();
+//! // the old tool isn't put back just to be swapped straight away
+//! assert_eq!(second, "(part 2 of 2)\nG21\nG90\nG1 F300\nT2 M6\nG1 X20\n");
+//! # Ok::<(), std::io::Error>(())
+//! ```
+
+use crate::{
+    state::{ModalState, Motion, Position, Units},
+    streaming::StreamingParser,
+    Line, Mnemonic, Nop,
+};
+use std::{
+    fs::File,
+    io::{self, BufRead, BufReader, BufWriter, Read, Seek, SeekFrom, Write},
+    path::{Path, PathBuf},
+    sync::{
+        atomic::{AtomicUsize, Ordering},
+        Mutex,
+    },
+    thread,
+    time::Duration,
+};
+
+/// Where a program may be split.
+#[derive(Debug, Copy, Clone, PartialEq, Eq, Hash)]
+pub enum Boundary {
+    /// Before a line which changes tools.
+    ToolChange,
+    /// Before a line which moves the Z axis up.
+    Layer,
+    /// Before any line containing a command.
+    AnyLine,
+}
+
+/// How the program should be divided up.
+#[derive(Debug, Copy, Clone, PartialEq)]
+pub enum Target {
+    /// Split into (at most) this many parts, each taking roughly the same
+    /// amount of time.
+    Parts(usize),
+    /// Make each part take at most this long, where possible.
+    Duration(Duration),
+}
+
+/// Settings for splitting a program.
+#[derive(Debug, Copy, Clone, PartialEq)]
+pub struct Splitter {
+    boundary: Boundary,
+    target: Target,
+    rapid_rate: f32,
+    clearance: Option<f32>,
+}
+
+impl Splitter {
+    /// The rapid rate used when none is specified, in mm/min.
+    pub const DEFAULT_RAPID_RATE: f32 = 3000.0;
+
+    /// Create a new [`Splitter`].
+    pub fn new(boundary: Boundary, target: Target) -> Self {
+        Splitter {
+            boundary,
+            target,
+            rapid_rate: Splitter::DEFAULT_RAPID_RATE,
+            clearance: None,
+        }
+    }
+
+    /// Set the speed (in mm/min) used for rapid moves and moves without a
+    /// feed rate when estimating how long the program takes.
+    pub fn with_rapid_rate(self, rapid_rate: f32) -> Self {
+        Splitter { rapid_rate, ..self }
+    }
+
+    /// Set a Z height which is safe to move across the work at, for
+    /// programs that don't move up to one themselves. Each part's preamble
+    /// retracts to the highest of this and any Z the program has used (see
+    /// [`ModalState::clearance`]).
+    pub fn with_clearance(self, clearance: f32) -> Self {
+        Splitter {
+            clearance: Some(clearance),
+            ..self
+        }
+    }
+
+    /// Read through a program and decide where to split it.
+    pub fn plan<R: BufRead>(&self, mut reader: R) -> io::Result<Plan> {
+        let mut scanner = Scanner::new(self);
+        let mut parser: StreamingParser<Nop> = StreamingParser::new(Nop);
+        let mut buffer = Vec::new();
+
+        loop {
+            buffer.clear();
+            let bytes_read = reader.read_until(b'\n', &mut buffer)?;
+            if bytes_read == 0 {
+                break;
+            }
+
+            if buffer.ends_with(b"\n") {
+                parser.push(&buffer, |line| scanner.on_line(&line));
+            } else {
+                parser.push(&buffer, |_| unreachable!());
+                parser.finish(|line| scanner.on_line(&line));
+            }
+            scanner.offset += bytes_read as u64;
+        }
+
+        Ok(scanner.into_plan())
+    }
+}
+
+/// A place the program could be split.
+#[derive(Debug, Copy, Clone, PartialEq)]
+struct Candidate {
+    offset: u64,
+    state: ModalState,
+    elapsed: f64,
+    /// Does the line at `offset` change tool?
+    changes_tool: bool,
+}
+
+/// Keeps track of the [`Candidate`]s while reading a program.
+#[derive(Debug)]
+struct Scanner {
+    boundary: Boundary,
+    rapid_rate: f32,
+    state: ModalState,
+    /// Estimated running time, in minutes.
+    elapsed: f64,
+    offset: u64,
+    cuts: Cuts,
+}
+
+/// Choosing where to cut, without remembering every [`Candidate`].
+#[derive(Debug)]
+enum Cuts {
+    /// The cut points depend on the total running time, which isn't known
+    /// until the end, so keep a bounded sample of candidates spread evenly
+    /// over the job.
+    Parts {
+        parts: usize,
+        candidates: Vec<Candidate>,
+        capacity: usize,
+        /// Candidates closer than this (in minutes) to the last one kept
+        /// are skipped. It grows each time the sample is thinned out.
+        min_gap: f64,
+    },
+    /// Cuts can be decided as we go, only looking back one candidate.
+    Duration {
+        budget: f64,
+        part_start: f64,
+        previous: Option<Candidate>,
+        cuts: Vec<Candidate>,
+    },
+}
+
+impl Cuts {
+    /// The most candidates kept when splitting into a number of parts.
+    const SAMPLE_SIZE: usize = 4096;
+
+    fn new(target: Target) -> Self {
+        match target {
+            Target::Parts(parts) => Cuts::Parts {
+                parts,
+                candidates: Vec::new(),
+                capacity: Cuts::SAMPLE_SIZE.max(4 * parts),
+                min_gap: 0.0,
+            },
+            Target::Duration(budget) => Cuts::Duration {
+                budget: budget.as_secs_f64() / 60.0,
+                part_start: 0.0,
+                previous: None,
+                cuts: Vec::new(),
+            },
+        }
+    }
+
+    fn candidate(&mut self, candidate: Candidate) {
+        match self {
+            Cuts::Parts {
+                candidates,
+                capacity,
+                min_gap,
+                ..
+            } => {
+                if let Some(last) = candidates.last() {
+                    if candidate.elapsed - last.elapsed < *min_gap {
+                        return;
+                    }
+                }
+                candidates.push(candidate);
+
+                if candidates.len() >= *capacity {
+                    // drop every second candidate, and keep new ones at
+                    // least as far apart as the survivors
+                    let mut index = 0;
+                    candidates.retain(|_| {
+                        index += 1;
+                        index % 2 == 1
+                    });
+                    let first = candidates[0].elapsed;
+                    let last = candidates[candidates.len() - 1].elapsed;
+                    *min_gap = (last - first) / candidates.len() as f64;
+                }
+            },
+            Cuts::Duration {
+                budget,
+                part_start,
+                previous,
+                cuts,
+            } => {
+                if candidate.elapsed - *part_start > *budget {
+                    // cut as late as possible without going over budget
+                    let cut = match *previous {
+                        Some(p) if p.elapsed > *part_start => p,
+                        _ => candidate,
+                    };
+                    cuts.push(cut);
+                    *part_start = cut.elapsed;
+                }
+                *previous = Some(candidate);
+            },
+        }
+    }
+
+    fn finish(self, total: f64) -> Vec<Candidate> {
+        match self {
+            Cuts::Parts {
+                parts, candidates, ..
+            } => {
+                let mut cuts = Vec::new();
+                let mut remaining = candidates.into_iter().peekable();
+
+                for k in 1..parts.max(1) {
+                    let goal = total * k as f64 / parts as f64;
+
+                    // find the candidate closest to the goal
+                    let mut best = None;
+                    while let Some(candidate) = remaining.peek() {
+                        if candidate.elapsed > goal {
+                            let overshoot = candidate.elapsed - goal;
+                            let undershoot = best
+                                .map(|b: Candidate| goal - b.elapsed)
+                                .unwrap_or(std::f64::INFINITY);
+                            if overshoot < undershoot {
+                                best = remaining.next();
+                            }
+                            break;
+                        }
+                        best = remaining.next();
+                    }
+
+                    if let Some(best) = best {
+                        cuts.push(best);
+                    }
+                }
+
+                cuts
+            },
+            Cuts::Duration { cuts, .. } => cuts,
+        }
+    }
+}
+
+impl Scanner {
+    fn new(splitter: &Splitter) -> Self {
+        Scanner {
+            boundary: splitter.boundary,
+            rapid_rate: splitter.rapid_rate,
+            state: ModalState {
+                clearance: splitter.clearance,
+                ..ModalState::new()
+            },
+            elapsed: 0.0,
+            offset: 0,
+            cuts: Cuts::new(splitter.target),
+        }
+    }
+
+    fn on_line(&mut self, line: &Line<'_>) {
+        let before = self.state;
+        let elapsed_before = self.elapsed;
+        let mut changes_tool = false;
+
+        for gcode in line.gcodes() {
+            let start = self.state.position;
+            self.state.apply(gcode);
+
+            if let Some(motion) = self.state.motion {
+                let distance = start.distance_to(&self.state.position);
+                self.elapsed += f64::from(distance / self.rate(motion));
+            }
+            changes_tool |= gcode.mnemonic() == Mnemonic::ToolChange
+                || (gcode.mnemonic() == Mnemonic::Miscellaneous
+                    && gcode.major_number() == 6);
+        }
+
+        let is_boundary = match self.boundary {
+            Boundary::ToolChange => changes_tool,
+            Boundary::Layer => match (before.position.z, self.state.position.z)
+            {
+                (Some(previous), Some(current)) => current > previous,
+                _ => false,
+            },
+            Boundary::AnyLine => !line.gcodes().is_empty(),
+        };
+
+        if is_boundary && self.offset > 0 {
+            self.cuts.candidate(Candidate {
+                offset: self.offset,
+                state: before,
+                elapsed: elapsed_before,
+                changes_tool,
+            });
+        }
+    }
+
+    /// How fast a move will be, in program units per minute.
+    fn rate(&self, motion: Motion) -> f32 {
+        let rapid_rate = match self.state.units {
+            Some(Units::Inches) => self.rapid_rate / 25.4,
+            _ => self.rapid_rate,
+        };
+
+        match (motion, self.state.feed_rate) {
+            (Motion::Rapid, _) => rapid_rate,
+            (_, Some(feed_rate)) if feed_rate > 0.0 => feed_rate,
+            _ => rapid_rate,
+        }
+    }
+
+    fn into_plan(self) -> Plan {
+        let total = self.elapsed;
+        let cuts = self.cuts.finish(total);
+
+        let mut parts = Vec::new();
+        let mut start = Candidate {
+            offset: 0,
+            state: ModalState::new(),
+            elapsed: 0.0,
+            changes_tool: false,
+        };
+
+        let end = Candidate {
+            offset: self.offset,
+            state: self.state,
+            elapsed: total,
+            changes_tool: false,
+        };
+
+        for cut in cuts.into_iter().chain(std::iter::once(end)) {
+            if cut.offset <= start.offset && !parts.is_empty() {
+                continue;
+            }
+            parts.push(Part {
+                start: start.offset,
+                end: cut.offset,
+                state: start.state,
+                estimated_duration: minutes(cut.elapsed - start.elapsed),
+                changes_tool: start.changes_tool,
+            });
+            start = cut;
+        }
+
+        Plan { parts }
+    }
+}
+
+fn minutes(minutes: f64) -> Duration {
+    Duration::from_secs_f64((minutes * 60.0).max(0.0))
+}
+
+/// A contiguous chunk of the original program.
+#[derive(Debug, Copy, Clone, PartialEq)]
+pub struct Part {
+    /// The byte offset this part starts at.
+    pub start: u64,
+    /// The byte offset one past the end of this part.
+    pub end: u64,
+    /// The state of the machine when this part starts.
+    pub state: ModalState,
+    /// Roughly how long this part will take to run.
+    pub estimated_duration: Duration,
+    /// Does this part start by changing tool?
+    pub changes_tool: bool,
+}
+
+impl Part {
+    /// Write this part's preamble.
+    ///
+    /// If the part starts by changing tool, the old tool isn't restored or
+    /// moved back into position first. That also means `G92` offsets on the
+    /// X, Y and Z axes can't be restored.
+    pub fn preamble(&self, index: usize, total: usize) -> String {
+        let mut state = self.state;
+        if self.changes_tool {
+            state.tool = None;
+            state.position = Position::default();
+            state.clearance = None;
+        }
+
+        let mut preamble = format!("(part {} of {})\n", index + 1, total);
+        state
+            .write_preamble(&mut preamble)
+            .expect("Writing to a String never fails");
+        preamble
+    }
+
+    /// Write the preamble followed by this part of the original program.
+    fn copy<R, W>(
+        &self,
+        index: usize,
+        total: usize,
+        mut reader: R,
+        writer: &mut W,
+    ) -> io::Result<()>
+    where
+        R: Read + Seek,
+        W: Write,
+    {
+        writer.write_all(self.preamble(index, total).as_bytes())?;
+        let _ = reader.seek(SeekFrom::Start(self.start))?;
+        let _ = io::copy(&mut reader.take(self.end - self.start), writer)?;
+        Ok(())
+    }
+}
+
+/// Adapts the `emit` callback from [`Plan::write()`] to a [`Write`]r.
+struct Emit<'a, E> {
+    index: usize,
+    emit: &'a E,
+}
+
+impl<'a, E> Write for Emit<'a, E>
+where
+    E: Fn(usize, &[u8]) -> io::Result<()>,
+{
+    fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
+        (self.emit)(self.index, buf)?;
+        Ok(buf.len())
+    }
+
+    fn flush(&mut self) -> io::Result<()> { Ok(()) }
+}
+
+/// Where a program will be split.
+#[derive(Debug, Clone, PartialEq)]
+pub struct Plan {
+    parts: Vec<Part>,
+}
+
+impl Plan {
+    /// The individual [`Part`]s, in order.
+    pub fn parts(&self) -> &[Part] { &self.parts }
+
+    /// Write each [`Part`] in parallel.
+    ///
+    /// Each thread calls `open` to get its own handle to the original
+    /// program, then passes the part's text to `emit` in pieces (starting
+    /// with the preamble) along with the part's index.
+    pub fn write<R, O, E>(&self, open: O, emit: E) -> io::Result<()>
+    where
+        R: Read + Seek,
+        O: Fn() -> io::Result<R> + Sync,
+        E: Fn(usize, &[u8]) -> io::Result<()> + Sync,
+    {
+        self.write_parts(|index, part| {
+            let mut writer = Emit { index, emit: &emit };
+            part.copy(index, self.parts.len(), open()?, &mut writer)
+        })
+    }
+
+    /// Run `write_part` for every [`Part`], using one thread per CPU.
+    fn write_parts<F>(&self, write_part: F) -> io::Result<()>
+    where
+        F: Fn(usize, &Part) -> io::Result<()> + Sync,
+    {
+        let next = AtomicUsize::new(0);
+        let first_error = Mutex::new(None);
+        let workers = thread::available_parallelism()
+            .map(|n| n.get())
+            .unwrap_or(1)
+            .min(self.parts.len());
+
+        thread::scope(|s| {
+            for _ in 0..workers {
+                let _ = s.spawn(|| loop {
+                    let index = next.fetch_add(1, Ordering::Relaxed);
+                    let part = match self.parts.get(index) {
+                        Some(part) => part,
+                        None => return,
+                    };
+
+                    if let Err(e) = write_part(index, part) {
+                        let _ = first_error.lock().unwrap().get_or_insert(e);
+                        return;
+                    }
+                });
+            }
+        });
+
+        match first_error.into_inner().unwrap() {
+            Some(e) => Err(e),
+            None => Ok(()),
+        }
+    }
+}
+
+/// Split a file, writing each part to the path returned by `output`.
+pub fn split_file<F>(
+    input: &Path,
+    splitter: &Splitter,
+    output: F,
+) -> io::Result<Plan>
+where
+    F: Fn(usize) -> PathBuf + Sync,
+{
+    let plan = splitter.plan(BufReader::new(File::open(input)?))?;
+
+    plan.write_parts(|index, part| {
+        let mut writer = BufWriter::new(File::create(output(index))?);
+        part.copy(index, plan.parts.len(), File::open(input)?, &mut writer)?;
+        writer.flush()
+    })?;
+
+    Ok(plan)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::io::Cursor;
+
+    const PROGRAM: &str = "\
+G21 G90
+T1 M6
+G0 X0 Y0 Z1
+G1 Z0 F600
+G1 X60
+G1 Y60
+G0 Z2
+G1 Z1
+G1 X0
+G1 Y0
+T2 M6
+G1 X60 F1200
+G0 Z3
+G1 Y60
+";
+
+    fn split(splitter: Splitter, src: &str) -> Vec<String> {
+        let plan = splitter.plan(Cursor::new(src)).unwrap();
+        let outputs = Mutex::new(vec![Vec::new(); plan.parts().len()]);
+
+        plan.write(
+            || Ok(Cursor::new(src)),
+            |part, text| {
+                outputs.lock().unwrap()[part].extend_from_slice(text);
+                Ok(())
+            },
+        )
+        .unwrap();
+
+        outputs
+            .into_inner()
+            .unwrap()
+            .into_iter()
+            .map(|text| String::from_utf8(text).unwrap())
+            .collect()
+    }
+
+    /// Strip the preambles and glue the parts back together.
+    fn reassemble(parts: &[String], plan: &Plan) -> String {
+        parts
+            .iter()
+            .enumerate()
+            .map(|(i, text)| {
+                let preamble = plan.parts()[i].preamble(i, parts.len());
+                text[preamble.len()..].to_string()
+            })
+            .collect()
+    }
+
+    #[test]
+    fn split_at_tool_changes() {
+        let splitter = Splitter::new(Boundary::ToolChange, Target::Parts(2));
+
+        let parts = split(splitter, PROGRAM);
+
+        assert_eq!(parts.len(), 2);
+        assert!(parts[0].starts_with("(part 1 of 2)\nG21 G90\n"));
+        assert_eq!(
+            parts[1],
+            "(part 2 of 2)\nG21\nG90\nG1 F600\nT2 M6\nG1 X60 F1200\nG0 \
+             Z3\nG1 Y60\n"
+        );
+    }
+
+    #[test]
+    fn the_parts_contain_the_whole_program() {
+        for &boundary in
+            &[Boundary::ToolChange, Boundary::Layer, Boundary::AnyLine]
+        {
+            for parts in 1..6 {
+                let splitter = Splitter::new(boundary, Target::Parts(parts));
+                let plan = splitter.plan(Cursor::new(PROGRAM)).unwrap();
+
+                let got = split(splitter, PROGRAM);
+
+                assert!(got.len() <= parts);
+                assert_eq!(reassemble(&got, &plan), PROGRAM);
+            }
+        }
+    }
+
+    #[test]
+    fn preambles_retract_to_the_clearance_height() {
+        let src = "G21 G90\nT1 M6\nG0 X10 Y10\nG1 Z-1 F300\nG1 X20\nG1 X30\n";
+        let splitter = Splitter::new(Boundary::AnyLine, Target::Parts(2))
+            .with_clearance(10.0);
+
+        let parts = split(splitter, src);
+
+        assert!(parts[1].contains("T1 M6\nG0 Z10\nG0 X20 Y10\nG1 Z-1 F300\n"));
+    }
+
+    #[test]
+    fn the_candidates_kept_are_bounded() {
+        let line = "G1 X10 F600\nG1 X0\n";
+        let src = line.repeat(Cuts::SAMPLE_SIZE * 3);
+        let splitter = Splitter::new(Boundary::AnyLine, Target::Parts(4));
+        let mut scanner = Scanner::new(&splitter);
+        let mut parser: StreamingParser<Nop> = StreamingParser::new(Nop);
+
+        parser.push(src.as_bytes(), |l| {
+            scanner.on_line(&l);
+            scanner.offset += 1;
+        });
+
+        match &scanner.cuts {
+            Cuts::Parts { candidates, .. } => {
+                assert!(candidates.len() < Cuts::SAMPLE_SIZE);
+                assert!(candidates.len() > Cuts::SAMPLE_SIZE / 4);
+            },
+            other => panic!("{:?}", other),
+        }
+
+        // the parts are still even
+        let plan = scanner.into_plan();
+        assert_eq!(plan.parts().len(), 4);
+        let durations: Vec<f64> = plan
+            .parts()
+            .iter()
+            .map(|p| p.estimated_duration.as_secs_f64())
+            .collect();
+        let mean = durations.iter().sum::<f64>() / 4.0;
+        assert!(durations.iter().all(|d| (d - mean).abs() < mean * 0.01));
+    }
+
+    #[test]
+    fn split_at_layers() {
+        let splitter = Splitter::new(Boundary::Layer, Target::Parts(10));
+
+        let plan = splitter.plan(Cursor::new(PROGRAM)).unwrap();
+
+        // "G0 Z2" and "G0 Z3" are the only times Z goes up
+        let starts: Vec<u64> = plan.parts().iter().map(|p| p.start).collect();
+        assert_eq!(
+            starts,
+            &[
+                0,
+                PROGRAM.find("G0 Z2").unwrap() as u64,
+                PROGRAM.find("G0 Z3").unwrap() as u64
+            ]
+        );
+        assert_eq!(plan.parts()[1].state.position.z, Some(0.0));
+    }
+
+    #[test]
+    fn split_by_duration() {
+        // each 60mm cut at 600mm/min takes 6 seconds
+        let splitter = Splitter::new(
+            Boundary::AnyLine,
+            Target::Duration(Duration::from_secs(7)),
+        );
+
+        let plan = splitter.plan(Cursor::new(PROGRAM)).unwrap();
+
+        assert!(plan.parts().len() > 3);
+        for part in &plan.parts()[..plan.parts().len() - 1] {
+            assert!(
+                part.estimated_duration <= Duration::from_secs(7),
+                "{:?}",
+                part
+            );
+        }
+    }
+
+    #[test]
+    fn split_a_file() {
+        let dir = std::env::temp_dir()
+            .join(format!("gcode-split-{}", std::process::id()));
+        std::fs::create_dir_all(&dir).unwrap();
+        let input = dir.join("input.gcode");
+        std::fs::write(&input, PROGRAM).unwrap();
+        let splitter = Splitter::new(Boundary::ToolChange, Target::Parts(2));
+
+        let plan =
+            split_file(&input, &splitter, |i| dir.join(format!("{}.gcode", i)))
+                .unwrap();
+
+        let parts: Vec<String> = (0..plan.parts().len())
+            .map(|i| {
+                std::fs::read_to_string(dir.join(format!("{}.gcode", i)))
+                    .unwrap()
+            })
+            .collect();
+        assert_eq!(parts, split(splitter, PROGRAM));
+        std::fs::remove_dir_all(&dir).unwrap();
+    }
+}
@@ -0,0 +1,546 @@
+//! Keeping track of a machine's modal state as a program is executed.
+//!
+//! Most g-code commands are *modal*, meaning they change some setting (units,
+//! distance mode, feed rate, etc.) which sticks around until another command
+//! changes it. A [`ModalState`] follows along with a program so you can find
+//! out what those settings are at any point, and generate a preamble which
+//! restores them.
+//!
+//! ```rust
+//! use gcode::state::{DistanceMode, ModalState, Units};
+//!
+//! let mut state = ModalState::new();
+//!
+//! for gcode in gcode::parse("G21 G28\nG91\nG01 X5 F1200\nG01 X5") {
+//!     state.apply(&gcode);
+//! }
+//!
+//! assert_eq!(state.units, Some(Units::Millimeters));
+//! assert_eq!(state.distance_mode, Some(DistanceMode::Relative));
+//! assert_eq!(state.position.x, Some(10.0));
+//! assert_eq!(state.feed_rate, Some(1200.0));
+//! ```
+
+use crate::{buffers::Buffer, GCode, Mnemonic, Word};
+use core::fmt::{self, Write};
+
+/// The units used for lengths (`G20`/`G21`).
+#[derive(Debug, Copy, Clone, PartialEq, Eq, Hash)]
+pub enum Units {
+    /// `G20`.
+    Inches,
+    /// `G21`.
+    Millimeters,
+}
+
+/// Whether coordinates are absolute or relative to the current position
+/// (`G90`/`G91`).
+#[derive(Debug, Copy, Clone, PartialEq, Eq, Hash)]
+pub enum DistanceMode {
+    /// `G90`.
+    Absolute,
+    /// `G91`.
+    Relative,
+}
+
+/// The type of motion used when a line only contains coordinates
+/// (`G00` to `G03`).
+#[derive(Debug, Copy, Clone, PartialEq, Eq, Hash)]
+pub enum Motion {
+    /// `G00`.
+    Rapid,
+    /// `G01`.
+    Linear,
+    /// `G02`.
+    ClockwiseArc,
+    /// `G03`.
+    CounterClockwiseArc,
+}
+
+impl Motion {
+    /// The [`Motion`] corresponding to a `G` code's major number.
+    pub fn from_major_number(number: u32) -> Option<Motion> {
+        match number {
+            0 => Some(Motion::Rapid),
+            1 => Some(Motion::Linear),
+            2 => Some(Motion::ClockwiseArc),
+            3 => Some(Motion::CounterClockwiseArc),
+            _ => None,
+        }
+    }
+
+    /// The number to use in a `G` code.
+    pub fn major_number(self) -> u32 {
+        match self {
+            Motion::Rapid => 0,
+            Motion::Linear => 1,
+            Motion::ClockwiseArc => 2,
+            Motion::CounterClockwiseArc => 3,
+        }
+    }
+}
+
+/// Where the machine is, for each axis we know about.
+#[derive(Debug, Default, Copy, Clone, PartialEq)]
+pub struct Position {
+    /// The X coordinate.
+    pub x: Option<f32>,
+    /// The Y coordinate.
+    pub y: Option<f32>,
+    /// The Z coordinate.
+    pub z: Option<f32>,
+}
+
+impl Position {
+    fn axis_mut(&mut self, letter: char) -> Option<&mut Option<f32>> {
+        match letter.to_ascii_lowercase() {
+            'x' => Some(&mut self.x),
+            'y' => Some(&mut self.y),
+            'z' => Some(&mut self.z),
+            _ => None,
+        }
+    }
+
+    /// Get the coordinate for an axis letter, or `None` if this isn't an
+    /// axis we know about.
+    pub fn axis(&self, letter: char) -> Option<Option<f32>> {
+        match letter.to_ascii_lowercase() {
+            'x' => Some(self.x),
+            'y' => Some(self.y),
+            'z' => Some(self.z),
+            _ => None,
+        }
+    }
+
+    /// The straight-line distance to another [`Position`], treating unknown
+    /// coordinates as `0.0`.
+    pub fn distance_to(&self, other: &Position) -> f32 {
+        let delta = |a: Option<f32>, b: Option<f32>| {
+            b.unwrap_or(0.0) - a.unwrap_or(0.0)
+        };
+        let dx = delta(self.x, other.x);
+        let dy = delta(self.y, other.y);
+        let dz = delta(self.z, other.z);
+
+        libm::sqrtf(dx * dx + dy * dy + dz * dz)
+    }
+}
+
+/// The settings which persist from one command to the next.
+///
+/// Anything which hasn't been set by the program yet is `None`, because it
+/// depends on how the machine was configured.
+#[derive(Debug, Default, Copy, Clone, PartialEq)]
+pub struct ModalState {
+    /// Whether extruder (`E`) values are absolute or relative (`M82`/`M83`).
+    /// Relative coordinates (`G91`) also make them relative.
+    pub extrusion_mode: Option<DistanceMode>,
+    /// The extruder position, as an absolute value.
+    pub extruder: Option<f32>,
+    /// How far `G92` has shifted program coordinates from where they would
+    /// otherwise be, for each axis. A machine position is the program
+    /// position minus this offset.
+    pub offset: Position,
+    /// A Z height it's safe to move across the work at, in program
+    /// coordinates. This is the highest Z the program has moved to, so set
+    /// it to something higher beforehand if the program doesn't start with a
+    /// move up to its clearance height.
+    pub clearance: Option<f32>,
+    /// The units used for lengths.
+    pub units: Option<Units>,
+    /// Whether coordinates are absolute or relative.
+    pub distance_mode: Option<DistanceMode>,
+    /// The most recent type of motion.
+    pub motion: Option<Motion>,
+    /// Where the machine is, in program coordinates.
+    pub position: Position,
+    /// The tool that was selected last.
+    pub tool: Option<u32>,
+    /// The feed rate used for non-rapid moves.
+    pub feed_rate: Option<f32>,
+}
+
+impl ModalState {
+    /// Create a new [`ModalState`] where nothing is known.
+    pub fn new() -> Self { ModalState::default() }
+
+    /// Update the state to reflect the effects of a [`GCode`].
+    pub fn apply<A: Buffer<Word>>(&mut self, gcode: &GCode<A>) {
+        if let Some(feed_rate) = gcode.value_for('F') {
+            self.feed_rate = Some(feed_rate);
+        }
+
+        match (gcode.mnemonic(), gcode.major_number(), gcode.minor_number()) {
+            (Mnemonic::General, n @ 0..=3, 0) => {
+                self.motion = Motion::from_major_number(n);
+                self.move_to(gcode.arguments());
+            },
+            (Mnemonic::General, 20, 0) => self.units = Some(Units::Inches),
+            (Mnemonic::General, 21, 0) => self.units = Some(Units::Millimeters),
+            (Mnemonic::General, 28, 0) => self.home(gcode.arguments()),
+            (Mnemonic::General, 90, 0) => {
+                self.distance_mode = Some(DistanceMode::Absolute)
+            },
+            (Mnemonic::General, 91, 0) => {
+                self.distance_mode = Some(DistanceMode::Relative)
+            },
+            (Mnemonic::General, 92, 0) => self.set_position(gcode.arguments()),
+            (Mnemonic::ToolChange, tool, _) => self.tool = Some(tool),
+            (Mnemonic::Miscellaneous, 82, 0) => {
+                self.extrusion_mode = Some(DistanceMode::Absolute)
+            },
+            (Mnemonic::Miscellaneous, 83, 0) => {
+                self.extrusion_mode = Some(DistanceMode::Relative)
+            },
+            (Mnemonic::Miscellaneous, 6, 0) => {
+                if let Some(tool) = gcode.value_for('T') {
+                    self.tool = Some(tool as u32);
+                }
+            },
+            _ => {},
+        }
+    }
+
+    fn move_to(&mut self, arguments: &[Word]) {
+        let relative = self.distance_mode == Some(DistanceMode::Relative);
+        let relative_extrusion =
+            relative || self.extrusion_mode == Some(DistanceMode::Relative);
+
+        for arg in arguments {
+            let (axis, relative) = match self.position.axis_mut(arg.letter) {
+                Some(axis) => (axis, relative),
+                None if arg.letter.to_ascii_lowercase() == 'e' => {
+                    (&mut self.extruder, relative_extrusion)
+                },
+                None => continue,
+            };
+
+            *axis = match *axis {
+                Some(current) if relative => Some(current + arg.value),
+                // moving relative to an unknown position leaves it unknown
+                None if relative => None,
+                _ => Some(arg.value),
+            };
+        }
+
+        self.raise_clearance();
+    }
+
+    fn home(&mut self, arguments: &[Word]) {
+        let mut homed_an_axis = false;
+
+        for arg in arguments {
+            if let Some(axis) = self.position.axis_mut(arg.letter) {
+                *axis = Some(0.0);
+                homed_an_axis = true;
+            }
+            // homing goes back to the machine's own coordinates
+            if let Some(offset) = self.offset.axis_mut(arg.letter) {
+                *offset = None;
+            }
+        }
+
+        if !homed_an_axis {
+            self.position = Position {
+                x: Some(0.0),
+                y: Some(0.0),
+                z: Some(0.0),
+            };
+            self.offset = Position::default();
+        }
+
+        self.raise_clearance();
+    }
+
+    /// `G92`, which says the machine is at a position without moving it.
+    fn set_position(&mut self, arguments: &[Word]) {
+        for arg in arguments {
+            if arg.letter.to_ascii_lowercase() == 'e' {
+                self.extruder = Some(arg.value);
+                continue;
+            }
+
+            let (axis, offset) = match (
+                self.position.axis_mut(arg.letter),
+                self.offset.axis_mut(arg.letter),
+            ) {
+                (Some(axis), Some(offset)) => (axis, offset),
+                _ => continue,
+            };
+
+            // we can only tell how far things moved if we knew where we were
+            if let Some(current) = *axis {
+                let shift = arg.value - current;
+                *offset = Some(offset.unwrap_or(0.0) + shift);
+
+                if arg.letter.to_ascii_lowercase() == 'z' {
+                    self.clearance = self.clearance.map(|c| c + shift);
+                }
+            }
+            *axis = Some(arg.value);
+        }
+
+        self.raise_clearance();
+    }
+
+    fn raise_clearance(&mut self) {
+        if let Some(z) = self.position.z {
+            self.clearance = Some(match self.clearance {
+                Some(clearance) => clearance.max(z),
+                None => z,
+            });
+        }
+    }
+
+    /// Convert a program coordinate to a machine coordinate by undoing any
+    /// `G92` offset.
+    fn machine(program: Option<f32>, offset: Option<f32>) -> Option<f32> {
+        program.map(|p| p - offset.unwrap_or(0.0))
+    }
+
+    /// Write the commands needed to bring a machine into this state, one
+    /// per line.
+    ///
+    /// If [`ModalState::clearance`] is above the target Z, the machine is
+    /// first raised to it. It then moves across in the X-Y plane and feeds
+    /// down to Z with `G1` at the restored feed rate, so the preamble never
+    /// rapids into the work. Without a clearance height it assumes the
+    /// machine starts somewhere safe to move across from (e.g. after
+    /// homing). `G92` offsets and the extruder position are restored last.
+    pub fn write_preamble<W: Write>(&self, w: &mut W) -> fmt::Result {
+        match self.units {
+            Some(Units::Inches) => writeln!(w, "G20")?,
+            Some(Units::Millimeters) => writeln!(w, "G21")?,
+            None => {},
+        }
+
+        if self.distance_mode.is_some() || self.position != Position::default()
+        {
+            // positions are always restored in absolute coordinates
+            writeln!(w, "G90")?;
+        }
+
+        match self.extrusion_mode {
+            Some(DistanceMode::Absolute) => writeln!(w, "M82")?,
+            Some(DistanceMode::Relative) => writeln!(w, "M83")?,
+            None => {},
+        }
+
+        if let Some(tool) = self.tool {
+            writeln!(w, "T{} M6", tool)?;
+        }
+
+        let x = ModalState::machine(self.position.x, self.offset.x);
+        let y = ModalState::machine(self.position.y, self.offset.y);
+        let z = ModalState::machine(self.position.z, self.offset.z);
+        let clearance = ModalState::machine(self.clearance, self.offset.z)
+            .filter(|&clearance| z.map_or(true, |z| clearance > z));
+
+        if let Some(clearance) = clearance {
+            writeln!(w, "G0 Z{}", clearance)?;
+        }
+        if x.is_some() || y.is_some() {
+            write!(w, "G0")?;
+            if let Some(x) = x {
+                write!(w, " X{}", x)?;
+            }
+            if let Some(y) = y {
+                write!(w, " Y{}", y)?;
+            }
+            writeln!(w)?;
+        }
+        if let Some(z) = z {
+            write!(w, "G1 Z{}", z)?;
+            if let Some(feed_rate) = self.feed_rate {
+                write!(w, " F{}", feed_rate)?;
+            }
+            writeln!(w)?;
+        }
+
+        self.write_offsets(w)?;
+
+        if self.distance_mode == Some(DistanceMode::Relative) {
+            writeln!(w, "G91")?;
+        }
+
+        match (self.motion, self.feed_rate) {
+            (Some(motion), Some(feed_rate)) => {
+                writeln!(w, "G{} F{}", motion.major_number(), feed_rate)?
+            },
+            (Some(motion), None) => writeln!(w, "G{}", motion.major_number())?,
+            (None, Some(feed_rate)) => {
+                // there's no command for setting the feed rate on its own
+                writeln!(w, "G1 F{}", feed_rate)?;
+            },
+            (None, None) => {},
+        }
+
+        Ok(())
+    }
+
+    /// Restore the `G92` offsets and extruder position.
+    fn write_offsets<W: Write>(&self, w: &mut W) -> fmt::Result {
+        let shifted = |program: Option<f32>, offset: Option<f32>| match offset {
+            Some(offset) if offset != 0.0 => program,
+            _ => None,
+        };
+        let axes = [
+            ('X', shifted(self.position.x, self.offset.x)),
+            ('Y', shifted(self.position.y, self.offset.y)),
+            ('Z', shifted(self.position.z, self.offset.z)),
+            ('E', self.extruder),
+        ];
+
+        if axes.iter().all(|(_, value)| value.is_none()) {
+            return Ok(());
+        }
+
+        write!(w, "G92")?;
+        for (letter, value) in &axes {
+            if let Some(value) = value {
+                write!(w, " {}{}", letter, value)?;
+            }
+        }
+        writeln!(w)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::prelude::v1::*;
+
+    fn run(src: &str) -> ModalState {
+        let mut state = ModalState::new();
+        for gcode in crate::parse(src) {
+            state.apply(&gcode);
+        }
+        state
+    }
+
+    #[test]
+    fn follow_a_simple_program() {
+        let state = run("G20 G90\nT2 M6\nG0 X1 Y2 Z3\nG1 X4 F100\nY5");
+
+        assert_eq!(
+            state,
+            ModalState {
+                units: Some(Units::Inches),
+                distance_mode: Some(DistanceMode::Absolute),
+                motion: Some(Motion::Linear),
+                position: Position {
+                    x: Some(4.0),
+                    y: Some(5.0),
+                    z: Some(3.0),
+                },
+                tool: Some(2),
+                feed_rate: Some(100.0),
+                clearance: Some(3.0),
+                ..ModalState::default()
+            }
+        );
+    }
+
+    #[test]
+    fn relative_moves_and_homing() {
+        let state = run("G28\nG91\nG1 X1 Y1\nG1 X1\nG92 Z10\nG28 X0");
+
+        assert_eq!(state.position.x, Some(0.0));
+        assert_eq!(state.position.y, Some(1.0));
+        assert_eq!(state.position.z, Some(10.0));
+    }
+
+    #[test]
+    fn preamble_restores_the_state() {
+        let original = run("G28\nG21 G91\nT3\nG1 X5 Y5 Z-1 F300\nG0 Z2");
+        let mut preamble = String::new();
+
+        original.write_preamble(&mut preamble).unwrap();
+
+        assert_eq!(
+            preamble,
+            "G21\nG90\nT3 M6\nG0 X5 Y5\nG1 Z1 F300\nG91\nG0 F300\n"
+        );
+        assert_eq!(run(&preamble), original);
+    }
+
+    #[test]
+    fn relative_moves_from_an_unknown_position_stay_unknown() {
+        let original = run("G21 G91\nG1 X5 F300\nG90\nG0 Y2\nG91\nG1 Y1");
+
+        assert_eq!(original.position.x, None);
+        assert_eq!(original.position.y, Some(3.0));
+        assert_eq!(original.position.z, None);
+
+        let mut preamble = String::new();
+        original.write_preamble(&mut preamble).unwrap();
+
+        // only the axes we know about are moved
+        assert_eq!(preamble, "G21\nG90\nG0 Y3\nG91\nG1 F300\n");
+    }
+
+    #[test]
+    fn preamble_retracts_before_moving_across() {
+        let original = run("G21 G90\nG0 Z5\nG0 X10 Y10\nG1 Z-1 F300\nG1 X20");
+        let mut preamble = String::new();
+
+        original.write_preamble(&mut preamble).unwrap();
+
+        assert_eq!(
+            preamble,
+            "G21\nG90\nG0 Z5\nG0 X20 Y10\nG1 Z-1 F300\nG1 F300\n"
+        );
+        assert_eq!(run(&preamble), original);
+    }
+
+    #[test]
+    fn track_the_extruder() {
+        let state = run("M83\nG1 X1 E2\nG1 X2 E0.5\nM82\nG1 X3 E10\nG1 X4 E11");
+        assert_eq!(state.extrusion_mode, Some(DistanceMode::Absolute));
+        assert_eq!(state.extruder, Some(11.0));
+
+        let state = run("G92 E0\nM83\nG1 X1 E2\nG91\nM82\nG1 X1 E1");
+        // G91 makes extrusion relative too
+        assert_eq!(state.extruder, Some(3.0));
+    }
+
+    #[test]
+    fn preamble_restores_the_extruder_and_offsets() {
+        let original = run(
+            "G28\nG92 X10\nM82\nG0 Z0.4\nG1 X20 Y5 E105.5 F1200\nG92 E0\nG1 X25 E1",
+        );
+        assert_eq!(original.offset.x, Some(10.0));
+        let mut preamble = String::new();
+
+        original.write_preamble(&mut preamble).unwrap();
+
+        // the machine is moved in its own coordinates, then shifted
+        assert_eq!(
+            preamble,
+            "G90\nM82\nG0 X15 Y5\nG1 Z0.4 F1200\nG92 X25 E1\nG1 F1200\n"
+        );
+        let mut restored = ModalState {
+            position: Position {
+                x: Some(0.0),
+                y: Some(0.0),
+                z: Some(0.0),
+            },
+            ..ModalState::default()
+        };
+        for gcode in crate::parse(&preamble) {
+            restored.apply(&gcode);
+        }
+        assert_eq!(restored.position, original.position);
+        assert_eq!(restored.offset, original.offset);
+        assert_eq!(restored.extruder, original.extruder);
+    }
+
+    #[test]
+    fn nothing_known_means_no_preamble() {
+        let mut preamble = String::new();
+
+        ModalState::new().write_preamble(&mut preamble).unwrap();
+
+        assert!(preamble.is_empty());
+    }
+}
@@ -0,0 +1,513 @@
+//! Incremental parsing for text which arrives in pieces.
+//!
+//! A [`StreamingParser`] accepts arbitrary chunks of bytes (e.g. from a socket
+//! or a HTTP download) and emits each [`Line`] as soon as it is complete. Only
+//! the trailing partial line of each chunk is kept around, so memory usage is
+//! bounded by the chunk size and the longest line.
+//!
+//! ```rust
+//! use gcode::{streaming::StreamingParser, Nop};
+//!
+//! let mut parser = StreamingParser::new(Nop);
+//! let mut gcodes = Vec::new();
+//!
+//! for chunk in &["G90\nG0", "1 X5\nY", "10\n"] {
+//!     parser.push(chunk.as_bytes(), |line: gcode::Line<'_>| {
+//!         gcodes.extend(line.gcodes().iter().map(|g| g.to_string()));
+//!     });
+//! }
+//! parser.finish(|_: gcode::Line<'_>| unreachable!());
+//!
+//! assert_eq!(gcodes, &["G90", "G1 X5", "G1 Y10"]);
+//! ```
+//!
+//! Servers juggling thousands of streams can use a [`StreamState`] instead.
+//! It is a small `Copy` value containing everything carried from one line to
+//! the next, so states can be kept in a dense array and any thread can pick
+//! up where the last one left off. The partial line is left in the caller's
+//! own receive buffer.
+//!
+//! ```rust
+//! use gcode::{streaming::StreamState, Line, Nop};
+//!
+//! struct Connection {
+//!     state: StreamState,
+//!     received: Vec<u8>,
+//!     commands: usize,
+//! }
+//!
+//! let mut connections: Vec<Connection> = (0..3)
+//!     .map(|_| Connection {
+//!         state: StreamState::new(),
+//!         received: Vec::new(),
+//!         commands: 0,
+//!     })
+//!     .collect();
+//!
+//! for packet in &["G90\nG0", "1 X5\nY", "10\n"] {
+//!     for conn in &mut connections {
+//!         conn.received.extend_from_slice(packet.as_bytes());
+//!
+//!         let commands = &mut conn.commands;
+//!         let consumed = conn.state.resume(&conn.received, Nop, |line: Line<'_>| {
+//!             *commands += line.gcodes().len();
+//!         });
+//!         let _ = conn.received.drain(..consumed);
+//!     }
+//! }
+//!
+//! assert!(connections.iter().all(|conn| conn.commands == 3));
+//! ```
+
+use crate::{
+    buffers::{Buffers, DefaultBuffers},
+    lexer::Lexer,
+    parser::Lines,
+    profile::Full,
+    scan,
+    words::{Word, WordsOrComments},
+    Callbacks, Line, Span,
+};
+use std::{borrow::Cow, convert::TryFrom, marker::PhantomData};
+
+/// Everything which needs to be remembered between one line and the next.
+///
+/// A [`StreamState`] doesn't own any of the input, so the caller is
+/// responsible for holding onto the bytes [`StreamState::resume()`] didn't
+/// consume and passing them back in (followed by any new input) next time.
+#[derive(Debug, Default, Copy, Clone, PartialEq)]
+pub struct StreamState {
+    /// The byte offset of the next unparsed byte, from the start of the
+    /// stream.
+    offset: u64,
+    /// The (zero-based) line number of the next unparsed byte.
+    line: u32,
+    /// The command used by the last line, for lines which only contain
+    /// arguments.
+    last_command: Option<LastCommand>,
+}
+
+/// A [`Word`] with a more compact [`Span`].
+#[derive(Debug, Copy, Clone, PartialEq)]
+struct LastCommand {
+    letter: char,
+    value: f32,
+    start: u64,
+    len: u32,
+    line: u32,
+}
+
+impl LastCommand {
+    fn from_word(word: Word) -> Option<Self> {
+        Some(LastCommand {
+            letter: word.letter,
+            value: word.value,
+            start: u64::try_from(word.span.start).ok()?,
+            len: u32::try_from(word.span.end - word.span.start).ok()?,
+            line: u32::try_from(word.span.line).ok()?,
+        })
+    }
+
+    fn to_word(self) -> Word {
+        let start = self.start as usize;
+        let span =
+            Span::new(start, start + self.len as usize, self.line as usize);
+        Word::new(self.letter, self.value, span)
+    }
+}
+
+impl StreamState {
+    /// The state at the start of a stream.
+    pub const fn new() -> Self {
+        StreamState {
+            offset: 0,
+            line: 0,
+            last_command: None,
+        }
+    }
+
+    /// How many bytes have been parsed so far.
+    pub fn bytes_parsed(&self) -> u64 { self.offset }
+
+    /// The (zero-based) line number parsing will resume from.
+    pub fn line(&self) -> u32 { self.line }
+
+    /// Parse every complete line at the start of `input`, returning how many
+    /// bytes were consumed.
+    ///
+    /// Anything after the last newline is left alone, and should be passed
+    /// in again once more input has arrived.
+    ///
+    /// Text is expected to be UTF-8. A line containing invalid UTF-8 is
+    /// decoded lossily, which may shift the [`Span`]s within that line, but
+    /// never those of the lines after it.
+    pub fn resume<C, B, F>(
+        &mut self,
+        input: &[u8],
+        callbacks: C,
+        on_line: F,
+    ) -> usize
+    where
+        C: Callbacks,
+        B: for<'input> Buffers<'input>,
+        F: FnMut(Line<'_, B>),
+    {
+        let complete = input
+            .iter()
+            .rposition(|&b| b == b'\n')
+            .map(|newline| newline + 1)
+            .unwrap_or(0);
+
+        if complete > 0 {
+            self.parse(&input[..complete], callbacks, on_line);
+        }
+
+        complete
+    }
+
+    /// Parse the remaining `input` at the end of the stream, even if it
+    /// doesn't end with a newline.
+    ///
+    /// The state is reset afterwards, ready for a new stream.
+    pub fn finish<C, B, F>(&mut self, input: &[u8], callbacks: C, on_line: F)
+    where
+        C: Callbacks,
+        B: for<'input> Buffers<'input>,
+        F: FnMut(Line<'_, B>),
+    {
+        self.parse(input, callbacks, on_line);
+        *self = StreamState::new();
+    }
+
+    fn parse<C, B, F>(
+        &mut self,
+        mut text: &[u8],
+        mut callbacks: C,
+        mut on_line: F,
+    ) where
+        C: Callbacks,
+        B: for<'input> Buffers<'input>,
+        F: FnMut(Line<'_, B>),
+    {
+        // Lossy decoding turns each invalid byte into a 3 byte U+FFFD, so a
+        // line containing invalid UTF-8 is decoded on its own to stop it
+        // shifting the spans of the lines after it
+        while !text.is_empty() {
+            let (src, len): (Cow<'_, str>, usize) =
+                match std::str::from_utf8(text) {
+                    Ok(src) => (Cow::Borrowed(src), text.len()),
+                    Err(e) => {
+                        let valid = e.valid_up_to();
+
+                        match text[..valid].iter().rposition(|&b| b == b'\n') {
+                            // the lines before the invalid one
+                            Some(newline) => {
+                                let src =
+                                    std::str::from_utf8(&text[..=newline])
+                                        .expect(
+                                            "Checked by the first from_utf8()",
+                                        );
+                                (Cow::Borrowed(src), newline + 1)
+                            },
+                            None => {
+                                let end = scan::find_newline(&text[valid..])
+                                    .map_or(text.len(), |n| valid + n + 1);
+                                (String::from_utf8_lossy(&text[..end]), end)
+                            },
+                        }
+                    },
+                };
+
+            self.parse_str(&src, &text[..len], &mut callbacks, &mut on_line);
+            text = &text[len..];
+        }
+    }
+
+    /// Parse `src`, which was decoded from the `raw` bytes.
+    fn parse_str<C, B, F>(
+        &mut self,
+        src: &str,
+        raw: &[u8],
+        callbacks: C,
+        mut on_line: F,
+    ) where
+        C: Callbacks,
+        B: for<'input> Buffers<'input>,
+        F: FnMut(Line<'_, B>),
+    {
+        let tokens =
+            Lexer::starting_at(src, self.offset as usize, self.line as usize);
+        let atoms = WordsOrComments::new(tokens);
+        let mut lines = Lines::<'_, _, _, B, Full>::new(atoms, callbacks)
+            .with_last_gcode_type(self.last_command.map(LastCommand::to_word));
+
+        for line in lines.by_ref() {
+            on_line(line);
+        }
+
+        self.last_command =
+            lines.last_gcode_type().and_then(LastCommand::from_word);
+        self.offset += raw.len() as u64;
+        let newlines = raw.iter().filter(|&&b| b == b'\n').count();
+        self.line = self.line.saturating_add(newlines as u32);
+    }
+}
+
+/// A parser which is fed its input a chunk at a time.
+///
+/// All [`Span`]s are relative to the start of the stream, not the chunk
+/// they came from.
+///
+/// Text is expected to be UTF-8. A line containing invalid UTF-8 is decoded
+/// lossily, which may shift the [`Span`]s within that line.
+#[derive(Debug)]
+pub struct StreamingParser<C, B = DefaultBuffers> {
+    callbacks: C,
+    /// Any bytes which are part of a line we haven't seen the end of yet.
+    pending: Vec<u8>,
+    state: StreamState,
+    _buffers: PhantomData<B>,
+}
+
+impl<C, B> StreamingParser<C, B> {
+    /// Create a new [`StreamingParser`].
+    pub fn new(callbacks: C) -> Self {
+        StreamingParser {
+            callbacks,
+            pending: Vec::new(),
+            state: StreamState::new(),
+            _buffers: PhantomData,
+        }
+    }
+
+    /// How many bytes have been parsed so far.
+    pub fn bytes_parsed(&self) -> usize { self.state.offset as usize }
+
+    /// How many bytes are being held onto because they belong to an
+    /// incomplete line.
+    pub fn bytes_pending(&self) -> usize { self.pending.len() }
+
+    /// Get a reference to the [`Callbacks`].
+    pub fn callbacks(&self) -> &C { &self.callbacks }
+
+    /// Get back the [`Callbacks`] this [`StreamingParser`] was created with.
+    pub fn into_callbacks(self) -> C { self.callbacks }
+}
+
+impl<C, B> StreamingParser<C, B>
+where
+    C: Callbacks,
+    B: for<'input> Buffers<'input>,
+{
+    /// Feed the parser another chunk of input, calling `on_line` for each
+    /// [`Line`] that was completed.
+    pub fn push<F>(&mut self, mut chunk: &[u8], mut on_line: F)
+    where
+        F: FnMut(Line<'_, B>),
+    {
+        if !self.pending.is_empty() {
+            // finish off the line we were in the middle of
+            match scan::find_newline(chunk) {
+                Some(newline) => {
+                    let (head, tail) = chunk.split_at(newline + 1);
+                    self.pending.extend_from_slice(head);
+                    let _ = self.state.resume(
+                        &self.pending,
+                        &mut self.callbacks,
+                        &mut on_line,
+                    );
+                    self.pending.clear();
+                    chunk = tail;
+                },
+                None => {
+                    self.pending.extend_from_slice(chunk);
+                    return;
+                },
+            }
+        }
+
+        // Everything up to the last newline can be parsed in place
+        let consumed =
+            self.state.resume(chunk, &mut self.callbacks, &mut on_line);
+        self.pending.extend_from_slice(&chunk[consumed..]);
+    }
+
+    /// Tell the parser there is no more input, flushing any trailing text
+    /// which didn't end with a newline.
+    ///
+    /// The [`StreamingParser`] can be reused for another stream afterwards.
+    pub fn finish<F>(&mut self, on_line: F)
+    where
+        F: FnMut(Line<'_, B>),
+    {
+        self.state
+            .finish(&self.pending, &mut self.callbacks, on_line);
+        self.pending.clear();
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::{GCode, Nop};
+    use std::prelude::v1::*;
+
+    /// An owned copy of everything a [`Line`] contains, because comments
+    /// borrow from a buffer inside the parser.
+    type Snapshot = (Vec<GCode>, Vec<(String, Span)>, Option<Word>, Span);
+
+    fn snapshot(line: &Line<'_>) -> Snapshot {
+        let comments = line
+            .comments()
+            .iter()
+            .map(|c| (c.value.to_string(), c.span))
+            .collect();
+
+        (
+            line.gcodes().to_vec(),
+            comments,
+            line.line_number(),
+            line.span(),
+        )
+    }
+
+    /// Check snapshots for equality, including the spans ([`Span`]'s
+    /// `PartialEq` treats the placeholder as equal to anything).
+    fn assert_same(got: &[Snapshot], expected: &[Snapshot], context: &str) {
+        assert_eq!(got, expected, "{}", context);
+
+        let spans = |snapshots: &[Snapshot]| -> Vec<(usize, usize, usize)> {
+            snapshots
+                .iter()
+                .map(|s| (s.3.start, s.3.end, s.3.line))
+                .collect()
+        };
+        assert_eq!(spans(got), spans(expected), "{}", context);
+    }
+
+    fn parse_in_chunks(src: &str, chunk_size: usize) -> Vec<Snapshot> {
+        let mut parser = StreamingParser::new(Nop);
+        let mut lines = Vec::new();
+        let mut on_line = |line: Line<'_>| lines.push(snapshot(&line));
+
+        for chunk in src.as_bytes().chunks(chunk_size) {
+            parser.push(chunk, &mut on_line);
+        }
+        parser.finish(&mut on_line);
+
+        lines
+    }
+
+    #[test]
+    fn chunk_size_doesnt_change_the_result() {
+        let src = "G90 (absolute)\nN10 G01 X5 Y-2\n\n; a comment\nX7 Y8\r\nM30";
+        let expected: Vec<_> = crate::full_parse_with_callbacks(src, Nop)
+            .map(|line| snapshot(&line))
+            .collect();
+
+        for chunk_size in 1..src.len() + 1 {
+            let got = parse_in_chunks(src, chunk_size);
+
+            assert_same(
+                &got,
+                &expected,
+                &format!("chunk size: {}", chunk_size),
+            );
+        }
+    }
+
+    #[test]
+    fn only_the_partial_line_is_kept() {
+        let mut parser: StreamingParser<Nop> = StreamingParser::new(Nop);
+        let mut gcodes: Vec<GCode> = Vec::new();
+
+        parser.push(b"G90\nG01 X", |l| gcodes.extend_from_slice(l.gcodes()));
+
+        assert_eq!(gcodes.len(), 1);
+        assert_eq!(parser.bytes_parsed(), 4);
+        assert_eq!(parser.bytes_pending(), 5);
+    }
+
+    #[test]
+    fn stream_state_matches_the_streaming_parser() {
+        let src = "G90 (absolute)\nN10 G01 X5 Y-2\n\n; a comment\nX7 Y8\r\nM30";
+        let expected = parse_in_chunks(src, 7);
+        let mut state = StreamState::new();
+        let mut received = Vec::new();
+        let mut got = Vec::new();
+
+        for chunk in src.as_bytes().chunks(7) {
+            received.extend_from_slice(chunk);
+            let consumed = state
+                .resume(&received, Nop, |l: Line<'_>| got.push(snapshot(&l)));
+            let _ = received.drain(..consumed);
+        }
+        state.finish(&received, Nop, |l: Line<'_>| got.push(snapshot(&l)));
+
+        assert_same(&got, &expected, "resumed");
+        assert_eq!(state, StreamState::new());
+    }
+
+    #[test]
+    fn stream_state_keeps_spans_after_invalid_utf8() {
+        let packets: &[&[u8]] =
+            &[b"(\xb0C)\nG9", b"0\n(\xff\xfe)\nG01 X", b"5\nY7"];
+        let mut state = StreamState::new();
+        let mut received = Vec::new();
+        let mut got = Vec::new();
+
+        for packet in packets {
+            received.extend_from_slice(packet);
+            let consumed = state
+                .resume(&received, Nop, |l: Line<'_>| got.push(snapshot(&l)));
+            let _ = received.drain(..consumed);
+        }
+        assert_eq!(state.bytes_parsed(), 21);
+        assert_eq!(state.line(), 4);
+        state.finish(&received, Nop, |l: Line<'_>| got.push(snapshot(&l)));
+
+        let starts: Vec<_> =
+            got.iter().map(|l| (l.3.start, l.3.line)).collect();
+        assert_eq!(starts, &[(0, 0), (5, 1), (9, 2), (14, 3), (14, 3)]);
+        // the implied G01 still carries over, without shifting the new word
+        let g01 = &got[4].0[0];
+        assert_eq!(g01.to_string(), "G1 Y7");
+        let y = g01.arguments()[0].span;
+        assert_eq!((y.start, y.end, y.line), (21, 23, 4));
+    }
+
+    #[test]
+    fn stream_state_is_small() {
+        use std::mem::size_of;
+
+        assert!(size_of::<StreamState>() <= 48);
+    }
+
+    #[test]
+    fn invalid_utf8_only_affects_its_own_line() {
+        let src: &[u8] = b"(\xb0C)\nG90\nG01 X5 (\xff)\nG00 Y2\n";
+        let mut parser: StreamingParser<Nop> = StreamingParser::new(Nop);
+        let mut lines = Vec::new();
+
+        parser.push(src, |l| lines.push(snapshot(&l)));
+        assert_eq!(parser.bytes_parsed(), src.len());
+
+        let starts: Vec<_> = lines.iter().map(|l| l.3.start).collect();
+        assert_eq!(starts, &[0, 5, 9, 20]);
+        assert_eq!(lines[0].1[0].0, "(\u{fffd}C)");
+        // spans still line up with the raw bytes
+        assert_eq!(&src[5..8], b"G90");
+        assert_eq!(lines[1].0[0].span().start, 5);
+        assert_eq!(&src[20..26], b"G00 Y2");
+        assert_eq!(lines[3].0[0].arguments()[0].span, Span::new(24, 26, 3));
+    }
+
+    #[test]
+    fn multi_byte_characters_can_be_split_across_chunks() {
+        let src = "(10°C)\nG90\n";
+        let lines = parse_in_chunks(src, 3);
+
+        assert_eq!(lines.len(), 2);
+        assert_eq!(lines[0].1[0].0, "(10°C)");
+    }
+}
@@ -0,0 +1,710 @@
+//! Executing programs which call subprograms.
+//!
+//! An [`Executor`] walks through a program, calling `on_command` for every
+//! command which would be sent to the machine. Subprogram calls are expanded
+//! in place, fetching the subprogram through a [`Loader`]. Both Fanuc-style
+//! calls and LinuxCNC's named subroutines are understood:
+//!
+//! - `M98 P1000 L3` runs the subprogram `O1000` three times. If there is no `L`
+//!   word, a `P` with more than four digits gives the repeat count in the
+//!   leading digits (`M98 P31000`)
+//! - `M99` returns from a subprogram, and the subprogram's own `O1000` header
+//!   isn't passed on
+//! - `o<name> call` runs the subprogram `name`, while `o<name> sub` and
+//!   `o<name> endsub` are ignored and `o<name> return` returns
+//!
+//! Each subprogram is parsed once into a compact representation and kept in
+//! a cache, evicting the least recently used subprograms when the cache's
+//! memory budget is exceeded.
+//!
+//! ```rust
+//! use gcode::subprogram::{Executor, MemoryLoader};
+//!
+//! let mut loader = MemoryLoader::new();
+//! loader.insert("O1000", "G91\nG01 X10\nM99");
+//!
+//! let mut executor = Executor::new(loader);
+//! let mut commands = Vec::new();
+//!
+//! executor.run("G90\nM98 P1000 L2\nG90", |cmd| commands.push(cmd.to_string()))?;
+//!
+//! assert_eq!(commands, &["G90", "G91", "G1 X10", "G91", "G1 X10", "G90"]);
+//! # Ok::<(), gcode::subprogram::ExecutionError>(())
+//! ```
+
+use crate::{
+    buffers::DefaultBuffers,
+    lexer::Lexer,
+    packed::{Command, PackedCommand, PackedWord, Program},
+    parser::Lines,
+    profile::Full,
+    words::{Word, WordsOrComments},
+    GCode, Mnemonic, Nop,
+};
+use std::{
+    collections::HashMap,
+    convert::TryFrom,
+    error::Error,
+    fmt::{self, Display, Formatter},
+    fs, io,
+    mem::size_of,
+    path::PathBuf,
+    sync::Arc,
+};
+
+/// Something which can fetch the source code for a subprogram.
+pub trait Loader {
+    /// Load the subprogram with the given name (e.g. `"O1000"` for
+    /// `M98 P1000`, or `"probe"` for `o<probe> call`).
+    fn load(&mut self, name: &str) -> io::Result<String>;
+}
+
+impl<'a, L: Loader + ?Sized> Loader for &'a mut L {
+    fn load(&mut self, name: &str) -> io::Result<String> { (**self).load(name) }
+}
+
+/// A [`Loader`] which reads subprograms from a directory.
+///
+/// The subprogram `name` is looked for as `name`, then `name.nc`,
+/// `name.ngc` and `name.gcode`.
+#[derive(Debug, Clone, PartialEq)]
+pub struct FileSystemLoader {
+    root: PathBuf,
+}
+
+impl FileSystemLoader {
+    /// Load subprograms from the `root` directory.
+    pub fn new<P: Into<PathBuf>>(root: P) -> Self {
+        FileSystemLoader { root: root.into() }
+    }
+}
+
+impl Loader for FileSystemLoader {
+    fn load(&mut self, name: &str) -> io::Result<String> {
+        for extension in &["", ".nc", ".ngc", ".gcode"] {
+            let path = self.root.join(format!("{}{}", name, extension));
+            if path.is_file() {
+                return fs::read_to_string(path);
+            }
+        }
+
+        Err(io::Error::new(
+            io::ErrorKind::NotFound,
+            format!(
+                "No subprogram called \"{}\" in {}",
+                name,
+                self.root.display()
+            ),
+        ))
+    }
+}
+
+/// A [`Loader`] which keeps every subprogram in memory.
+#[derive(Debug, Default, Clone, PartialEq)]
+pub struct MemoryLoader {
+    programs: HashMap<String, String>,
+    loads: usize,
+}
+
+impl MemoryLoader {
+    /// Create an empty [`MemoryLoader`].
+    pub fn new() -> Self { MemoryLoader::default() }
+
+    /// Add a subprogram.
+    pub fn insert<N, S>(&mut self, name: N, src: S)
+    where
+        N: Into<String>,
+        S: Into<String>,
+    {
+        let _ = self.programs.insert(name.into(), src.into());
+    }
+
+    /// How many times [`Loader::load()`] has been called.
+    pub fn loads(&self) -> usize { self.loads }
+}
+
+impl Loader for MemoryLoader {
+    fn load(&mut self, name: &str) -> io::Result<String> {
+        self.loads += 1;
+
+        self.programs.get(name).cloned().ok_or_else(|| {
+            io::Error::new(
+                io::ErrorKind::NotFound,
+                format!("No subprogram called \"{}\"", name),
+            )
+        })
+    }
+}
+
+/// Something that went wrong while executing a program.
+#[derive(Debug)]
+pub enum ExecutionError {
+    /// The [`Loader`] couldn't load a subprogram.
+    Load {
+        /// The subprogram's name.
+        name: String,
+        /// Why loading failed.
+        error: io::Error,
+    },
+    /// Subprograms were nested too deeply (usually because of recursion).
+    TooDeep {
+        /// The subprogram which would have exceeded the limit.
+        name: String,
+    },
+    /// A program had more commands or arguments than the compact
+    /// representation can hold.
+    TooLarge,
+}
+
+impl Display for ExecutionError {
+    fn fmt(&self, f: &mut Formatter<'_>) -> fmt::Result {
+        match self {
+            ExecutionError::Load { name, .. } => {
+                write!(f, "Unable to load the \"{}\" subprogram", name)
+            },
+            ExecutionError::TooDeep { name } => write!(
+                f,
+                "Calling the \"{}\" subprogram nests subprograms too deeply",
+                name
+            ),
+            ExecutionError::TooLarge => {
+                write!(f, "The program is too large to execute")
+            },
+        }
+    }
+}
+
+impl Error for ExecutionError {
+    fn source(&self) -> Option<&(dyn Error + 'static)> {
+        match self {
+            ExecutionError::Load { error, .. } => Some(error),
+            _ => None,
+        }
+    }
+}
+
+/// Runs programs, expanding subprogram calls.
+#[derive(Debug)]
+pub struct Executor<L> {
+    loader: L,
+    cache: Cache,
+    max_depth: usize,
+}
+
+impl<L: Loader> Executor<L> {
+    /// The default limit on how much memory cached subprograms may use.
+    pub const DEFAULT_CACHE_SIZE: usize = 1024 * 1024;
+    /// The default limit on how deeply subprograms may be nested.
+    pub const DEFAULT_MAX_DEPTH: usize = 64;
+
+    /// Create a new [`Executor`].
+    pub fn new(loader: L) -> Self {
+        Executor {
+            loader,
+            cache: Cache::new(Self::DEFAULT_CACHE_SIZE),
+            max_depth: Self::DEFAULT_MAX_DEPTH,
+        }
+    }
+
+    /// Set how many bytes cached subprograms may use.
+    pub fn with_cache_size(self, bytes: usize) -> Self {
+        Executor {
+            cache: Cache::new(bytes),
+            ..self
+        }
+    }
+
+    /// Set how deeply subprograms may be nested.
+    pub fn with_max_depth(self, max_depth: usize) -> Self {
+        Executor { max_depth, ..self }
+    }
+
+    /// Get a reference to the [`Loader`].
+    pub fn loader(&self) -> &L { &self.loader }
+
+    /// How many bytes the cached subprograms are currently using.
+    pub fn cache_usage(&self) -> usize { self.cache.usage }
+
+    /// Run a program, calling `on_command` for each command in the order
+    /// the machine would execute them.
+    pub fn run<F>(
+        &mut self,
+        src: &str,
+        mut on_command: F,
+    ) -> Result<(), ExecutionError>
+    where
+        F: FnMut(Command<'_>),
+    {
+        let main = Arc::new(Compiled::from_source(src, false)?);
+        let mut stack = vec![Frame {
+            program: main,
+            next_step: 0,
+            repeats_left: 0,
+        }];
+
+        while let Some(frame) = stack.last_mut() {
+            let program = Arc::clone(&frame.program);
+            let step = match program.steps.get(frame.next_step) {
+                Some(step) => step,
+                None => {
+                    // we've reached the end of this (sub)program
+                    if frame.repeats_left > 0 {
+                        frame.repeats_left -= 1;
+                        frame.next_step = 0;
+                    } else {
+                        let _ = stack.pop();
+                    }
+                    continue;
+                },
+            };
+            frame.next_step += 1;
+
+            match step {
+                Step::Command(index) => {
+                    let command = program.as_program().get(*index as usize);
+                    on_command(command.expect("Always in bounds"));
+                },
+                Step::Call { name, repeat } => {
+                    if *repeat == 0 {
+                        continue;
+                    }
+                    let name = &program.names[*name as usize];
+                    if stack.len() >= self.max_depth {
+                        return Err(ExecutionError::TooDeep {
+                            name: name.to_string(),
+                        });
+                    }
+
+                    let subprogram =
+                        self.cache.get_or_load(name, &mut self.loader)?;
+                    stack.push(Frame {
+                        program: subprogram,
+                        next_step: 0,
+                        repeats_left: *repeat - 1,
+                    });
+                },
+                Step::Return => frame.next_step = program.steps.len(),
+            }
+        }
+
+        Ok(())
+    }
+}
+
+/// Where we're up to in a (sub)program.
+#[derive(Debug)]
+struct Frame {
+    program: Arc<Compiled>,
+    next_step: usize,
+    repeats_left: u32,
+}
+
+#[derive(Debug, Clone, PartialEq)]
+enum Step {
+    /// Send a command to the machine.
+    Command(u32),
+    /// Call a subprogram, looking up its name in [`Compiled::names`].
+    Call { name: u32, repeat: u32 },
+    /// Return from the current subprogram.
+    Return,
+}
+
+/// A parsed program, in a compact form.
+#[derive(Debug, Default, Clone, PartialEq)]
+struct Compiled {
+    commands: Vec<PackedCommand>,
+    arguments: Vec<PackedWord>,
+    steps: Vec<Step>,
+    names: Vec<Arc<str>>,
+}
+
+impl Compiled {
+    /// Compile some source code. A subprogram's own `O` number is only there
+    /// to name it, so it is left out when `subprogram` is set.
+    fn from_source(
+        src: &str,
+        subprogram: bool,
+    ) -> Result<Compiled, ExecutionError> {
+        let mut compiled = Compiled::default();
+        let mut last_gcode_type: Option<Word> = None;
+        let mut offset = 0;
+
+        for (line_number, line) in src.split('\n').enumerate() {
+            if let Some(subroutine) = named_subroutine(line) {
+                match subroutine {
+                    Subroutine::Call(name) => compiled.call(name, 1)?,
+                    Subroutine::Return => compiled.steps.push(Step::Return),
+                    Subroutine::Ignored => {},
+                }
+            } else {
+                let tokens = Lexer::starting_at(line, offset, line_number);
+                let mut lines = Lines::<'_, _, _, DefaultBuffers, Full>::new(
+                    WordsOrComments::new(tokens),
+                    Nop,
+                )
+                .with_last_gcode_type(last_gcode_type);
+
+                for parsed in lines.by_ref() {
+                    for gcode in parsed.gcodes() {
+                        if subprogram
+                            && gcode.mnemonic() == Mnemonic::ProgramNumber
+                        {
+                            continue;
+                        }
+                        compiled.push(gcode)?;
+                    }
+                }
+                last_gcode_type = lines.last_gcode_type();
+            }
+
+            offset += line.len() + 1;
+        }
+
+        compiled.commands.shrink_to_fit();
+        compiled.arguments.shrink_to_fit();
+        compiled.steps.shrink_to_fit();
+        compiled.names.shrink_to_fit();
+
+        Ok(compiled)
+    }
+
+    fn push(&mut self, gcode: &GCode) -> Result<(), ExecutionError> {
+        if gcode.number() < 0.0 {
+            // not a real command
+            return Ok(());
+        }
+
+        match (gcode.mnemonic(), gcode.major_number(), gcode.minor_number()) {
+            (Mnemonic::Miscellaneous, 98, 0) => {
+                let program = gcode.value_for('P').unwrap_or(0.0) as u32;
+                let (program, repeat) = match gcode.value_for('L') {
+                    Some(repeat) => (program, repeat as u32),
+                    None if program > 9999 => {
+                        (program % 10000, program / 10000)
+                    },
+                    None => (program, 1),
+                };
+
+                self.call(&format!("O{}", program), repeat)?;
+            },
+            (Mnemonic::Miscellaneous, 99, 0) => self.steps.push(Step::Return),
+            (mnemonic, major, minor) => {
+                let too_large = |_| ExecutionError::TooLarge;
+                let index =
+                    u32::try_from(self.commands.len()).map_err(too_large)?;
+                let command = PackedCommand::new(
+                    mnemonic,
+                    u16::try_from(major).map_err(too_large)?,
+                    u8::try_from(minor).map_err(too_large)?,
+                    u32::try_from(self.arguments.len()).map_err(too_large)?,
+                    u8::try_from(gcode.arguments().len()).map_err(too_large)?,
+                );
+
+                self.commands.push(command);
+                self.arguments.extend(
+                    gcode
+                        .arguments()
+                        .iter()
+                        .map(|arg| PackedWord::new(arg.letter, arg.value)),
+                );
+                self.steps.push(Step::Command(index));
+            },
+        }
+
+        Ok(())
+    }
+
+    fn call(&mut self, name: &str, repeat: u32) -> Result<(), ExecutionError> {
+        let index = u32::try_from(self.names.len())
+            .map_err(|_| ExecutionError::TooLarge)?;
+        self.names.push(Arc::from(name));
+        self.steps.push(Step::Call {
+            name: index,
+            repeat,
+        });
+
+        Ok(())
+    }
+
+    fn as_program(&self) -> Program<'_> {
+        Program::new(&self.commands, &self.arguments, None)
+    }
+
+    /// Roughly how much memory this program uses.
+    fn memory_usage(&self) -> usize {
+        let names: usize = self
+            .names
+            .iter()
+            .map(|name| size_of::<Arc<str>>() + name.len())
+            .sum();
+
+        size_of::<Self>()
+            + self.commands.len() * size_of::<PackedCommand>()
+            + self.arguments.len() * size_of::<PackedWord>()
+            + self.steps.len() * size_of::<Step>()
+            + names
+    }
+}
+
+/// The LinuxCNC `o<name> ...` lines we understand.
+#[derive(Debug, Copy, Clone, PartialEq)]
+enum Subroutine<'a> {
+    Call(&'a str),
+    Return,
+    /// A line which marks the start or end of a subroutine's body.
+    Ignored,
+}
+
+/// Recognise LinuxCNC's `o<name> call/sub/endsub/return` lines.
+fn named_subroutine(line: &str) -> Option<Subroutine<'_>> {
+    let line = line.trim();
+    let rest = line.strip_prefix('o').or_else(|| line.strip_prefix('O'))?;
+    let rest = rest.strip_prefix('<')?;
+    let end = rest.find('>')?;
+    let name = &rest[..end];
+    let keyword = rest[end + 1..]
+        .split_whitespace()
+        .next()
+        .unwrap_or("")
+        .to_ascii_lowercase();
+
+    match keyword.as_str() {
+        "call" => Some(Subroutine::Call(name)),
+        "return" => Some(Subroutine::Return),
+        "sub" | "endsub" => Some(Subroutine::Ignored),
+        _ => None,
+    }
+}
+
+/// Compiled subprograms, evicting the least recently used ones when they use
+/// too much memory.
+#[derive(Debug)]
+struct Cache {
+    entries: HashMap<Arc<str>, CacheEntry>,
+    capacity: usize,
+    usage: usize,
+    clock: u64,
+}
+
+#[derive(Debug)]
+struct CacheEntry {
+    program: Arc<Compiled>,
+    size: usize,
+    last_used: u64,
+}
+
+impl Cache {
+    fn new(capacity: usize) -> Self {
+        Cache {
+            entries: HashMap::new(),
+            capacity,
+            usage: 0,
+            clock: 0,
+        }
+    }
+
+    fn get_or_load<L: Loader>(
+        &mut self,
+        name: &Arc<str>,
+        loader: &mut L,
+    ) -> Result<Arc<Compiled>, ExecutionError> {
+        self.clock += 1;
+
+        if let Some(entry) = self.entries.get_mut(name) {
+            entry.last_used = self.clock;
+            return Ok(Arc::clone(&entry.program));
+        }
+
+        let src = loader.load(name).map_err(|error| ExecutionError::Load {
+            name: name.to_string(),
+            error,
+        })?;
+        let program = Arc::new(Compiled::from_source(&src, true)?);
+        let size = program.memory_usage();
+
+        self.make_room_for(size);
+        if size <= self.capacity {
+            self.usage += size;
+            let _ = self.entries.insert(
+                Arc::clone(name),
+                CacheEntry {
+                    program: Arc::clone(&program),
+                    size,
+                    last_used: self.clock,
+                },
+            );
+        }
+
+        Ok(program)
+    }
+
+    fn make_room_for(&mut self, size: usize) {
+        while self.usage + size > self.capacity {
+            let oldest = self
+                .entries
+                .iter()
+                .min_by_key(|(_, entry)| entry.last_used)
+                .map(|(name, _)| Arc::clone(name));
+
+            match oldest.and_then(|name| self.entries.remove(&name)) {
+                Some(evicted) => self.usage -= evicted.size,
+                None => break,
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn run<L: Loader>(
+        executor: &mut Executor<L>,
+        src: &str,
+    ) -> Result<Vec<String>, ExecutionError> {
+        let mut commands = Vec::new();
+        executor.run(src, |cmd| commands.push(cmd.to_string()))?;
+        Ok(commands)
+    }
+
+    #[test]
+    fn programs_without_calls_are_unchanged() {
+        let src = "G90\nG01 X5 Y5 F100\nX10\nM30";
+        let mut executor = Executor::new(MemoryLoader::new());
+
+        let got = run(&mut executor, src).unwrap();
+
+        let expected: Vec<String> =
+            crate::parse(src).map(|g| g.to_string()).collect();
+        assert_eq!(got, expected);
+    }
+
+    #[test]
+    fn subprogram_headers_are_not_emitted() {
+        let mut loader = MemoryLoader::new();
+        loader.insert("O1000", "O1000\nG1 X1\nM99");
+        let mut executor = Executor::new(loader);
+
+        let got = run(&mut executor, "O1\nM98 P1000\nM30").unwrap();
+
+        assert_eq!(got, &["O1", "G1 X1", "M30"]);
+    }
+
+    #[test]
+    fn nested_calls_with_repeats() {
+        let mut loader = MemoryLoader::new();
+        loader.insert("O1", "G1 X1\nM98 P2 L2\nM99");
+        loader.insert("O2", "G1 Y2\nM99\nG1 Z100");
+        let mut executor = Executor::new(loader);
+
+        let got = run(&mut executor, "M98 P1\nM98 P30001\nM30").unwrap();
+
+        let once = ["G1 X1", "G1 Y2", "G1 Y2"];
+        let expected: Vec<&str> = once
+            .iter()
+            .cycle()
+            .take(once.len() * 4)
+            .cloned()
+            .chain(Some("M30"))
+            .collect();
+        assert_eq!(got, expected);
+        // each subprogram is only parsed once
+        assert_eq!(executor.loader().loads(), 2);
+    }
+
+    #[test]
+    fn linuxcnc_style_subroutines() {
+        let mut loader = MemoryLoader::new();
+        loader.insert(
+            "probe",
+            "o<probe> sub\nG38.2 Z-10 F50\no<probe> return\nG0 Z100\no<probe> endsub",
+        );
+        let mut executor = Executor::new(loader);
+
+        let got = run(&mut executor, "G90\no<probe> call\nO<probe> CALL [1]")
+            .unwrap();
+
+        assert_eq!(got, &["G90", "G38.2 Z-10 F50", "G38.2 Z-10 F50"]);
+    }
+
+    #[test]
+    fn recursion_is_an_error() {
+        let mut loader = MemoryLoader::new();
+        loader.insert("O1", "G1 X1\nM98 P1");
+        let mut executor = Executor::new(loader).with_max_depth(8);
+
+        let got = run(&mut executor, "M98 P1");
+
+        match got {
+            Err(ExecutionError::TooDeep { name }) => assert_eq!(name, "O1"),
+            other => panic!("Unexpected result: {:?}", other),
+        }
+    }
+
+    #[test]
+    fn missing_subprograms_are_an_error() {
+        let mut executor = Executor::new(MemoryLoader::new());
+
+        let got = run(&mut executor, "M98 P1234");
+
+        match got {
+            Err(ExecutionError::Load { name, error }) => {
+                assert_eq!(name, "O1234");
+                assert_eq!(error.kind(), io::ErrorKind::NotFound);
+            },
+            other => panic!("Unexpected result: {:?}", other),
+        }
+    }
+
+    #[test]
+    fn least_recently_used_subprograms_are_evicted() {
+        let mut loader = MemoryLoader::new();
+        for i in 1..=3 {
+            loader.insert(format!("O{}", i), "G1 X1 Y2 Z3\nG1 X4 Y5 Z6");
+        }
+        let size = Compiled::from_source("G1 X1 Y2 Z3\nG1 X4 Y5 Z6", true)
+            .unwrap()
+            .memory_usage();
+        let mut executor = Executor::new(loader).with_cache_size(size * 2);
+
+        // O1 was used more recently than O2, so loading O3 evicts O2
+        let _ = run(&mut executor, "M98 P1\nM98 P2\nM98 P1\nM98 P3").unwrap();
+        assert_eq!(executor.loader().loads(), 3);
+        assert_eq!(executor.cache_usage(), size * 2);
+
+        let _ = run(&mut executor, "M98 P1\nM98 P3").unwrap();
+        assert_eq!(executor.loader().loads(), 3);
+        let _ = run(&mut executor, "M98 P2").unwrap();
+        assert_eq!(executor.loader().loads(), 4);
+    }
+
+    #[test]
+    fn main_programs_with_lots_of_arguments() {
+        // more arguments than fit in a u16
+        let src = "G1 X1 Y2 Z3\n".repeat(30_000);
+        let mut loader = MemoryLoader::new();
+        loader.insert("O1", &src);
+        let mut executor = Executor::new(loader);
+        let main = format!("{}M98 P1\nG1 X-1", src);
+
+        let got = run(&mut executor, &main).unwrap();
+
+        assert_eq!(got.len(), 60_001);
+        assert_eq!(got[59_999], "G1 X1 Y2 Z3");
+        assert_eq!(got[60_000], "G1 X-1");
+    }
+
+    #[test]
+    fn load_from_the_file_system() {
+        let dir = std::env::temp_dir()
+            .join(format!("gcode-subprograms-{}", std::process::id()));
+        fs::create_dir_all(&dir).unwrap();
+        fs::write(dir.join("O1000.nc"), "G1 X1\nM99\n").unwrap();
+        let mut executor = Executor::new(FileSystemLoader::new(&dir));
+
+        let got = run(&mut executor, "M98 P1000 L2").unwrap();
+
+        assert_eq!(got, &["G1 X1", "G1 X1"]);
+        fs::remove_dir_all(&dir).unwrap();
+    }
+}
@@ -0,0 +1,1292 @@
+//! Reordering contours to reduce the distance travelled by rapid moves.
+//!
+//! CAM and laser software often visit contours in whatever order they were
+//! drawn, leaving the machine to spend a lot of time on `G00` rapids between
+//! them. An [`Optimizer`] splits a program into *contours*, each starting
+//! with a rapid move in the X-Y plane and running until the next one, then
+//! finds a shorter order for them (optionally reversing the direction they
+//! are cut in) and rewrites the program.
+//!
+//! Only contours which start and finish at the same safe height are moved,
+//! and contours are never moved past a tool change, a change of units or
+//! coordinate system, a program stop, turning the spindle or coolant on or
+//! off, a dwell, or a change of cutter compensation. Programs must use
+//! absolute coordinates (`G90`).
+//!
+//! ```rust
+//! use gcode::{travel::Optimizer, GCode};
+//!
+//! // three slots, visited left, right, middle
+//! let src = "G21 G90\nG0 Z5\n\
+//!            G0 X0 Y0\nG1 Z-1 F100\nG1 Y10\nG0 Z5\n\
+//!            G0 X20 Y0\nG1 Z-1\nG1 Y10\nG0 Z5\n\
+//!            G0 X10 Y0\nG1 Z-1\nG1 Y10\nG0 Z5\n";
+//! let program: Vec<GCode> = gcode::parse(src).collect();
+//!
+//! let optimized = Optimizer::new().optimize(&program)?;
+//!
+//! assert_eq!(optimized.report.contours, 3);
+//! assert!(optimized.report.travel_after < optimized.report.travel_before);
+//! # Ok::<(), gcode::travel::TravelError>(())
+//! ```
+
+use crate::{
+    state::{ModalState, Position},
+    GCode, Mnemonic, Span, Word,
+};
+use std::{
+    error::Error,
+    fmt::{self, Display, Formatter},
+    ops::Range,
+    thread,
+    time::Duration,
+};
+
+/// Settings for reordering contours.
+#[derive(Debug, Copy, Clone, PartialEq)]
+pub struct Optimizer {
+    rapid_rate: f32,
+    allow_reversal: bool,
+    rounds: usize,
+}
+
+impl Optimizer {
+    /// The rapid rate used when none is specified, in program units per
+    /// minute.
+    pub const DEFAULT_RAPID_RATE: f32 = 3000.0;
+    /// The default number of improvement rounds.
+    pub const DEFAULT_ROUNDS: usize = 4;
+
+    /// Create an [`Optimizer`] with the default settings.
+    pub fn new() -> Self {
+        Optimizer {
+            rapid_rate: Optimizer::DEFAULT_RAPID_RATE,
+            allow_reversal: true,
+            rounds: Optimizer::DEFAULT_ROUNDS,
+        }
+    }
+
+    /// Set the speed of rapid moves (in program units per minute), used when
+    /// estimating how much time was saved.
+    pub fn with_rapid_rate(self, rapid_rate: f32) -> Self {
+        Optimizer { rapid_rate, ..self }
+    }
+
+    /// Allow contours made of `G01` to `G03` moves to be cut in the
+    /// opposite direction.
+    pub fn with_reversal(self, allow_reversal: bool) -> Self {
+        Optimizer {
+            allow_reversal,
+            ..self
+        }
+    }
+
+    /// How many rounds of local improvements to make after the initial
+    /// nearest-neighbour tour.
+    pub fn with_rounds(self, rounds: usize) -> Self {
+        Optimizer { rounds, ..self }
+    }
+
+    /// Find a better order for the contours in a program.
+    pub fn optimize(
+        &self,
+        program: &[GCode],
+    ) -> Result<Optimized, TravelError> {
+        let analysis = Analysis::new(program, self.allow_reversal)?;
+
+        let mut report = Report::default();
+        let mut tours = Vec::new();
+
+        for segment in &analysis.segments {
+            if let Segment::Run { start, contours } = segment {
+                let original: Vec<Node> =
+                    (0..contours.len()).map(Node::forwards).collect();
+                let tour = self.solve(*start, contours);
+
+                report.contours += contours.len();
+                report.reversed += tour.iter().filter(|n| n.reversed).count();
+                report.travel_before +=
+                    tour_length(*start, contours, &original);
+                report.travel_after += tour_length(*start, contours, &tour);
+                tours.push(tour);
+            }
+        }
+
+        let saved = (report.travel_before - report.travel_after).max(0.0);
+        if self.rapid_rate > 0.0 {
+            report.time_saved =
+                Duration::from_secs_f32(saved / self.rapid_rate * 60.0);
+        }
+
+        Ok(Optimized {
+            program: analysis.rewrite(&tours),
+            report,
+        })
+    }
+
+    fn solve(&self, start: Point, contours: &[Contour]) -> Vec<Node> {
+        let mut tour = nearest_neighbour(start, contours);
+        let original = tour_length(start, contours, &tour);
+
+        for round in 0..self.rounds {
+            // shift the windows every other round so the contours at the
+            // edges of a window get a chance to move
+            let offset = (round % 2) * WINDOW / 2;
+            improve_in_parallel(&mut tour, offset, contours);
+        }
+
+        // the improvements should only ever make things better, but let's be
+        // sure we never hand back something worse than the greedy tour
+        if tour_length(start, contours, &tour) > original {
+            nearest_neighbour(start, contours)
+        } else {
+            tour
+        }
+    }
+}
+
+impl Default for Optimizer {
+    fn default() -> Self { Optimizer::new() }
+}
+
+/// The result of [`Optimizer::optimize()`].
+#[derive(Debug, Clone, PartialEq)]
+pub struct Optimized {
+    /// The rewritten program.
+    pub program: Vec<GCode>,
+    /// What the [`Optimizer`] did.
+    pub report: Report,
+}
+
+/// A summary of what an [`Optimizer`] did.
+#[derive(Debug, Default, Copy, Clone, PartialEq)]
+pub struct Report {
+    /// The number of contours which could be reordered.
+    pub contours: usize,
+    /// How many of those contours are now cut in the opposite direction.
+    pub reversed: usize,
+    /// The distance travelled between contours in the original program.
+    pub travel_before: f32,
+    /// The distance travelled between contours after reordering.
+    pub travel_after: f32,
+    /// An estimate of how much time was saved.
+    pub time_saved: Duration,
+}
+
+/// Reasons a program can't be optimized.
+#[derive(Debug, Copy, Clone, PartialEq)]
+pub enum TravelError {
+    /// The program uses relative coordinates (`G91`).
+    RelativeCoordinates {
+        /// The index of the `G91` command.
+        index: usize,
+    },
+}
+
+impl Display for TravelError {
+    fn fmt(&self, f: &mut Formatter<'_>) -> fmt::Result {
+        match self {
+            TravelError::RelativeCoordinates { index } => write!(
+                f,
+                "Command {} switches to relative coordinates, which aren't \
+                 supported",
+                index
+            ),
+        }
+    }
+}
+
+impl Error for TravelError {}
+
+type Point = [f32; 2];
+
+fn distance(a: Point, b: Point) -> f32 {
+    let dx = a[0] - b[0];
+    let dy = a[1] - b[1];
+    (dx * dx + dy * dy).sqrt()
+}
+
+/// A chunk of the program starting with a rapid move in the X-Y plane.
+#[derive(Debug, Clone, PartialEq)]
+struct Contour {
+    /// The commands making up this contour, starting with the rapid move.
+    commands: Range<usize>,
+    entry: Point,
+    exit: Point,
+    /// The moves which can be reversed, if this contour is reversible.
+    cuts: Option<Range<usize>>,
+    /// The feed rate used by `cuts`.
+    cut_feed: Option<f32>,
+}
+
+impl Contour {
+    fn entry(&self, reversed: bool) -> Point {
+        if reversed {
+            self.exit
+        } else {
+            self.entry
+        }
+    }
+
+    fn exit(&self, reversed: bool) -> Point {
+        if reversed {
+            self.entry
+        } else {
+            self.exit
+        }
+    }
+
+    fn reversible(&self) -> bool { self.cuts.is_some() }
+}
+
+/// A contour's place in a tour.
+#[derive(Debug, Copy, Clone, PartialEq)]
+struct Node {
+    contour: u32,
+    reversed: bool,
+}
+
+impl Node {
+    fn forwards(contour: usize) -> Self {
+        Node {
+            contour: contour as u32,
+            reversed: false,
+        }
+    }
+}
+
+#[derive(Debug, Clone, PartialEq)]
+enum Segment {
+    /// Commands which have to stay where they are.
+    Fixed(Range<usize>),
+    /// Contours which can be visited in any order.
+    Run {
+        start: Point,
+        contours: Vec<Contour>,
+    },
+}
+
+/// A program broken up into [`Segment`]s.
+#[derive(Debug)]
+struct Analysis<'a> {
+    program: &'a [GCode],
+    segments: Vec<Segment>,
+    /// The [`ModalState`] before each command.
+    states: Vec<ModalState>,
+}
+
+impl<'a> Analysis<'a> {
+    fn new(
+        program: &'a [GCode],
+        allow_reversal: bool,
+    ) -> Result<Self, TravelError> {
+        let mut state = ModalState::new();
+        let mut states = Vec::with_capacity(program.len() + 1);
+
+        for (index, gcode) in program.iter().enumerate() {
+            if (gcode.mnemonic(), gcode.major_number(), gcode.minor_number())
+                == (Mnemonic::General, 91, 0)
+            {
+                return Err(TravelError::RelativeCoordinates { index });
+            }
+
+            states.push(state);
+            state.apply(gcode);
+        }
+        states.push(state);
+
+        let mut analysis = Analysis {
+            program,
+            segments: Vec::new(),
+            states,
+        };
+        analysis.segment(allow_reversal);
+
+        Ok(analysis)
+    }
+
+    fn segment(&mut self, allow_reversal: bool) {
+        let mut contour_start = None;
+        let mut fixed_start = 0;
+
+        for (index, gcode) in self.program.iter().enumerate() {
+            let travel = is_travel(gcode);
+
+            if travel || is_barrier(gcode) {
+                if let Some(start) = contour_start.take() {
+                    self.add_contour(start..index, allow_reversal);
+                    fixed_start = index;
+                }
+            }
+
+            if travel {
+                self.add_fixed(fixed_start..index);
+                contour_start = Some(index);
+            }
+        }
+
+        match contour_start {
+            Some(start) => {
+                self.add_contour(start..self.program.len(), allow_reversal)
+            },
+            None => self.add_fixed(fixed_start..self.program.len()),
+        }
+    }
+
+    fn add_fixed(&mut self, range: Range<usize>) {
+        if range.is_empty() {
+            return;
+        }
+
+        match self.segments.last_mut() {
+            Some(Segment::Fixed(previous)) if previous.end == range.start => {
+                previous.end = range.end
+            },
+            _ => self.segments.push(Segment::Fixed(range)),
+        }
+    }
+
+    fn add_contour(&mut self, commands: Range<usize>, allow_reversal: bool) {
+        let before = self.states[commands.start].position;
+        let after_travel = self.states[commands.start + 1].position;
+        let after = self.states[commands.end].position;
+
+        let (entry, exit, safe_z) = match (
+            after_travel.x,
+            after_travel.y,
+            after.x,
+            after.y,
+            before.z,
+        ) {
+            (Some(x1), Some(y1), Some(x2), Some(y2), Some(z))
+                if after_travel.z == Some(z) && after.z == Some(z) =>
+            {
+                ([x1, y1], [x2, y2], z)
+            },
+            _ => {
+                // we can't tell whether it's safe to move this contour
+                self.add_fixed(commands);
+                return;
+            },
+        };
+
+        let start = match before {
+            Position {
+                x: Some(x),
+                y: Some(y),
+                ..
+            } => [x, y],
+            _ => entry,
+        };
+
+        let cuts = if allow_reversal {
+            self.reversible_cuts(commands.clone())
+        } else {
+            None
+        };
+        let cut_feed = cuts
+            .as_ref()
+            .and_then(|cuts| self.states[cuts.start + 1].feed_rate);
+        let contour = Contour {
+            commands,
+            entry,
+            exit,
+            cuts,
+            cut_feed,
+        };
+
+        let same_run = match self.segments.last() {
+            Some(Segment::Run { contours, .. }) => {
+                let previous = &contours[contours.len() - 1];
+                previous.commands.end == contour.commands.start
+                    && self.states[previous.commands.start].position.z
+                        == Some(safe_z)
+            },
+            _ => false,
+        };
+
+        if same_run {
+            if let Some(Segment::Run { contours, .. }) =
+                self.segments.last_mut()
+            {
+                contours.push(contour);
+            }
+        } else {
+            self.segments.push(Segment::Run {
+                start,
+                contours: vec![contour],
+            });
+        }
+    }
+
+    /// Find the moves in a contour which could be cut backwards.
+    fn reversible_cuts(&self, commands: Range<usize>) -> Option<Range<usize>> {
+        let is_cut = |g: &GCode| {
+            is_feed_move(g)
+                && g.arguments().iter().any(|arg| {
+                    matches!(
+                        arg.letter.to_ascii_uppercase(),
+                        'X' | 'Y' | 'I' | 'J'
+                    )
+                })
+        };
+
+        let body = commands.start + 1..commands.end;
+        let first = body.clone().find(|&i| is_cut(&self.program[i]))?;
+        let last = body.rev().find(|&i| is_cut(&self.program[i]))?;
+        let cuts = first..last + 1;
+
+        let simple_moves =
+            self.program[cuts.clone()].iter().enumerate().all(|(i, g)| {
+                is_feed_move(g)
+                    && g.arguments().iter().all(|arg| {
+                        match arg.letter.to_ascii_uppercase() {
+                            'X' | 'Y' | 'Z' | 'I' | 'J' => true,
+                            // the feed rate can only be set at the start
+                            'F' => i == 0,
+                            _ => false,
+                        }
+                    })
+            });
+        let positions_known = (cuts.start..=cuts.end).all(|i| {
+            let p = self.states[i].position;
+            p.x.is_some() && p.y.is_some() && p.z.is_some()
+        });
+        let same_depth = self.states[cuts.start].position.z
+            == self.states[cuts.end].position.z;
+
+        if simple_moves && positions_known && same_depth {
+            Some(cuts)
+        } else {
+            None
+        }
+    }
+
+    fn rewrite(&self, tours: &[Vec<Node>]) -> Vec<GCode> {
+        let mut writer = Writer {
+            program: self.program,
+            states: &self.states,
+            output: Vec::with_capacity(self.program.len()),
+            feed_rate: None,
+        };
+        let mut tours = tours.iter();
+
+        for segment in &self.segments {
+            match segment {
+                Segment::Fixed(range) => {
+                    for index in range.clone() {
+                        writer.copy(index);
+                    }
+                },
+                Segment::Run { contours, .. } => {
+                    let tour = tours.next().expect("One tour per run");
+
+                    for node in tour {
+                        let contour = &contours[node.contour as usize];
+                        if node.reversed {
+                            writer.reversed(contour);
+                        } else {
+                            writer.travel(contour, contour.entry);
+                            for index in
+                                contour.commands.start + 1..contour.commands.end
+                            {
+                                writer.copy(index);
+                            }
+                        }
+                    }
+                },
+            }
+        }
+
+        writer.output
+    }
+}
+
+/// Builds up the rewritten program, making sure each move still uses the
+/// feed rate it originally did.
+#[derive(Debug)]
+struct Writer<'a> {
+    program: &'a [GCode],
+    states: &'a [ModalState],
+    output: Vec<GCode>,
+    feed_rate: Option<f32>,
+}
+
+impl<'a> Writer<'a> {
+    fn copy(&mut self, index: usize) {
+        let feed_rate = self.states[index].feed_rate;
+        self.push(self.program[index].clone(), feed_rate);
+    }
+
+    fn push(&mut self, mut gcode: GCode, feed_rate: Option<f32>) {
+        if let Some(feed_rate) = feed_rate {
+            if is_feed_move(&gcode)
+                && gcode.value_for('F').is_none()
+                && self.feed_rate != Some(feed_rate)
+            {
+                gcode = gcode.with_argument(Word::new(
+                    'F',
+                    feed_rate,
+                    Span::PLACEHOLDER,
+                ));
+            }
+        }
+
+        if let Some(feed_rate) = gcode.value_for('F') {
+            self.feed_rate = Some(feed_rate);
+        }
+        self.output.push(gcode);
+    }
+
+    /// Write a contour's rapid move, going to `target`.
+    ///
+    /// X and Y are always both given, because a rapid which only mentions
+    /// one of them would pick up the other from whichever contour now comes
+    /// before it.
+    fn travel(&mut self, contour: &Contour, target: Point) {
+        let travel = &self.program[contour.commands.start];
+        let [x, y] = target;
+
+        let mut gcode =
+            GCode::new(travel.mnemonic(), travel.number(), travel.span());
+        for arg in travel.arguments() {
+            let value = match arg.letter.to_ascii_uppercase() {
+                'X' => x,
+                'Y' => y,
+                _ => arg.value,
+            };
+            gcode = gcode.with_argument(Word::new(arg.letter, value, arg.span));
+        }
+        for &(letter, value) in &[('X', x), ('Y', y)] {
+            if travel.value_for(letter).is_none() {
+                gcode = gcode.with_argument(Word::new(
+                    letter,
+                    value,
+                    Span::PLACEHOLDER,
+                ));
+            }
+        }
+
+        self.push(gcode, None);
+    }
+
+    fn reversed(&mut self, contour: &Contour) {
+        let cuts = contour.cuts.clone().expect("Only reversible contours");
+
+        // the rapid move, now going to where the contour used to finish
+        self.travel(contour, contour.exit);
+
+        // plunging is the same in either direction
+        for index in contour.commands.start + 1..cuts.start {
+            self.copy(index);
+        }
+
+        for index in cuts.clone().rev() {
+            let gcode = reverse_move(
+                &self.program[index],
+                &self.states[index],
+                &self.states[index + 1],
+            );
+            self.push(gcode, contour.cut_feed);
+        }
+
+        // and so is retracting
+        for index in cuts.end..contour.commands.end {
+            self.copy(index);
+        }
+    }
+}
+
+/// Create a move which goes from the end of `gcode` back to its start.
+fn reverse_move(
+    gcode: &GCode,
+    before: &ModalState,
+    after: &ModalState,
+) -> GCode {
+    let start = before.position;
+    let end = after.position;
+    let number = match gcode.major_number() {
+        2 => 3.0,
+        3 => 2.0,
+        other => other as f32,
+    };
+
+    let mut reversed = GCode::new(gcode.mnemonic(), number, Span::PLACEHOLDER);
+
+    for arg in gcode.arguments() {
+        let letter = arg.letter.to_ascii_uppercase();
+        let value = match letter {
+            'X' => start.x,
+            'Y' => start.y,
+            'Z' => start.z,
+            // arc centres are relative to the start of the move
+            'I' => {
+                Some(start.x.unwrap_or(0.0) + arg.value - end.x.unwrap_or(0.0))
+            },
+            'J' => {
+                Some(start.y.unwrap_or(0.0) + arg.value - end.y.unwrap_or(0.0))
+            },
+            // the feed rate is added back later
+            _ => None,
+        };
+
+        if let Some(value) = value {
+            reversed = reversed.with_argument(Word::new(
+                letter,
+                value,
+                Span::PLACEHOLDER,
+            ));
+        }
+    }
+
+    reversed
+}
+
+/// A rapid move which goes somewhere in the X-Y plane.
+fn is_travel(gcode: &GCode) -> bool {
+    gcode.mnemonic() == Mnemonic::General
+        && gcode.major_number() == 0
+        && gcode.minor_number() == 0
+        && (gcode.value_for('X').is_some() || gcode.value_for('Y').is_some())
+}
+
+/// A `G01`, `G02` or `G03` move.
+fn is_feed_move(gcode: &GCode) -> bool {
+    gcode.mnemonic() == Mnemonic::General
+        && (1..=3).contains(&gcode.major_number())
+        && gcode.minor_number() == 0
+}
+
+/// Commands which contours can't be moved past.
+fn is_barrier(gcode: &GCode) -> bool {
+    match (gcode.mnemonic(), gcode.major_number()) {
+        (Mnemonic::ToolChange, _) | (Mnemonic::ProgramNumber, _) => true,
+        // program stops, spindle, tool changes and coolant
+        (Mnemonic::Miscellaneous, n) => {
+            [0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 30, 60].contains(&n)
+        },
+        // dwells, planes, units, homing, cutter compensation, tool offsets,
+        // coordinate systems, etc.
+        (Mnemonic::General, n) => {
+            [4, 17, 18, 19, 20, 21, 28, 30, 40, 41, 42, 43, 49, 90, 92]
+                .contains(&n)
+                || (53..=59).contains(&n)
+        },
+    }
+}
+
+fn tour_length(start: Point, contours: &[Contour], tour: &[Node]) -> f32 {
+    let mut position = start;
+    let mut total = 0.0;
+
+    for node in tour {
+        let contour = &contours[node.contour as usize];
+        total += distance(position, contour.entry(node.reversed));
+        position = contour.exit(node.reversed);
+    }
+
+    total
+}
+
+/// A uniform grid for finding the closest unvisited contour.
+#[derive(Debug)]
+struct Grid {
+    origin: Point,
+    cell_size: f32,
+    columns: usize,
+    rows: usize,
+    /// Each cell holds the contours with an end (entry or exit) in it.
+    cells: Vec<Vec<u32>>,
+}
+
+impl Grid {
+    fn new(contours: &[Contour]) -> Self {
+        let mut min = [f32::INFINITY; 2];
+        let mut max = [f32::NEG_INFINITY; 2];
+        for contour in contours {
+            for p in &[contour.entry, contour.exit] {
+                for axis in 0..2 {
+                    min[axis] = min[axis].min(p[axis]);
+                    max[axis] = max[axis].max(p[axis]);
+                }
+            }
+        }
+
+        // aim for about one contour per cell
+        let width = (max[0] - min[0]).max(f32::EPSILON);
+        let height = (max[1] - min[1]).max(f32::EPSILON);
+        let cell_size = (width * height / contours.len() as f32)
+            .sqrt()
+            .max(width.max(height) / 1024.0)
+            .max(f32::EPSILON);
+        let columns = (width / cell_size) as usize + 1;
+        let rows = (height / cell_size) as usize + 1;
+
+        let mut grid = Grid {
+            origin: min,
+            cell_size,
+            columns,
+            rows,
+            cells: vec![Vec::new(); columns * rows],
+        };
+
+        for (i, contour) in contours.iter().enumerate() {
+            let entry = grid.cell(contour.entry);
+            grid.cells[entry].push(i as u32);
+
+            let exit = grid.cell(contour.exit);
+            if contour.reversible() && exit != entry {
+                grid.cells[exit].push(i as u32);
+            }
+        }
+
+        grid
+    }
+
+    fn coordinates(&self, p: Point) -> (usize, usize) {
+        let column = ((p[0] - self.origin[0]) / self.cell_size).max(0.0);
+        let row = ((p[1] - self.origin[1]) / self.cell_size).max(0.0);
+        (
+            (column as usize).min(self.columns - 1),
+            (row as usize).min(self.rows - 1),
+        )
+    }
+
+    fn cell(&self, p: Point) -> usize {
+        let (column, row) = self.coordinates(p);
+        row * self.columns + column
+    }
+
+    fn remove(&mut self, contour: &Contour, index: u32) {
+        for p in &[contour.entry, contour.exit] {
+            let cell = self.cell(*p);
+            if let Some(i) = self.cells[cell].iter().position(|&c| c == index) {
+                let _ = self.cells[cell].swap_remove(i);
+            }
+        }
+    }
+
+    /// Find the closest unvisited contour end, searching outwards one ring
+    /// of cells at a time.
+    fn nearest(&self, from: Point, contours: &[Contour]) -> Option<Node> {
+        let (column, row) = self.coordinates(from);
+        let mut best: Option<(f32, Node)> = None;
+        // once a ring is this big it covers the whole grid
+        let max_ring = column
+            .max(self.columns - 1 - column)
+            .max(row)
+            .max(self.rows - 1 - row);
+
+        for ring in 0..=max_ring {
+            if let Some((best_distance, _)) = best {
+                // nothing in this ring or beyond can be any closer
+                let closest_possible = (ring as f32 - 1.0) * self.cell_size;
+                if closest_possible > best_distance {
+                    break;
+                }
+            }
+
+            self.for_each_cell_in_ring(column, row, ring, |cell| {
+                for &index in cell {
+                    let contour = &contours[index as usize];
+                    let ends = [(contour.entry, false), (contour.exit, true)];
+                    let usable = if contour.reversible() { 2 } else { 1 };
+
+                    for &(p, reversed) in &ends[..usable] {
+                        let d = distance(from, p);
+                        if best.map_or(true, |(b, _)| d < b) {
+                            let node = Node {
+                                contour: index,
+                                reversed,
+                            };
+                            best = Some((d, node));
+                        }
+                    }
+                }
+            });
+        }
+
+        best.map(|(_, node)| node)
+    }
+
+    /// Visit the cells which are exactly `ring` cells away from
+    /// `(column, row)`.
+    fn for_each_cell_in_ring<F>(
+        &self,
+        column: usize,
+        row: usize,
+        ring: usize,
+        mut visit: F,
+    ) where
+        F: FnMut(&[u32]),
+    {
+        let columns =
+            column.saturating_sub(ring)..=(column + ring).min(self.columns - 1);
+        let rows = row.saturating_sub(ring)..=(row + ring).min(self.rows - 1);
+        let mut cell =
+            |c: usize, r: usize| visit(&self.cells[r * self.columns + c]);
+
+        if ring == 0 {
+            cell(column, row);
+            return;
+        }
+
+        // the top and bottom edges
+        for &r in &[row.checked_sub(ring), Some(row + ring)] {
+            if let Some(r) = r.filter(|&r| r < self.rows) {
+                for c in columns.clone() {
+                    cell(c, r);
+                }
+            }
+        }
+
+        // the left and right edges, without the corners
+        for &c in &[column.checked_sub(ring), Some(column + ring)] {
+            if let Some(c) = c.filter(|&c| c < self.columns) {
+                for r in rows.clone() {
+                    if r + ring != row && r != row + ring {
+                        cell(c, r);
+                    }
+                }
+            }
+        }
+    }
+}
+
+/// A greedy tour which always goes to the closest unvisited contour.
+fn nearest_neighbour(start: Point, contours: &[Contour]) -> Vec<Node> {
+    let mut grid = Grid::new(contours);
+    let mut tour = Vec::with_capacity(contours.len());
+    let mut position = start;
+
+    while let Some(node) = grid.nearest(position, contours) {
+        let contour = &contours[node.contour as usize];
+        grid.remove(contour, node.contour);
+        position = contour.exit(node.reversed);
+        tour.push(node);
+    }
+
+    tour
+}
+
+/// The number of contours each thread improves at a time.
+const WINDOW: usize = 256;
+
+/// Run [`improve_window()`] over consecutive windows of the tour in
+/// parallel.
+///
+/// The first and last contour in each window stay where they are, so
+/// windows can be improved independently.
+fn improve_in_parallel(tour: &mut [Node], offset: usize, contours: &[Contour]) {
+    let offset = offset.min(tour.len());
+    let (head, tail) = tour.split_at_mut(offset);
+    let windows: Vec<&mut [Node]> = std::iter::once(head)
+        .chain(tail.chunks_mut(WINDOW))
+        .filter(|w| w.len() > 2)
+        .collect();
+
+    let workers = thread::available_parallelism()
+        .map(|n| n.get())
+        .unwrap_or(1)
+        .min(windows.len());
+    if workers <= 1 {
+        for window in windows {
+            improve_window(window, contours);
+        }
+        return;
+    }
+
+    let per_worker = (windows.len() + workers - 1) / workers;
+    let mut windows = windows.into_iter();
+
+    thread::scope(|s| loop {
+        let batch: Vec<&mut [Node]> =
+            windows.by_ref().take(per_worker).collect();
+        if batch.is_empty() {
+            break;
+        }
+
+        let _ = s.spawn(move || {
+            for window in batch {
+                improve_window(window, contours);
+            }
+        });
+    });
+}
+
+/// Apply 2-opt and Or-opt moves to the inside of a window until they stop
+/// helping.
+fn improve_window(window: &mut [Node], contours: &[Contour]) {
+    const MAX_PASSES: usize = 8;
+
+    for _ in 0..MAX_PASSES {
+        let improved_2opt = two_opt(window, contours);
+        let improved_or_opt = or_opt(window, contours);
+
+        if !improved_2opt && !improved_or_opt {
+            break;
+        }
+    }
+}
+
+/// Improvements smaller than this are just rounding noise.
+const EPSILON: f32 = 1e-4;
+
+fn entry(contours: &[Contour], node: Node) -> Point {
+    contours[node.contour as usize].entry(node.reversed)
+}
+
+fn exit(contours: &[Contour], node: Node) -> Point {
+    contours[node.contour as usize].exit(node.reversed)
+}
+
+fn reversible(contours: &[Contour], node: Node) -> bool {
+    contours[node.contour as usize].reversible()
+}
+
+fn reverse_nodes(nodes: &mut [Node]) {
+    nodes.reverse();
+    for node in nodes {
+        node.reversed = !node.reversed;
+    }
+}
+
+/// Try reversing runs of contours, `w[i..=j]`.
+fn two_opt(w: &mut [Node], contours: &[Contour]) -> bool {
+    let last = w.len() - 1;
+    let mut improved = false;
+
+    for i in 1..last {
+        for j in i..last {
+            if !reversible(contours, w[j]) {
+                // every contour in the run needs to be reversible
+                break;
+            }
+
+            let before = exit(contours, w[i - 1]);
+            let after = entry(contours, w[j + 1]);
+            let current = distance(before, entry(contours, w[i]))
+                + distance(exit(contours, w[j]), after);
+            let candidate = distance(before, exit(contours, w[j]))
+                + distance(entry(contours, w[i]), after);
+
+            if candidate + EPSILON < current {
+                reverse_nodes(&mut w[i..=j]);
+                improved = true;
+            }
+        }
+    }
+
+    improved
+}
+
+/// How far Or-opt will look when moving a run of contours.
+const OR_OPT_REACH: usize = 48;
+
+/// Try moving short runs of contours somewhere nearby in the window,
+/// optionally reversing them.
+fn or_opt(w: &mut [Node], contours: &[Contour]) -> bool {
+    let last = w.len() - 1;
+    let mut improved = false;
+
+    for len in 1..=3 {
+        let mut i = 1;
+
+        while i + len <= last {
+            let first = w[i];
+            let end = w[i + len - 1];
+            let before = exit(contours, w[i - 1]);
+            let after = entry(contours, w[i + len]);
+            let removal_gain = distance(before, entry(contours, first))
+                + distance(exit(contours, end), after)
+                - distance(before, after);
+            let can_reverse =
+                w[i..i + len].iter().all(|&node| reversible(contours, node));
+
+            let mut best: Option<(f32, usize, bool)> = None;
+
+            let nearby = i.saturating_sub(OR_OPT_REACH)
+                ..(i + len + OR_OPT_REACH).min(last);
+
+            for k in nearby {
+                if k + 1 >= i && k < i + len {
+                    // inserting next to (or inside) the run itself
+                    continue;
+                }
+
+                let a = exit(contours, w[k]);
+                let b = entry(contours, w[k + 1]);
+                let gap = distance(a, b);
+
+                let forwards = distance(a, entry(contours, first))
+                    + distance(exit(contours, end), b)
+                    - gap;
+                if forwards + EPSILON < removal_gain
+                    && best.map_or(true, |(cost, ..)| forwards < cost)
+                {
+                    best = Some((forwards, k, false));
+                }
+
+                if can_reverse {
+                    let backwards = distance(a, exit(contours, end))
+                        + distance(entry(contours, first), b)
+                        - gap;
+                    if backwards + EPSILON < removal_gain
+                        && best.map_or(true, |(cost, ..)| backwards < cost)
+                    {
+                        best = Some((backwards, k, true));
+                    }
+                }
+            }
+
+            match best {
+                Some((_, k, reverse)) => {
+                    let position = if k >= i + len {
+                        w[i..=k].rotate_left(len);
+                        k + 1 - len
+                    } else {
+                        w[k + 1..i + len].rotate_right(len);
+                        k + 1
+                    };
+                    if reverse {
+                        reverse_nodes(&mut w[position..position + len]);
+                    }
+                    improved = true;
+                },
+                None => i += 1,
+            }
+        }
+    }
+
+    improved
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn parse(src: &str) -> Vec<GCode> { crate::parse(src).collect() }
+
+    /// Every cut in the X-Y plane, ignoring direction.
+    fn cuts(program: &[GCode]) -> Vec<String> {
+        let mut state = ModalState::new();
+        let mut cuts = Vec::new();
+
+        for gcode in program {
+            let before = state.position;
+            state.apply(gcode);
+
+            let moved =
+                (before.x, before.y) != (state.position.x, state.position.y);
+            if is_feed_move(gcode) && moved {
+                let a = format!("{:?}", before);
+                let b = format!("{:?}", state.position);
+                cuts.push(if a < b {
+                    format!("{} {}", a, b)
+                } else {
+                    format!("{} {}", b, a)
+                });
+            }
+        }
+
+        cuts.sort();
+        cuts
+    }
+
+    fn slot(x: f32, y: f32, length: f32) -> String {
+        format!(
+            "G0 X{} Y{}\nG1 Z-1 F50\nG1 X{} F500\nG0 Z5\n",
+            x,
+            y,
+            x + length
+        )
+    }
+
+    #[test]
+    fn reorder_slots() {
+        let mut src = String::from("G21 G90\nG0 Z5\n");
+        for &x in &[0.0, 100.0, 10.0, 90.0, 20.0, 80.0] {
+            src.push_str(&slot(x, 0.0, 5.0));
+        }
+        let program = parse(&src);
+
+        let got = Optimizer::new().optimize(&program).unwrap();
+
+        assert_eq!(got.report.contours, 6);
+        assert!(got.report.travel_after < got.report.travel_before / 2.0);
+        assert!(got.report.time_saved > Duration::from_secs(1));
+        assert_eq!(cuts(&got.program), cuts(&program));
+    }
+
+    #[test]
+    fn contours_can_be_reversed() {
+        let src = "G90\nG0 Z5\nG0 X0 Y0\nG1 Z-1 F100\nG1 X10\nG0 Z5\n\
+                   G0 X20 Y0\nG1 Z-1 F100\nG1 X10.5\nG0 Z5\n";
+        let program = parse(src);
+
+        let got = Optimizer::new().optimize(&program).unwrap();
+
+        assert_eq!(got.report.reversed, 1);
+        assert!(got.report.travel_after < 1.0);
+        assert_eq!(cuts(&got.program), cuts(&program));
+
+        let without = Optimizer::new()
+            .with_reversal(false)
+            .optimize(&program)
+            .unwrap();
+        assert_eq!(without.report.reversed, 0);
+        assert_eq!(without.program, program);
+    }
+
+    #[test]
+    fn arcs_are_reversed_around_the_same_centre() {
+        let src = "G90\nG0 Z5\nG0 X0 Y0\nG1 Z-1 F100\nG1 X5\nG0 Z5\n\
+                   G0 X20 Y0\nG1 Z-1\nG2 X10 Y0 I-5 J0\nG0 Z5\n";
+        let program = parse(src);
+
+        let got = Optimizer::new().optimize(&program).unwrap();
+        let text: Vec<String> =
+            got.program.iter().map(|g| g.to_string()).collect();
+
+        assert_eq!(got.report.reversed, 1);
+        assert!(text.contains(&"G3 X20 Y0 I5 J0".to_string()), "{:?}", text);
+    }
+
+    #[test]
+    fn contours_dont_move_past_a_tool_change() {
+        let mut src = String::from("G90\nG0 Z5\nT1 M6\n");
+        src.push_str(&slot(100.0, 0.0, 1.0));
+        src.push_str(&slot(0.0, 0.0, 1.0));
+        src.push_str("T2 M6\n");
+        src.push_str(&slot(50.0, 0.0, 1.0));
+        src.push_str(&slot(101.0, 0.0, 1.0));
+        let program = parse(&src);
+
+        let got = Optimizer::new().optimize(&program).unwrap();
+
+        let tool_change = got
+            .program
+            .iter()
+            .position(|g| {
+                g.mnemonic() == Mnemonic::ToolChange && g.major_number() == 2
+            })
+            .unwrap();
+        let before: Vec<GCode> = got.program[..tool_change].to_vec();
+        let after: Vec<GCode> = got.program[tool_change..].to_vec();
+        let original_split = program
+            .iter()
+            .position(|g| {
+                g.mnemonic() == Mnemonic::ToolChange && g.major_number() == 2
+            })
+            .unwrap();
+        assert_eq!(cuts(&before), cuts(&program[..original_split]));
+        assert_eq!(cuts(&after), cuts(&program[original_split..]));
+    }
+
+    #[test]
+    fn contours_dont_move_past_the_spindle() {
+        let mut src = String::from("G21 G90\nG0 Z5\nG0 X100 Y0\nM3 S1000\n");
+        src.push_str("G1 Z-1 F50\nG1 X101\nG0 Z5\n");
+        for &x in &[0.0, 90.0, 10.0] {
+            src.push_str(&slot(x, 0.0, 1.0));
+        }
+        src.push_str(&slot(50.0, 0.0, 1.0));
+        src.push_str("M5\n");
+        let program = parse(&src);
+
+        let got = Optimizer::new().optimize(&program).unwrap();
+
+        let position = |major: u32| {
+            got.program
+                .iter()
+                .position(|g| {
+                    g.mnemonic() == Mnemonic::Miscellaneous
+                        && g.major_number() == major
+                })
+                .unwrap()
+        };
+        let (spindle_on, spindle_off) = (position(3), position(5));
+        for (index, gcode) in got.program.iter().enumerate() {
+            if is_feed_move(gcode) {
+                assert!(spindle_on < index && index < spindle_off, "{}", gcode);
+            }
+        }
+        assert_eq!(spindle_off, got.program.len() - 1);
+        assert_eq!(cuts(&got.program), cuts(&program));
+    }
+
+    #[test]
+    fn single_axis_rapids_keep_their_other_axis() {
+        let src = "G21 G90\nG0 Z5\n\
+                   G0 X100 Y0\nG1 Z-1 F50\nG1 X101\nG0 Z5\n\
+                   G0 X0 Y10\nG1 Z-1\nG1 X50\nG0 Z5\n\
+                   G0 Y20\nG1 Z-1\nG1 X51\nG0 Z5\n";
+        let program = parse(src);
+
+        for &reversal in &[true, false] {
+            let got = Optimizer::new()
+                .with_reversal(reversal)
+                .optimize(&program)
+                .unwrap();
+
+            assert_eq!(cuts(&got.program), cuts(&program));
+            for gcode in got.program.iter().filter(|g| is_travel(g)) {
+                assert!(gcode.value_for('X').is_some(), "{}", gcode);
+                assert!(gcode.value_for('Y').is_some(), "{}", gcode);
+            }
+        }
+    }
+
+    #[test]
+    fn feed_rates_are_preserved() {
+        // the second slot relies on the first one's feed rate
+        let src = "G90\nG0 X0 Y0 Z5\nG0 X100 Y0\nG1 Z-1 F50\nG1 X101\nG0 Z5\n\
+                   G0 X0 Y0\nG1 Z-1\nG1 X1\nG0 Z5\n";
+        let program = parse(src);
+
+        let got = Optimizer::new()
+            .with_reversal(false)
+            .optimize(&program)
+            .unwrap();
+
+        let mut state = ModalState::new();
+        for gcode in &got.program {
+            state.apply(gcode);
+            if is_feed_move(gcode) {
+                assert_eq!(state.feed_rate, Some(50.0), "{}", gcode);
+            }
+        }
+        assert_eq!(got.program[2].value_for('X'), Some(0.0));
+    }
+
+    #[test]
+    fn relative_programs_are_rejected() {
+        let program = parse("G90\nG0 X1 Y1\nG91\nG1 X1");
+
+        let got = Optimizer::new().optimize(&program);
+
+        assert_eq!(got, Err(TravelError::RelativeCoordinates { index: 2 }));
+    }
+
+    #[test]
+    fn lots_of_contours() {
+        // a deterministic scatter of points
+        let mut seed = 12345_u32;
+        let mut random = move || {
+            seed = seed.wrapping_mul(1_103_515_245).wrapping_add(12345);
+            (seed >> 8) as f32 / (1 << 24) as f32 * 500.0
+        };
+        let mut src = String::from("G21 G90\nG0 Z5\n");
+        for _ in 0..2000 {
+            let (x, y) = (random(), random());
+            src.push_str(&slot(x, y, 1.0));
+        }
+        let program = parse(&src);
+
+        let got = Optimizer::new().optimize(&program).unwrap();
+
+        assert_eq!(got.report.contours, 2000);
+        assert!(got.report.travel_after < got.report.travel_before / 5.0);
+        assert_eq!(cuts(&got.program).len(), cuts(&program).len());
+    }
+}
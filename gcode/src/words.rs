@@ -1,6 +1,6 @@
 use crate::{
     lexer::{Lexer, Token, TokenType},
-    Comment, Span,
+    number, Comment, Span,
 };
 use core::fmt::{self, Display, Formatter};
 
@@ -93,16 +93,24 @@ where
                 TokenType::Comment => {
                     return Some(Atom::Comment(Comment { value, span }))
                 },
-                TokenType::Letter if self.last_letter.is_none() => {
-                    self.last_letter = Some(token);
+                TokenType::Letter => {
+                    // a letter followed by another letter means the first
+                    // one was missing its number
+                    if let Some(broken) = self.last_letter.replace(token) {
+                        return Some(Atom::BrokenWord(broken));
+                    }
                 },
                 TokenType::Number if self.last_letter.is_some() => {
+                    let value = match number::parse(value) {
+                        Some(value) => value,
+                        // the lexer should only give us numbers with digits
+                        None => return Some(Atom::Unknown(token)),
+                    };
                     let letter_token = self.last_letter.take().unwrap();
                     let span = letter_token.span.merge(span);
 
                     debug_assert_eq!(letter_token.value.len(), 1);
                     let letter = letter_token.value.chars().next().unwrap();
-                    let value = value.parse().expect("");
 
                     return Some(Atom::Word(Word {
                         letter,
@@ -186,6 +194,19 @@ mod tests {
         assert_eq!(got, expected);
     }
 
+    #[test]
+    fn a_letter_without_a_number_doesnt_steal_the_next_number() {
+        let text = "G ; comment\nG01";
+        let mut words = WordsOrComments::new(Lexer::new(text));
+
+        let got: Vec<_> = words.by_ref().collect();
+
+        assert_eq!(got.len(), 3);
+        assert!(matches!(got[0], Atom::Comment(_)));
+        assert!(matches!(got[1], Atom::BrokenWord(t) if t.span.line == 0));
+        assert!(matches!(got[2], Atom::Word(w) if w.span.line == 1));
+    }
+
     #[test]
     fn recognise_a_valid_word() {
         let text = "G90";
@@ -25,6 +25,29 @@ smoke_test!(pi_octcat, "PI_octcat.gcode");
 smoke_test!(pi_rustlogo, "PI_rustlogo.gcode");
 smoke_test!(insulpro_piping, "Insulpro.Piping.-.115mm.OD.-.40mm.WT.txt");
 
+#[test]
+#[cfg(feature = "std")]
+fn overfull_lines_are_split_instead_of_dropped() {
+    use gcode::{buffers::SmallFixedBuffers, profile::SplitLines, Parser};
+
+    let src = include_str!("data/Insulpro.Piping.-.115mm.OD.-.40mm.WT.txt");
+    let src = sanitise_input(src);
+
+    let full: Vec<_> = gcode::parse(&src).collect();
+    let (lines, continuations): (Vec<_>, Vec<_>) =
+        Parser::<_, SmallFixedBuffers, SplitLines>::new(&src, PanicOnError)
+            .with_continuations()
+            .unzip();
+    let split: Vec<_> = lines.iter().flat_map(|l| l.gcodes()).collect();
+
+    assert_eq!(split.len(), full.len());
+    for (got, original) in split.iter().zip(&full) {
+        assert_eq!(got.major_number(), original.major_number());
+        assert_eq!(got.arguments(), &original.arguments()[..]);
+    }
+    assert!(continuations.iter().any(|&c| c));
+}
+
 #[test]
 #[ignore]
 fn expected_program_2_output() {
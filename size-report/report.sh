@@ -0,0 +1,38 @@
+#!/bin/sh
+# Measure how much .text and .rodata the gcode crate costs for each feature
+# combination.
+#
+# Usage: ./report.sh [--record]
+#
+# With --record, the results are also appended to sizes.csv so we can keep
+# track of how the numbers change over time.
+
+set -e
+cd "$(dirname "$0")"
+
+CONFIGS="minimal compact-float dyn-callbacks compact-float+dyn-callbacks std"
+DATE=$(date -u +%Y-%m-%d)
+RUSTC=$(rustc --version | cut -d' ' -f2)
+
+printf '| %-28s | %8s | %8s |\n' "features" ".text" ".rodata"
+printf '| %-28s | %8s | %8s |\n' "----------------------------" "--------" "--------"
+
+for config in $CONFIGS; do
+    if [ "$config" = "minimal" ]; then
+        features=""
+    else
+        features=$(echo "$config" | tr '+' ',')
+    fi
+
+    cargo build --quiet --release --no-default-features --features "$features"
+
+    lib=$(ls target/release/libgcode_size_report.* | grep -E '\.(so|dylib)$')
+    text=$(size -A "$lib" | awk '$1 == ".text" { print $2 }')
+    rodata=$(size -A "$lib" | awk '$1 == ".rodata" { print $2 }')
+
+    printf '| %-28s | %8s | %8s |\n' "$config" "$text" "$rodata"
+
+    if [ "$1" = "--record" ]; then
+        echo "$DATE,$RUSTC,$config,$text,$rodata" >> sizes.csv
+    fi
+done
@@ -0,0 +1,98 @@
+//! A stand-in for firmware using the `gcode` crate.
+//!
+//! It exposes a couple of `extern "C"` functions which parse with different
+//! [`Callbacks`], the same way an application with several entry points would.
+//! Building it as a `cdylib` means only code reachable from those functions
+//! ends up in the binary, so the section sizes reflect what an application
+//! would pay.
+
+#![cfg_attr(not(feature = "std"), no_std)]
+
+use gcode::{Callbacks, Nop, Parser, Span};
+
+#[derive(Debug, Default)]
+struct CountErrors(usize);
+
+impl Callbacks for CountErrors {
+    fn unknown_content(&mut self, _text: &str, _span: Span) { self.0 += 1; }
+
+    fn letter_without_a_number(&mut self, _value: &str, _span: Span) {
+        self.0 += 1;
+    }
+
+    fn number_without_a_letter(&mut self, _value: &str, _span: Span) {
+        self.0 += 1;
+    }
+}
+
+#[cfg(not(feature = "dyn-callbacks"))]
+fn sum_arguments<C: Callbacks>(src: &str, callbacks: C) -> f32 {
+    let mut total = 0.0;
+
+    for line in Parser::<C>::new(src, callbacks) {
+        for gcode in line.gcodes() {
+            for word in gcode.arguments() {
+                total += word.value;
+            }
+        }
+    }
+
+    total
+}
+
+#[cfg(feature = "dyn-callbacks")]
+fn sum_arguments(src: &str, callbacks: &mut dyn Callbacks) -> f32 {
+    let mut total = 0.0;
+
+    for line in Parser::<&mut dyn Callbacks>::new(src, callbacks) {
+        for gcode in line.gcodes() {
+            for word in gcode.arguments() {
+                total += word.value;
+            }
+        }
+    }
+
+    total
+}
+
+/// View the bytes passed in from C as a `&str`.
+///
+/// # Safety
+///
+/// `ptr` must point to `len` bytes of valid UTF-8 which stay alive and
+/// unmodified for `'a`.
+unsafe fn text<'a>(ptr: *const u8, len: usize) -> &'a str {
+    core::str::from_utf8_unchecked(core::slice::from_raw_parts(ptr, len))
+}
+
+/// Add up every argument in a program, ignoring errors.
+///
+/// # Safety
+///
+/// `ptr` must point to `len` bytes of valid UTF-8.
+#[no_mangle]
+pub unsafe extern "C" fn gcode_sum_arguments(
+    ptr: *const u8,
+    len: usize,
+) -> f32 {
+    sum_arguments(text(ptr, len), &mut Nop)
+}
+
+/// Count how many errors there are in a program.
+///
+/// # Safety
+///
+/// `ptr` must point to `len` bytes of valid UTF-8.
+#[no_mangle]
+pub unsafe extern "C" fn gcode_count_errors(
+    ptr: *const u8,
+    len: usize,
+) -> usize {
+    let mut errors = CountErrors::default();
+    let _ = sum_arguments(text(ptr, len), &mut errors);
+    errors.0
+}
+
+#[cfg(not(feature = "std"))]
+#[panic_handler]
+fn panic(_info: &core::panic::PanicInfo<'_>) -> ! { loop {} }
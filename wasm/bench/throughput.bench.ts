@@ -0,0 +1,279 @@
+/**
+ * Throughput benchmarks for the JavaScript bindings, run with `yarn bench`.
+ *
+ * Each file from `gcode/tests/data` is parsed in three ways so the cost of
+ * `parseLines()` can be broken down:
+ *
+ * - **wasm:** the text is parsed entirely inside WebAssembly
+ *   (`Parser.parse_remaining()`), so this is the floor for everything else
+ * - **boundary:** every line, gcode, argument and comment is fetched through
+ *   the generated bindings and freed, without building any JavaScript objects
+ * - **full:** `parseLines()` as a user would call it
+ *
+ * The difference between successive stages is the time spent crossing the
+ * boundary and constructing JavaScript objects respectively.
+ *
+ * Results are written to `bench/results/latest.json` and appended to
+ * `bench/results/history.jsonl`. If `bench/results/baseline.json` exists
+ * (create it with `GCODE_BENCH_SAVE_BASELINE=1 yarn bench`), a file whose
+ * full throughput dropped by more than `GCODE_BENCH_TOLERANCE` (default
+ * 0.2, i.e. 20%) fails the run. `GCODE_BENCH_ROUNDS` sets how many times
+ * each measurement is repeated.
+ */
+import * as fs from "fs";
+import * as path from "path";
+import { performance } from "perf_hooks";
+import * as scalar from "../pkg/gcode_wasm";
+import * as simd from "../pkg-simd/gcode_wasm";
+import { parseLines, simdEnabled } from "../ts/index";
+
+const wasm: typeof scalar = simdEnabled ? simd : scalar;
+
+const DATA_DIR = path.join(__dirname, "..", "..", "gcode", "tests", "data");
+const RESULTS_DIR = path.join(__dirname, "results");
+const BASELINE = path.join(RESULTS_DIR, "baseline.json");
+
+const ROUNDS = Number(process.env.GCODE_BENCH_ROUNDS || 10);
+const TOLERANCE = Number(process.env.GCODE_BENCH_TOLERANCE || 0.2);
+
+type Stage = "wasm" | "boundary" | "full";
+
+type Measurement = {
+    seconds: number,
+    megabytesPerSecond: number,
+    linesPerSecond: number,
+};
+
+type FileResult = {
+    file: string,
+    bytes: number,
+    lines: number,
+    stages: { [stage in Stage]: Measurement },
+    breakdown: {
+        wasmParsing: number,
+        boundaryCrossings: number,
+        objectConstruction: number,
+    },
+};
+
+type Results = {
+    timestamp: string,
+    simd: boolean,
+    node: string,
+    files: FileResult[],
+};
+
+function inputs(): Array<{ file: string, text: string }> {
+    return fs.readdirSync(DATA_DIR)
+        .filter(file => file.endsWith(".gcode") || file.endsWith(".txt"))
+        .sort()
+        .map(file => ({ file, text: fs.readFileSync(path.join(DATA_DIR, file), "utf8") }));
+}
+
+/**
+ * Run `parse` a couple of times to warm up the JIT, then return the median
+ * time (in seconds) and the number of lines it reported.
+ */
+function measure(parse: () => number): { seconds: number, lines: number } {
+    let lines = 0;
+
+    for (let i = 0; i < 2; i++) {
+        lines = parse();
+    }
+
+    const timings = [];
+
+    for (let i = 0; i < ROUNDS; i++) {
+        const start = performance.now();
+        lines = parse();
+        timings.push((performance.now() - start) / 1000);
+    }
+
+    timings.sort((a, b) => a - b);
+    return { seconds: timings[Math.floor(timings.length / 2)], lines };
+}
+
+function parseInWasm(text: string): number {
+    const parser = new wasm.Parser(text, {});
+
+    try {
+        return parser.parse_remaining();
+    } finally {
+        parser.free();
+    }
+}
+
+/**
+ * Visit everything `translateLine()` would, without building any objects.
+ */
+function crossBoundary(text: string): number {
+    const parser = new wasm.Parser(text, {});
+    let lines = 0;
+
+    try {
+        while (true) {
+            const line = parser.next_line();
+
+            if (!line) {
+                break;
+            }
+
+            lines++;
+            touchSpan(line.span);
+
+            for (let i = 0; i < line.num_gcodes(); i++) {
+                const gcode = line.get_gcode(i)!;
+                touch(gcode.mnemonic, gcode.number);
+                touchSpan(gcode.span);
+
+                for (let j = 0; j < gcode.num_arguments(); j++) {
+                    const word = gcode.get_argument(j)!;
+                    touch(word.letter, word.value);
+                    word.free();
+                }
+
+                gcode.free();
+            }
+
+            for (let i = 0; i < line.num_comments(); i++) {
+                const comment = line.get_comment(i)!;
+                touch(comment.text, 0);
+                touchSpan(comment.span);
+                comment.free();
+            }
+
+            line.free();
+        }
+    } finally {
+        parser.free();
+    }
+
+    return lines;
+}
+
+let sink = 0;
+
+/**
+ * Use a value so the JIT can't optimise the getter call away.
+ */
+function touch(text: unknown, value: number) {
+    sink += String(text).length + value;
+}
+
+function touchSpan(span: scalar.Span) {
+    sink += span.start + span.end + span.line;
+}
+
+function parseFully(text: string): number {
+    let lines = 0;
+
+    for (const _ of parseLines(text)) {
+        lines++;
+    }
+
+    return lines;
+}
+
+function toMeasurement(bytes: number, lines: number, seconds: number): Measurement {
+    return {
+        seconds,
+        megabytesPerSecond: bytes / 1e6 / seconds,
+        linesPerSecond: lines / seconds,
+    };
+}
+
+function benchmark(file: string, text: string): FileResult {
+    const bytes = new TextEncoder().encode(text).length;
+    const stages = {
+        wasm: measure(() => parseInWasm(text)),
+        boundary: measure(() => crossBoundary(text)),
+        full: measure(() => parseFully(text)),
+    };
+    const lines = stages.full.lines;
+
+    return {
+        file,
+        bytes,
+        lines,
+        stages: {
+            wasm: toMeasurement(bytes, lines, stages.wasm.seconds),
+            boundary: toMeasurement(bytes, lines, stages.boundary.seconds),
+            full: toMeasurement(bytes, lines, stages.full.seconds),
+        },
+        breakdown: {
+            wasmParsing: stages.wasm.seconds,
+            boundaryCrossings: Math.max(0, stages.boundary.seconds - stages.wasm.seconds),
+            objectConstruction: Math.max(0, stages.full.seconds - stages.boundary.seconds),
+        },
+    };
+}
+
+function report(result: FileResult, baseline?: FileResult) {
+    const { full } = result.stages;
+    const total = result.stages.full.seconds;
+    const percent = (seconds: number) => `${(100 * seconds / total).toFixed(0)}%`;
+    const change = baseline
+        ? ` (${(100 * (full.linesPerSecond / baseline.stages.full.linesPerSecond - 1)).toFixed(1)}% vs baseline)`
+        : "";
+
+    console.log([
+        `${result.file}: ${result.lines} lines, ${(result.bytes / 1e6).toFixed(2)} MB`,
+        `  ${full.megabytesPerSecond.toFixed(2)} MB/s, ${full.linesPerSecond.toFixed(0)} lines/s${change}`,
+        `  wasm parsing ${percent(result.breakdown.wasmParsing)}, ` +
+        `boundary crossings ${percent(result.breakdown.boundaryCrossings)}, ` +
+        `object construction ${percent(result.breakdown.objectConstruction)}`,
+    ].join("\n"));
+}
+
+function save(results: Results) {
+    fs.mkdirSync(RESULTS_DIR, { recursive: true });
+    const json = JSON.stringify(results, null, 2);
+
+    fs.writeFileSync(path.join(RESULTS_DIR, "latest.json"), json + "\n");
+    fs.appendFileSync(path.join(RESULTS_DIR, "history.jsonl"), JSON.stringify(results) + "\n");
+
+    if (process.env.GCODE_BENCH_SAVE_BASELINE) {
+        fs.writeFileSync(BASELINE, json + "\n");
+    }
+}
+
+function loadBaseline(): Results | undefined {
+    if (process.env.GCODE_BENCH_SAVE_BASELINE || !fs.existsSync(BASELINE)) {
+        return undefined;
+    }
+
+    return JSON.parse(fs.readFileSync(BASELINE, "utf8"));
+}
+
+describe("parseLines() throughput", () => {
+    it("hasn't regressed", () => {
+        const baseline = loadBaseline();
+        const results: Results = {
+            timestamp: new Date().toISOString(),
+            simd: simdEnabled,
+            node: process.version,
+            files: [],
+        };
+        const regressions = [];
+
+        for (const { file, text } of inputs()) {
+            const result = benchmark(file, text);
+            const previous = baseline && baseline.files.find(f => f.file === file);
+
+            report(result, previous);
+            results.files.push(result);
+
+            if (previous) {
+                const ratio = result.stages.full.linesPerSecond / previous.stages.full.linesPerSecond;
+
+                if (ratio < 1 - TOLERANCE) {
+                    regressions.push(file);
+                }
+            }
+        }
+
+        save(results);
+        expect(sink).toBeGreaterThan(0);
+        expect(regressions).toEqual([]);
+    });
+});
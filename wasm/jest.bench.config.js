@@ -0,0 +1,9 @@
+// Runs the throughput benchmarks in bench/ instead of the normal tests.
+module.exports = {
+    transform: { '^.+\\.ts?$': 'ts-jest' },
+    testEnvironment: 'node',
+    testRegex: 'bench/.*\\.bench\\.ts$',
+    moduleFileExtensions: ['ts', 'tsx', 'js', 'jsx', 'json', 'node'],
+    // the benchmarks can take a while on the bigger files
+    testTimeout: 10 * 60 * 1000,
+};
@@ -2,5 +2,7 @@ module.exports = {
     transform: { '^.+\\.ts?$': 'ts-jest' },
     testEnvironment: 'node',
     testRegex: '.*\\.(test|spec)?\\.(ts|tsx)$',
-    moduleFileExtensions: ['ts', 'tsx', 'js', 'jsx', 'json', 'node']
+    moduleFileExtensions: ['ts', 'tsx', 'js', 'jsx', 'json', 'node'],
+    // benchmarks are run separately with "yarn bench"
+    testPathIgnorePatterns: ['/node_modules/', '/bench/'],
 };
\ No newline at end of file
@@ -4,10 +4,14 @@
 mod callbacks;
 mod parser;
 mod simple_wrappers;
+mod streaming_parser;
+mod text_buffer;
 
 pub use callbacks::JavaScriptCallbacks;
 pub use parser::Parser;
 pub use simple_wrappers::{Comment, GCode, Line, Span, Word};
+pub use streaming_parser::StreamingParser;
+pub use text_buffer::{memory, TextBuffer};
 
 use gcode::Mnemonic;
 
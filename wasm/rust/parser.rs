@@ -1,75 +1,79 @@
-use crate::{JavaScriptCallbacks, Line};
-use std::{mem::ManuallyDrop, pin::Pin};
-use wasm_bindgen::prelude::wasm_bindgen;
+use crate::{JavaScriptCallbacks, Line, TextBuffer};
+use gcode::owned::{Batch, OwnedParser};
+use std::rc::Rc;
+use wasm_bindgen::prelude::{wasm_bindgen, JsValue};
 
 #[wasm_bindgen]
 pub struct Parser {
-    /// A pinned heap allocation containing the text that `inner` has
-    /// references to.
-    ///
-    /// # Safety
-    ///
-    /// This field **must** be destroyed after `inner`. The `&str` it contains
-    /// should also never change, otherwise we may invalidate references inside
-    /// `inner`.
-    _text: Pin<Box<str>>,
-    /// The actual `gcode::Parser`. We've told the compiler that it has a
-    /// `'static` lifetime because we'll be using `unsafe` code to manually
-    /// manage memory.
-    inner: ManuallyDrop<gcode::Parser<'static, JavaScriptCallbacks>>,
+    /// The actual parser, which shares ownership of the text with every
+    /// [`Batch`] it produces.
+    inner: OwnedParser<Rc<String>, JavaScriptCallbacks>,
+    /// The batch lines are currently being taken from.
+    current: Option<Batch<Rc<String>>>,
+    /// The index of the next line in `current`.
+    next_index: usize,
 }
 
 #[wasm_bindgen]
 impl Parser {
     #[wasm_bindgen(constructor)]
     pub fn new(text: String, callbacks: JavaScriptCallbacks) -> Parser {
-        // make sure our text is allocated on the heap and will never move
-        let text: Pin<Box<str>> = text.into_boxed_str().into();
+        Parser::from_string(text, callbacks)
+    }
 
-        // SAFETY: Because gcode::Parser contains a reference to the text string
-        // it needs a lifetime, however it's not sound to expose a struct with
-        // a lifetime to JavaScript (JavaScript doesn't have a borrow checker).
-        //
-        // To work around this we turn the string into a `Box<Pin<str>>` (to
-        // statically ensure pointers to our string will never change) then
-        // take a reference to it and "extend" the reference lifetime to
-        // 'static.
-        //
-        // The order that `text` and `inner` are destroyed in isn't really
-        // defined, so we use `ManuallyDrop` to ensure the `gcode::Parser` is
-        // destroyed first. That way we don't get the situation where `text` is
-        // destroyed and our `inner` parser is left with dangling references.
-        unsafe {
-            // get a pointer to the underlying text
-            let text_ptr: *const str = &*text;
-            // then convert it to a reference with a 'static lifetime
-            let static_str: &'static str = &*text_ptr;
+    /// Create a [`Parser`] which takes ownership of the text JavaScript wrote
+    /// into a [`TextBuffer`], so the text isn't copied again.
+    pub fn from_buffer(
+        buffer: TextBuffer,
+        len: usize,
+        callbacks: JavaScriptCallbacks,
+    ) -> Result<Parser, JsValue> {
+        let text = buffer.into_string(len)?;
+        Ok(Parser::from_string(text, callbacks))
+    }
 
-            // now make a gcode::Parser which uses the 'static text as input
-            let inner =
-                ManuallyDrop::new(gcode::Parser::new(static_str, callbacks));
+    /// Try to parse the next [`Line`].
+    pub fn next_line(&mut self) -> Option<Line> {
+        loop {
+            if let Some(batch) = &self.current {
+                if let Some(line) = batch.lines().get(self.next_index) {
+                    self.next_index += 1;
+                    return Some(Line::from_owned(line, batch.source()));
+                }
+            }
 
-            Parser { _text: text, inner }
+            self.current = Some(self.inner.next_batch()?);
+            self.next_index = 0;
         }
     }
 
-    /// Try to parse the next [`Line`].
-    ///
-    /// # Safety
+    /// Parse the rest of the text without handing any [`Line`]s to
+    /// JavaScript, returning how many lines there were.
     ///
-    /// The line must not outlive the [`Parser`] it came from.
-    pub fn next_line(&mut self) -> Option<Line> { self.inner.next().map(From::from) }
-}
+    /// This is mainly useful for benchmarking, to separate the time spent
+    /// parsing from the time spent crossing the wasm boundary.
+    pub fn parse_remaining(&mut self) -> usize {
+        let mut lines = match self.current.take() {
+            Some(batch) => batch.len().saturating_sub(self.next_index),
+            None => 0,
+        };
 
-impl Drop for Parser {
-    fn drop(&mut self) {
-        // SAFETY: This is the only place `inner` gets destroyed, and the field
-        // can never be touch after `Parser::drop()` is called.
-        unsafe {
-            ManuallyDrop::drop(&mut self.inner);
+        while let Some(batch) = self.inner.next_batch() {
+            lines += batch.len();
         }
 
-        // the text will be destroyed somewhere after here because Rust's drop
-        // glue destroys fields after the containing type is destroyed.
+        lines
+    }
+}
+
+impl Parser {
+    fn from_string(text: String, callbacks: JavaScriptCallbacks) -> Parser {
+        // wrapping the String in an Rc (rather than converting to Rc<str>)
+        // means the text is never copied
+        Parser {
+            inner: OwnedParser::new(Rc::new(text), callbacks),
+            current: None,
+            next_index: 0,
+        }
     }
 }
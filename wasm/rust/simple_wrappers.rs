@@ -44,36 +44,56 @@ impl From<gcode::Word> for Word {
     }
 }
 
+/// A [`gcode::Line`] which owns its contents, so it can be handed to
+/// JavaScript without worrying about the source text.
 #[wasm_bindgen]
 #[derive(Debug)]
-pub struct Line(gcode::Line<'static>);
+pub struct Line {
+    gcodes: Vec<gcode::GCode>,
+    comments: Vec<Comment>,
+    span: Span,
+}
 
 #[wasm_bindgen]
 impl Line {
-    pub fn num_gcodes(&self) -> usize { self.0.gcodes().len() }
+    pub fn num_gcodes(&self) -> usize { self.gcodes.len() }
 
     pub fn get_gcode(&self, index: usize) -> Option<GCode> {
-        self.0.gcodes().get(index).map(|g| GCode(g.clone()))
+        self.gcodes.get(index).map(|g| GCode(g.clone()))
     }
 
-    pub fn num_comments(&self) -> usize { self.0.comments().len() }
+    pub fn num_comments(&self) -> usize { self.comments.len() }
 
     pub fn get_comment(&self, index: usize) -> Option<Comment> {
-        self.0.comments().get(index).map(|c| Comment {
-            text: c.value.into(),
-            span: Span(c.span),
-        })
+        self.comments.get(index).cloned()
     }
 
     #[wasm_bindgen(getter)]
-    pub fn span(&self) -> Span {
-        self.0.span().into()
+    pub fn span(&self) -> Span { self.span }
+}
+
+impl Line {
+    /// Copy an [`gcode::owned::OwnedLine`], looking its comments up in the
+    /// `source` text.
+    pub(crate) fn from_owned(
+        line: &gcode::owned::OwnedLine,
+        source: &str,
+    ) -> Line {
+        Line {
+            gcodes: line.gcodes().to_vec(),
+            comments: line.comments(source).map(Comment::from).collect(),
+            span: line.span().into(),
+        }
     }
 }
 
-impl From<gcode::Line<'static>> for Line {
-    fn from(other: gcode::Line<'static>) -> Line {
-        Line(other)
+impl<'input> From<gcode::Line<'input>> for Line {
+    fn from(other: gcode::Line<'input>) -> Line {
+        Line {
+            gcodes: other.gcodes().to_vec(),
+            comments: other.comments().iter().copied().map(Comment::from).collect(),
+            span: other.span().into(),
+        }
     }
 }
 
@@ -112,7 +132,7 @@ impl From<gcode::GCode> for GCode {
 }
 
 #[wasm_bindgen]
-#[derive(Debug)]
+#[derive(Debug, Clone)]
 pub struct Comment {
     text: String,
     #[wasm_bindgen(readonly)]
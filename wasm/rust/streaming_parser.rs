@@ -0,0 +1,39 @@
+use crate::{JavaScriptCallbacks, Line};
+use std::collections::VecDeque;
+use wasm_bindgen::prelude::wasm_bindgen;
+
+/// A parser which is given its input a chunk at a time (e.g. from a
+/// `ReadableStream`), buffering completed lines until they are retrieved.
+#[wasm_bindgen]
+pub struct StreamingParser {
+    inner: gcode::streaming::StreamingParser<JavaScriptCallbacks>,
+    completed: VecDeque<Line>,
+}
+
+#[wasm_bindgen]
+impl StreamingParser {
+    #[wasm_bindgen(constructor)]
+    pub fn new(callbacks: JavaScriptCallbacks) -> StreamingParser {
+        StreamingParser {
+            inner: gcode::streaming::StreamingParser::new(callbacks),
+            completed: VecDeque::new(),
+        }
+    }
+
+    /// Parse another chunk of UTF-8 encoded text.
+    pub fn push(&mut self, chunk: &[u8]) {
+        let completed = &mut self.completed;
+        self.inner
+            .push(chunk, |line| completed.push_back(Line::from(line)));
+    }
+
+    /// Signal that there is no more input, parsing any text left over from
+    /// the last chunk.
+    pub fn finish(&mut self) {
+        let completed = &mut self.completed;
+        self.inner.finish(|line| completed.push_back(Line::from(line)));
+    }
+
+    /// Take the next completed [`Line`], if there is one.
+    pub fn next_line(&mut self) -> Option<Line> { self.completed.pop_front() }
+}
@@ -0,0 +1,75 @@
+use wasm_bindgen::prelude::{wasm_bindgen, JsValue};
+
+/// A chunk of WebAssembly memory which JavaScript can write text into
+/// directly (e.g. with `TextEncoder.encodeInto()`), avoiding the copy
+/// `wasm-bindgen` would make when passing a `string` across.
+///
+/// The memory is zeroed up front, so reading it back is always sound no
+/// matter how much JavaScript says it wrote.
+#[wasm_bindgen]
+#[derive(Debug)]
+pub struct TextBuffer {
+    bytes: Vec<u8>,
+}
+
+#[wasm_bindgen]
+impl TextBuffer {
+    #[wasm_bindgen(constructor)]
+    pub fn new(capacity: usize) -> TextBuffer {
+        TextBuffer {
+            bytes: vec![0; capacity],
+        }
+    }
+
+    /// The buffer's address in WebAssembly memory.
+    ///
+    /// This is only valid until the next allocation, because growing the
+    /// memory detaches any existing views into it.
+    pub fn ptr(&self) -> *const u8 { self.bytes.as_ptr() }
+
+    /// How many bytes JavaScript may write, starting at [`TextBuffer::ptr()`].
+    pub fn capacity(&self) -> usize { self.bytes.len() }
+
+    /// Keep the first `written` bytes, then make room for `additional` more
+    /// after them.
+    pub fn grow(
+        &mut self,
+        written: usize,
+        additional: usize,
+    ) -> Result<(), JsValue> {
+        self.check(written)?;
+        let len = written
+            .checked_add(additional)
+            .ok_or_else(|| JsValue::from_str("The buffer is too large"))?;
+
+        self.bytes.truncate(written);
+        self.bytes.resize(len, 0);
+        Ok(())
+    }
+}
+
+impl TextBuffer {
+    /// Take the first `len` bytes as a UTF-8 string without copying them.
+    ///
+    /// Any room left over stays allocated, because giving it back could mean
+    /// copying the text.
+    pub(crate) fn into_string(mut self, len: usize) -> Result<String, JsValue> {
+        self.check(len)?;
+        self.bytes.truncate(len);
+
+        String::from_utf8(self.bytes)
+            .map_err(|e| JsValue::from_str(&e.to_string()))
+    }
+
+    fn check(&self, written: usize) -> Result<(), JsValue> {
+        if written > self.bytes.len() {
+            Err(JsValue::from_str("Length exceeds the buffer capacity"))
+        } else {
+            Ok(())
+        }
+    }
+}
+
+/// The WebAssembly memory backing every [`TextBuffer`].
+#[wasm_bindgen]
+pub fn memory() -> JsValue { wasm_bindgen::memory() }
@@ -0,0 +1,13 @@
+// The wasm-pack output is shipped inside this package (see "files" in
+// package.json) rather than being published on its own. wasm-pack writes a
+// .gitignore that ignores everything, which npm would also use to leave the
+// build out of the tarball, so remove it.
+const fs = require("fs");
+const path = require("path");
+
+const outDir = path.join(__dirname, "..", process.argv[2]);
+const gitignore = path.join(outDir, ".gitignore");
+
+if (fs.existsSync(gitignore)) {
+    fs.unlinkSync(gitignore);
+}
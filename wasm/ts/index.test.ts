@@ -1,4 +1,4 @@
-import { parse, GCode } from "./index";
+import { parse, parseLines, parseStream, GCode, Line } from "./index";
 
 describe("gcode parsing", () => {
     it("can parse G90", () => {
@@ -43,4 +43,40 @@ describe("gcode parsing", () => {
 
         expect(got).toEqual(expected);
     });
-});
\ No newline at end of file
+
+    it("gives the same lines when parsing a stream", async () => {
+        const src = "G90 (absolute)\nG01 X5 Y-2.5\nX10 ; move right\nM30";
+        const bytes = new TextEncoder().encode(src);
+        const chunks: Uint8Array[] = [];
+        for (let i = 0; i < bytes.length; i += 5) {
+            chunks.push(bytes.slice(i, i + 5));
+        }
+        const stream = {
+            getReader() {
+                return {
+                    read: async () => chunks.length > 0
+                        ? { done: false, value: chunks.shift() }
+                        : { done: true, value: undefined },
+                    releaseLock() { },
+                };
+            },
+        } as unknown as ReadableStream<Uint8Array>;
+
+        const got: Line[] = [];
+        for await (const line of parseStream(stream)) {
+            got.push(line);
+        }
+
+        expect(got).toEqual(Array.from(parseLines(src)));
+    });
+
+    it("can parse text containing non-ASCII characters", () => {
+        const src = "G90 (10°)\nG01 X5";
+
+        const got = Array.from(parseLines(src));
+
+        expect(got.length).toEqual(2);
+        expect(got[0].comments[0].text).toEqual("(10°)");
+        expect(Array.from(parseLines(new TextEncoder().encode(src)))).toEqual(got);
+    });
+});
@@ -1,4 +1,33 @@
-import * as wasm from "@michael-f-bryan/gcode-wasm";
+import * as scalar from "../pkg/gcode_wasm";
+import * as simd from "../pkg-simd/gcode_wasm";
+
+/**
+ * The smallest valid WebAssembly module which uses a SIMD instruction
+ * (`i8x16.splat`), used to check whether the runtime supports SIMD.
+ */
+const SIMD_PROBE = new Uint8Array([
+    0, 97, 115, 109, 1, 0, 0, 0, 1, 5, 1, 96, 0, 1, 123, 3, 2, 1, 0, 10, 10, 1,
+    8, 0, 65, 0, 253, 15, 253, 98, 11,
+]);
+
+function supportsSimd(): boolean {
+    try {
+        return typeof WebAssembly === "object" && WebAssembly.validate(SIMD_PROBE);
+    } catch {
+        return false;
+    }
+}
+
+/**
+ * The bindings we'll be using. Both builds expose an identical API, the SIMD
+ * one just has a faster lexer.
+ */
+const wasm: typeof scalar = supportsSimd() ? simd : scalar;
+
+/**
+ * Whether the SIMD build of the bindings is being used.
+ */
+export const simdEnabled: boolean = wasm === simd;
 
 export type Line = {
     gcodes: GCode[],
@@ -38,7 +67,7 @@ export interface Callbacks {
     gcode_argument_buffer_overflowed?(
         mnemonic: string,
         number: number,
-        argument: wasm.Word,
+        argument: scalar.Word,
     ): void;
 
     comment_buffer_overflow?(
@@ -68,8 +97,8 @@ export interface Callbacks {
     ): void;
 }
 
-export function* parseLines(text: string, callbacks?: Callbacks): Iterable<Line> {
-    const parser = new wasm.Parser(text, callbacks);
+export function* parseLines(text: string | Uint8Array, callbacks?: Callbacks): Iterable<Line> {
+    const parser = createParser(text, callbacks);
 
     try {
         while (true) {
@@ -87,7 +116,59 @@ export function* parseLines(text: string, callbacks?: Callbacks): Iterable<Line>
     }
 }
 
-export function* parse(text: string, callbacks?: Callbacks): Iterable<GCode> {
+/**
+ * Parse lines from a stream of UTF-8 encoded bytes (e.g. the body of a
+ * `fetch()` response) as they arrive.
+ *
+ * Only the incomplete line at the end of each chunk is kept around, so memory
+ * usage is bounded by the chunk size rather than the size of the file.
+ */
+export async function* parseStream(stream: ReadableStream<Uint8Array>, callbacks?: Callbacks): AsyncIterable<Line> {
+    const parser = new wasm.StreamingParser(callbacks);
+    const reader = stream.getReader();
+
+    try {
+        while (true) {
+            const { done, value } = await reader.read();
+
+            if (done) {
+                parser.finish();
+            } else if (value) {
+                parser.push(value);
+            }
+
+            while (true) {
+                const line = parser.next_line();
+
+                if (line) {
+                    yield translateLine(line);
+                } else {
+                    break;
+                }
+            }
+
+            if (done) {
+                break;
+            }
+        }
+    } finally {
+        reader.releaseLock();
+        parser.free();
+    }
+}
+
+/**
+ * Parse the lines in a `fetch()` response while it is still downloading.
+ */
+export async function* parseResponse(response: Response, callbacks?: Callbacks): AsyncIterable<Line> {
+    if (!response.body) {
+        throw new Error("The response has no body");
+    }
+
+    yield* parseStream(response.body, callbacks);
+}
+
+export function* parse(text: string | Uint8Array, callbacks?: Callbacks): Iterable<GCode> {
     for (const line of parseLines(text, callbacks)) {
         for (const gcode of line.gcodes) {
             yield gcode;
@@ -95,7 +176,51 @@ export function* parse(text: string, callbacks?: Callbacks): Iterable<GCode> {
     }
 }
 
-function translateLine(line: wasm.Line): Line {
+/**
+ * Create a parser, writing the text straight into WebAssembly memory so it
+ * only gets copied once.
+ */
+function createParser(text: string | Uint8Array, callbacks?: Callbacks): scalar.Parser {
+    if (typeof text !== "string") {
+        const buffer = new wasm.TextBuffer(text.length);
+        spareBytes(buffer, 0).set(text);
+        return wasm.Parser.from_buffer(buffer, text.length, callbacks);
+    }
+
+    // Most g-code is pure ASCII, so start by assuming one byte per character.
+    // If that isn't enough, only the part which didn't fit needs the worst
+    // case (3 UTF-8 bytes per UTF-16 code unit), so a long file with a single
+    // "°" in it doesn't triple in size.
+    const encoder = new TextEncoder();
+    const buffer = new wasm.TextBuffer(text.length);
+    let read = 0;
+    let written = 0;
+
+    while (true) {
+        const remaining = read === 0 ? text : text.slice(read);
+        const result = encoder.encodeInto(remaining, spareBytes(buffer, written));
+        read += result.read || 0;
+        written += result.written || 0;
+
+        if (read >= text.length) {
+            return wasm.Parser.from_buffer(buffer, written, callbacks);
+        }
+
+        buffer.grow(written, (text.length - read) * 3);
+    }
+}
+
+/**
+ * A view of the unwritten bytes in a `TextBuffer`, starting `offset` bytes
+ * in. This must be used immediately, because any allocation may grow the
+ * WebAssembly memory and detach the view.
+ */
+function spareBytes(buffer: scalar.TextBuffer, offset: number): Uint8Array {
+    const memory = wasm.memory() as WebAssembly.Memory;
+    return new Uint8Array(memory.buffer, buffer.ptr() + offset, buffer.capacity() - offset);
+}
+
+function translateLine(line: scalar.Line): Line {
     try {
         return {
             comments: getAll(line, (l, i) => l.get_comment(i)).map(translateComment),
@@ -107,7 +232,7 @@ function translateLine(line: wasm.Line): Line {
     }
 }
 
-function translateGCode(gcode: wasm.GCode): GCode {
+function translateGCode(gcode: scalar.GCode): GCode {
     const translated = {
         mnemonic: gcode.mnemonic,
         number: gcode.number,
@@ -119,7 +244,7 @@ function translateGCode(gcode: wasm.GCode): GCode {
     return translated;
 }
 
-function translateArguments(gcode: wasm.GCode): Arguments {
+function translateArguments(gcode: scalar.GCode): Arguments {
     const map: Arguments = {};
 
     for (const word of getAll(gcode, (g, i) => g.get_argument(i))) {
@@ -133,7 +258,7 @@ function translateArguments(gcode: wasm.GCode): Arguments {
     return map;
 }
 
-function translateComment(gcode: wasm.Comment): Comment {
+function translateComment(gcode: scalar.Comment): Comment {
     const translated = {
         text: gcode.text,
         span: translateSpan(gcode.span),
@@ -143,7 +268,7 @@ function translateComment(gcode: wasm.Comment): Comment {
     return translated;
 }
 
-function translateSpan(span: wasm.Span): Span {
+function translateSpan(span: scalar.Span): Span {
     const translated = {
         start: span.start,
         end: span.end,